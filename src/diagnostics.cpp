@@ -0,0 +1,300 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "diagnostics.hpp"
+#include "displaytap.hpp"
+#include "lvglscheduler.hpp"
+#include "touchinput.hpp"
+#include "framebuffer.hpp"
+#include "nativeimages.hpp"
+#include "imagecache.hpp"
+#include "lvmempool.hpp"
+#include "uicompiler.hpp"
+#include "glyphcache.hpp"
+#include "staticlayers.hpp"
+#include "qualitygovernor.hpp"
+#include "screensnapshot.hpp"
+#include "remotedisplay.hpp"
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#if !defined(__APPLE__)
+  #include <linux/serial.h>
+#endif
+
+using namespace p44;
+
+#define LAG_MEASURING_INTERVAL (5*Second) // low rate, main loop lag is a long term health indicator
+#define DIAG_AVG_WEIGHT 16 // moving averages over approx this many samples
+
+
+Diagnostics::Diagnostics() :
+  serialFd(-1),
+  lagInterval(LAG_MEASURING_INTERVAL)
+{
+  reset();
+  scheduleLagMeasurement();
+}
+
+
+Diagnostics::~Diagnostics()
+{
+  lagTicket.cancel();
+  if (serialFd>=0) close(serialFd);
+}
+
+
+void Diagnostics::reset()
+{
+  resetCounters();
+  inRequest = false;
+  requestFailed = false;
+  requestTime = 0;
+  avgRequestTime = 0;
+  maxRequestTime = 0;
+  avgLag = 0;
+  maxLag = 0;
+  lagSum = 0;
+  lagSamples = 0;
+  DisplayTap::tap().resetStatistics();
+  LvglScheduler::scheduler().resetStatistics();
+  TouchInput::touchInput().resetStatistics();
+}
+
+
+// MARK: - modbus
+
+void Diagnostics::resetCounters()
+{
+  messages = 0;
+  exceptions = 0;
+  noResponse = 0;
+  commErrorsBase = 0;
+  overrunsBase = 0;
+  lineCounters(commErrorsBase, overrunsBase);
+}
+
+
+void Diagnostics::setSerialDevice(const string aConnectionSpec)
+{
+  if (serialFd>=0) {
+    close(serialFd);
+    serialFd = -1;
+  }
+  // connection spec is /dev/xxx[:commParams] for RTU, host[:port] for TCP
+  if (aConnectionSpec.substr(0,1)!="/") return;
+  string dev = aConnectionSpec.substr(0, aConnectionSpec.find(':'));
+  // Note: opening a tty again does not change its settings, the fd is only used for TIOCGICOUNT
+  serialFd = open(dev.c_str(), O_RDONLY|O_NONBLOCK|O_NOCTTY);
+  uint32_t ce, ov;
+  if (serialFd>=0 && !lineCounters(ce, ov)) {
+    LOG(LOG_WARNING, "Serial driver of %s does not provide line error counters", dev.c_str());
+    close(serialFd);
+    serialFd = -1;
+  }
+  resetCounters();
+}
+
+
+bool Diagnostics::lineCounters(uint32_t &aCommErrors, uint32_t &aOverruns)
+{
+  #if defined(__APPLE__)
+  aCommErrors = 0;
+  aOverruns = 0;
+  return false;
+  #else
+  if (serialFd<0) return false;
+  struct serial_icounter_struct ic;
+  if (ioctl(serialFd, TIOCGICOUNT, &ic)<0) return false;
+  aCommErrors = ic.frame+ic.parity;
+  aOverruns = ic.overrun+ic.buf_overrun;
+  return true;
+  #endif
+}
+
+
+uint32_t Diagnostics::commErrors()
+{
+  uint32_t ce, ov;
+  if (!lineCounters(ce, ov)) return 0;
+  return ce-commErrorsBase;
+}
+
+
+uint32_t Diagnostics::overruns()
+{
+  uint32_t ce, ov;
+  if (!lineCounters(ce, ov)) return 0;
+  return ov-overrunsBase;
+}
+
+
+void Diagnostics::modbusAccess(ErrorPtr aError, MLMicroSeconds aProcessingTime)
+{
+  if (!inRequest) {
+    // first access of a new request (all accesses of a request happen within the same mainloop cycle)
+    inRequest = true;
+    requestFailed = false;
+    requestTime = 0;
+    messages++;
+    MainLoop::currentMainLoop().executeNow(boost::bind(&Diagnostics::requestDone, this));
+  }
+  // only the time actually spent processing counts, not the time until the mainloop gets to requestDone()
+  requestTime += aProcessingTime;
+  if (Error::notOK(aError) && !requestFailed) {
+    requestFailed = true;
+    exceptions++;
+  }
+}
+
+
+void Diagnostics::requestDone()
+{
+  inRequest = false;
+  avgRequestTime += ((double)requestTime-avgRequestTime)/DIAG_AVG_WEIGHT;
+  if (requestTime>maxRequestTime) maxRequestTime = requestTime;
+}
+
+
+// MARK: - FC8 counters
+
+uint16_t Diagnostics::fc8Counter(uint16_t aSubFunction)
+{
+  switch (aSubFunction) {
+    case 0x0B: return (messages+commErrors()) & 0xFFFF; // bus message count
+    case 0x0C: return commErrors() & 0xFFFF; // bus communication error count
+    case 0x0D: return exceptions & 0xFFFF; // bus exception error count
+    case 0x0E: return messages & 0xFFFF; // slave message count
+    case 0x0F: return noResponse & 0xFFFF; // slave no response count
+    case 0x12: return overruns() & 0xFFFF; // bus character overrun count
+    default: return 0; // 0x10 NAK, 0x11 busy: we never send these
+  }
+}
+
+
+// MARK: - main loop lag
+
+void Diagnostics::setLagInterval(MLMicroSeconds aInterval)
+{
+  lagInterval = aInterval;
+  scheduleLagMeasurement();
+}
+
+
+void Diagnostics::scheduleLagMeasurement()
+{
+  lagExpected = MainLoop::now()+lagInterval;
+  lagTicket.executeOnce(boost::bind(&Diagnostics::measureLag, this, _1), lagInterval);
+}
+
+
+void Diagnostics::measureLag(MLTimer &aTimer)
+{
+  MLMicroSeconds lag = MainLoop::now()-lagExpected;
+  if (lag<0) lag = 0;
+  avgLag += ((double)lag-avgLag)/DIAG_AVG_WEIGHT;
+  if (lag>maxLag) maxLag = lag;
+  lagSum += lag;
+  lagSamples++;
+  scheduleLagMeasurement();
+}
+
+
+// MARK: - register block
+
+static uint16_t sat16(double aValue)
+{
+  if (aValue<0) return 0;
+  if (aValue>0xFFFF) return 0xFFFF;
+  return (uint16_t)aValue;
+}
+
+
+void Diagnostics::installRegisters(RegisterHooksPtr aRegisterHooks, int aFirstInputReg)
+{
+  // block is evaluated as a whole on first read, and then served from cache for subsequent reads within the same poll
+  aRegisterHooks->addHandler(
+    aFirstInputReg, numDiagRegs, false, true,
+    boost::bind(&Diagnostics::diagReg, this, _1, aFirstInputReg),
+    RegisterHooks::WriteHandler(),
+    100*MilliSecond
+  );
+}
+
+
+uint16_t Diagnostics::diagReg(int aAddress, int aFirstInputReg)
+{
+  switch (aAddress-aFirstInputReg) {
+    case diagreg_busMessages: return fc8Counter(0x0B);
+    case diagreg_busCommErrors: return fc8Counter(0x0C);
+    case diagreg_exceptions: return fc8Counter(0x0D);
+    case diagreg_slaveMessages: return fc8Counter(0x0E);
+    case diagreg_noResponse: return fc8Counter(0x0F);
+    case diagreg_overruns: return fc8Counter(0x12);
+    case diagreg_avgRequestTime: return sat16(avgRequestTime*10/MilliSecond);
+    case diagreg_maxRequestTime: return sat16((double)maxRequestTime*10/MilliSecond);
+    case diagreg_avgMainloopLag: return sat16(avgLag/MilliSecond);
+    case diagreg_maxMainloopLag: return sat16((double)maxLag/MilliSecond);
+    case diagreg_avgFrameTime: return sat16(DisplayTap::tap().getAvgFrameTime());
+    case diagreg_maxFrameTime: return sat16(DisplayTap::tap().getMaxFrameTime());
+    case diagreg_lvglFreeHi: return LvMemPool::lvglPool().freeBytes()>>16;
+    case diagreg_lvglFreeLo: return LvMemPool::lvglPool().freeBytes() & 0xFFFF;
+    case diagreg_lvglFragmentation: return LvMemPool::lvglPool().fragmentation();
+    default: return 0; // not available
+  }
+}
+
+
+JsonObjectPtr Diagnostics::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  JsonObjectPtr m = JsonObject::newObj();
+  m->add("messages", JsonObject::newInt64(messages));
+  m->add("exceptions", JsonObject::newInt64(exceptions));
+  m->add("noResponse", JsonObject::newInt64(noResponse));
+  if (serialFd>=0) {
+    m->add("commErrors", JsonObject::newInt64(commErrors()));
+    m->add("overruns", JsonObject::newInt64(overruns()));
+  }
+  m->add("avgRequestTime", JsonObject::newDouble(avgRequestTime/MilliSecond));
+  m->add("maxRequestTime", JsonObject::newDouble((double)maxRequestTime/MilliSecond));
+  s->add("modbus", m);
+  JsonObjectPtr l = JsonObject::newObj();
+  l->add("avgLag", JsonObject::newDouble(avgLag/MilliSecond));
+  l->add("maxLag", JsonObject::newDouble((double)maxLag/MilliSecond));
+  l->add("meanLag", JsonObject::newDouble(lagSamples>0 ? (double)lagSum/lagSamples/MilliSecond : 0));
+  l->add("samples", JsonObject::newInt64(lagSamples));
+  s->add("mainloop", l);
+  JsonObjectPtr d = DisplayTap::tap().statistics();
+  d->add("memFree", JsonObject::newInt64(LvMemPool::lvglPool().freeBytes()));
+  d->add("memFragmentation", JsonObject::newInt32(LvMemPool::lvglPool().fragmentation()));
+  s->add("lvgl", d);
+  s->add("scheduler", LvglScheduler::scheduler().statistics());
+  s->add("touch", TouchInput::touchInput().statistics());
+  s->add("images", NativeImages::images().statistics());
+  s->add("imgcache", ImageCache::cache().statistics());
+  s->add("uicompiler", UiCompiler::compiler().statistics());
+  s->add("glyphcache", GlyphCache::cache().statistics());
+  s->add("staticlayers", StaticLayers::layers().statistics());
+  s->add("quality", QualityGovernor::governor().statistics());
+  if (ScreenSnapshot::snapshot().isInstalled()) s->add("snapshot", ScreenSnapshot::snapshot().statistics());
+  if (RemoteDisplay::remote().isStarted()) s->add("remote", RemoteDisplay::remote().statistics());
+  if (FrameBuffer::frameBuffer().isOpen()) s->add("framebuffer", FrameBuffer::frameBuffer().statistics());
+  return s;
+}
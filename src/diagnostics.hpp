@@ -0,0 +1,131 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__diagnostics__
+#define __p44mbcd__diagnostics__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+#include "registerhooks.hpp"
+
+namespace p44 {
+
+  /// Diagnostic counters block, laid out as consecutive input registers.
+  /// The first six registers follow the order of the modbus FC8 diagnostic counters (sub-functions 0x0B..0x12),
+  /// so masters can poll the same information with a plain FC4 read.
+  /// @note FC8 itself is decoded by libmodbus in p44utils (not part of this tree) and is not answered from
+  ///   these counters. Malformed requests are discarded there, too, so the no response count reads 0.
+  enum {
+    diagreg_busMessages, ///< bus message count (requests processed plus messages discarded due to line errors)
+    diagreg_busCommErrors, ///< bus communication error count (framing and parity errors of the RTU line)
+    diagreg_exceptions, ///< exception responses returned
+    diagreg_slaveMessages, ///< messages processed by this slave
+    diagreg_noResponse, ///< messages discarded without sending a response (not visible at application level, always 0)
+    diagreg_overruns, ///< character overrun count (UART and tty buffer overruns of the RTU line)
+    diagreg_avgRequestTime, ///< average request processing time in 0.1mS
+    diagreg_maxRequestTime, ///< max request processing time in 0.1mS
+    diagreg_avgMainloopLag, ///< average main loop lag in mS
+    diagreg_maxMainloopLag, ///< max main loop lag in mS
+    diagreg_avgFrameTime, ///< average littlevGL frame time in mS
+    diagreg_maxFrameTime, ///< max littlevGL frame time in mS
+    diagreg_lvglFreeHi, ///< free littlevGL memory in bytes, high word
+    diagreg_lvglFreeLo, ///< free littlevGL memory in bytes, low word
+    diagreg_lvglFragmentation, ///< littlevGL memory fragmentation in %
+    numDiagRegs
+  };
+
+
+  /// Collects diagnostic counters cheaply (plain counter increments at event time),
+  /// and only converts them to register values when the diagnostic block is actually read.
+  class Diagnostics : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    // modbus
+    uint32_t messages; ///< number of requests processed
+    uint32_t exceptions; ///< number of requests answered with exception
+    uint32_t noResponse; ///< number of requests not answered (none are known to the application)
+    bool inRequest; ///< set while processing a request
+    bool requestFailed; ///< set when current request has caused an exception
+    MLMicroSeconds requestTime; ///< accumulated processing time of the current request
+    double avgRequestTime; ///< moving average of request processing time
+    MLMicroSeconds maxRequestTime; ///< max request processing time
+
+    // serial line
+    int serialFd; ///< RTU serial device, opened for reading the line error counters only, -1 if none
+    uint32_t commErrorsBase; ///< framing+parity errors reported by the driver at last reset
+    uint32_t overrunsBase; ///< overruns reported by the driver at last reset
+
+    // mainloop
+    MLTicket lagTicket; ///< timer for measuring main loop lag
+    MLMicroSeconds lagInterval; ///< main loop lag sampling interval
+    MLMicroSeconds lagExpected; ///< when lag timer is expected to fire
+    double avgLag; ///< moving average of main loop lag
+    MLMicroSeconds maxLag; ///< max main loop lag
+    MLMicroSeconds lagSum; ///< sum of lag samples since last reset
+    long lagSamples; ///< number of lag samples since last reset
+
+  public:
+
+    Diagnostics();
+    virtual ~Diagnostics();
+
+    /// install read handlers for the diagnostic block
+    /// @param aRegisterHooks the register hooks to install the handlers into
+    /// @param aFirstInputReg first input register of the diagnostic block
+    void installRegisters(RegisterHooksPtr aRegisterHooks, int aFirstInputReg);
+
+    /// set the serial device of a RTU connection to obtain line error counters from the driver
+    /// @param aConnectionSpec the modbus connection specification, line counters are only available for serial devices
+    void setSerialDevice(const string aConnectionSpec);
+
+    /// to be called from the slave's value access handler for every access
+    /// @param aError error returned for the access, if any
+    /// @param aProcessingTime time spent processing this access
+    void modbusAccess(ErrorPtr aError, MLMicroSeconds aProcessingTime);
+
+    /// set the main loop lag sampling interval
+    /// @param aInterval sampling interval, default is a low rate suitable for long term monitoring
+    /// @note each sample is one mainloop wakeup, so only sample at high rate for benchmarks
+    void setLagInterval(MLMicroSeconds aInterval);
+
+    /// reset max values and counters
+    void reset();
+
+    /// @return all diagnostics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    void requestDone();
+    void measureLag(MLTimer &aTimer);
+    void scheduleLagMeasurement();
+    uint16_t diagReg(int aAddress, int aFirstInputReg);
+    void resetCounters();
+    bool lineCounters(uint32_t &aCommErrors, uint32_t &aOverruns);
+    uint32_t commErrors();
+    uint32_t overruns();
+    uint16_t fc8Counter(uint16_t aSubFunction);
+
+  };
+  typedef boost::intrusive_ptr<Diagnostics> DiagnosticsPtr;
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__diagnostics__) */
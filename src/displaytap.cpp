@@ -0,0 +1,324 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "displaytap.hpp"
+
+#include <fcntl.h>
+
+using namespace p44;
+
+#define FRAME_AVG_WEIGHT 16 // moving average over approx this many frames
+
+static DisplayTap* displayTapP = NULL;
+
+
+DisplayTap::DisplayTap() :
+  display(NULL),
+  orgMonitorCB(NULL),
+  orgFlushCB(NULL),
+  orgWaitCB(NULL),
+  flushThreadRunning(false),
+  inFlight(false),
+  secondBuffer(NULL),
+  frames(0),
+  lastFrameTime(0),
+  avgFrameTime(0),
+  maxFrameTime(0),
+  lastFramePixels(0),
+  flushes(0),
+  avgFlushTime(0),
+  frameFlushTime(0),
+  lastFrameFlushTime(0)
+{
+  memset(&flushJob, 0, sizeof(flushJob));
+  memset(&frameEnd, 0, sizeof(frameEnd));
+  donePipe[0] = -1;
+  donePipe[1] = -1;
+}
+
+
+DisplayTap::~DisplayTap()
+{
+  stopFlushThread();
+}
+
+
+DisplayTap& DisplayTap::tap()
+{
+  if (!displayTapP) {
+    displayTapP = new DisplayTap;
+  }
+  return *displayTapP;
+}
+
+
+void DisplayTap::install(lv_disp_t* aDisplay)
+{
+  if (display || !aDisplay) return; // already installed or no display
+  display = aDisplay;
+  orgMonitorCB = display->driver.monitor_cb;
+  display->driver.monitor_cb = &DisplayTap::monitorCB;
+  orgFlushCB = display->driver.flush_cb;
+  display->driver.flush_cb = &DisplayTap::flushCB;
+}
+
+
+// MARK: - rendering statistics
+
+void DisplayTap::monitorCB(struct _disp_drv_t * disp_drv, uint32_t time, uint32_t px)
+{
+  DisplayTap& t = tap();
+  if (t.inFlight) {
+    // last area of the frame is still being flushed, frame is complete when that is done
+    t.frameEnd.pending = true;
+    t.frameEnd.drv = disp_drv;
+    t.frameEnd.time = time;
+    t.frameEnd.px = px;
+    return;
+  }
+  t.frameRendered(disp_drv, time, px);
+}
+
+
+void DisplayTap::frameRendered(lv_disp_drv_t* aDrv, uint32_t aTime, uint32_t aPixels)
+{
+  frames++;
+  lastFrameTime = aTime;
+  lastFramePixels = aPixels;
+  if (frames==1) avgFrameTime = aTime;
+  else avgFrameTime += ((double)aTime-avgFrameTime)/FRAME_AVG_WEIGHT;
+  if (aTime>maxFrameTime) maxFrameTime = aTime;
+  lastFrameFlushTime = frameFlushTime;
+  frameFlushTime = 0;
+  if (frameHandler) frameHandler();
+  if (orgMonitorCB) orgMonitorCB(aDrv, aTime, aPixels);
+}
+
+
+// MARK: - flushing
+
+void DisplayTap::flushCB(struct _disp_drv_t * disp_drv, const lv_area_t * area, lv_color_t * color_p)
+{
+  DisplayTap& t = tap();
+  for (FlushObserverVector::iterator pos = t.flushObservers.begin(); pos!=t.flushObservers.end(); ++pos) {
+    (*pos)(area, color_p);
+  }
+  if (t.flushThreadRunning) {
+    // hand over to the flush thread. littlevGL makes sure the previous flush is complete
+    // (buffer->flushing cleared by completeFlush()) before it calls us again, so the job slot is always free here
+    pthread_mutex_lock(&t.flushMutex);
+    t.flushJob.drv = disp_drv;
+    t.flushJob.drvCopy = *disp_drv;
+    t.flushJob.bufCopy = *disp_drv->buffer;
+    t.flushJob.area = *area;
+    t.flushJob.pixels = color_p;
+    t.flushJob.done = false;
+    t.flushJob.pending = true;
+    pthread_cond_signal(&t.flushCond);
+    pthread_mutex_unlock(&t.flushMutex);
+    t.inFlight = true;
+    return;
+  }
+  MLMicroSeconds start = MainLoop::now();
+  t.orgFlushCB(disp_drv, area, color_p); // calls lv_disp_flush_ready() when done
+  t.flushed(MainLoop::now()-start);
+}
+
+
+void DisplayTap::flushed(MLMicroSeconds aFlushTime)
+{
+  double t = (double)aFlushTime/MilliSecond;
+  flushes++;
+  frameFlushTime += t;
+  if (flushes==1) avgFlushTime = t;
+  else avgFlushTime += (t-avgFlushTime)/FRAME_AVG_WEIGHT;
+}
+
+
+void DisplayTap::completeFlush()
+{
+  pthread_mutex_lock(&flushMutex);
+  if (!flushJob.done) {
+    pthread_mutex_unlock(&flushMutex);
+    return;
+  }
+  flushJob.done = false;
+  lv_disp_drv_t* drv = flushJob.drv;
+  MLMicroSeconds flushTime = flushJob.flushTime;
+  pthread_mutex_unlock(&flushMutex);
+  inFlight = false;
+  flushed(flushTime);
+  lv_disp_flush_ready(drv);
+  if (frameEnd.pending) {
+    frameEnd.pending = false;
+    frameRendered(frameEnd.drv, frameEnd.time, frameEnd.px);
+  }
+}
+
+
+bool DisplayTap::flushDoneHandler(int aFD, int aPollFlags)
+{
+  if (aPollFlags & POLLIN) {
+    uint8_t buf[16];
+    while (read(aFD, buf, sizeof(buf))>0);
+    completeFlush();
+  }
+  return true;
+}
+
+
+void DisplayTap::waitFlushDone()
+{
+  pthread_mutex_lock(&flushMutex);
+  while (!flushJob.done) {
+    pthread_cond_wait(&doneCond, &flushMutex);
+  }
+  pthread_mutex_unlock(&flushMutex);
+  completeFlush();
+}
+
+
+void DisplayTap::waitCB(struct _disp_drv_t * disp_drv)
+{
+  // littlevGL calls this in a loop while it waits for buffer->flushing to clear
+  DisplayTap& t = tap();
+  if (t.inFlight) t.waitFlushDone();
+  else if (t.orgWaitCB) t.orgWaitCB(disp_drv);
+}
+
+
+ErrorPtr DisplayTap::startFlushThread()
+{
+  if (!display) return TextError::err("no display");
+  if (flushThreadRunning) return ErrorPtr();
+  // add a second draw buffer of the same size
+  lv_disp_buf_t* orgBuf = display->driver.buffer;
+  if (!orgBuf->buf2) {
+    secondBuffer = new lv_color_t[orgBuf->size];
+    lv_disp_buf_init(&threadedBuf, orgBuf->buf1, secondBuffer, orgBuf->size);
+    display->driver.buffer = &threadedBuf;
+  }
+  if (pipe(donePipe)<0) {
+    return SysError::errNo("cannot create flush completion pipe: ");
+  }
+  fcntl(donePipe[0], F_SETFL, fcntl(donePipe[0], F_GETFL)|O_NONBLOCK);
+  fcntl(donePipe[1], F_SETFL, fcntl(donePipe[1], F_GETFL)|O_NONBLOCK);
+  pthread_mutex_init(&flushMutex, NULL);
+  pthread_cond_init(&flushCond, NULL);
+  pthread_cond_init(&doneCond, NULL);
+  flushJob.pending = false;
+  flushJob.done = false;
+  flushJob.terminate = false;
+  if (pthread_create(&flushThread, NULL, &DisplayTap::flushThreadFunc, this)!=0) {
+    ErrorPtr err = SysError::errNo("cannot start flush thread: ");
+    if (secondBuffer) {
+      display->driver.buffer = orgBuf;
+      delete[] secondBuffer;
+      secondBuffer = NULL;
+    }
+    close(donePipe[0]);
+    close(donePipe[1]);
+    donePipe[0] = -1;
+    donePipe[1] = -1;
+    return err;
+  }
+  MainLoop::currentMainLoop().registerPollHandler(donePipe[0], POLLIN, boost::bind(&DisplayTap::flushDoneHandler, this, _1, _2));
+  orgWaitCB = display->driver.wait_cb;
+  display->driver.wait_cb = &DisplayTap::waitCB;
+  flushThreadRunning = true;
+  LOG(LOG_NOTICE, "display flushing now runs in separate thread, draw buffers: 2*%u pixels", display->driver.buffer->size);
+  return ErrorPtr();
+}
+
+
+void* DisplayTap::flushThreadFunc(void* aArg)
+{
+  DisplayTap* t = static_cast<DisplayTap*>(aArg);
+  pthread_mutex_lock(&t->flushMutex);
+  while (true) {
+    while (!t->flushJob.pending && !t->flushJob.terminate) {
+      pthread_cond_wait(&t->flushCond, &t->flushMutex);
+    }
+    if (t->flushJob.terminate) break;
+    // flush through a private copy of the driver and its buffer descriptor (made in the main thread):
+    // the lv_disp_flush_ready() the original flush callback calls then only affects the copy, and never
+    // touches littlevGL state in this thread. completeFlush() calls it for the real driver in the main thread.
+    lv_disp_drv_t drv = t->flushJob.drvCopy;
+    lv_disp_buf_t buf = t->flushJob.bufCopy;
+    drv.buffer = &buf;
+    lv_area_t area = t->flushJob.area;
+    lv_color_t* pixels = t->flushJob.pixels;
+    t->flushJob.pending = false;
+    pthread_mutex_unlock(&t->flushMutex);
+    MLMicroSeconds start = MainLoop::now();
+    t->orgFlushCB(&drv, &area, pixels);
+    MLMicroSeconds flushTime = MainLoop::now()-start;
+    pthread_mutex_lock(&t->flushMutex);
+    t->flushJob.flushTime = flushTime;
+    t->flushJob.done = true;
+    pthread_cond_signal(&t->doneCond);
+    // wake the main loop in case it is not waiting in waitCB()
+    uint8_t b = 0;
+    if (write(t->donePipe[1], &b, 1)<0) { /* pipe full means main loop will wake anyway */ }
+  }
+  pthread_mutex_unlock(&t->flushMutex);
+  return NULL;
+}
+
+
+void DisplayTap::stopFlushThread()
+{
+  if (!flushThreadRunning) return;
+  if (inFlight) waitFlushDone();
+  pthread_mutex_lock(&flushMutex);
+  flushJob.terminate = true;
+  pthread_cond_signal(&flushCond);
+  pthread_mutex_unlock(&flushMutex);
+  pthread_join(flushThread, NULL);
+  flushThreadRunning = false;
+  display->driver.wait_cb = orgWaitCB;
+  MainLoop::currentMainLoop().unregisterPollHandler(donePipe[0]);
+  close(donePipe[0]);
+  close(donePipe[1]);
+  donePipe[0] = -1;
+  donePipe[1] = -1;
+}
+
+
+// MARK: - statistics
+
+void DisplayTap::resetStatistics()
+{
+  maxFrameTime = 0;
+}
+
+
+JsonObjectPtr DisplayTap::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("frames", JsonObject::newInt64(frames));
+  s->add("lastFrameTime", JsonObject::newInt32(lastFrameTime));
+  s->add("avgFrameTime", JsonObject::newDouble(avgFrameTime));
+  s->add("maxFrameTime", JsonObject::newInt32(maxFrameTime));
+  s->add("lastFramePixels", JsonObject::newInt32(lastFramePixels));
+  s->add("flushes", JsonObject::newInt64(flushes));
+  s->add("avgFlushTime", JsonObject::newDouble(avgFlushTime));
+  s->add("flushThread", JsonObject::newBool(flushThreadRunning));
+  return s;
+}
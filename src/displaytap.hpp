@@ -0,0 +1,176 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__displaytap__
+#define __p44mbcd__displaytap__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+#include <pthread.h>
+#include <vector>
+
+namespace p44 {
+
+  /// Taps into the driver callbacks of the littlevGL display set up by LvglScheduler::init()
+  /// to collect rendering statistics, and optionally moves flushing rendered areas to the
+  /// actual display hardware into a separate thread.
+  /// In threaded mode, only the original flush callback runs in the flush thread. Completion is handed
+  /// back to the main thread, where lv_disp_flush_ready() is called and the statistics are updated.
+  class DisplayTap : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+  public:
+
+    /// called with every area rendered, before it is flushed to the display
+    /// @param aArea the area
+    /// @param aPixels the rendered pixels, only valid during the call
+    typedef boost::function<void (const lv_area_t* aArea, const lv_color_t* aPixels)> FlushObserverCB;
+
+  private:
+
+    typedef void (*FlushCB)(struct _disp_drv_t * disp_drv, const lv_area_t * area, lv_color_t * color_p);
+    typedef void (*MonitorCB)(struct _disp_drv_t * disp_drv, uint32_t time, uint32_t px);
+    typedef void (*WaitCB)(struct _disp_drv_t * disp_drv);
+
+    lv_disp_t* display; ///< the display we are tapping
+    MonitorCB orgMonitorCB; ///< original monitor callback
+    FlushCB orgFlushCB; ///< original flush callback
+    WaitCB orgWaitCB; ///< original wait callback
+    SimpleCB frameHandler; ///< called after each rendered frame
+    typedef std::vector<FlushObserverCB> FlushObserverVector;
+    FlushObserverVector flushObservers; ///< called for each flushed area
+
+    // flush thread
+    bool flushThreadRunning; ///< set when flush thread is running
+    pthread_t flushThread; ///< the flush thread
+    pthread_mutex_t flushMutex; ///< protects flushJob
+    pthread_cond_t flushCond; ///< signals new flush job or termination to the flush thread
+    pthread_cond_t doneCond; ///< signals completion of a flush job to the main thread
+    int donePipe[2]; ///< written to by the flush thread to wake the main loop when a job is done
+    struct {
+      bool pending; ///< set when job is waiting for the flush thread
+      bool done; ///< set when the flush thread has completed the job
+      bool terminate; ///< set to make the thread terminate
+      lv_disp_drv_t* drv; ///< the driver
+      lv_disp_drv_t drvCopy; ///< private copy of the driver, for the flush thread
+      lv_disp_buf_t bufCopy; ///< private copy of the driver's buffer descriptor, for the flush thread
+      lv_area_t area; ///< the area to flush
+      lv_color_t* pixels; ///< the pixels to flush
+      MLMicroSeconds flushTime; ///< time the flush took
+    } flushJob;
+    bool inFlight; ///< set (main thread only) from handing a job to the flush thread until its completion was processed
+    lv_disp_buf_t threadedBuf; ///< double buffer descriptor used in threaded mode
+    lv_color_t* secondBuffer; ///< the second draw buffer for threaded mode
+
+    // frame statistics
+    long frames; ///< number of refreshes that actually rendered something
+    uint32_t lastFrameTime; ///< time of last refresh in mS
+    double avgFrameTime; ///< moving average of refresh time in mS
+    uint32_t maxFrameTime; ///< max refresh time in mS
+    uint32_t lastFramePixels; ///< number of pixels rendered in last refresh
+    long flushes; ///< number of flushes
+    double avgFlushTime; ///< moving average of time per flush in mS
+    double frameFlushTime; ///< flush time accumulated for the current frame in mS
+    double lastFrameFlushTime; ///< total flush time of the last frame in mS
+    struct {
+      bool pending; ///< set when the frame has been rendered, but its last area is still being flushed
+      lv_disp_drv_t* drv;
+      uint32_t time;
+      uint32_t px;
+    } frameEnd; ///< end of frame, deferred until all areas of the frame are flushed
+
+  public:
+
+    DisplayTap();
+    virtual ~DisplayTap();
+
+    /// get the shared instance
+    static DisplayTap& tap();
+
+    /// install the tap on a display
+    /// @param aDisplay the display, usually lv_disp_get_default()
+    void install(lv_disp_t* aDisplay);
+
+    /// move flushing rendered areas to the display into a separate thread.
+    /// A second draw buffer is added, so littlevGL can render the next area while the previous
+    /// one is still being transferred to the display.
+    /// @return error if thread could not be started
+    /// @note must be called after install(), before anything was rendered
+    ErrorPtr startFlushThread();
+
+    /// set a handler to be called after every frame that actually rendered something
+    /// @param aFrameHandler the handler, NULL to remove
+    /// @note the handler is called when all areas of the frame are flushed, so the frame's statistics are complete
+    void setFrameHandler(SimpleCB aFrameHandler) { frameHandler = aFrameHandler; };
+
+    /// add an observer for the rendered areas
+    /// @param aFlushObserver the observer. It is called from littlevGL's refresh in the main thread,
+    ///   even when flushing runs in a separate thread, and must be fast (a memcpy at most)
+    void addFlushObserver(FlushObserverCB aFlushObserver) { flushObservers.push_back(aFlushObserver); };
+
+    /// @return the display we are installed on, or NULL if none
+    lv_disp_t* getDisplay() { return display; };
+
+    /// @return number of frames rendered so far
+    long getFrames() { return frames; };
+
+    /// @return moving average of time needed per frame, in mS
+    double getAvgFrameTime() { return avgFrameTime; };
+
+    /// @return max time needed per frame, in mS
+    uint32_t getMaxFrameTime() { return maxFrameTime; };
+
+    /// @return time needed for the last frame, in mS
+    uint32_t getLastFrameTime() { return lastFrameTime; };
+
+    /// @return number of pixels rendered in the last frame
+    uint32_t getLastFramePixels() { return lastFramePixels; };
+
+    /// @return total time for flushing the areas of the last frame, in mS
+    double getLastFrameFlushTime() { return lastFrameFlushTime; };
+
+    /// reset max values
+    void resetStatistics();
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    static void monitorCB(struct _disp_drv_t * disp_drv, uint32_t time, uint32_t px);
+    void frameRendered(lv_disp_drv_t* aDrv, uint32_t aTime, uint32_t aPixels);
+
+    static void flushCB(struct _disp_drv_t * disp_drv, const lv_area_t * area, lv_color_t * color_p);
+    void flushed(MLMicroSeconds aFlushTime);
+    static void waitCB(struct _disp_drv_t * disp_drv);
+    void waitFlushDone();
+    bool flushDoneHandler(int aFD, int aPollFlags);
+    void completeFlush();
+    static void* flushThreadFunc(void* aArg);
+    void stopFlushThread();
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__displaytap__) */
@@ -0,0 +1,355 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "framebuffer.hpp"
+
+#include <png.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#if !defined(__APPLE__)
+  #include <linux/fb.h>
+#endif
+
+using namespace p44;
+
+#define MAX_DIRTY_AREAS 16 // with more areas per frame, the entire page is considered dirty
+
+static FrameBuffer* frameBufferP = NULL;
+
+
+FrameBuffer::FrameBuffer() :
+  fd(-1),
+  mem(NULL),
+  memSize(0),
+  xres(0),
+  yres(0),
+  bytesPerPixel(0),
+  lineLength(0),
+  pages(1),
+  visiblePage(0),
+  display(NULL),
+  orgMonitorCB(NULL),
+  flushCostNs(0),
+  flips(0),
+  areas(0),
+  memcpys(0),
+  bytesCopied(0)
+{
+  pthread_mutex_init(&pageMutex, NULL);
+}
+
+
+FrameBuffer::~FrameBuffer()
+{
+  close();
+  pthread_mutex_destroy(&pageMutex);
+}
+
+
+FrameBuffer& FrameBuffer::frameBuffer()
+{
+  if (!frameBufferP) {
+    frameBufferP = new FrameBuffer;
+  }
+  return *frameBufferP;
+}
+
+
+ErrorPtr FrameBuffer::openDevice(const string aDevicePath, bool aPageFlip)
+{
+  #if defined(__APPLE__)
+  return TextError::err("framebuffer devices not supported on this platform");
+  #else
+  if (mem) return TextError::err("framebuffer already open");
+  fd = ::open(aDevicePath.c_str(), O_RDWR);
+  if (fd<0) return SysError::errNo("cannot open framebuffer: ");
+  struct fb_var_screeninfo vinfo;
+  struct fb_fix_screeninfo finfo;
+  if (ioctl(fd, FBIOGET_FSCREENINFO, &finfo)<0 || ioctl(fd, FBIOGET_VSCREENINFO, &vinfo)<0) {
+    ErrorPtr err = SysError::errNo("cannot get framebuffer info: ");
+    close();
+    return err;
+  }
+  if (vinfo.bits_per_pixel!=16 && vinfo.bits_per_pixel!=32) {
+    close();
+    return TextError::err("unsupported framebuffer depth: %d bits per pixel", vinfo.bits_per_pixel);
+  }
+  xres = vinfo.xres;
+  yres = vinfo.yres;
+  bytesPerPixel = vinfo.bits_per_pixel/8;
+  lineLength = finfo.line_length;
+  pages = 1;
+  if (aPageFlip) {
+    if (vinfo.yres_virtual<2*vinfo.yres) {
+      // try to get room for a second page
+      vinfo.yres_virtual = 2*vinfo.yres;
+      if (ioctl(fd, FBIOPUT_VSCREENINFO, &vinfo)<0 || ioctl(fd, FBIOGET_VSCREENINFO, &vinfo)<0 || ioctl(fd, FBIOGET_FSCREENINFO, &finfo)<0) {
+        LOG(LOG_WARNING, "framebuffer: cannot enlarge virtual yres: %s", Error::text(SysError::errNo()));
+      }
+      lineLength = finfo.line_length;
+    }
+    if (vinfo.yres_virtual>=2*vinfo.yres && finfo.smem_len>=(uint32_t)(2*yres*lineLength)) {
+      pages = 2;
+    }
+    else {
+      LOG(LOG_WARNING, "framebuffer: no room for second page, copying into visible page");
+    }
+  }
+  memSize = pages*yres*lineLength;
+  void* m = mmap(NULL, memSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (m==MAP_FAILED) {
+    ErrorPtr err = SysError::errNo("cannot map framebuffer: ");
+    close();
+    return err;
+  }
+  mem = (uint8_t*)m;
+  visiblePage = pages>1 ? vinfo.yoffset/yres : 0;
+  if (visiblePage>=pages) visiblePage = 0;
+  LOG(LOG_NOTICE, "framebuffer %s: %dx%d, %d bits per pixel, %d page(s)", aDevicePath.c_str(), xres, yres, bytesPerPixel*8, pages);
+  return ErrorPtr();
+  #endif
+}
+
+
+ErrorPtr FrameBuffer::openMemory(int aXRes, int aYRes, int aPages)
+{
+  if (mem) return TextError::err("framebuffer already open");
+  if (aXRes<=0 || aYRes<=0 || aPages<1 || aPages>2) return TextError::err("invalid memory framebuffer geometry");
+  xres = aXRes;
+  yres = aYRes;
+  bytesPerPixel = sizeof(lv_color_t)>=4 ? 4 : 2;
+  lineLength = xres*bytesPerPixel;
+  pages = aPages;
+  visiblePage = 0;
+  memSize = pages*yres*lineLength;
+  mem = new uint8_t[memSize];
+  memset(mem, 0, memSize);
+  return ErrorPtr();
+}
+
+
+void FrameBuffer::close()
+{
+  if (mem) {
+    if (fd>=0) munmap(mem, memSize);
+    else delete[] mem;
+    mem = NULL;
+  }
+  if (fd>=0) {
+    ::close(fd);
+    fd = -1;
+  }
+  dirty.clear();
+  prevDirty.clear();
+}
+
+
+void FrameBuffer::install(lv_disp_t* aDisplay)
+{
+  if (display || !aDisplay || !mem) return; // already installed, no display or no framebuffer
+  display = aDisplay;
+  display->driver.flush_cb = &FrameBuffer::flushCB;
+  orgMonitorCB = display->driver.monitor_cb;
+  display->driver.monitor_cb = &FrameBuffer::monitorCB;
+}
+
+
+// MARK: - drawing
+
+void FrameBuffer::copyArea(uint8_t* aDest, const lv_area_t* aArea, const uint8_t* aSrc, int aSrcLineLength)
+{
+  size_t w = (aArea->x2-aArea->x1+1)*bytesPerPixel;
+  uint8_t* d = aDest+aArea->y1*lineLength+aArea->x1*bytesPerPixel;
+  int h = aArea->y2-aArea->y1+1;
+  if ((int)w==lineLength && aSrcLineLength==lineLength) {
+    // full lines on both sides: one contiguous span
+    memcpy(d, aSrc, w*h);
+    memcpys++;
+  }
+  else {
+    for (int y=0; y<h; y++) {
+      memcpy(d, aSrc, w);
+      d += lineLength;
+      aSrc += aSrcLineLength;
+    }
+    memcpys += h;
+  }
+  bytesCopied += w*h;
+}
+
+
+void FrameBuffer::addDirty(const lv_area_t* aArea)
+{
+  if (dirty.size()==1 && dirty[0].x1==0 && dirty[0].y1==0 && dirty[0].x2==xres-1 && dirty[0].y2==yres-1) return; // already all dirty
+  if (dirty.size()>=MAX_DIRTY_AREAS) {
+    dirty.clear();
+    lv_area_t all;
+    lv_area_set(&all, 0, 0, xres-1, yres-1);
+    dirty.push_back(all);
+    return;
+  }
+  dirty.push_back(*aArea);
+}
+
+
+void FrameBuffer::drawArea(const lv_area_t* aArea, const lv_color_t* aPixels)
+{
+  if (!mem) return;
+  // clip
+  lv_area_t a = *aArea;
+  if (a.x1<0) a.x1 = 0;
+  if (a.y1<0) a.y1 = 0;
+  if (a.x2>=xres) a.x2 = xres-1;
+  if (a.y2>=yres) a.y2 = yres-1;
+  if (a.x2<a.x1 || a.y2<a.y1) return;
+  pthread_mutex_lock(&pageMutex);
+  areas++;
+  int srcW = aArea->x2-aArea->x1+1;
+  const lv_color_t* src = aPixels+(a.y1-aArea->y1)*srcW+(a.x1-aArea->x1);
+  uint8_t* page = mem;
+  if (pages>1) {
+    int backPage = 1-visiblePage;
+    page = mem+backPage*yres*lineLength;
+    if (dirty.empty() && !prevDirty.empty()) {
+      // first area of a new frame: bring back page up to date with what was drawn into the other page last time
+      const uint8_t* visible = mem+visiblePage*yres*lineLength;
+      for (AreaList::iterator pos = prevDirty.begin(); pos!=prevDirty.end(); ++pos) {
+        copyArea(page, &(*pos), visible+pos->y1*lineLength+pos->x1*bytesPerPixel, lineLength);
+      }
+      prevDirty.clear();
+    }
+    addDirty(&a);
+  }
+  if (flushCostNs>0) {
+    // simulate a display that takes time to accept pixels
+    MLMicroSeconds until = MainLoop::now()+(MLMicroSeconds)lv_area_get_size(&a)*flushCostNs/1000;
+    while (MainLoop::now()<until);
+  }
+  if (bytesPerPixel==(int)sizeof(lv_color_t)) {
+    copyArea(page, &a, (const uint8_t*)src, srcW*sizeof(lv_color_t));
+  }
+  else {
+    // needs conversion
+    int w = a.x2-a.x1+1;
+    for (lv_coord_t y=a.y1; y<=a.y2; y++) {
+      uint32_t* d = (uint32_t*)(page+y*lineLength+a.x1*bytesPerPixel);
+      for (int x=0; x<w; x++) d[x] = lv_color_to32(src[x]);
+      src += srcW;
+    }
+    bytesCopied += w*(a.y2-a.y1+1)*bytesPerPixel;
+  }
+  pthread_mutex_unlock(&pageMutex);
+}
+
+
+void FrameBuffer::frameDone()
+{
+  if (pages<2) return;
+  pthread_mutex_lock(&pageMutex);
+  if (dirty.empty()) {
+    pthread_mutex_unlock(&pageMutex);
+    return;
+  }
+  int backPage = 1-visiblePage;
+  #if !defined(__APPLE__)
+  if (fd>=0) {
+    struct fb_var_screeninfo vinfo;
+    if (ioctl(fd, FBIOGET_VSCREENINFO, &vinfo)==0) {
+      vinfo.yoffset = backPage*yres;
+      if (ioctl(fd, FBIOPAN_DISPLAY, &vinfo)<0) {
+        LOG(LOG_WARNING, "framebuffer: FBIOPAN_DISPLAY failed: %s", Error::text(SysError::errNo()));
+      }
+    }
+  }
+  #endif
+  visiblePage = backPage;
+  flips++;
+  prevDirty.swap(dirty);
+  dirty.clear();
+  pthread_mutex_unlock(&pageMutex);
+}
+
+
+void FrameBuffer::flushCB(struct _disp_drv_t * disp_drv, const lv_area_t * area, lv_color_t * color_p)
+{
+  frameBuffer().drawArea(area, color_p);
+  lv_disp_flush_ready(disp_drv);
+}
+
+
+void FrameBuffer::monitorCB(struct _disp_drv_t * disp_drv, uint32_t time, uint32_t px)
+{
+  FrameBuffer& fb = frameBuffer();
+  fb.frameDone();
+  if (fb.orgMonitorCB) fb.orgMonitorCB(disp_drv, time, px);
+}
+
+
+ErrorPtr FrameBuffer::writePng(const string aPngPath)
+{
+  if (!mem) return TextError::err("no framebuffer");
+  const uint8_t* page = visiblePixels();
+  std::vector<uint8_t> rgb(xres*yres*3);
+  uint8_t* d = &rgb[0];
+  for (int y=0; y<yres; y++) {
+    const uint8_t* l = page+y*lineLength;
+    for (int x=0; x<xres; x++) {
+      lv_color32_t c;
+      if (bytesPerPixel==2) {
+        lv_color_t px;
+        memcpy(&px, l+x*2, 2);
+        c.full = lv_color_to32(px);
+      }
+      else {
+        memcpy(&c.full, l+x*4, 4);
+      }
+      *d++ = c.ch.red;
+      *d++ = c.ch.green;
+      *d++ = c.ch.blue;
+    }
+  }
+  png_image image;
+  memset(&image, 0, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  image.width = xres;
+  image.height = yres;
+  image.format = PNG_FORMAT_RGB;
+  if (!png_image_write_to_file(&image, aPngPath.c_str(), 0, &rgb[0], 0, NULL)) {
+    return TextError::err("cannot write PNG '%s': %s", aPngPath.c_str(), image.message);
+  }
+  return ErrorPtr();
+}
+
+
+// MARK: - statistics
+
+JsonObjectPtr FrameBuffer::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("xres", JsonObject::newInt32(xres));
+  s->add("yres", JsonObject::newInt32(yres));
+  s->add("pages", JsonObject::newInt32(pages));
+  s->add("device", JsonObject::newBool(fd>=0));
+  s->add("flips", JsonObject::newInt64(flips));
+  s->add("areas", JsonObject::newInt64(areas));
+  s->add("memcpys", JsonObject::newInt64(memcpys));
+  s->add("bytesCopied", JsonObject::newInt64(bytesCopied));
+  return s;
+}
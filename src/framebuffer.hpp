@@ -0,0 +1,155 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__framebuffer__
+#define __p44mbcd__framebuffer__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+#include <pthread.h>
+
+namespace p44 {
+
+  /// Flush target for littlevGL rendering into a linux framebuffer device, or into memory.
+  /// When the framebuffer has room for two pages (virtual yres >= 2*yres), rendering goes into
+  /// the invisible page, which is made visible with FBIOPAN_DISPLAY at the end of each frame.
+  /// Areas changed in a frame are copied to the other page before the next frame is rendered,
+  /// so both pages stay complete. Otherwise, areas are copied directly into the visible page,
+  /// using a single memcpy per area when lines are contiguous.
+  /// Areas may be drawn from DisplayTap's flush thread, while frameDone() is called from the main thread.
+  class FrameBuffer : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    typedef void (*FlushCB)(struct _disp_drv_t * disp_drv, const lv_area_t * area, lv_color_t * color_p);
+    typedef void (*MonitorCB)(struct _disp_drv_t * disp_drv, uint32_t time, uint32_t px);
+
+    int fd; ///< framebuffer device, -1 for memory framebuffer
+    uint8_t* mem; ///< the (mapped) framebuffer memory
+    size_t memSize; ///< size of mem
+    int xres; ///< visible width in pixels
+    int yres; ///< visible height in pixels
+    int bytesPerPixel; ///< bytes per pixel (2 or 4)
+    int lineLength; ///< bytes per line
+    int pages; ///< number of pages (1 or 2)
+    int visiblePage; ///< currently visible page
+    lv_disp_t* display; ///< the display we are installed on
+    MonitorCB orgMonitorCB; ///< original monitor callback
+
+    pthread_mutex_t pageMutex; ///< protects pages, dirty and prevDirty between drawArea() and frameDone()
+    typedef std::vector<lv_area_t> AreaList;
+    AreaList dirty; ///< areas drawn into the back page in the current frame
+    AreaList prevDirty; ///< areas drawn in the previous frame (missing in the back page)
+    long flushCostNs; ///< simulated transfer cost per pixel in nS, for memory framebuffers
+
+    // statistics
+    long flips; ///< number of page flips
+    long areas; ///< number of areas flushed
+    long memcpys; ///< number of memcpy calls
+    uint64_t bytesCopied; ///< total bytes copied
+
+  public:
+
+    FrameBuffer();
+    virtual ~FrameBuffer();
+
+    /// get the shared instance
+    static FrameBuffer& frameBuffer();
+
+    /// use a framebuffer device
+    /// @param aDevicePath framebuffer device such as /dev/fb0
+    /// @param aPageFlip if set, try to use page flipping
+    /// @return error if device cannot be used
+    ErrorPtr openDevice(const string aDevicePath, bool aPageFlip);
+
+    /// use a memory framebuffer (for headless operation and for testing)
+    /// @param aXRes width in pixels
+    /// @param aYRes height in pixels
+    /// @param aPages 1 for direct copy, 2 for page flipping
+    /// @return error if memory cannot be allocated
+    ErrorPtr openMemory(int aXRes, int aYRes, int aPages);
+
+    /// simulate the cost of transferring pixels to a display (for memory framebuffers)
+    /// @param aNsPerPixel time in nS each flushed pixel takes
+    void setFlushCost(long aNsPerPixel) { flushCostNs = aNsPerPixel; };
+
+    /// write the visible page as PNG file
+    /// @param aPngPath the path of the PNG file to write
+    /// @return error if file could not be written
+    ErrorPtr writePng(const string aPngPath);
+
+    /// close the framebuffer
+    void close();
+
+    /// route rendering of a display into this framebuffer
+    /// @param aDisplay the display, usually lv_disp_get_default()
+    /// @note must be called before DisplayTap::install(), so the tap sees our callbacks as the originals
+    void install(lv_disp_t* aDisplay);
+
+    /// @return true if framebuffer is open
+    bool isOpen() { return mem!=NULL; };
+
+    /// @return true if rendering goes to an invisible page that is flipped at the end of the frame
+    /// @note page flipping needs two draw buffers to let littlevGL render while flushing,
+    ///   so DisplayTap's flush thread should be running in this case
+    bool isPageFlipping() { return mem!=NULL && pages>1; };
+
+    /// @return width in pixels
+    int getXRes() { return xres; };
+
+    /// @return height in pixels
+    int getYRes() { return yres; };
+
+    /// @return bytes per pixel
+    int getBytesPerPixel() { return bytesPerPixel; };
+
+    /// @return bytes per line
+    int getLineLength() { return lineLength; };
+
+    /// @return pointer to the first pixel of the visible page
+    const uint8_t* visiblePixels() { return mem ? mem+visiblePage*yres*lineLength : NULL; };
+
+    /// copy a rendered area into the back page (or the visible page when not page flipping)
+    /// @param aArea the area
+    /// @param aPixels the pixels for the area
+    void drawArea(const lv_area_t* aArea, const lv_color_t* aPixels);
+
+    /// end of frame: make back page visible
+    /// @note DisplayTap calls the monitor callback (and thus this) only when the frame's last area is flushed.
+    ///   Should an area still be drawn, this waits on the page mutex until it is complete.
+    void frameDone();
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    void copyArea(uint8_t* aDest, const lv_area_t* aArea, const uint8_t* aSrc, int aSrcLineLength);
+    void addDirty(const lv_area_t* aArea);
+    static void flushCB(struct _disp_drv_t * disp_drv, const lv_area_t * area, lv_color_t * color_p);
+    static void monitorCB(struct _disp_drv_t * disp_drv, uint32_t time, uint32_t px);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__framebuffer__) */
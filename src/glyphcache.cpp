@@ -0,0 +1,257 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "glyphcache.hpp"
+
+using namespace p44;
+
+static GlyphCache* glyphCacheP = NULL;
+
+
+GlyphCache::GlyphCache() :
+  budget(0),
+  resident(0),
+  mru(NULL),
+  lru(NULL),
+  lastGlyph(NULL),
+  hits(0),
+  misses(0),
+  evictions(0)
+{
+}
+
+
+GlyphCache::~GlyphCache()
+{
+  for (FontMap::iterator pos = fonts.begin(); pos!=fonts.end(); ++pos) {
+    Font* f = pos->second;
+    for (int i=0; i<GLYPHCACHE_DIRECT; i++) delete[] f->direct[i].bitmap;
+    for (GlyphMap::iterator gpos = f->others.begin(); gpos!=f->others.end(); ++gpos) delete[] gpos->second.bitmap;
+    delete f;
+  }
+}
+
+
+GlyphCache& GlyphCache::cache()
+{
+  if (!glyphCacheP) {
+    glyphCacheP = new GlyphCache;
+  }
+  return *glyphCacheP;
+}
+
+
+void GlyphCache::setBudget(size_t aBudget)
+{
+  budget = aBudget;
+  enforceBudget(0);
+}
+
+
+void GlyphCache::addFont(lv_font_t* aFont)
+{
+  if (!aFont || fonts.find(aFont)!=fonts.end()) return;
+  if (aFont->subpx!=LV_FONT_SUBPX_NONE) return; // subpixel glyphs have a different layout, leave them alone
+  Font* f = new Font;
+  f->orgGlyphDsc = aFont->get_glyph_dsc;
+  f->orgGlyphBitmap = aFont->get_glyph_bitmap;
+  memset(f->direct, 0, sizeof(f->direct));
+  fonts[aFont] = f;
+  aFont->get_glyph_dsc = &GlyphCache::glyphDscCB;
+  aFont->get_glyph_bitmap = &GlyphCache::glyphBitmapCB;
+}
+
+
+// MARK: - font callbacks
+
+bool GlyphCache::glyphDscCB(const lv_font_t* aFont, lv_font_glyph_dsc_t* aDsc, uint32_t aLetter, uint32_t aLetterNext)
+{
+  FontMap::iterator pos = cache().fonts.find(aFont);
+  if (pos==cache().fonts.end()) return false;
+  if (!pos->second->orgGlyphDsc(aFont, aDsc, aLetter, aLetterNext)) return false;
+  // our bitmaps are always 8bpp
+  if (aDsc->bpp<8 && aDsc->box_w>0 && aDsc->box_h>0) aDsc->bpp = 8;
+  return true;
+}
+
+
+const uint8_t* GlyphCache::glyphBitmapCB(const lv_font_t* aFont, uint32_t aLetter)
+{
+  GlyphCache& c = cache();
+  FontMap::iterator pos = c.fonts.find(aFont);
+  if (pos==c.fonts.end()) return NULL;
+  Font* f = pos->second;
+  Glyph* g = c.findGlyph(f, aLetter);
+  if (g) {
+    c.hits++;
+    c.touch(g);
+    c.lastGlyph = g;
+    return g->bitmap;
+  }
+  c.misses++;
+  return c.expand(aFont, f, aLetter, true);
+}
+
+
+GlyphCache::Glyph* GlyphCache::findGlyph(Font* aFont, uint32_t aLetter)
+{
+  if (aLetter<GLYPHCACHE_DIRECT) return aFont->direct[aLetter].bitmap ? &aFont->direct[aLetter] : NULL;
+  GlyphMap::iterator pos = aFont->others.find(aLetter);
+  return pos!=aFont->others.end() ? &pos->second : NULL;
+}
+
+
+void GlyphCache::touch(Glyph* aGlyph)
+{
+  if (aGlyph==mru) return;
+  unlink(aGlyph);
+  aGlyph->next = mru;
+  if (mru) mru->prev = aGlyph;
+  mru = aGlyph;
+  if (!lru) lru = aGlyph;
+}
+
+
+void GlyphCache::unlink(Glyph* aGlyph)
+{
+  if (aGlyph->prev) aGlyph->prev->next = aGlyph->next;
+  else if (mru==aGlyph) mru = aGlyph->next;
+  if (aGlyph->next) aGlyph->next->prev = aGlyph->prev;
+  else if (lru==aGlyph) lru = aGlyph->prev;
+  aGlyph->prev = NULL;
+  aGlyph->next = NULL;
+}
+
+
+const uint8_t* GlyphCache::expand(const lv_font_t* aLvFont, Font* aFont, uint32_t aLetter, bool aMayEvict)
+{
+  lv_font_glyph_dsc_t dsc;
+  if (!aFont->orgGlyphDsc(aLvFont, &dsc, aLetter, 0)) return NULL;
+  const uint8_t* src = aFont->orgGlyphBitmap(aLvFont, aLetter);
+  if (!src || dsc.bpp>=8 || dsc.box_w==0 || dsc.box_h==0) return src; // nothing to expand
+  uint32_t npx = (uint32_t)dsc.box_w*dsc.box_h;
+  if (aMayEvict) enforceBudget(npx);
+  else if (resident+npx>budget) return NULL;
+  // only now create the entry, so the map holds expanded glyphs only
+  Glyph* g = aLetter<GLYPHCACHE_DIRECT ? &aFont->direct[aLetter] : &aFont->others[aLetter];
+  memset(g, 0, sizeof(Glyph));
+  g->font = aFont;
+  g->letter = aLetter;
+  uint8_t* dst = new uint8_t[npx];
+  // font bitmaps are packed MSB first, rows are not byte aligned
+  uint8_t bpp = dsc.bpp;
+  uint8_t mask = (1<<bpp)-1;
+  uint8_t scale = 0xFF/mask; // same values as littlevGL's opacity tables
+  uint32_t bitpos = 0;
+  for (uint32_t i=0; i<npx; i++, bitpos += bpp) {
+    dst[i] = ((src[bitpos>>3] >> (8-(bitpos&7)-bpp)) & mask)*scale;
+  }
+  g->bitmap = dst;
+  g->bytes = npx;
+  touch(g);
+  resident += npx;
+  lastGlyph = g;
+  return dst;
+}
+
+
+void GlyphCache::enforceBudget(size_t aNeeded)
+{
+  if (resident+aNeeded<=budget) return;
+  // evict least recently used glyphs until we are at 3/4 of the budget, to avoid evicting on every miss
+  size_t target = budget*3/4;
+  Glyph* g = lru;
+  while (g && resident+aNeeded>target) {
+    Glyph* victim = g;
+    g = g->prev;
+    if (victim==lastGlyph) continue; // still in use by the renderer
+    unlink(victim);
+    delete[] victim->bitmap;
+    resident -= victim->bytes;
+    evictions++;
+    if (victim->letter<GLYPHCACHE_DIRECT) memset(victim, 0, sizeof(Glyph));
+    else victim->font->others.erase(victim->letter);
+  }
+}
+
+
+// MARK: - prewarming and subsetting
+
+void GlyphCache::collectCodePoints(const string aText, std::set<uint32_t> &aCodePoints)
+{
+  uint32_t i = 0;
+  while (i<aText.size()) {
+    uint32_t cp = lv_txt_encoded_next(aText.c_str(), &i);
+    if (cp>=0x20) aCodePoints.insert(cp);
+  }
+}
+
+
+string GlyphCache::rangeList(const std::set<uint32_t> &aCodePoints)
+{
+  string r;
+  std::set<uint32_t>::const_iterator pos = aCodePoints.begin();
+  while (pos!=aCodePoints.end()) {
+    uint32_t first = *pos;
+    uint32_t last = first;
+    while (++pos!=aCodePoints.end() && *pos==last+1) last = *pos;
+    if (!r.empty()) r += ",";
+    if (first==last) string_format_append(r, "0x%X", first);
+    else string_format_append(r, "0x%X-0x%X", first, last);
+  }
+  return r;
+}
+
+
+void GlyphCache::prewarm(const string aText)
+{
+  std::set<uint32_t> cps;
+  collectCodePoints(aText, cps);
+  bool full = false;
+  for (FontMap::iterator pos = fonts.begin(); pos!=fonts.end() && !full; ++pos) {
+    for (std::set<uint32_t>::iterator cpos = cps.begin(); cpos!=cps.end(); ++cpos) {
+      if (findGlyph(pos->second, *cpos)) continue; // already expanded
+      lv_font_glyph_dsc_t dsc;
+      if (!pos->second->orgGlyphDsc(pos->first, &dsc, *cpos, 0)) continue; // not in this font
+      if (dsc.bpp>=8 || dsc.box_w==0 || dsc.box_h==0) continue; // nothing to expand
+      if (resident+(size_t)dsc.box_w*dsc.box_h>budget) {
+        // do not evict what was prewarmed before
+        full = true;
+        break;
+      }
+      expand(pos->first, pos->second, *cpos, false);
+    }
+  }
+  LOG(LOG_INFO, "glyph cache prewarmed with %zu code points, %zu bytes%s", cps.size(), resident, full ? " (budget exhausted)" : "");
+}
+
+
+// MARK: - statistics
+
+JsonObjectPtr GlyphCache::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("fonts", JsonObject::newInt32((int)fonts.size()));
+  s->add("budget", JsonObject::newInt64(budget));
+  s->add("resident", JsonObject::newInt64(resident));
+  s->add("hits", JsonObject::newInt64(hits));
+  s->add("misses", JsonObject::newInt64(misses));
+  s->add("evictions", JsonObject::newInt64(evictions));
+  return s;
+}
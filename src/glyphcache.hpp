@@ -0,0 +1,123 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__glyphcache__
+#define __p44mbcd__glyphcache__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+#include <set>
+
+namespace p44 {
+
+  /// Byte budgeted cache of glyph bitmaps pre-expanded to 8 bits per pixel.
+  /// Wraps the glyph callbacks of littlevGL fonts, so the letter renderer gets plain alpha bytes
+  /// instead of unpacking the font's 1/2/4 bit per pixel bitmaps for every pixel of every redraw.
+  /// The rendered result is identical (8bpp values are the same as the renderer's opacity tables).
+  class GlyphCache : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    typedef bool (*GlyphDscCB)(const lv_font_t* aFont, lv_font_glyph_dsc_t* aDsc, uint32_t aLetter, uint32_t aLetterNext);
+    typedef const uint8_t* (*GlyphBitmapCB)(const lv_font_t* aFont, uint32_t aLetter);
+
+    #define GLYPHCACHE_DIRECT 128 // code points below this are looked up in an array
+
+    struct Font;
+
+    typedef struct Glyph {
+      uint8_t* bitmap; ///< 8bpp bitmap, NULL if not yet expanded
+      uint32_t bytes; ///< size of bitmap
+      struct Glyph* prev; ///< more recently used expanded glyph
+      struct Glyph* next; ///< less recently used expanded glyph
+      struct Font* font; ///< font the glyph belongs to
+      uint32_t letter; ///< code point
+    } Glyph;
+    typedef std::map<uint32_t, Glyph> GlyphMap;
+
+    typedef struct Font {
+      GlyphDscCB orgGlyphDsc;
+      GlyphBitmapCB orgGlyphBitmap;
+      Glyph direct[GLYPHCACHE_DIRECT];
+      GlyphMap others; ///< only expanded glyphs
+    } Font;
+    typedef std::map<const lv_font_t*, Font*> FontMap;
+    FontMap fonts;
+
+    size_t budget; ///< max bytes of expanded bitmaps
+    size_t resident; ///< bytes of expanded bitmaps
+    Glyph* mru; ///< most recently used expanded glyph
+    Glyph* lru; ///< least recently used expanded glyph
+    Glyph* lastGlyph; ///< glyph returned last, must not be evicted before the next one is requested
+
+    // statistics
+    long hits;
+    long misses;
+    long evictions;
+
+  public:
+
+    GlyphCache();
+    virtual ~GlyphCache();
+
+    /// get the shared instance
+    static GlyphCache& cache();
+
+    /// set the budget
+    /// @param aBudget max number of bytes of expanded glyph bitmaps to keep
+    void setBudget(size_t aBudget);
+
+    /// wrap a font's glyph callbacks
+    /// @param aFont the font
+    void addFont(lv_font_t* aFont);
+
+    /// expand the glyphs for all code points in a text for all wrapped fonts in advance,
+    /// as long as they fit into the budget (prewarming never evicts)
+    /// @param aText UTF-8 text
+    void prewarm(const string aText);
+
+    /// @param aText UTF-8 text
+    /// @param aCodePoints all code points found in aText are added to this set
+    static void collectCodePoints(const string aText, std::set<uint32_t> &aCodePoints);
+
+    /// @param aCodePoints set of code points
+    /// @return compact range list (like "0x20-0x7E,0xB0") for use with font converters
+    static string rangeList(const std::set<uint32_t> &aCodePoints);
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    Glyph* findGlyph(Font* aFont, uint32_t aLetter);
+    const uint8_t* expand(const lv_font_t* aLvFont, Font* aFont, uint32_t aLetter, bool aMayEvict);
+    void touch(Glyph* aGlyph);
+    void unlink(Glyph* aGlyph);
+    void enforceBudget(size_t aNeeded);
+    static bool glyphDscCB(const lv_font_t* aFont, lv_font_glyph_dsc_t* aDsc, uint32_t aLetter, uint32_t aLetterNext);
+    static const uint8_t* glyphBitmapCB(const lv_font_t* aFont, uint32_t aLetter);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__glyphcache__) */
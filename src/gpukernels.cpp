@@ -0,0 +1,220 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "gpukernels.hpp"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #include <arm_neon.h>
+  #define GPU_NEON 1
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+  #define GPU_SSE2 1
+#endif
+
+using namespace p44;
+
+#if LV_COLOR_DEPTH!=16 || LV_COLOR_16_SWAP
+  #error "GpuKernels only support LV_COLOR_DEPTH 16 without LV_COLOR_16_SWAP"
+#endif
+
+
+const char* GpuKernels::simdName()
+{
+  #if GPU_NEON
+  return "NEON";
+  #elif GPU_SSE2
+  return "SSE2";
+  #else
+  return "none";
+  #endif
+}
+
+
+void GpuKernels::install(lv_disp_t* aDisplay)
+{
+  if (!aDisplay) return;
+  aDisplay->driver.gpu_fill_cb = &GpuKernels::fillCB;
+  aDisplay->driver.gpu_blend_cb = &GpuKernels::blendCB;
+  LOG(LOG_NOTICE, "littlevGL fill/blend kernels installed, SIMD: %s", simdName());
+}
+
+
+void GpuKernels::fillCB(struct _disp_drv_t * disp_drv, lv_color_t * dest_buf, lv_coord_t dest_width, const lv_area_t * fill_area, lv_color_t color)
+{
+  fill(dest_buf, dest_width, fill_area, color);
+}
+
+
+void GpuKernels::blendCB(struct _disp_drv_t * disp_drv, lv_color_t * dest, const lv_color_t * src, uint32_t length, lv_opa_t opa)
+{
+  blend(dest, src, length, opa);
+}
+
+
+// MARK: - kernels
+
+void GpuKernels::fill(lv_color_t* aDest, lv_coord_t aDestWidth, const lv_area_t* aArea, lv_color_t aColor, bool aSimd)
+{
+  int w = aArea->x2-aArea->x1+1;
+  uint16_t c = aColor.full;
+  uint16_t* row = &aDest[(int32_t)aArea->y1*aDestWidth+aArea->x1].full;
+  for (lv_coord_t y=aArea->y1; y<=aArea->y2; y++) {
+    uint16_t* p = row;
+    int n = w;
+    if (aSimd) {
+      #if GPU_NEON
+      uint16x8_t cv = vdupq_n_u16(c);
+      for (; n>=8; n-=8, p+=8) vst1q_u16(p, cv);
+      #elif GPU_SSE2
+      __m128i cv = _mm_set1_epi16((short)c);
+      for (; n>=8; n-=8, p+=8) _mm_storeu_si128((__m128i*)p, cv);
+      #endif
+    }
+    while (n-->0) *p++ = c;
+    row += aDestWidth;
+  }
+}
+
+
+static inline uint16_t blend565(uint16_t aSrc, uint16_t aDest, uint16_t aOpa, uint16_t aInvOpa)
+{
+  uint16_t r = ((aSrc>>11)*aOpa + (aDest>>11)*aInvOpa)>>8;
+  uint16_t g = (((aSrc>>5)&0x3F)*aOpa + ((aDest>>5)&0x3F)*aInvOpa)>>8;
+  uint16_t b = ((aSrc&0x1F)*aOpa + (aDest&0x1F)*aInvOpa)>>8;
+  return (r<<11) | (g<<5) | b;
+}
+
+
+void GpuKernels::blend(lv_color_t* aDest, const lv_color_t* aSrc, uint32_t aLength, lv_opa_t aOpa, bool aSimd)
+{
+  if (aOpa>=LV_OPA_MAX) {
+    memcpy(aDest, aSrc, aLength*sizeof(lv_color_t));
+    return;
+  }
+  if (aOpa<=LV_OPA_MIN) return;
+  uint16_t* d = &aDest->full;
+  const uint16_t* s = &aSrc->full;
+  uint16_t opa = aOpa;
+  uint16_t invOpa = 255-aOpa;
+  uint32_t n = aLength;
+  if (aSimd) {
+    // all intermediate products fit into 16 bits: 63*255+63*255 < 65536
+    #if GPU_NEON
+    uint16x8_t ov = vdupq_n_u16(opa);
+    uint16x8_t iv = vdupq_n_u16(invOpa);
+    uint16x8_t m6 = vdupq_n_u16(0x3F);
+    uint16x8_t m5 = vdupq_n_u16(0x1F);
+    for (; n>=8; n-=8, d+=8, s+=8) {
+      uint16x8_t sv = vld1q_u16(s);
+      uint16x8_t dv = vld1q_u16(d);
+      uint16x8_t r = vshrq_n_u16(vmlaq_u16(vmulq_u16(vshrq_n_u16(sv, 11), ov), vshrq_n_u16(dv, 11), iv), 8);
+      uint16x8_t g = vshrq_n_u16(vmlaq_u16(vmulq_u16(vandq_u16(vshrq_n_u16(sv, 5), m6), ov), vandq_u16(vshrq_n_u16(dv, 5), m6), iv), 8);
+      uint16x8_t b = vshrq_n_u16(vmlaq_u16(vmulq_u16(vandq_u16(sv, m5), ov), vandq_u16(dv, m5), iv), 8);
+      vst1q_u16(d, vorrq_u16(vorrq_u16(vshlq_n_u16(r, 11), vshlq_n_u16(g, 5)), b));
+    }
+    #elif GPU_SSE2
+    __m128i ov = _mm_set1_epi16((short)opa);
+    __m128i iv = _mm_set1_epi16((short)invOpa);
+    __m128i m6 = _mm_set1_epi16(0x3F);
+    __m128i m5 = _mm_set1_epi16(0x1F);
+    for (; n>=8; n-=8, d+=8, s+=8) {
+      __m128i sv = _mm_loadu_si128((const __m128i*)s);
+      __m128i dv = _mm_loadu_si128((const __m128i*)d);
+      __m128i r = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_srli_epi16(sv, 11), ov), _mm_mullo_epi16(_mm_srli_epi16(dv, 11), iv)), 8);
+      __m128i g = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(sv, 5), m6), ov), _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(dv, 5), m6), iv)), 8);
+      __m128i b = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(sv, m5), ov), _mm_mullo_epi16(_mm_and_si128(dv, m5), iv)), 8);
+      _mm_storeu_si128((__m128i*)d, _mm_or_si128(_mm_or_si128(_mm_slli_epi16(r, 11), _mm_slli_epi16(g, 5)), b));
+    }
+    #endif
+  }
+  while (n-->0) {
+    *d = blend565(*s, *d, opa, invOpa);
+    d++; s++;
+  }
+}
+
+
+// MARK: - benchmark
+
+#define BENCH_W 320
+#define BENCH_H 240
+
+static double benchFill(lv_color_t* aBuf, bool aSimd, MLMicroSeconds aDuration)
+{
+  lv_area_t a;
+  lv_area_set(&a, 3, 5, BENCH_W-4, BENCH_H-6); // unaligned, like typical widget areas
+  uint64_t px = 0;
+  uint16_t c = 0;
+  MLMicroSeconds start = MainLoop::now();
+  MLMicroSeconds t;
+  do {
+    lv_color_t col;
+    col.full = c++;
+    GpuKernels::fill(aBuf, BENCH_W, &a, col, aSimd);
+    px += lv_area_get_size(&a);
+    t = MainLoop::now()-start;
+  } while (t<aDuration);
+  return (double)px*Second/t;
+}
+
+
+static double benchBlend(lv_color_t* aBuf, const lv_color_t* aSrc, bool aSimd, MLMicroSeconds aDuration)
+{
+  uint64_t px = 0;
+  lv_opa_t opa = 1;
+  MLMicroSeconds start = MainLoop::now();
+  MLMicroSeconds t;
+  do {
+    for (int y=0; y<BENCH_H; y++) {
+      GpuKernels::blend(aBuf+y*BENCH_W+1, aSrc+y*BENCH_W, BENCH_W-1, opa, aSimd);
+    }
+    if (++opa>=LV_OPA_MAX) opa = LV_OPA_MIN+1;
+    px += BENCH_H*(BENCH_W-1);
+    t = MainLoop::now()-start;
+  } while (t<aDuration);
+  return (double)px*Second/t;
+}
+
+
+JsonObjectPtr GpuKernels::benchmark(MLMicroSeconds aDuration)
+{
+  lv_color_t* buf = new lv_color_t[BENCH_W*BENCH_H];
+  lv_color_t* src = new lv_color_t[BENCH_W*BENCH_H];
+  for (int i=0; i<BENCH_W*BENCH_H; i++) {
+    src[i].full = (uint16_t)(i*2654435761u>>16);
+    buf[i].full = (uint16_t)i;
+  }
+  // verify vectorized results against scalar
+  lv_color_t* ref = new lv_color_t[BENCH_W*BENCH_H];
+  memcpy(ref, buf, BENCH_W*BENCH_H*sizeof(lv_color_t));
+  blend(ref, src, BENCH_W*BENCH_H, 77, false);
+  blend(buf, src, BENCH_W*BENCH_H, 77, true);
+  bool match = memcmp(ref, buf, BENCH_W*BENCH_H*sizeof(lv_color_t))==0;
+  delete[] ref;
+  JsonObjectPtr r = JsonObject::newObj();
+  r->add("simd", JsonObject::newString(simdName()));
+  r->add("simdMatchesScalar", JsonObject::newBool(match));
+  r->add("fillScalarMPixPerSec", JsonObject::newDouble(benchFill(buf, false, aDuration)/1e6));
+  r->add("fillSimdMPixPerSec", JsonObject::newDouble(benchFill(buf, true, aDuration)/1e6));
+  r->add("blendScalarMPixPerSec", JsonObject::newDouble(benchBlend(buf, src, false, aDuration)/1e6));
+  r->add("blendSimdMPixPerSec", JsonObject::newDouble(benchBlend(buf, src, true, aDuration)/1e6));
+  delete[] buf;
+  delete[] src;
+  return r;
+}
@@ -0,0 +1,73 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__gpukernels__
+#define __p44mbcd__gpukernels__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+namespace p44 {
+
+  /// RGB565 fill and blend kernels for littlevGL's GPU interface (LV_USE_GPU).
+  /// Vectorized with NEON or SSE2 when the compiler targets these, scalar otherwise.
+  class GpuKernels
+  {
+  public:
+
+    /// @return name of the SIMD instruction set compiled in, "none" if none
+    static const char* simdName();
+
+    /// install the kernels as gpu_fill_cb and gpu_blend_cb of a display
+    /// @param aDisplay the display, usually lv_disp_get_default()
+    static void install(lv_disp_t* aDisplay);
+
+    /// fill an area of a buffer with a solid color
+    /// @param aDest the buffer
+    /// @param aDestWidth width of the buffer in pixels
+    /// @param aArea the area to fill, relative to the buffer
+    /// @param aColor the color
+    /// @param aSimd if set, use vectorized code (when compiled in)
+    static void fill(lv_color_t* aDest, lv_coord_t aDestWidth, const lv_area_t* aArea, lv_color_t aColor, bool aSimd = true);
+
+    /// blend pixels onto a buffer: dest = src*opa + dest*(255-opa)
+    /// @param aDest the destination pixels
+    /// @param aSrc the source pixels
+    /// @param aLength number of pixels
+    /// @param aOpa opacity of the source
+    /// @param aSimd if set, use vectorized code (when compiled in)
+    static void blend(lv_color_t* aDest, const lv_color_t* aSrc, uint32_t aLength, lv_opa_t aOpa, bool aSimd = true);
+
+    /// compare pixels/second of scalar and vectorized kernels
+    /// @param aDuration time to run each kernel
+    /// @return results as JSON object
+    static JsonObjectPtr benchmark(MLMicroSeconds aDuration);
+
+  private:
+
+    static void fillCB(struct _disp_drv_t * disp_drv, lv_color_t * dest_buf, lv_coord_t dest_width, const lv_area_t * fill_area, lv_color_t color);
+    static void blendCB(struct _disp_drv_t * disp_drv, lv_color_t * dest, const lv_color_t * src, uint32_t length, lv_opa_t opa);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__gpukernels__) */
@@ -0,0 +1,281 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "imagecache.hpp"
+
+#include "lvgl/src/lv_misc/lv_gc.h"
+
+#include <algorithm>
+
+using namespace p44;
+
+static ImageCache* imageCacheP = NULL;
+
+
+ImageCache::ImageCache() :
+  budget(0),
+  lvCacheEntries(0),
+  resident(0),
+  useCounter(0),
+  enforcing(false),
+  hits(0),
+  misses(0),
+  evictions(0),
+  uncacheable(0)
+{
+}
+
+
+ImageCache& ImageCache::cache()
+{
+  if (!imageCacheP) {
+    imageCacheP = new ImageCache;
+  }
+  return *imageCacheP;
+}
+
+
+void ImageCache::install(size_t aBudget)
+{
+  budget = aBudget;
+  // littlevGL does not expose its cache size, so set it explicitly to know how many entries to scan
+  lvCacheEntries = LV_IMG_CACHE_DEF_SIZE;
+  lv_img_cache_set_size(lvCacheEntries);
+  lv_img_decoder_t* d = (lv_img_decoder_t*)lv_ll_get_head(&LV_GC_ROOT(_lv_img_defoder_ll));
+  while (d) {
+    if (decoders.find(d)==decoders.end() && d->open_cb) {
+      DecoderCBs &cbs = decoders[d];
+      cbs.open_cb = d->open_cb;
+      cbs.close_cb = d->close_cb;
+      d->open_cb = &ImageCache::openCB;
+      d->close_cb = &ImageCache::closeCB;
+    }
+    d = (lv_img_decoder_t*)lv_ll_get_next(&LV_GC_ROOT(_lv_img_defoder_ll), d);
+  }
+  LOG(LOG_NOTICE, "image cache installed on %zu decoders, budget: %zu bytes", decoders.size(), budget);
+}
+
+
+void ImageCache::setBudget(size_t aBudget)
+{
+  budget = aBudget;
+  scheduleEnforce();
+}
+
+
+string ImageCache::keyFor(const void* aSrc)
+{
+  switch (lv_img_src_get_type(aSrc)) {
+    case LV_IMG_SRC_FILE: return string("f:") + (const char*)aSrc;
+    case LV_IMG_SRC_VARIABLE: return string_format("v:%p", aSrc);
+    default: return ""; // symbols are not cached
+  }
+}
+
+
+// MARK: - decoder wrapping
+
+lv_res_t ImageCache::openCB(lv_img_decoder_t* aDecoder, lv_img_decoder_dsc_t* aDsc)
+{
+  ImageCache& c = cache();
+  DecoderMap::iterator d = c.decoders.find(aDecoder);
+  if (d==c.decoders.end()) return LV_RES_INV;
+  string key = keyFor(aDsc->src);
+  if (!key.empty()) {
+    EntryMap::iterator pos = c.entries.find(key);
+    if (pos!=c.entries.end()) {
+      // still open from earlier
+      Entry* e = pos->second;
+      aDsc->img_data = e->dsc.img_data;
+      aDsc->user_data = e->dsc.user_data;
+      e->refs++;
+      e->lastUse = ++c.useCounter;
+      c.hits++;
+      return LV_RES_OK;
+    }
+  }
+  lv_res_t res = d->second.open_cb(aDecoder, aDsc);
+  if (res!=LV_RES_OK) return res;
+  if (aDsc->src_type==LV_IMG_SRC_VARIABLE && aDsc->img_data==((const lv_img_dsc_t*)aDsc->src)->data) {
+    // image data used in place, nothing to keep (and the data might change, e.g. static layers)
+    return res;
+  }
+  c.misses++;
+  if (key.empty() || aDsc->img_data==NULL) {
+    // decoded line by line, cannot keep it
+    c.uncacheable++;
+    return res;
+  }
+  Entry* e = new Entry;
+  e->decoder = aDecoder;
+  e->dsc = *aDsc;
+  if (aDsc->src_type==LV_IMG_SRC_FILE) {
+    e->path = (const char*)aDsc->src;
+    e->src = e->path.c_str();
+  }
+  else {
+    e->src = aDsc->src;
+  }
+  e->dsc.src = e->src;
+  e->bytes = (size_t)aDsc->header.w*aDsc->header.h*lv_img_color_format_get_px_size(aDsc->header.cf)/8;
+  e->lastUse = ++c.useCounter;
+  e->refs = 1;
+  e->evicted = false;
+  c.entries[key] = e;
+  c.resident += e->bytes;
+  c.scheduleEnforce();
+  return res;
+}
+
+
+void ImageCache::closeCB(lv_img_decoder_t* aDecoder, lv_img_decoder_dsc_t* aDsc)
+{
+  ImageCache& c = cache();
+  string key = keyFor(aDsc->src);
+  if (!key.empty()) {
+    EntryMap::iterator pos = c.entries.find(key);
+    if (pos!=c.entries.end() && pos->second->dsc.img_data==aDsc->img_data) {
+      // stays open in the cache
+      pos->second->refs--;
+      return;
+    }
+  }
+  ZombieMap::iterator z = c.zombies.find(aDsc->img_data);
+  if (z!=c.zombies.end()) {
+    Entry* e = z->second;
+    if (--e->refs<=0) c.release(e);
+    return;
+  }
+  // not cached, pass on
+  DecoderMap::iterator d = c.decoders.find(aDecoder);
+  if (d!=c.decoders.end() && d->second.close_cb) d->second.close_cb(aDecoder, aDsc);
+}
+
+
+void ImageCache::release(Entry* aEntry)
+{
+  if (aEntry->evicted) zombies.erase(aEntry->dsc.img_data);
+  DecoderMap::iterator d = decoders.find(aEntry->decoder);
+  if (d!=decoders.end() && d->second.close_cb) d->second.close_cb(aEntry->decoder, &aEntry->dsc);
+  delete aEntry;
+}
+
+
+// MARK: - budget
+
+void ImageCache::scheduleEnforce()
+{
+  if (enforcing || budget==0 || resident<=budget) return;
+  // not from within littlevGL's image cache handling, but right after
+  enforcing = true;
+  MainLoop::currentMainLoop().executeNow(boost::bind(&ImageCache::enforceBudget, this));
+}
+
+
+void ImageCache::collectPinned(lv_obj_t* aObj, std::set<string> &aPinned)
+{
+  lv_obj_type_t t;
+  lv_obj_get_type(aObj, &t);
+  if (strcmp(t.type[0], "lv_img")==0) {
+    string k = keyFor(lv_img_get_src(aObj));
+    if (!k.empty()) aPinned.insert(k);
+  }
+  #if LV_USE_IMGBTN
+  else if (strcmp(t.type[0], "lv_imgbtn")==0) {
+    for (int s=0; s<LV_BTN_STATE_NUM; s++) {
+      const void* src = lv_imgbtn_get_src(aObj, (lv_btn_state_t)s);
+      if (src) {
+        string k = keyFor(src);
+        if (!k.empty()) aPinned.insert(k);
+      }
+    }
+  }
+  #endif
+  lv_obj_t* child = lv_obj_get_child(aObj, NULL);
+  while (child) {
+    collectPinned(child, aPinned);
+    child = lv_obj_get_child(aObj, child);
+  }
+}
+
+
+void ImageCache::invalidateLvCache(const uint8_t* aImgData)
+{
+  // lv_img_cache_invalidate_src() compares sources by pointer, so pass exactly the one
+  // littlevGL's cache entry was opened with (for files, that's the lv_img's own copy, not ours)
+  lv_img_cache_entry_t* lvCache = (lv_img_cache_entry_t*)LV_GC_ROOT(_lv_img_cache_array);
+  for (uint16_t i=0; lvCache && i<lvCacheEntries; i++) {
+    if (lvCache[i].dec_dsc.src && lvCache[i].dec_dsc.img_data==aImgData) {
+      lv_img_cache_invalidate_src(lvCache[i].dec_dsc.src);
+    }
+  }
+}
+
+
+void ImageCache::enforceBudget()
+{
+  enforcing = false;
+  if (budget==0 || resident<=budget) return;
+  // images of the active screen must stay
+  std::set<string> pinned;
+  collectPinned(lv_scr_act(), pinned);
+  collectPinned(lv_layer_top(), pinned);
+  // least recently used first
+  std::vector<std::pair<long, string> > lru;
+  for (EntryMap::iterator pos = entries.begin(); pos!=entries.end(); ++pos) {
+    if (pinned.find(pos->first)==pinned.end()) lru.push_back(std::make_pair(pos->second->lastUse, pos->first));
+  }
+  std::sort(lru.begin(), lru.end());
+  for (size_t i=0; i<lru.size() && resident>budget; i++) {
+    EntryMap::iterator pos = entries.find(lru[i].second);
+    Entry* e = pos->second;
+    entries.erase(pos);
+    resident -= e->bytes;
+    evictions++;
+    if (e->refs>0) {
+      // still in littlevGL's image cache: drop it from there, closing it via closeCB()
+      e->evicted = true;
+      zombies[e->dsc.img_data] = e;
+      invalidateLvCache(e->dsc.img_data);
+    }
+    else {
+      release(e);
+    }
+  }
+  if (resident>budget) {
+    LOG(LOG_WARNING, "image cache: pinned images (%zu bytes) exceed budget (%zu bytes)", resident, budget);
+  }
+}
+
+
+// MARK: - statistics
+
+JsonObjectPtr ImageCache::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("hits", JsonObject::newInt64(hits));
+  s->add("misses", JsonObject::newInt64(misses));
+  s->add("hitRate", JsonObject::newDouble(hits+misses>0 ? (double)hits/(hits+misses) : 0));
+  s->add("evictions", JsonObject::newInt64(evictions));
+  s->add("uncacheable", JsonObject::newInt64(uncacheable));
+  s->add("entries", JsonObject::newInt64(entries.size()));
+  s->add("residentBytes", JsonObject::newInt64(resident));
+  s->add("budgetBytes", JsonObject::newInt64(budget));
+  return s;
+}
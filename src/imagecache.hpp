@@ -0,0 +1,108 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__imagecache__
+#define __p44mbcd__imagecache__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+#include <set>
+
+namespace p44 {
+
+  /// Byte budgeted LRU cache for decoded littlevGL images.
+  /// Wraps the open/close callbacks of all installed image decoders, keeps fully decoded images
+  /// open beyond littlevGL's own (entry count based) image cache, and closes the least recently
+  /// used ones when the total size exceeds the budget. Images shown on the active screen are pinned.
+  class ImageCache : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    typedef struct {
+      lv_img_decoder_open_f_t open_cb;
+      lv_img_decoder_close_f_t close_cb;
+    } DecoderCBs;
+    typedef std::map<lv_img_decoder_t*, DecoderCBs> DecoderMap;
+    DecoderMap decoders; ///< original callbacks of the wrapped decoders
+
+    typedef struct {
+      string path; ///< file path for file sources
+      const void* src; ///< the source as used by littlevGL (points to path for file sources)
+      lv_img_decoder_t* decoder; ///< the decoder that opened the image
+      lv_img_decoder_dsc_t dsc; ///< the descriptor as returned by the decoder
+      size_t bytes; ///< decoded size
+      long lastUse; ///< LRU stamp
+      int refs; ///< number of littlevGL descriptors currently using the image
+      bool evicted; ///< set when evicted but still in use
+    } Entry;
+    typedef std::map<string, Entry*> EntryMap;
+    EntryMap entries; ///< cached images by source
+    typedef std::map<const uint8_t*, Entry*> ZombieMap;
+    ZombieMap zombies; ///< evicted images still in use by littlevGL, by image data
+
+    size_t budget; ///< max bytes, 0 = no limit
+    uint16_t lvCacheEntries; ///< size of littlevGL's image cache
+    size_t resident; ///< bytes of decoded images held
+    long useCounter; ///< for LRU stamps
+    bool enforcing; ///< set when budget enforcement is scheduled
+
+    // statistics
+    long hits;
+    long misses;
+    long evictions;
+    long uncacheable; ///< opens that did not produce a fully decoded image
+
+  public:
+
+    ImageCache();
+
+    /// get the shared instance
+    static ImageCache& cache();
+
+    /// wrap all image decoders that are currently installed
+    /// @param aBudget max number of bytes of decoded images to keep, 0 for unlimited
+    /// @note must be called after all decoders are created
+    void install(size_t aBudget);
+
+    /// change the budget
+    /// @param aBudget max number of bytes of decoded images to keep, 0 for unlimited
+    void setBudget(size_t aBudget);
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    static string keyFor(const void* aSrc);
+    void scheduleEnforce();
+    void enforceBudget();
+    void invalidateLvCache(const uint8_t* aImgData);
+    void collectPinned(lv_obj_t* aObj, std::set<string> &aPinned);
+    void release(Entry* aEntry);
+    static lv_res_t openCB(lv_img_decoder_t* aDecoder, lv_img_decoder_dsc_t* aDsc);
+    static void closeCB(lv_img_decoder_t* aDecoder, lv_img_decoder_dsc_t* aDsc);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__imagecache__) */
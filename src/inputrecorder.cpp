@@ -0,0 +1,124 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "inputrecorder.hpp"
+
+using namespace p44;
+
+static InputRecorder* inputRecorderP = NULL;
+
+
+InputRecorder::InputRecorder() :
+  file(NULL),
+  lastEvent(Never),
+  events(0)
+{
+}
+
+
+InputRecorder::~InputRecorder()
+{
+  stop();
+}
+
+
+InputRecorder& InputRecorder::recorder()
+{
+  if (!inputRecorderP) {
+    inputRecorderP = new InputRecorder;
+  }
+  return *inputRecorderP;
+}
+
+
+ErrorPtr InputRecorder::start(const string aPath)
+{
+  stop();
+  file = fopen(aPath.c_str(), "w");
+  if (!file) return SysError::errNo("cannot create input recording: ");
+  path = aPath;
+  fprintf(file, "# input recording, delay_ms action x y device\n");
+  lastEvent = MainLoop::now();
+  events = 0;
+  lv_indev_t* indev = lv_indev_get_next(NULL);
+  while (indev) {
+    // do not record our own synthetic input (which would record playback and remote input, too)
+    if (indev->driver.type==LV_INDEV_TYPE_POINTER && !ScriptedInput::isScriptedInput(indev)) {
+      Device d;
+      d.orgReadCB = indev->driver.read_cb;
+      d.id = (int)devices.size();
+      d.pressed = false;
+      d.point.x = 0;
+      d.point.y = 0;
+      devices[&indev->driver] = d;
+      indev->driver.read_cb = &InputRecorder::readCB;
+    }
+    indev = lv_indev_get_next(indev);
+  }
+  if (devices.empty()) {
+    fclose(file);
+    file = NULL;
+    return TextError::err("no pointer input devices to record");
+  }
+  LOG(LOG_NOTICE, "recording input of %zu pointer devices to %s", devices.size(), path.c_str());
+  return ErrorPtr();
+}
+
+
+void InputRecorder::stop()
+{
+  if (!file) return;
+  for (DeviceMap::iterator pos = devices.begin(); pos!=devices.end(); ++pos) {
+    pos->first->read_cb = pos->second.orgReadCB;
+  }
+  devices.clear();
+  fclose(file);
+  file = NULL;
+  LOG(LOG_NOTICE, "input recording stopped, %ld events recorded to %s", events, path.c_str());
+}
+
+
+bool InputRecorder::readCB(lv_indev_drv_t* aDrv, lv_indev_data_t* aData)
+{
+  InputRecorder& r = recorder();
+  DeviceMap::iterator pos = r.devices.find(aDrv);
+  if (pos==r.devices.end()) return false; // should not happen
+  bool more = pos->second.orgReadCB(aDrv, aData);
+  r.record(pos->second, aData);
+  return more;
+}
+
+
+void InputRecorder::record(Device &aDevice, const lv_indev_data_t* aData)
+{
+  bool pressed = aData->state==LV_INDEV_STATE_PR;
+  const char* action;
+  if (pressed && !aDevice.pressed) action = "press";
+  else if (!pressed && aDevice.pressed) action = "release";
+  else if (pressed && (aData->point.x!=aDevice.point.x || aData->point.y!=aDevice.point.y)) action = "move";
+  else return; // nothing to record (pointer position without touch is irrelevant)
+  aDevice.pressed = pressed;
+  aDevice.point = aData->point;
+  MLMicroSeconds now = MainLoop::now();
+  fprintf(file, "%lld %s %d %d %d\n", (long long)((now-lastEvent)/MilliSecond), action, aData->point.x, aData->point.y, aDevice.id);
+  fflush(file); // input events are rare, keep the recording complete even if we crash or get killed
+  // advance by the recorded (truncated) delay only, so rounding errors do not accumulate
+  lastEvent += (now-lastEvent)/MilliSecond*MilliSecond;
+  events++;
+}
@@ -0,0 +1,88 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__inputrecorder__
+#define __p44mbcd__inputrecorder__
+
+#include "p44utils_common.hpp"
+#include "scriptedinput.hpp"
+
+#include "lvgl/lvgl.h"
+
+#include <stdio.h>
+
+namespace p44 {
+
+  /// Records the input of all physical littlevGL pointer devices into a file, in the input script
+  /// format of ScriptedInput (`<delay_ms> press|move|release <x> <y> <device>`), so recorded
+  /// interaction can be played back with --inputscript or replayinput(), at original or
+  /// accelerated speed. The device number is ignored on playback, it only tells apart events
+  /// of different devices in the recording.
+  /// Recording wraps the read callbacks of the pointer devices registered at start. ScriptedInput
+  /// devices (input script playback, remote display) are not recorded.
+  /// @note timing resolution is that of littlevGL's input device polling
+  class InputRecorder : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    typedef bool (*ReadCB)(struct _lv_indev_drv_t * indev_drv, lv_indev_data_t * data);
+
+    typedef struct {
+      ReadCB orgReadCB; ///< original read callback
+      int id; ///< device number in the recording
+      bool pressed; ///< last recorded state
+      lv_point_t point; ///< last recorded position
+    } Device;
+    typedef std::map<lv_indev_drv_t*, Device> DeviceMap;
+    DeviceMap devices; ///< the devices being recorded
+
+    FILE* file; ///< the recording
+    string path; ///< path of the recording
+    MLMicroSeconds lastEvent; ///< time of last recorded event
+    long events; ///< number of recorded events
+
+  public:
+
+    InputRecorder();
+    virtual ~InputRecorder();
+
+    /// get the shared instance
+    static InputRecorder& recorder();
+
+    /// start recording
+    /// @param aPath file to write the recording to
+    /// @return error if file cannot be created or there are no pointer devices
+    ErrorPtr start(const string aPath);
+
+    /// stop recording, restore input devices
+    void stop();
+
+    /// @return true while recording
+    bool isRecording() { return file!=NULL; };
+
+  private:
+
+    static bool readCB(lv_indev_drv_t* aDrv, lv_indev_data_t* aData);
+    void record(Device &aDevice, const lv_indev_data_t* aData);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__inputrecorder__) */
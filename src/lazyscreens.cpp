@@ -0,0 +1,335 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "lazyscreens.hpp"
+#include "lvmempool.hpp"
+
+using namespace p44;
+
+#define LAZY_CHECK_INTERVAL (5*Second)
+#define BUILD_AVG_WEIGHT 8
+
+
+LazyScreens::LazyScreens(ConfigApplyCB aApplyCB, ScreenDeleteCB aDeleteCB) :
+  applyCB(aApplyCB),
+  deleteCB(aDeleteCB),
+  placeholder(NULL),
+  idleTime(Never),
+  lowMemory(0),
+  builds(0),
+  teardowns(0),
+  avgBuildTime(0),
+  configTime(0),
+  peakBuiltMemory(0),
+  definitionBytes(0)
+{
+  checkTicket.executeOnce(boost::bind(&LazyScreens::check, this), LAZY_CHECK_INTERVAL);
+}
+
+
+LazyScreens::~LazyScreens()
+{
+  checkTicket.cancel();
+}
+
+
+void LazyScreens::setTeardownPolicy(MLMicroSeconds aIdleTime, size_t aLowMemory)
+{
+  idleTime = aIdleTime;
+  lowMemory = aLowMemory;
+}
+
+
+const UiCompiler::KeySet& LazyScreens::hookKeys()
+{
+  static UiCompiler::KeySet keys;
+  if (keys.empty()) {
+    keys.insert("onbuild");
+    keys.insert("onteardown");
+    keys.insert("resident");
+  }
+  return keys;
+}
+
+
+ErrorPtr LazyScreens::setConfig(JsonObjectPtr aConfig)
+{
+  if (!aConfig || !aConfig->isType(json_type_object)) return TextError::err("UI config must be an object");
+  // copy, the caller's config must remain untouched
+  JsonObjectPtr cfg = JsonObject::newObj();
+  UiCompiler::DeferredMembers defs;
+  aConfig->resetKeyIteration();
+  string key;
+  JsonObjectPtr o;
+  while (aConfig->nextKeyValue(key, o)) {
+    if (key=="screens" && o && o->isType(json_type_object)) UiCompiler::deferMembers(o, hookKeys(), defs);
+    else cfg->add(key.c_str(), o);
+  }
+  return setConfig(cfg, defs);
+}
+
+
+ErrorPtr LazyScreens::setConfig(JsonObjectPtr aConfig, const UiCompiler::DeferredMembers &aScreens)
+{
+  if (!aConfig || !aConfig->isType(json_type_object)) return TextError::err("UI config must be an object");
+  MLMicroSeconds start = MainLoop::now();
+  JsonObjectPtr eager = JsonObject::newObj();
+  string startScreen;
+  aConfig->resetKeyIteration();
+  string key;
+  JsonObjectPtr o;
+  while (aConfig->nextKeyValue(key, o)) {
+    if (key=="startscreen") startScreen = o->stringValue();
+    else if (key!="screens") eager->add(key.c_str(), o);
+  }
+  // store screen definitions as text
+  std::list<string> buildNow;
+  for (UiCompiler::DeferredMembers::const_iterator pos = aScreens.begin(); pos!=aScreens.end(); ++pos) {
+    Screen& s = screens[pos->name];
+    bool wasActive = s.built && s.screen==lv_scr_act();
+    if (s.built) {
+      s.stale = true;
+      if (!wasActive) teardown(pos->name, s); // active screen gets replaced when new version is shown
+    }
+    JsonObjectPtr h;
+    s.onBuild = pos->extracted && pos->extracted->get("onbuild", h) ? h->stringValue() : "";
+    s.onTeardown = pos->extracted && pos->extracted->get("onteardown", h) ? h->stringValue() : "";
+    s.resident = pos->extracted && pos->extracted->get("resident", h) && h->boolValue();
+    if (!s.definition.empty()) definitionBytes -= s.definition.size();
+    s.definition = pos->text;
+    definitionBytes += s.definition.size();
+    if (!s.built) {
+      s.screen = NULL;
+      s.lastShown = Never;
+      s.memory = 0;
+    }
+    if (s.resident) buildNow.push_back(pos->name);
+    if (wasActive && startScreen.empty()) startScreen = pos->name; // redefined the active screen, show new version
+  }
+  ErrorPtr err = applyCB(eager);
+  if (Error::notOK(err)) return err;
+  for (std::list<string>::iterator pos = buildNow.begin(); pos!=buildNow.end(); ++pos) {
+    err = build(*pos, screens[*pos]);
+    if (Error::notOK(err)) return err;
+  }
+  if (!startScreen.empty()) {
+    err = showScreen(startScreen);
+  }
+  configTime = (double)(MainLoop::now()-start)/MilliSecond;
+  LOG(LOG_INFO, "lazy screens: %zu screens defined, %zu bytes of definitions, config applied in %.1f mS", screens.size(), definitionBytes, configTime);
+  return err;
+}
+
+
+ErrorPtr LazyScreens::showScreen(const string aScreenName)
+{
+  ScreenMap::iterator pos = screens.find(aScreenName);
+  if (pos==screens.end()) return TextError::err("unknown screen '%s'", aScreenName.c_str());
+  Screen& s = pos->second;
+  if (s.built && s.stale) {
+    // outdated widgets, must be rebuilt
+    remove(aScreenName, s);
+  }
+  if (s.tearingDown) {
+    // widgets still exist, just keep them
+    LOG(LOG_INFO, "lazy screens: teardown of '%s' cancelled", aScreenName.c_str());
+    s.tearingDown = false;
+  }
+  if (!s.built) {
+    // make room first
+    while (lowMemory>0 && LvMemPool::lvglPool().allocatableBytes()+pendingRelease()<lowMemory) {
+      if (!releaseOldest()) break;
+    }
+    ErrorPtr err = build(aScreenName, s);
+    if (Error::notOK(err)) return err;
+  }
+  JsonObjectPtr cfg = JsonObject::newObj();
+  cfg->add("startscreen", JsonObject::newString(aScreenName));
+  ErrorPtr err = applyCB(cfg);
+  if (Error::notOK(err)) return err;
+  s.screen = lv_scr_act();
+  s.lastShown = MainLoop::now();
+  return ErrorPtr();
+}
+
+
+ErrorPtr LazyScreens::build(const string aName, Screen& aScreen)
+{
+  if (aScreen.built) {
+    if (!aScreen.stale) return ErrorPtr(); // already there
+    remove(aName, aScreen);
+  }
+  MLMicroSeconds start = MainLoop::now();
+  size_t freeBefore = LvMemPool::lvglPool().freeBytes();
+  ErrorPtr err;
+  JsonObjectPtr def = JsonObject::objFromText(aScreen.definition.c_str(), -1, &err);
+  if (Error::notOK(err)) return err;
+  JsonObjectPtr scrs = JsonObject::newObj();
+  scrs->add(aName.c_str(), def);
+  JsonObjectPtr cfg = JsonObject::newObj();
+  cfg->add("screens", scrs);
+  err = applyCB(cfg);
+  if (Error::notOK(err)) return err->withPrefix("building screen '%s': ", aName.c_str());
+  aScreen.built = true;
+  aScreen.stale = false;
+  aScreen.memory = (long)freeBefore-(long)LvMemPool::lvglPool().freeBytes();
+  long m = builtMemory();
+  if (m>peakBuiltMemory) peakBuiltMemory = m;
+  double t = (double)(MainLoop::now()-start)/MilliSecond;
+  builds++;
+  if (builds==1) avgBuildTime = t;
+  else avgBuildTime += (t-avgBuildTime)/BUILD_AVG_WEIGHT;
+  LOG(LOG_INFO, "lazy screens: built '%s' in %.1f mS, %ld bytes", aName.c_str(), t, aScreen.memory);
+  if (hookCB && !aScreen.onBuild.empty()) hookCB(aName, aScreen.onBuild, NULL);
+  return ErrorPtr();
+}
+
+
+void LazyScreens::teardown(const string aName, Screen& aScreen)
+{
+  if (!aScreen.built || aScreen.tearingDown) return;
+  aScreen.tearingDown = true;
+  if (hookCB && !aScreen.onTeardown.empty()) {
+    // widgets must still exist while the hook saves their state
+    hookCB(aName, aScreen.onTeardown, boost::bind(&LazyScreens::teardownHookDone, this, aName));
+    return;
+  }
+  remove(aName, aScreen);
+}
+
+
+void LazyScreens::teardownHookDone(const string aName)
+{
+  ScreenMap::iterator pos = screens.find(aName);
+  if (pos==screens.end() || !pos->second.tearingDown) return; // cancelled or already removed meanwhile
+  remove(aName, pos->second);
+}
+
+
+void LazyScreens::remove(const string aName, Screen& aScreen)
+{
+  aScreen.tearingDown = false;
+  if (!aScreen.built) return;
+  if (aScreen.screen && aScreen.screen==lv_scr_act()) {
+    // never delete the active screen, show a blank one until the replacement is loaded
+    if (!placeholder) placeholder = lv_obj_create(NULL, NULL);
+    lv_scr_load(placeholder);
+  }
+  size_t freeBefore = LvMemPool::lvglPool().freeBytes();
+  deleteCB(aName);
+  if (aScreen.memory>0 && LvMemPool::lvglPool().freeBytes()<=freeBefore) {
+    // widgets are only deleted with the last reference to their elements
+    LOG(LOG_WARNING, "lazy screens: tearing down '%s' did not free memory, still referenced elsewhere (e.g. by a script variable)?", aName.c_str());
+  }
+  aScreen.built = false;
+  aScreen.screen = NULL;
+  teardowns++;
+  LOG(LOG_INFO, "lazy screens: tore down '%s'", aName.c_str());
+}
+
+
+long LazyScreens::builtMemory()
+{
+  long m = 0;
+  for (ScreenMap::iterator pos = screens.begin(); pos!=screens.end(); ++pos) {
+    if (pos->second.built) m += pos->second.memory;
+  }
+  return m;
+}
+
+
+size_t LazyScreens::pendingRelease()
+{
+  // memory that will become free when running teardown hooks complete
+  long m = 0;
+  for (ScreenMap::iterator pos = screens.begin(); pos!=screens.end(); ++pos) {
+    if (pos->second.tearingDown && pos->second.memory>0) m += pos->second.memory;
+  }
+  return (size_t)m;
+}
+
+
+bool LazyScreens::releaseOldest()
+{
+  lv_obj_t* act = lv_scr_act();
+  ScreenMap::iterator oldest = screens.end();
+  for (ScreenMap::iterator pos = screens.begin(); pos!=screens.end(); ++pos) {
+    Screen& s = pos->second;
+    if (!s.built || s.resident || s.tearingDown || s.screen==act) continue;
+    if (oldest==screens.end() || s.lastShown<oldest->second.lastShown) oldest = pos;
+  }
+  if (oldest==screens.end()) return false;
+  teardown(oldest->first, oldest->second);
+  return true;
+}
+
+
+void LazyScreens::releaseAll()
+{
+  while (releaseOldest());
+}
+
+
+void LazyScreens::check()
+{
+  MLMicroSeconds now = MainLoop::now();
+  lv_obj_t* act = lv_scr_act();
+  for (ScreenMap::iterator pos = screens.begin(); pos!=screens.end(); ++pos) {
+    Screen& s = pos->second;
+    if (!s.built || s.resident || s.tearingDown) continue;
+    if (s.screen==act) {
+      s.lastShown = now; // still in use
+    }
+    else if (idleTime!=Never && s.lastShown!=Never && now-s.lastShown>idleTime) {
+      teardown(pos->first, s);
+    }
+  }
+  while (lowMemory>0 && LvMemPool::lvglPool().allocatableBytes()+pendingRelease()<lowMemory) {
+    if (!releaseOldest()) break;
+  }
+  checkTicket.executeOnce(boost::bind(&LazyScreens::check, this), LAZY_CHECK_INTERVAL);
+}
+
+
+JsonObjectPtr LazyScreens::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  int built = 0;
+  int neverBuilt = 0;
+  long knownMemory = 0;
+  for (ScreenMap::iterator pos = screens.begin(); pos!=screens.end(); ++pos) {
+    if (pos->second.built) built++;
+    else if (pos->second.memory==0) neverBuilt++;
+    knownMemory += pos->second.memory;
+  }
+  long bm = builtMemory();
+  s->add("screens", JsonObject::newInt32((int)screens.size()));
+  s->add("built", JsonObject::newInt32(built));
+  s->add("definitionBytes", JsonObject::newInt64(definitionBytes));
+  s->add("builtMemory", JsonObject::newInt64(bm));
+  s->add("peakBuiltMemory", JsonObject::newInt64(peakBuiltMemory));
+  s->add("savedMemory", JsonObject::newInt64(knownMemory-bm)); // of screens built at least once
+  s->add("builds", JsonObject::newInt64(builds));
+  s->add("teardowns", JsonObject::newInt64(teardowns));
+  s->add("avgBuildTime", JsonObject::newDouble(avgBuildTime));
+  // startup: what applying the config took, vs. estimate for building all screens up front
+  s->add("configTime", JsonObject::newDouble(configTime));
+  s->add("eagerConfigTime", JsonObject::newDouble(configTime+neverBuilt*avgBuildTime));
+  return s;
+}
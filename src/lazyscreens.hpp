@@ -0,0 +1,143 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__lazyscreens__
+#define __p44mbcd__lazyscreens__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "uicompiler.hpp"
+#include "lvgl/lvgl.h"
+
+namespace p44 {
+
+  /// Keeps the screen definitions of a UI config as compact JSON text, and only lets LvGLUi build
+  /// a screen's widgets when the screen is shown for the first time. Screens not shown for a while,
+  /// or when littlevGL memory runs low, are torn down again and rebuilt on next use.
+  /// Screen definitions may contain two extra script snippets:
+  /// - "onbuild": run after the screen's widgets were (re)created, to restore state
+  /// - "onteardown": run before the screen's widgets are destroyed, to save state
+  /// Hooks are run from the mainloop, not from within building or tearing down. A screen's widgets
+  /// are deleted only after its onteardown hook has completed; showing the screen before that
+  /// cancels the teardown.
+  /// A screen with "resident":true is built immediately and never torn down.
+  class LazyScreens : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+  public:
+
+    /// applies a (partial) config to LvGLUi
+    typedef boost::function<ErrorPtr (JsonObjectPtr aConfig)> ConfigApplyCB;
+    /// removes a screen from LvGLUi, which deletes its widgets when its elements are released
+    typedef boost::function<void (const string aScreenName)> ScreenDeleteCB;
+    /// runs a screen hook script, must call aDoneCB when the script has completed
+    typedef boost::function<void (const string aScreenName, const string aHookCode, SimpleCB aDoneCB)> HookCB;
+
+  private:
+
+    typedef struct {
+      string definition; ///< the screen's definition as JSON text
+      string onBuild; ///< script run after building
+      string onTeardown; ///< script run before teardown
+      bool resident; ///< never torn down
+      bool built; ///< set when widgets exist
+      bool tearingDown; ///< set while waiting for the onteardown hook to complete
+      bool stale; ///< set when definition was replaced while built, existing widgets must not be shown again
+      lv_obj_t* screen; ///< the screen object, once it was shown
+      MLMicroSeconds lastShown; ///< last time the screen was active
+      long memory; ///< memory used by the screen's widgets when last built
+    } Screen;
+    typedef std::map<string, Screen> ScreenMap;
+    ScreenMap screens;
+
+    ConfigApplyCB applyCB; ///< to apply configs
+    ScreenDeleteCB deleteCB; ///< to delete screens
+    lv_obj_t* placeholder; ///< blank screen shown while the active screen is replaced
+    HookCB hookCB; ///< to run hook scripts
+    MLMicroSeconds idleTime; ///< tear down screens not shown for this long, Never = no idle teardown
+    size_t lowMemory; ///< tear down unused screens when allocatable littlevGL memory goes below this
+    MLTicket checkTicket; ///< periodic idle check
+
+    // statistics
+    long builds;
+    long teardowns;
+    double avgBuildTime; ///< in mS
+    double configTime; ///< time the last setConfig() took, in mS
+    long peakBuiltMemory; ///< max memory used by built screens at the same time
+    size_t definitionBytes; ///< total size of the stored definitions
+
+  public:
+
+    LazyScreens(ConfigApplyCB aApplyCB, ScreenDeleteCB aDeleteCB);
+    virtual ~LazyScreens();
+
+    /// set handler for running onbuild/onteardown scripts
+    void setHookHandler(HookCB aHookCB) { hookCB = aHookCB; };
+
+    /// set teardown policy
+    /// @param aIdleTime tear down screens not active for this long, Never to keep them
+    /// @param aLowMemory tear down least recently used screens when allocatable littlevGL memory (see LvMemPool::allocatableBytes()) is below this
+    void setTeardownPolicy(MLMicroSeconds aIdleTime, size_t aLowMemory);
+
+    /// take a UI config. "screens" are stored for lazy building, everything else (themes, styles...)
+    /// is applied right away, as well as resident screens and the "startscreen".
+    /// @param aConfig UI configuration in LvGLUi JSON format
+    /// @return error if config could not be applied
+    ErrorPtr setConfig(JsonObjectPtr aConfig);
+
+    /// take a UI config with the screen definitions already split off as JSON text
+    /// (as delivered by UiCompiler::loadDeferred(), with hookKeys() extracted)
+    /// @param aConfig UI configuration in LvGLUi JSON format, "screens" is ignored
+    /// @param aScreens the screen definitions
+    /// @return error if config could not be applied
+    ErrorPtr setConfig(JsonObjectPtr aConfig, const UiCompiler::DeferredMembers &aScreens);
+
+    /// @return the screen definition fields handled by LazyScreens itself
+    static const UiCompiler::KeySet& hookKeys();
+
+    /// show a screen, building its widgets if needed
+    /// @param aScreenName name of the screen
+    /// @return error if screen is unknown or could not be built
+    ErrorPtr showScreen(const string aScreenName);
+
+    /// tear down all screens that are not active and not resident
+    void releaseAll();
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    ErrorPtr build(const string aName, Screen& aScreen);
+    void teardown(const string aName, Screen& aScreen);
+    void teardownHookDone(const string aName);
+    void remove(const string aName, Screen& aScreen);
+    long builtMemory();
+    size_t pendingRelease();
+    void check();
+    bool releaseOldest();
+
+  };
+  typedef boost::intrusive_ptr<LazyScreens> LazyScreensPtr;
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__lazyscreens__) */
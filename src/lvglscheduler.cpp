@@ -0,0 +1,333 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "lvglscheduler.hpp"
+
+#include "lvgl/src/lv_misc/lv_gc.h"
+#if defined(__APPLE__)
+  #include "lvgl.hpp"
+#else
+  #include "lv_drivers/display/fbdev.h"
+  #include "lv_drivers/indev/evdev.h"
+#endif
+
+#include <sys/resource.h>
+
+using namespace p44;
+
+#define IDLE_DELAY (300*MilliSecond) // keep refreshing this long after last invalidation
+#define STANDBY_READ_PERIOD 150 // input device polling period in standby, in mS
+#define DISPLAY_BUFFER_LINES 40 // size of the draw buffer
+
+static LvglScheduler* lvglSchedulerP = NULL;
+
+
+static struct timeval cpuTime()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  struct timeval t;
+  timeradd(&ru.ru_utime, &ru.ru_stime, &t);
+  return t;
+}
+
+
+LvglScheduler::LvglScheduler() :
+  display(NULL),
+  enabled(false),
+  refreshing(true),
+  standby(false),
+  lastBusy(Never),
+  running(false),
+  nextRun(Never),
+  animTask(NULL),
+  orgRounderCB(NULL),
+  idleStart(Never)
+{
+  resetStatistics();
+}
+
+
+LvglScheduler& LvglScheduler::scheduler()
+{
+  if (!lvglSchedulerP) {
+    lvglSchedulerP = new LvglScheduler;
+  }
+  return *lvglSchedulerP;
+}
+
+
+// MARK: - running littlevGL
+
+#if !defined(__APPLE__)
+
+static void lvglLog(lv_log_level_t aLevel, const char* aFile, uint32_t aLine, const char* aDesc)
+{
+  LOG(aLevel>=LV_LOG_LEVEL_ERROR ? LOG_ERR : (aLevel>=LV_LOG_LEVEL_WARN ? LOG_WARNING : LOG_INFO), "littlevGL: %s (%s:%u)", aDesc, aFile, aLine);
+}
+
+#endif
+
+
+void LvglScheduler::init(bool aShowCursor, SimpleCB aTaskCallback)
+{
+  taskCB = aTaskCallback;
+  #if defined(__APPLE__)
+  // SDL simulator: p44utils' LvGL runs lv_task_handler() (and SDL event processing) periodically
+  LvGL::lvgl().setTaskCallback(aTaskCallback);
+  LvGL::lvgl().init(aShowCursor);
+  #else
+  lv_log_register_print_cb(&lvglLog);
+  lv_init();
+  // right after lv_init(), the only task is the animation task, which otherwise runs even without animations
+  animTask = (lv_task_t*)lv_ll_get_head(&LV_GC_ROOT(_lv_task_ll));
+  if (animTask && lv_ll_get_next(&LV_GC_ROOT(_lv_task_ll), animTask)) animTask = NULL; // not what we expect, leave alone
+  // display
+  fbdev_init();
+  static lv_color_t drawBuffer[LV_HOR_RES_MAX*DISPLAY_BUFFER_LINES];
+  static lv_disp_buf_t dispBuf;
+  lv_disp_buf_init(&dispBuf, drawBuffer, NULL, LV_HOR_RES_MAX*DISPLAY_BUFFER_LINES);
+  lv_disp_drv_t dispDrv;
+  lv_disp_drv_init(&dispDrv);
+  dispDrv.buffer = &dispBuf;
+  dispDrv.flush_cb = &fbdev_flush;
+  lv_disp_drv_register(&dispDrv);
+  // polled pointer input (replaced by TouchInput when --touchdev is given)
+  evdev_init();
+  lv_indev_drv_t indevDrv;
+  lv_indev_drv_init(&indevDrv);
+  indevDrv.type = LV_INDEV_TYPE_POINTER;
+  indevDrv.read_cb = &evdev_read;
+  lv_indev_t* pointer = lv_indev_drv_register(&indevDrv);
+  if (aShowCursor) {
+    lv_obj_t* cursor = lv_img_create(lv_disp_get_layer_sys(NULL), NULL);
+    lv_img_set_src(cursor, LV_SYMBOL_PLUS);
+    lv_indev_set_cursor(pointer, cursor);
+  }
+  running = true;
+  scheduleTasks();
+  #endif
+}
+
+
+void LvglScheduler::runTasks()
+{
+  nextRun = Never;
+  lv_task_handler();
+  if (taskCB) taskCB();
+  scheduleTasks();
+}
+
+
+void LvglScheduler::wakeup()
+{
+  if (running) scheduleTasks();
+}
+
+
+void LvglScheduler::scheduleTasks()
+{
+  MLMicroSeconds delay;
+  if (!nextTaskDelay(delay)) {
+    // nothing to do until something wakes us up
+    taskTicket.cancel();
+    nextRun = Never;
+    return;
+  }
+  MLMicroSeconds when = MainLoop::now()+delay;
+  if (nextRun!=Never && nextRun<=when) return; // already scheduled early enough
+  nextRun = when;
+  taskTicket.executeOnce(boost::bind(&LvglScheduler::runTasks, this), delay);
+}
+
+
+bool LvglScheduler::nextTaskDelay(MLMicroSeconds &aDelay)
+{
+  bool any = false;
+  lv_task_t* t;
+  LV_LL_READ(LV_GC_ROOT(_lv_task_ll), t) {
+    if (t->prio==LV_TASK_PRIO_OFF) continue;
+    uint32_t elapsed = lv_tick_elaps(t->last_run);
+    MLMicroSeconds d = elapsed>=t->period ? 0 : (MLMicroSeconds)(t->period-elapsed)*MilliSecond;
+    if (!any || d<aDelay) aDelay = d;
+    any = true;
+  }
+  return any;
+}
+
+
+// MARK: - event driven refresh
+
+void LvglScheduler::install(lv_disp_t* aDisplay)
+{
+  if (display || !aDisplay) return; // already installed or no display
+  display = aDisplay;
+  enabled = true;
+  lastBusy = MainLoop::now();
+  // get notified of invalidations
+  orgRounderCB = display->driver.rounder_cb;
+  display->driver.rounder_cb = &LvglScheduler::rounderCB;
+}
+
+
+void LvglScheduler::rounderCB(struct _disp_drv_t* aDispDrv, lv_area_t* aArea)
+{
+  LvglScheduler& s = scheduler();
+  if (s.orgRounderCB) s.orgRounderCB(aDispDrv, aArea);
+  // called for every invalidated area. Just get lv_task_handler() to run, cycle() will then resume
+  // refreshing (not here, this might be called from within lv_task_handler(), where tasks must not change priority)
+  if (s.running && !s.refreshing && (s.nextRun==Never || s.nextRun>MainLoop::now())) {
+    s.nextRun = MainLoop::now();
+    s.taskTicket.executeOnce(boost::bind(&LvglScheduler::runTasks, &s), 0);
+  }
+}
+
+
+bool LvglScheduler::cycle()
+{
+  cycles++;
+  if (refreshing) refreshCycles++;
+  if (!enabled) return false;
+  MLMicroSeconds now = MainLoop::now();
+  if (display->inv_p>0 || lv_anim_count_running()>0) {
+    lastBusy = now;
+    if (!refreshing) {
+      refreshResumes++;
+      setRefreshing(true);
+      lv_task_ready(display->refr_task); // render in next cycle, don't wait for the period
+      return true;
+    }
+  }
+  else if (refreshing && now>lastBusy+IDLE_DELAY) {
+    setRefreshing(false);
+  }
+  return false;
+}
+
+
+void LvglScheduler::setRefreshing(bool aRefreshing)
+{
+  refreshing = aRefreshing;
+  // track idle periods for the idle wakeup rate and CPU load
+  if (!refreshing) {
+    idleStart = MainLoop::now();
+    idleStartWakeups = mainThreadWakeups();
+    idleStartCpu = cpuTime();
+  }
+  else if (idleStart!=Never) {
+    idleTime += MainLoop::now()-idleStart;
+    idleWakeups += mainThreadWakeups()-idleStartWakeups;
+    struct timeval cpu = cpuTime();
+    struct timeval d;
+    timersub(&cpu, &idleStartCpu, &d);
+    timeradd(&idleCpu, &d, &idleCpu);
+    idleStart = Never;
+  }
+  lv_task_set_prio(display->refr_task, refreshing ? LV_TASK_PRIO_MID : LV_TASK_PRIO_OFF);
+  // only suspended while no animation is running (see cycle()), lv_anim_create() does not wake us up,
+  // but creating an animation usually goes along with an invalidation, which does
+  if (animTask) lv_task_set_prio(animTask, refreshing ? LV_TASK_PRIO_HIGH : LV_TASK_PRIO_OFF);
+}
+
+
+void LvglScheduler::setStandby(bool aStandby)
+{
+  if (aStandby==standby || !enabled) return;
+  standby = aStandby;
+  lv_indev_t* indev = lv_indev_get_next(NULL);
+  while (indev) {
+    if (!indev->driver.user_data) lv_task_set_period(indev->driver.read_task, standby ? STANDBY_READ_PERIOD : LV_INDEV_DEF_READ_PERIOD);
+    indev = lv_indev_get_next(indev);
+  }
+  LOG(LOG_INFO, "littlevGL input polling period now %d mS", standby ? STANDBY_READ_PERIOD : LV_INDEV_DEF_READ_PERIOD);
+}
+
+
+// MARK: - statistics
+
+long LvglScheduler::mainThreadWakeups()
+{
+  // every time the main thread blocks in the mainloop's poll() and is woken up again by a timer or I/O
+  // counts as a voluntary context switch
+  struct rusage ru;
+  #ifdef RUSAGE_THREAD
+  getrusage(RUSAGE_THREAD, &ru);
+  #else
+  getrusage(RUSAGE_SELF, &ru);
+  #endif
+  return ru.ru_nvcsw;
+}
+
+
+void LvglScheduler::resetStatistics()
+{
+  statsStart = MainLoop::now();
+  cycles = 0;
+  refreshCycles = 0;
+  refreshResumes = 0;
+  statsWakeups = mainThreadWakeups();
+  statsCpu = cpuTime();
+  idleTime = 0;
+  idleWakeups = 0;
+  timerclear(&idleCpu);
+  if (idleStart!=Never) {
+    idleStart = statsStart;
+    idleStartWakeups = statsWakeups;
+    idleStartCpu = statsCpu;
+  }
+}
+
+
+JsonObjectPtr LvglScheduler::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  double secs = (double)(MainLoop::now()-statsStart)/Second;
+  struct timeval cpu = cpuTime();
+  struct timeval d;
+  timersub(&cpu, &statsCpu, &d);
+  s->add("eventDriven", JsonObject::newBool(enabled));
+  s->add("deadlineScheduling", JsonObject::newBool(running));
+  s->add("refreshing", JsonObject::newBool(refreshing));
+  s->add("standby", JsonObject::newBool(standby));
+  s->add("seconds", JsonObject::newDouble(secs));
+  long wakeups = mainThreadWakeups();
+  if (secs>0) {
+    s->add("taskHandlerRunsPerSecond", JsonObject::newDouble(cycles/secs));
+    s->add("refreshCyclesPerSecond", JsonObject::newDouble(refreshCycles/secs));
+    s->add("refreshResumesPerSecond", JsonObject::newDouble(refreshResumes/secs));
+    s->add("wakeupsPerSecond", JsonObject::newDouble((wakeups-statsWakeups)/secs));
+    s->add("cpuLoad", JsonObject::newDouble((d.tv_sec+(double)d.tv_usec/1000000)/secs*100));
+  }
+  // include the current idle period
+  MLMicroSeconds it = idleTime;
+  long iw = idleWakeups;
+  struct timeval ic = idleCpu;
+  if (idleStart!=Never) {
+    it += MainLoop::now()-idleStart;
+    iw += wakeups-idleStartWakeups;
+    timersub(&cpu, &idleStartCpu, &d);
+    timeradd(&ic, &d, &ic);
+  }
+  if (it>0) {
+    s->add("idleSeconds", JsonObject::newDouble((double)it/Second));
+    s->add("idleWakeupsPerSecond", JsonObject::newDouble((double)iw*Second/it));
+    s->add("idleCpuLoad", JsonObject::newDouble((ic.tv_sec+(double)ic.tv_usec/1000000)/((double)it/Second)*100));
+  }
+  return s;
+}
@@ -0,0 +1,127 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__lvglscheduler__
+#define __p44mbcd__lvglscheduler__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+namespace p44 {
+
+  /// task period for event driven littlevGL tasks while they have nothing to do. Such tasks are made
+  /// ready with lv_task_ready() (followed by LvglScheduler::wakeup()) when they need to run.
+  /// Long, but still short enough for lv_task_ready() to work (it sets last_run to period+1 mS ago).
+  #define LVGL_IDLE_TASK_PERIOD 0x7FFFFFFF
+
+  /// Runs littlevGL: sets up display and pointer input, and calls lv_task_handler() from the mainloop
+  /// exactly when the next littlevGL task is due - not periodically. While nothing is due, the mainloop
+  /// is not woken up at all.
+  /// To get there, the display refresh task and the animation task are suspended while nothing is
+  /// invalidated and no animation is running, and input polling is slowed down while the UI is in
+  /// standby. An invalidation (from a script, modbus access or input) wakes up the scheduler via the
+  /// display driver's rounder callback.
+  /// @note polled input devices (without user_data, such as the evdev pointer when no --touchdev
+  ///   is given) still need their read task to run periodically.
+  /// @note on macOS, the SDL simulator needs p44utils' LvGL, which runs lv_task_handler() periodically.
+  class LvglScheduler : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    lv_disp_t* display; ///< the display
+    bool enabled; ///< set when event driven refresh is enabled
+    bool refreshing; ///< set while display refresh task is enabled
+    bool standby; ///< set while input polling is slowed down
+    MLMicroSeconds lastBusy; ///< last time something was invalidated or animated
+
+    bool running; ///< set when we run lv_task_handler() ourselves
+    SimpleCB taskCB; ///< called after every lv_task_handler() run
+    MLTicket taskTicket; ///< timer for the next lv_task_handler() run
+    MLMicroSeconds nextRun; ///< when taskTicket fires, Never if not armed
+    lv_task_t* animTask; ///< littlevGL's animation task, NULL if not known
+    void (*orgRounderCB)(struct _disp_drv_t* aDispDrv, lv_area_t* aArea); ///< original rounder callback
+
+    // statistics
+    MLMicroSeconds statsStart; ///< start of statistics period
+    long cycles; ///< number of littlevGL cycles (= lv_task_handler() invocations)
+    long refreshCycles; ///< number of cycles with refresh task enabled
+    long refreshResumes; ///< number of times refresh task was re-enabled
+    long statsWakeups; ///< main thread wakeups at start of statistics period
+    struct timeval statsCpu; ///< process CPU time at start of statistics period
+    MLMicroSeconds idleStart; ///< when the current idle period (refresh suspended) started, Never if not idle
+    long idleStartWakeups; ///< main thread wakeups at start of current idle period
+    MLMicroSeconds idleTime; ///< accumulated time in completed idle periods
+    long idleWakeups; ///< main thread wakeups in completed idle periods
+    struct timeval idleStartCpu; ///< process CPU time at start of current idle period
+    struct timeval idleCpu; ///< process CPU time used in completed idle periods
+
+  public:
+
+    LvglScheduler();
+
+    /// get the shared instance
+    static LvglScheduler& scheduler();
+
+    /// initialize littlevGL with the platform's display and pointer input device, and start running its tasks
+    /// @param aShowCursor if set, a cursor is shown for the pointer
+    /// @param aTaskCallback called after every lv_task_handler() run
+    void init(bool aShowCursor, SimpleCB aTaskCallback);
+
+    /// start event driven refresh for a display
+    /// @param aDisplay the display, usually lv_disp_get_default()
+    void install(lv_disp_t* aDisplay);
+
+    /// to be called when littlevGL tasks have been made ready or their period was changed
+    /// outside lv_task_handler(), so they are run in time
+    void wakeup();
+
+    /// to be called once per littlevGL cycle, after lv_task_handler()
+    /// @return true if display refresh was suspended and has now been re-enabled, i.e. running
+    ///   lv_task_handler() again right now would render pending changes
+    bool cycle();
+
+    /// set standby mode (slow input polling)
+    /// @note event driven input devices (those with user_data set) manage their read period themselves
+    /// @param aStandby true when UI is in standby (e.g. backlight dimmed)
+    void setStandby(bool aStandby);
+
+    /// reset statistics
+    void resetStatistics();
+
+    /// @return statistics as JSON object. Besides littlevGL cycles, this reports the actual wakeups of the
+    ///   main thread (any timer or I/O, counted as voluntary context switches), overall and while idle.
+    /// @note must be called from the main thread
+    JsonObjectPtr statistics();
+
+  private:
+
+    void setRefreshing(bool aRefreshing);
+    void runTasks();
+    void scheduleTasks();
+    bool nextTaskDelay(MLMicroSeconds &aDelay);
+    static void rounderCB(struct _disp_drv_t* aDispDrv, lv_area_t* aArea);
+    static long mainThreadWakeups();
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__lvglscheduler__) */
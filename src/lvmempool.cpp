@@ -0,0 +1,384 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "lvmempool.hpp"
+
+using namespace p44;
+
+#define DEFAULT_LVGL_BUDGET (32*1024) // same as the former built-in littlevGL heap (LV_MEM_SIZE)
+#define LARGE_HEADER_SIZE 16 // keeps large blocks 16-byte aligned
+#define NO_CLASS 0xFF
+
+static const uint16_t classSizes[LVMEM_NUM_CLASSES] = { 16, 24, 32, 48, 64, 96, 128, 256 };
+
+static LvMemPool* lvglPoolP = NULL;
+static size_t lvglBudget = DEFAULT_LVGL_BUDGET;
+
+
+// MARK: - C interface for littlevGL
+
+extern "C" void* lvmem_alloc(size_t aSize)
+{
+  return LvMemPool::lvglPool().alloc(aSize);
+}
+
+
+extern "C" void lvmem_free(void* aPtr)
+{
+  LvMemPool::lvglPool().free(aPtr);
+}
+
+
+// MARK: - pool
+
+LvMemPool::LvMemPool(size_t aBudget) :
+  budget(aBudget),
+  arenaMem(NULL),
+  arena(NULL),
+  numPages(0),
+  pagesCarved(0),
+  pageDescs(NULL),
+  freePages(NULL),
+  poolBytes(0),
+  largeBytes(0),
+  largeBlocks(0),
+  usedBytes(0),
+  peakBytes(0),
+  failures(0)
+{
+  for (int i=0; i<LVMEM_NUM_CLASSES; i++) {
+    classes[i].blockSize = classSizes[i];
+    classes[i].perPage = LVMEM_PAGE_SIZE/classSizes[i];
+    classes[i].partial = NULL;
+    classes[i].blocksUsed = 0;
+    classes[i].pages = 0;
+  }
+}
+
+
+LvMemPool::~LvMemPool()
+{
+  // large blocks still allocated are leaked intentionally, they might still be referenced
+  delete[] pageDescs;
+  delete[] arenaMem;
+}
+
+
+LvMemPool& LvMemPool::lvglPool()
+{
+  if (!lvglPoolP) {
+    lvglPoolP = new LvMemPool(lvglBudget);
+  }
+  return *lvglPoolP;
+}
+
+
+void LvMemPool::setLvglBudget(size_t aBudget)
+{
+  lvglBudget = aBudget;
+}
+
+
+void LvMemPool::initArena()
+{
+  // arena is only reserved address space, pages get resident when first used
+  numPages = budget/LVMEM_PAGE_SIZE;
+  arenaMem = new uint8_t[(numPages+1)*LVMEM_PAGE_SIZE];
+  arena = (uint8_t*)(((uintptr_t)arenaMem+LVMEM_PAGE_SIZE-1) & ~(uintptr_t)(LVMEM_PAGE_SIZE-1));
+  pageDescs = new PageDesc[numPages];
+  for (size_t i=0; i<numPages; i++) pageDescs[i].cls = NO_CLASS;
+}
+
+
+int LvMemPool::classFor(size_t aSize)
+{
+  for (int i=0; i<LVMEM_NUM_CLASSES; i++) {
+    if (aSize<=classSizes[i]) return i;
+  }
+  return -1;
+}
+
+
+LvMemPool::PageDesc* LvMemPool::newPage(int aCls)
+{
+  if (poolBytes+largeBytes+LVMEM_PAGE_SIZE>budget) return NULL;
+  PageDesc* pg;
+  if (freePages) {
+    pg = freePages;
+    freePages = pg->next;
+  }
+  else if (pagesCarved<numPages) {
+    pg = &pageDescs[pagesCarved++];
+  }
+  else {
+    return NULL;
+  }
+  SizeClass &sc = classes[aCls];
+  pg->cls = aCls;
+  pg->used = 0;
+  pg->carved = 0;
+  pg->freeList = NULL;
+  pg->prev = NULL;
+  pg->next = sc.partial;
+  if (sc.partial) sc.partial->prev = pg;
+  sc.partial = pg;
+  sc.pages++;
+  poolBytes += LVMEM_PAGE_SIZE;
+  return pg;
+}
+
+
+void LvMemPool::unlinkPartial(SizeClass &aClass, PageDesc* aPage)
+{
+  if (aPage->prev) aPage->prev->next = aPage->next;
+  else aClass.partial = aPage->next;
+  if (aPage->next) aPage->next->prev = aPage->prev;
+  aPage->prev = NULL;
+  aPage->next = NULL;
+}
+
+
+void* LvMemPool::alloc(size_t aSize)
+{
+  if (!arena) initArena();
+  if (aSize==0) aSize = 1;
+  int c = classFor(aSize);
+  if (c<0) {
+    // large block
+    size_t sz = aSize+LARGE_HEADER_SIZE;
+    if (poolBytes+largeBytes+sz>budget) {
+      failures++;
+      return NULL;
+    }
+    uint8_t* b = (uint8_t*)malloc(sz);
+    if (!b) {
+      failures++;
+      return NULL;
+    }
+    *((size_t*)b) = sz;
+    largeBytes += sz;
+    largeBlocks++;
+    usedBytes += sz;
+    if (poolBytes+largeBytes>peakBytes) peakBytes = poolBytes+largeBytes;
+    return b+LARGE_HEADER_SIZE;
+  }
+  SizeClass &sc = classes[c];
+  PageDesc* pg = sc.partial;
+  if (!pg) {
+    pg = newPage(c);
+    if (!pg) {
+      failures++;
+      return NULL;
+    }
+    if (poolBytes+largeBytes>peakBytes) peakBytes = poolBytes+largeBytes;
+  }
+  void* b;
+  if (pg->freeList) {
+    b = pg->freeList;
+    pg->freeList = *((void**)b);
+  }
+  else {
+    // carve next fresh block
+    b = arena+(pg-pageDescs)*LVMEM_PAGE_SIZE+pg->carved*sc.blockSize;
+    pg->carved++;
+  }
+  pg->used++;
+  if (pg->used>=sc.perPage) unlinkPartial(sc, pg); // full now
+  sc.blocksUsed++;
+  usedBytes += sc.blockSize;
+  return b;
+}
+
+
+void LvMemPool::free(void* aPtr)
+{
+  if (!aPtr) return;
+  uint8_t* p = (uint8_t*)aPtr;
+  if (p<arena || p>=arena+numPages*LVMEM_PAGE_SIZE) {
+    // large block
+    uint8_t* b = p-LARGE_HEADER_SIZE;
+    size_t sz = *((size_t*)b);
+    largeBytes -= sz;
+    largeBlocks--;
+    usedBytes -= sz;
+    ::free(b);
+    return;
+  }
+  PageDesc* pg = &pageDescs[(p-arena)/LVMEM_PAGE_SIZE];
+  SizeClass &sc = classes[pg->cls];
+  bool wasFull = pg->used>=sc.perPage;
+  *((void**)aPtr) = pg->freeList;
+  pg->freeList = aPtr;
+  pg->used--;
+  sc.blocksUsed--;
+  usedBytes -= sc.blockSize;
+  if (wasFull) {
+    // has a free block again
+    pg->prev = NULL;
+    pg->next = sc.partial;
+    if (sc.partial) sc.partial->prev = pg;
+    sc.partial = pg;
+  }
+  else if (pg->used==0 && !(sc.partial==pg && pg->next==NULL)) {
+    // empty and not the only page with free blocks of its class: return to arena
+    unlinkPartial(sc, pg);
+    pg->cls = NO_CLASS;
+    pg->next = freePages;
+    freePages = pg;
+    sc.pages--;
+    poolBytes -= LVMEM_PAGE_SIZE;
+  }
+}
+
+
+size_t LvMemPool::freeBytes()
+{
+  return usedBytes<budget ? budget-usedBytes : 0;
+}
+
+
+size_t LvMemPool::allocatableBytes()
+{
+  size_t taken = poolBytes+largeBytes;
+  size_t a = taken<budget ? budget-taken : 0;
+  for (int i=0; i<LVMEM_NUM_CLASSES; i++) {
+    a += (classes[i].pages*classes[i].perPage-classes[i].blocksUsed)*classes[i].blockSize;
+  }
+  return a;
+}
+
+
+int LvMemPool::fragmentation()
+{
+  size_t taken = poolBytes+largeBytes;
+  if (taken==0) return 0;
+  return (int)((taken-usedBytes)*100/taken);
+}
+
+
+JsonObjectPtr LvMemPool::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("budget", JsonObject::newInt64(budget));
+  s->add("used", JsonObject::newInt64(usedBytes));
+  s->add("taken", JsonObject::newInt64(poolBytes+largeBytes));
+  s->add("allocatable", JsonObject::newInt64(allocatableBytes()));
+  s->add("peak", JsonObject::newInt64(peakBytes));
+  s->add("fragmentation", JsonObject::newInt32(fragmentation()));
+  s->add("failures", JsonObject::newInt64(failures));
+  s->add("largeBlocks", JsonObject::newInt64(largeBlocks));
+  s->add("largeBytes", JsonObject::newInt64(largeBytes));
+  JsonObjectPtr ca = JsonObject::newArray();
+  for (int i=0; i<LVMEM_NUM_CLASSES; i++) {
+    JsonObjectPtr c = JsonObject::newObj();
+    c->add("blockSize", JsonObject::newInt32(classes[i].blockSize));
+    c->add("blocks", JsonObject::newInt64(classes[i].blocksUsed));
+    c->add("capacity", JsonObject::newInt64(classes[i].pages*classes[i].perPage));
+    c->add("pages", JsonObject::newInt64(classes[i].pages));
+    ca->arrayAppend(c);
+  }
+  s->add("classes", ca);
+  return s;
+}
+
+
+// MARK: - benchmark
+
+#define BENCH_ROUNDS 200
+#define BENCH_OBJECTS 2000
+
+static uint32_t benchRandom(uint32_t &aSeed)
+{
+  aSeed = aSeed*1103515245+12345;
+  return aSeed>>8;
+}
+
+
+static size_t benchSize(uint32_t &aSeed)
+{
+  // mostly small objects, as littlevGL objects, ext data, styles and strings are
+  uint32_t r = benchRandom(aSeed)%100;
+  if (r<60) return 8+benchRandom(aSeed)%57;
+  if (r<90) return 64+benchRandom(aSeed)%193;
+  return 256+benchRandom(aSeed)%3841;
+}
+
+
+/// build up screens, modify them, and tear them down except for a few long lived objects
+template<class A, class F> static MLMicroSeconds runPattern(A aAlloc, F aFree, long &aOps, long &aFailures)
+{
+  std::vector<void*> objs(BENCH_OBJECTS, (void*)NULL);
+  std::vector<void*> keep;
+  uint32_t seed = 42;
+  MLMicroSeconds start = MainLoop::now();
+  for (int round=0; round<BENCH_ROUNDS; round++) {
+    for (int i=0; i<BENCH_OBJECTS; i++) {
+      objs[i] = aAlloc(benchSize(seed));
+      if (!objs[i]) aFailures++;
+      aOps++;
+    }
+    for (int i=0; i<BENCH_OBJECTS/2; i++) {
+      int k = benchRandom(seed)%BENCH_OBJECTS;
+      aFree(objs[k]);
+      objs[k] = aAlloc(benchSize(seed));
+      if (!objs[k]) aFailures++;
+      aOps += 2;
+    }
+    for (int i=0; i<BENCH_OBJECTS; i++) {
+      if (i%50==0 && keep.size()<BENCH_OBJECTS) keep.push_back(objs[i]);
+      else aFree(objs[i]);
+      aOps++;
+    }
+  }
+  for (size_t i=0; i<keep.size(); i++) aFree(keep[i]);
+  return MainLoop::now()-start;
+}
+
+
+static LvMemPool* benchPoolP = NULL;
+static void* benchPoolAlloc(size_t aSize) { return benchPoolP->alloc(aSize); }
+static void benchPoolFree(void* aPtr) { benchPoolP->free(aPtr); }
+static void* benchMalloc(size_t aSize) { return malloc(aSize); }
+static void benchFree(void* aPtr) { ::free(aPtr); }
+
+
+JsonObjectPtr LvMemPool::benchmark(size_t aBudget)
+{
+  JsonObjectPtr r = JsonObject::newObj();
+  long ops = 0;
+  long fails = 0;
+  benchPoolP = new LvMemPool(aBudget);
+  MLMicroSeconds t = runPattern(benchPoolAlloc, benchPoolFree, ops, fails);
+  JsonObjectPtr p = JsonObject::newObj();
+  p->add("opsPerSec", JsonObject::newDouble((double)ops*Second/t));
+  p->add("failures", JsonObject::newInt64(fails));
+  p->add("peak", JsonObject::newInt64(benchPoolP->peakBytes));
+  p->add("stats", benchPoolP->statistics());
+  r->add("pool", p);
+  delete benchPoolP;
+  benchPoolP = NULL;
+  ops = 0;
+  fails = 0;
+  t = runPattern(benchMalloc, benchFree, ops, fails);
+  JsonObjectPtr m = JsonObject::newObj();
+  m->add("opsPerSec", JsonObject::newDouble((double)ops*Second/t));
+  m->add("failures", JsonObject::newInt64(fails));
+  r->add("malloc", m);
+  return r;
+}
@@ -0,0 +1,143 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__lvmempool__
+#define __p44mbcd__lvmempool__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// C interface, used by littlevGL via LV_MEM_CUSTOM_ALLOC/LV_MEM_CUSTOM_FREE in lv_conf.h
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void* lvmem_alloc(size_t aSize);
+void lvmem_free(void* aPtr);
+
+#ifdef __cplusplus
+}
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+namespace p44 {
+
+  #define LVMEM_NUM_CLASSES 8
+  #define LVMEM_PAGE_SIZE 1024
+
+  /// Memory allocator with size class pools for the small objects littlevGL allocates most,
+  /// plus malloc for larger blocks, all within a total budget.
+  /// Pool blocks are handed out from 1k pages of a preallocated arena. Each page holds blocks
+  /// of one size class only and has its own free list, so alloc and free are constant time.
+  /// Pages that become empty return to the arena for use by any size class.
+  class LvMemPool
+  {
+    typedef struct PageDesc {
+      uint8_t cls; ///< size class, 0xFF when page is unused
+      uint16_t used; ///< blocks in use
+      uint16_t carved; ///< blocks carved from the page so far
+      void* freeList; ///< freed blocks of this page
+      struct PageDesc* prev; ///< link in partial pages list of the class, or in free pages list
+      struct PageDesc* next;
+    } PageDesc;
+
+    typedef struct {
+      uint16_t blockSize; ///< size of blocks
+      uint16_t perPage; ///< blocks per page
+      PageDesc* partial; ///< pages of this class with free blocks
+      long blocksUsed; ///< blocks in use
+      long pages; ///< pages owned
+    } SizeClass;
+
+    size_t budget; ///< total bytes available (pool pages and large blocks)
+    uint8_t* arenaMem; ///< allocated arena memory
+    uint8_t* arena; ///< page aligned start of arena
+    size_t numPages; ///< number of pages in the arena
+    size_t pagesCarved; ///< pages taken from the arena so far
+    PageDesc* pageDescs; ///< one descriptor per arena page
+    PageDesc* freePages; ///< pages that became empty
+    SizeClass classes[LVMEM_NUM_CLASSES];
+
+    // statistics
+    size_t poolBytes; ///< bytes of pages owned by size classes
+    size_t largeBytes; ///< bytes in large blocks (malloc)
+    long largeBlocks; ///< number of large blocks
+    size_t usedBytes; ///< bytes in blocks handed out (rounded up to block size)
+    size_t peakBytes; ///< max of poolBytes+largeBytes
+    long failures; ///< number of allocations that failed because budget was exhausted
+
+  public:
+
+    /// create a pool
+    /// @param aBudget total number of bytes available
+    LvMemPool(size_t aBudget);
+    ~LvMemPool();
+
+    /// @return the pool used by littlevGL
+    static LvMemPool& lvglPool();
+
+    /// set the budget for the littlevGL pool
+    /// @param aBudget total number of bytes available
+    /// @note must be called before littlevGL is initialized
+    static void setLvglBudget(size_t aBudget);
+
+    /// allocate
+    /// @param aSize number of bytes
+    /// @return block or NULL if budget is exhausted
+    void* alloc(size_t aSize);
+
+    /// free
+    /// @param aPtr block returned by alloc(), or NULL
+    void free(void* aPtr);
+
+    /// @return bytes still available within the budget
+    size_t freeBytes();
+
+    /// @return bytes that can actually still be allocated: budget not yet taken by pages or large blocks,
+    ///   plus free blocks in pages already owned by size classes. Unlike freeBytes(), this does not count
+    ///   unused space in pages of other classes as available.
+    size_t allocatableBytes();
+
+    /// @return fragmentation in percent (unused space in pages owned by size classes vs. all space taken)
+    int fragmentation();
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+    /// run an allocation pattern resembling building and tearing down littlevGL screens,
+    /// with this allocator and with malloc/free
+    /// @param aBudget budget for the pool to benchmark
+    /// @return results as JSON object
+    static JsonObjectPtr benchmark(size_t aBudget);
+
+  private:
+
+    void initArena();
+    int classFor(size_t aSize);
+    PageDesc* newPage(int aCls);
+    void unlinkPartial(SizeClass &aClass, PageDesc* aPage);
+
+  };
+
+} // namespace p44
+
+#endif // __cplusplus
+
+#endif /* defined(__p44mbcd__lvmempool__) */
@@ -0,0 +1,307 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "nativeimages.hpp"
+
+#include <png.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+using namespace p44;
+
+#define NATIVE_IMAGE_MAGIC 0x49343450 // "P44I"
+#define NATIVE_IMAGE_VERSION 2
+#define NATIVE_IMAGE_SUFFIX ".lvimg"
+
+/// header of a native image file, followed by the source PNG path and the pixel data in littlevGL format
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t cf; ///< littlevGL color format (LV_IMG_CF_TRUE_COLOR or LV_IMG_CF_TRUE_COLOR_ALPHA)
+  uint16_t w;
+  uint16_t h;
+  uint32_t decodeTime; ///< time needed to decode the PNG in uS
+  uint32_t dataSize; ///< size of pixel data in bytes
+  uint16_t pathLen; ///< space used by the NUL padded source PNG path following the header (multiple of 4 to keep pixel data aligned)
+  uint16_t reserved;
+} NativeImageHeader;
+
+/// mapping of an open native image
+typedef struct {
+  void* base;
+  size_t size;
+} NativeImageMapping;
+
+static NativeImages* nativeImagesP = NULL;
+
+
+NativeImages::NativeImages() :
+  decoder(NULL),
+  conversions(0),
+  pruned(0),
+  conversionTime(0),
+  nativeOpens(0),
+  decodeTimeSaved(0)
+{
+}
+
+
+NativeImages& NativeImages::images()
+{
+  if (!nativeImagesP) {
+    nativeImagesP = new NativeImages;
+  }
+  return *nativeImagesP;
+}
+
+
+void NativeImages::install(const string aCacheDir)
+{
+  if (decoder) return; // already installed
+  cacheDir = aCacheDir;
+  mkdir(cacheDir.c_str(), 0755);
+  pruneCache();
+  // decoders created later are tried first, so this one takes precedence over the regular PNG decoder
+  decoder = lv_img_decoder_create();
+  lv_img_decoder_set_info_cb(decoder, &NativeImages::infoCB);
+  lv_img_decoder_set_open_cb(decoder, &NativeImages::openCB);
+  lv_img_decoder_set_close_cb(decoder, &NativeImages::closeCB);
+}
+
+
+static bool isPngPath(const void* aSrc)
+{
+  if (lv_img_src_get_type(aSrc)!=LV_IMG_SRC_FILE) return false;
+  const char* p = (const char*)aSrc;
+  size_t n = strlen(p);
+  return n>4 && strcasecmp(p+n-4, ".png")==0;
+}
+
+
+ErrorPtr NativeImages::prepare(const string aPngPath)
+{
+  string cf;
+  return cacheFileFor(aPngPath, cf);
+}
+
+
+string NativeImages::cacheNameFor(const string aPngPath, const struct stat &aStat)
+{
+  // FNV-1a 64bit of the path, plus modification time and size: no need to read the PNG to find its cache file
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i=0; i<aPngPath.size(); i++) {
+    h ^= (uint8_t)aPngPath[i];
+    h *= 0x100000001b3ULL;
+  }
+  // modification time with sub-second resolution, a PNG rewritten within the same second with the same size must not hit the old entry
+  #if defined(__APPLE__)
+  uint64_t mtimeNs = (uint64_t)aStat.st_mtimespec.tv_sec*1000000000ULL + aStat.st_mtimespec.tv_nsec;
+  #else
+  uint64_t mtimeNs = (uint64_t)aStat.st_mtim.tv_sec*1000000000ULL + aStat.st_mtim.tv_nsec;
+  #endif
+  return string_format("%016llx-%llx-%llx" NATIVE_IMAGE_SUFFIX, (unsigned long long)h, (unsigned long long)mtimeNs, (unsigned long long)aStat.st_size);
+}
+
+
+ErrorPtr NativeImages::cacheFileFor(const string aPngPath, string &aCacheFile)
+{
+  struct stat st;
+  if (stat(aPngPath.c_str(), &st)<0) return SysError::errNo("cannot access PNG: ");
+  aCacheFile = cacheDir + "/" + cacheNameFor(aPngPath, st);
+  if (access(aCacheFile.c_str(), R_OK)==0) return ErrorPtr();
+  return convert(aPngPath, aCacheFile);
+}
+
+
+void NativeImages::pruneCache()
+{
+  DIR* d = opendir(cacheDir.c_str());
+  if (!d) return;
+  struct dirent* e;
+  while ((e = readdir(d))!=NULL) {
+    string name = e->d_name;
+    if (name=="." || name=="..") continue;
+    string path = cacheDir + "/" + name;
+    bool stale = true;
+    size_t sl = strlen(NATIVE_IMAGE_SUFFIX);
+    if (name.size()>sl && name.compare(name.size()-sl, sl, NATIVE_IMAGE_SUFFIX)==0) {
+      // still matching the current version of its source?
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd>=0) {
+        NativeImageHeader hdr;
+        if (read(fd, &hdr, sizeof(hdr))==sizeof(hdr) && hdr.magic==NATIVE_IMAGE_MAGIC && hdr.version==NATIVE_IMAGE_VERSION) {
+          string src(hdr.pathLen, 0);
+          struct stat st;
+          if (
+            read(fd, &src[0], hdr.pathLen)==hdr.pathLen &&
+            stat(src.c_str(), &st)==0 && // NUL padded
+            cacheNameFor(src.c_str(), st)==name
+          ) {
+            stale = false;
+          }
+        }
+        close(fd);
+      }
+    }
+    if (stale) {
+      LOG(LOG_INFO, "removing stale native image %s", path.c_str());
+      unlink(path.c_str());
+      pruned++;
+    }
+  }
+  closedir(d);
+}
+
+
+ErrorPtr NativeImages::convert(const string aPngPath, const string aCacheFile)
+{
+  MLMicroSeconds start = MainLoop::now();
+  png_image image;
+  memset(&image, 0, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_file(&image, aPngPath.c_str())) {
+    return TextError::err("cannot read PNG '%s': %s", aPngPath.c_str(), image.message);
+  }
+  image.format = PNG_FORMAT_RGBA;
+  std::vector<uint8_t> rgba(PNG_IMAGE_SIZE(image));
+  if (!png_image_finish_read(&image, NULL, &rgba[0], 0, NULL)) {
+    png_image_free(&image);
+    return TextError::err("cannot decode PNG '%s': %s", aPngPath.c_str(), image.message);
+  }
+  MLMicroSeconds decodeTime = MainLoop::now()-start;
+  // convert to littlevGL native format, with alpha only if needed
+  size_t npix = image.width*image.height;
+  bool hasAlpha = false;
+  for (size_t i=0; i<npix; i++) {
+    if (rgba[i*4+3]!=0xFF) { hasAlpha = true; break; }
+  }
+  size_t pxSize = hasAlpha ? LV_IMG_PX_SIZE_ALPHA_BYTE : sizeof(lv_color_t);
+  NativeImageHeader hdr;
+  hdr.magic = NATIVE_IMAGE_MAGIC;
+  hdr.version = NATIVE_IMAGE_VERSION;
+  hdr.cf = hasAlpha ? LV_IMG_CF_TRUE_COLOR_ALPHA : LV_IMG_CF_TRUE_COLOR;
+  hdr.w = image.width;
+  hdr.h = image.height;
+  hdr.decodeTime = (uint32_t)decodeTime;
+  hdr.dataSize = npix*pxSize;
+  hdr.pathLen = (aPngPath.size()+4) & ~3;
+  hdr.reserved = 0;
+  string data((const char*)&hdr, sizeof(hdr));
+  data += aPngPath;
+  data.resize(sizeof(hdr)+hdr.pathLen, 0);
+  size_t dataStart = data.size();
+  data.resize(dataStart+hdr.dataSize);
+  uint8_t* p = (uint8_t*)&data[dataStart];
+  for (size_t i=0; i<npix; i++) {
+    const uint8_t* s = &rgba[i*4];
+    lv_color_t c = LV_COLOR_MAKE(s[0], s[1], s[2]);
+    memcpy(p, &c, sizeof(c));
+    p += sizeof(c);
+    if (hasAlpha) *p++ = s[3];
+  }
+  // write atomically
+  string tmp = aCacheFile+".tmp";
+  ErrorPtr err = string_tofile(tmp, data);
+  if (Error::isOK(err) && rename(tmp.c_str(), aCacheFile.c_str())<0) {
+    err = SysError::errNo("cannot store native image: ");
+  }
+  conversions++;
+  conversionTime += MainLoop::now()-start;
+  LOG(LOG_INFO, "converted %s to native image %s (%dx%d, %salpha) in %lld mS", aPngPath.c_str(), aCacheFile.c_str(), hdr.w, hdr.h, hasAlpha ? "" : "no ", (MainLoop::now()-start)/MilliSecond);
+  return err;
+}
+
+
+// MARK: - decoder
+
+lv_res_t NativeImages::infoCB(lv_img_decoder_t* aDecoder, const void* aSrc, lv_img_header_t* aHeader)
+{
+  if (!isPngPath(aSrc)) return LV_RES_INV;
+  string cf;
+  if (Error::notOK(images().cacheFileFor((const char*)aSrc, cf))) return LV_RES_INV; // let regular decoder try
+  int fd = open(cf.c_str(), O_RDONLY);
+  if (fd<0) return LV_RES_INV;
+  NativeImageHeader hdr;
+  bool ok = read(fd, &hdr, sizeof(hdr))==sizeof(hdr) && hdr.magic==NATIVE_IMAGE_MAGIC && hdr.version==NATIVE_IMAGE_VERSION;
+  close(fd);
+  if (!ok) return LV_RES_INV;
+  aHeader->always_zero = 0;
+  aHeader->cf = hdr.cf;
+  aHeader->w = hdr.w;
+  aHeader->h = hdr.h;
+  return LV_RES_OK;
+}
+
+
+lv_res_t NativeImages::openCB(lv_img_decoder_t* aDecoder, lv_img_decoder_dsc_t* aDsc)
+{
+  if (!isPngPath(aDsc->src)) return LV_RES_INV;
+  NativeImages& ni = images();
+  string cf;
+  if (Error::notOK(ni.cacheFileFor((const char*)aDsc->src, cf))) return LV_RES_INV;
+  int fd = open(cf.c_str(), O_RDONLY);
+  if (fd<0) return LV_RES_INV;
+  struct stat st;
+  void* m = MAP_FAILED;
+  if (fstat(fd, &st)==0 && (size_t)st.st_size>=sizeof(NativeImageHeader)) {
+    m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (m==MAP_FAILED) return LV_RES_INV;
+  const NativeImageHeader* hdr = (const NativeImageHeader*)m;
+  if (hdr->magic!=NATIVE_IMAGE_MAGIC || hdr->version!=NATIVE_IMAGE_VERSION || sizeof(NativeImageHeader)+hdr->pathLen+hdr->dataSize>(size_t)st.st_size) {
+    munmap(m, st.st_size);
+    return LV_RES_INV;
+  }
+  NativeImageMapping* mapping = new NativeImageMapping;
+  mapping->base = m;
+  mapping->size = st.st_size;
+  aDsc->user_data = mapping;
+  aDsc->img_data = (const uint8_t*)m+sizeof(NativeImageHeader)+hdr->pathLen;
+  ni.nativeOpens++;
+  ni.decodeTimeSaved += hdr->decodeTime;
+  return LV_RES_OK;
+}
+
+
+void NativeImages::closeCB(lv_img_decoder_t* aDecoder, lv_img_decoder_dsc_t* aDsc)
+{
+  NativeImageMapping* mapping = (NativeImageMapping*)aDsc->user_data;
+  if (mapping) {
+    munmap(mapping->base, mapping->size);
+    delete mapping;
+    aDsc->user_data = NULL;
+  }
+  aDsc->img_data = NULL;
+}
+
+
+// MARK: - statistics
+
+JsonObjectPtr NativeImages::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("conversions", JsonObject::newInt64(conversions));
+  s->add("conversionTime", JsonObject::newDouble((double)conversionTime/MilliSecond));
+  s->add("pruned", JsonObject::newInt64(pruned));
+  s->add("nativeOpens", JsonObject::newInt64(nativeOpens));
+  s->add("decodeTimeSaved", JsonObject::newDouble((double)decodeTimeSaved/MilliSecond));
+  return s;
+}
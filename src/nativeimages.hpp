@@ -0,0 +1,86 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__nativeimages__
+#define __p44mbcd__nativeimages__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+#include <sys/stat.h>
+
+namespace p44 {
+
+  /// littlevGL image decoder for PNG files that converts each PNG only once into littlevGL's
+  /// native true color (+alpha) format, stores that in a cache directory keyed by the PNG's path,
+  /// modification time and size, and serves images directly from the mmap-ed cache file afterwards.
+  /// Cache files whose source has changed or vanished are removed when the decoder is installed.
+  class NativeImages : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    string cacheDir; ///< directory for the native image files
+    lv_img_decoder_t* decoder; ///< our decoder
+
+    // statistics
+    long conversions; ///< number of PNG conversions done
+    long pruned; ///< number of stale cache files removed
+    MLMicroSeconds conversionTime; ///< total time spent converting
+    long nativeOpens; ///< number of images served from cache files
+    MLMicroSeconds decodeTimeSaved; ///< total PNG decode time saved by serving from cache files
+
+  public:
+
+    NativeImages();
+
+    /// get the shared instance
+    static NativeImages& images();
+
+    /// install the decoder
+    /// @param aCacheDir directory to store native image files in (created if needed)
+    void install(const string aCacheDir);
+
+    /// @return true if the decoder is installed
+    bool isInstalled() { return decoder!=NULL; };
+
+    /// make sure a PNG has an up-to-date native image file
+    /// @param aPngPath path of the PNG file
+    /// @return error if PNG could not be converted
+    ErrorPtr prepare(const string aPngPath);
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    string cacheNameFor(const string aPngPath, const struct stat &aStat);
+    void pruneCache();
+    ErrorPtr cacheFileFor(const string aPngPath, string &aCacheFile);
+    ErrorPtr convert(const string aPngPath, const string aCacheFile);
+    static lv_res_t infoCB(lv_img_decoder_t* aDecoder, const void* aSrc, lv_img_header_t* aHeader);
+    static lv_res_t openCB(lv_img_decoder_t* aDecoder, lv_img_decoder_dsc_t* aDsc);
+    static void closeCB(lv_img_decoder_t* aDecoder, lv_img_decoder_dsc_t* aDsc);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__nativeimages__) */
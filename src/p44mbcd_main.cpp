@@ -14,6 +14,32 @@
 #include "jsonobject.hpp"
 #include "analogio.hpp"
 #include "gpio.hpp"
+#include "registerpersistence.hpp"
+#include "shadowregisters.hpp"
+#include "registerhooks.hpp"
+#include "diagnostics.hpp"
+#include "displaytap.hpp"
+#include "lvglscheduler.hpp"
+#include "touchinput.hpp"
+#include "touchlatency.hpp"
+#include "framebuffer.hpp"
+#include "gpukernels.hpp"
+#include "nativeimages.hpp"
+#include "imagecache.hpp"
+#include "lvmempool.hpp"
+#include "scriptedinput.hpp"
+#include "uibenchmark.hpp"
+#include "lazyscreens.hpp"
+#include "uicompiler.hpp"
+#include "glyphcache.hpp"
+#include "valuelabels.hpp"
+#include "trendcharts.hpp"
+#include "staticlayers.hpp"
+#include "qualitygovernor.hpp"
+#include "screenmirror.hpp"
+#include "screensnapshot.hpp"
+#include "remotedisplay.hpp"
+#include "inputrecorder.hpp"
 
 #if ENABLE_UBUS
   #include "ubus.hpp"
@@ -35,11 +61,29 @@
 
 #define MAINSCRIPT_FILE_NAME "mainscript.txt"
 #define COMMCONFIG_FILE_NAME "commconfig"
+#define REGISTER_SNAPSHOT_FILE_NAME "registers.snapshot"
+#define NATIVE_IMAGES_DIR_NAME "imgcache"
+#define DEFAULT_IMAGE_CACHE_KB 2048
+#define UI_COMPILED_DIR_NAME "uicache"
+#define DEFAULT_GLYPH_CACHE_KB 64
+#define DEFAULT_STATIC_LAYER_KB 512
+#define DEFAULT_FRAME_BUDGET_MS 50
+#define DEFAULT_SNAPSHOT_INTERVAL_MS 1000
+#define SNAPSHOT_KEYFRAME_FILE_NAME "screenkey.p44s"
+#define SNAPSHOT_DELTA_FILE_NAME "screen.p44s"
+#define DEFAULT_REMOTE_FPS 10
+#define VALUELABEL_POLL_INTERVAL (100*MilliSecond)
+#define DEFAULT_TREND_INTERVAL_MS 1000
+#define UISTRESS_REDRAW_INTERVAL (50*MilliSecond)
+#define UISTRESS_REPORT_REDRAWS 200
+#define UISTRESS_LAG_INTERVAL (10*MilliSecond) // approx 1000 main loop lag samples per report
 
 #define FATAL_ERROR_IMG "errorscreen.png"
 
 #define FILENO_FIRMWARE 1
 #define FILENO_LOG 90
+#define FILENO_SCREEN 91 // delta snapshot, keyframe is FILENO_SCREEN+1
+#define FILENO_SCREENKEY 92
 #define FILENO_MAINSCRIPT 100
 #define FILENO_TEMPCOMMCONFIG 101
 #define FILENO_COMMCONFIG 102
@@ -52,6 +96,18 @@
 #define REGISTER_FIRST 101
 #define REGISTER_LAST 299
 
+#define INPUT_REGISTER_FIRST 101
+#define INPUT_REGISTER_LAST 199
+
+// computed input registers
+#define INPUTREG_TEMPERATURE 101 // temperature in 0.1 degree celsius (signed), 0x8000 if no sensor
+#define INPUTREG_BACKLIGHT 102 // current backlight brightness in 0.1%
+#define INPUTREG_BACKLIGHT_ACTIVE 103 // 1 when backlight is in active mode, 0 in standby
+#define INPUTREG_UPTIME 104 // 104,105: uptime in seconds (32 bit, high word first)
+#define INPUTREG_DIAGNOSTICS 150 // 150..164: diagnostic counters block, see diagnostics.hpp
+
+#define DEFAULT_PERSIST_INTERVAL 1000 // [ms] minimal interval between register snapshot updates
+
 using namespace p44;
 using namespace P44Script;
 
@@ -149,6 +205,18 @@ public:
   }
 
 
+  bool isActive()
+  {
+    return active;
+  }
+
+
+  double getCurrentBrightness()
+  {
+    return currentBrightness;
+  }
+
+
   void updateBacklight()
   {
     if (active) fadeTo(activeBrightness, 0);
@@ -218,36 +286,74 @@ class P44mbcd : public CmdLineApp
   ModbusSlavePtr modBusSlave; ///< modbus slave
   ModbusMasterPtr modBusMaster; ///< modbus master
   DigitalIoPtr modbusRxEnable; ///< if set, modbus receive is enabled
+  RegisterPersistencePtr registerPersistence; ///< persistent register snapshot
+  RegisterHooksPtr registerHooks; ///< native handlers for computed registers
 
   // app
   LvGLUi ui;
   bool active;
+  UiBenchmarkPtr uiBenchmark; ///< UI rendering benchmark
+  TouchLatencyTestPtr touchLatencyTest; ///< touch to pixel latency measurement
 
   // scripting
   ScriptSource mainScript;
+  ScriptSource screenHookScript; ///< runs lazy screen onbuild/onteardown hooks
+  typedef struct {
+    string screenName;
+    string code;
+    SimpleCB doneCB;
+  } ScreenHook;
+  typedef std::list<ScreenHook> ScreenHookList;
+  ScreenHookList pendingScreenHooks; ///< hooks waiting to be run, one at a time
+  bool screenHookRunning; ///< set while a hook script runs
 
   MLTicket exitTicket; ///< terminate delay
+  MLTicket stressTicket; ///< UI stress test
+  long stressCount; ///< number of stress test redraws
+  MLMicroSeconds startTime; ///< time when app was started
 
   // temperature sensor
   AnalogIoPtr tempSens; ///< the temperature sensor input
 
 public:
 
+  // double buffered registers
+  ShadowRegistersPtr shadowRegisters; ///< committed view of the registers for scripts and UI
+
+  // diagnostics
+  DiagnosticsPtr diagnostics; ///< diagnostic counters
+
+  // lazily built UI screens
+  LazyScreensPtr lazyScreens; ///< screen definitions built on first use
+
+  // labels for live values
+  ValueLabelsPtr valueLabels; ///< numeric labels with incremental redraw
+  TrendChartsPtr trendCharts; ///< streaming trend charts
+
+  // input playback
+  ScriptedInputPtr scriptedInput; ///< software pointer input (input scripts, recorded input)
+
   // LCD backlight control
   MLMicroSeconds backlightTimeout; ///< inactivity time that triggers backlight standby. 0 = never, -1 = always inactive
   BackLightControllerPtr backlight;
   // activity
   MLMicroSeconds activityTimeout; ///< inactivity time that triggers activityTimeoutScript
+  MLTicket activityTicket; ///< for checking activity when the next timeout is due, even when littlevGL has nothing to do
 
   P44mbcd() :
-    mainScript(sourcecode+regular, "main") // only init script may have declarations
+    mainScript(sourcecode+regular, "main"), // only init script may have declarations
+    screenHookScript(scriptbody+regular, "screenhook")
   {
     ui.isMemberVariable();
+    startTime = MainLoop::now();
+    stressCount = 0;
+    screenHookRunning = false;
     active = true;
     activityTimeout = Never;
     backlightTimeout = Never;
     // let all scripts run in the same (ui) context
     mainScript.setSharedMainContext(ui.getScriptMainContext());
+    screenHookScript.setSharedMainContext(ui.getScriptMainContext());
   }
 
   virtual int main(int argc, char **argv)
@@ -263,8 +369,49 @@ public:
       { 0  , "slave",           true,  "slave;use this slave by default (0: act as master)" },
       { 0  , "slaveswitch",     true,  "gpiono:numgpios;use GPIOs for slave address DIP switch, first GPIO=A0" },
       { 0  , "debugmodbus",     false, "enable libmodbus debug messages to stderr" },
+      { 0  , "persistregs",     true,  "rangelist;persist these registers across restarts (first[-last],... prefix i for input registers)" },
+      { 0  , "persistinterval", true,  "milliseconds;max rate of persistent register snapshot updates, default=1000" },
+      { 0  , "shadowregs",      true,  "regionlist;double buffered register regions (first-last[:commitreg],...)" },
       { 0  , "backlight",       true,  "pinspec;analog output for LCD backlight control" },
       { 0  , "tempsensor",      true,  "pinspec;analog input for temperature measurement" },
+      { 0  , "headless",        false, "render into memory instead of display hardware" },
+      { 0  , "flushcost",       true,  "nanoseconds;simulated time per flushed pixel in headless mode" },
+      { 0  , "pngdump",         true,  "pngfile;write screen contents to this PNG file at exit (headless mode)" },
+      { 0  , "inputscript",     true,  "scriptfile;play back pointer input from this file" },
+      { 0  , "inputloop",       false, "restart input script when done" },
+      { 0  , "inputspeed",      true,  "factor;play back input script faster (>1) or slower (<1), default=1" },
+      { 0  , "inputbench",      false, "print diagnostics and exit when input script is done (benchmarking real interaction)" },
+      { 0  , "recordinput",     true,  "scriptfile;record pointer input into this file (same format as inputscript)" },
+      { 0  , "touchlatency",    true,  "taps;measure touch to pixel latency with a synthetic uinput touch screen, print results and exit" },
+      { 0  , "pageflip",        true,  "fbdev;render into this framebuffer device, page flipping when it has room for two pages (implies flushthread)" },
+      { 0  , "flushthread",     false, "flush rendered display areas from a separate thread" },
+      { 0  , "framebudget",     true,  "milliseconds;reduce rendering quality while frames take longer, default=50, 0=never reduce automatically" },
+      { 0  , "fullquality",     false, "never reduce rendering quality" },
+      { 0  , "nosnapshot",      false, "do not maintain screen snapshots for reading via modbus" },
+      { 0  , "snapshotinterval",true,  "milliseconds;min interval between screen snapshot updates, default=1000" },
+      { 0  , "remoteport",      true,  "port;stream display to remote viewer and accept its pointer input on this TCP port" },
+      { 0  , "remotefps",       true,  "fps;max frames per second sent to remote viewer, default=10" },
+      { 0  , "remotenonlocal",  false, "accept remote viewer connections from other hosts (requires remotesecret)" },
+      { 0  , "remotesecret",    true,  "secret;remote viewer must send this secret before it gets the display" },
+      { 0  , "fixedrefresh",    false, "refresh display periodically even when nothing has changed" },
+      { 0  , "nonativeimages",  false, "always decode PNG images, do not convert them to cached native images" },
+      { 0  , "nouicompile",     false, "always parse JSON UI definitions, do not use cached compiled versions" },
+      { 0  , "uicompilebench",  true,  "jsonfile;benchmark loading this JSON UI definition as text vs. compiled, print results and exit" },
+      { 0  , "glyphcachekb",    true,  "kbytes;budget for pre-expanded font glyphs, default=64, 0=off" },
+      { 0  , "fontsubset",      false, "print the code points used by mainscript and JSON files (for generating subsetted fonts) and exit" },
+      { 0  , "staticlayerkb",   true,  "kbytes;budget for pre-rendered static layer buffers, default=512" },
+      { 0  , "imgcachekb",      true,  "kbytes;budget for decoded images kept in memory, default=2048, 0=unlimited" },
+      { 0  , "lvglmemkb",       true,  "kbytes;memory budget for littlevGL objects, styles and strings (decoded images: see imgcachekb), default=32" },
+      { 0  , "membench",        false, "benchmark littlevGL memory allocator vs. malloc, print results and exit" },
+      { 0  , "nodrawkernels",   false, "do not use optimized fill and blend kernels for rendering" },
+      { 0  , "drawbench",       false, "benchmark optimized vs. scalar fill and blend kernels, print results and exit" },
+      { 0  , "screenidle",      true,  "seconds;tear down lazily built screens not shown for this long, default=never" },
+      { 0  , "screenlowmemkb",  true,  "kbytes;tear down least recently shown screens when allocatable littlevGL memory is below this" },
+      { 0  , "trendinterval",   true,  "milliseconds;sampling interval for trend charts bound to registers, default=1000" },
+      { 0  , "uibench",         true,  "seconds;run UI rendering benchmark (headless) for this many seconds per phase, print results and exit" },
+      { 0  , "uibenchscreens",  true,  "jsonfile;UI definition to include in the UI rendering benchmark" },
+      { 0  , "uistress",        false, "continuously redraw the entire screen and log main loop lag every 10 seconds" },
+      { 0  , "touchdev",        true,  "evdev;read touch screen events from this device (event driven instead of polled)" },
       #if MOUSE_CURSOR_SUPPORT
       { 0  , "mousecursor",     false, "show mouse cursor" },
       #endif
@@ -288,6 +435,29 @@ public:
       terminateApp(EXIT_SUCCESS);
     }
 
+    if (getOption("membench")) {
+      printf("%s\n", LvMemPool::benchmark(8*1024*1024)->json_c_str());
+      terminateApp(EXIT_SUCCESS);
+    }
+    int lvglMemKB;
+    if (getIntOption("lvglmemkb", lvglMemKB)) {
+      LvMemPool::setLvglBudget((size_t)lvglMemKB*1024);
+    }
+    if (getOption("fontsubset")) {
+      printf("%s\n", fontSubset()->json_c_str());
+      terminateApp(EXIT_SUCCESS);
+    }
+    string benchFile;
+    if (getStringOption("uicompilebench", benchFile)) {
+      UiCompiler::compiler().setCacheDir(tempPath(UI_COMPILED_DIR_NAME));
+      printf("%s\n", UiCompiler::compiler().benchmark(benchFile, 100)->json_c_str());
+      terminateApp(EXIT_SUCCESS);
+    }
+    if (getOption("drawbench")) {
+      printf("%s\n", GpuKernels::benchmark(2*Second)->json_c_str());
+      terminateApp(EXIT_SUCCESS);
+    }
+
     #if ENABLE_UBUS
     // Prepare ubus API
     if (getOption("ubusapi")) {
@@ -301,6 +471,41 @@ public:
 
 
 
+  // MARK: - font subsetting
+
+  JsonObjectPtr fontSubset()
+  {
+    std::set<uint32_t> cps;
+    JsonObjectPtr files = JsonObject::newArray();
+    string text;
+    string fn = dataPath(MAINSCRIPT_FILE_NAME);
+    if (Error::notOK(string_fromfile(fn, text))) {
+      fn = resourcePath(MAINSCRIPT_FILE_NAME);
+      string_fromfile(fn, text);
+    }
+    if (!text.empty()) {
+      GlyphCache::collectCodePoints(text, cps);
+      files->arrayAppend(JsonObject::newString(fn));
+    }
+    for (int i=0; i<MAX_JSON; i++) {
+      fn = dataPath(string_format("data%03d.json", i));
+      text.clear();
+      if (Error::isOK(string_fromfile(fn, text))) {
+        GlyphCache::collectCodePoints(text, cps);
+        files->arrayAppend(JsonObject::newString(fn));
+      }
+    }
+    // always include printable ASCII, for numbers and messages generated at runtime
+    for (uint32_t c=0x20; c<0x7F; c++) cps.insert(c);
+    JsonObjectPtr r = JsonObject::newObj();
+    r->add("files", files);
+    r->add("codepoints", JsonObject::newInt32((int)cps.size()));
+    r->add("ranges", JsonObject::newString(GlyphCache::rangeList(cps)));
+    return r;
+  }
+
+
+
   // MARK: - ubus API
 
   #if ENABLE_UBUS
@@ -383,12 +588,12 @@ public:
                 if (o->isType(json_type_array)) {
                   // multiple
                   for(int i=0; i<o->arrayLength(); i++) {
-                    modBusSlave->setReg(reg+i, false, o->arrayGet(i)->int32Value());
+                    setLocalReg(reg+i, o->arrayGet(i)->int32Value());
                   }
                 }
                 else {
                   // single
-                  modBusSlave->setReg(reg, false, o->int32Value());
+                  setLocalReg(reg, o->int32Value());
                 }
               }
               else {
@@ -399,6 +604,25 @@ public:
               result = JsonObject::newBool(true);
             }
           }
+          else if (shadowRegisters && cmd=="txstats") {
+            result = shadowRegisters->statistics();
+          }
+          else if (registerHooks && cmd=="hookstats") {
+            result = registerHooks->statistics();
+          }
+          else if (cmd=="diagnostics") {
+            result = diagnostics->statistics();
+          }
+          else if (cmd=="imgcache") {
+            result = ImageCache::cache().statistics();
+          }
+          else if (cmd=="lvglmem") {
+            result = LvMemPool::lvglPool().statistics();
+          }
+          else if (cmd=="diag_reset") {
+            diagnostics->reset();
+            result = JsonObject::newBool(true);
+          }
           else {
             err = TextError::err("unknown modbus command");
           }
@@ -427,6 +651,7 @@ public:
   {
     ErrorPtr err;
     LOG(LOG_NOTICE, "p44mbcd: initialize");
+    diagnostics = DiagnosticsPtr(new Diagnostics);
     #if ENABLE_UBUS
     // start ubus API, if we have it
     if (ubusApiServer) {
@@ -488,8 +713,42 @@ public:
         0, 0, // coils
         0, 0, // input bits
         REGISTER_FIRST, REGISTER_LAST-REGISTER_FIRST+1, // registers
-        0, 0 // input registers
+        INPUT_REGISTER_FIRST, INPUT_REGISTER_LAST-INPUT_REGISTER_FIRST+1 // input registers
       );
+      // - restore persisted registers before we start answering requests
+      string persistRegs;
+      if (getStringOption("persistregs", persistRegs)) {
+        registerPersistence = RegisterPersistencePtr(new RegisterPersistence(modBusSlave));
+        ErrorPtr perr = registerPersistence->addRanges(persistRegs);
+        if (Error::isOK(perr)) {
+          int persistInterval = DEFAULT_PERSIST_INTERVAL;
+          getIntOption("persistinterval", persistInterval);
+          perr = registerPersistence->open(dataPath(REGISTER_SNAPSHOT_FILE_NAME), persistInterval*MilliSecond);
+        }
+        if (Error::notOK(perr)) {
+          LOG(LOG_ERR, "Register persistence not available: %s", perr->text());
+          registerPersistence.reset();
+        }
+      }
+      // - double buffered regions
+      shadowRegisters = ShadowRegistersPtr(new ShadowRegisters(modBusSlave));
+      string shadowRegs;
+      if (getStringOption("shadowregs", shadowRegs)) {
+        err = shadowRegisters->addRegions(shadowRegs);
+        if (Error::notOK(err)) {
+          terminateAppWith(err);
+          return;
+        }
+      }
+      // - native register handlers
+      registerHooks = RegisterHooksPtr(new RegisterHooks(modBusSlave));
+      registerHooks->addHandler(INPUTREG_TEMPERATURE, 1, false, true, boost::bind(&P44mbcd::temperatureReg, this, _1), RegisterHooks::WriteHandler(), 1*Second);
+      registerHooks->addHandler(INPUTREG_BACKLIGHT, 2, false, true, boost::bind(&P44mbcd::backlightReg, this, _1));
+      registerHooks->addHandler(INPUTREG_UPTIME, 2, false, true, boost::bind(&P44mbcd::uptimeReg, this, _1), RegisterHooks::WriteHandler(), 1*Second);
+      diagnostics->installRegisters(registerHooks, INPUTREG_DIAGNOSTICS);
+      // - RTU line errors from the serial driver
+      diagnostics->setSerialDevice(mbconn);
+      modBusSlave->setValueAccessHandler(boost::bind(&P44mbcd::modbusValueAccessHandler, this, _1, _2, _3, _4));
       // Files
       // - firmware
       modBusSlave->addFileHandler(ModbusFileHandlerPtr(new ModbusFileHandler(
@@ -510,6 +769,25 @@ public:
         "/var/log/p44mbcd/current",
         true // read only
       )));
+      // - screen snapshot (delta and keyframe)
+      if (!getOption("nosnapshot")) {
+        modBusSlave->addFileHandler(ModbusFileHandlerPtr(new ModbusFileHandler(
+          FILENO_SCREEN,
+          9, // max segs
+          1, // single file
+          true, // p44 header
+          tempPath(SNAPSHOT_DELTA_FILE_NAME),
+          true // read only
+        )));
+        modBusSlave->addFileHandler(ModbusFileHandlerPtr(new ModbusFileHandler(
+          FILENO_SCREENKEY,
+          9, // max segs
+          1, // single file
+          true, // p44 header
+          tempPath(SNAPSHOT_KEYFRAME_FILE_NAME),
+          true // read only
+        )));
+      }
       // - json config
       modBusSlave->addFileHandler(ModbusFileHandlerPtr(new ModbusFileHandler(
         FILENO_MAINSCRIPT,
@@ -604,7 +882,43 @@ public:
     // start littlevGL
     ui.setResourceLoadOptions(true, "");
     initLvgl();
-    LvGL::lvgl().setTaskCallback(boost::bind(&P44mbcd::taskCallBack, this));
+    lazyScreens = LazyScreensPtr(new LazyScreens(boost::bind(&LvGLUi::setConfig, &ui, _1), boost::bind(&P44mbcd::deleteUiScreen, this, _1)));
+    lazyScreens->setHookHandler(boost::bind(&P44mbcd::queueScreenHook, this, _1, _2, _3));
+    int screenIdle = 0;
+    int screenLowMemKB = 0;
+    getIntOption("screenidle", screenIdle);
+    getIntOption("screenlowmemkb", screenLowMemKB);
+    lazyScreens->setTeardownPolicy(screenIdle>0 ? screenIdle*Second : Never, (size_t)screenLowMemKB*1024);
+    valueLabels = ValueLabelsPtr(new ValueLabels);
+    if (shadowRegisters) {
+      valueLabels->setRegisterReader(boost::bind(&ShadowRegisters::getReg, shadowRegisters, _1), VALUELABEL_POLL_INTERVAL);
+    }
+    trendCharts = TrendChartsPtr(new TrendCharts);
+    if (shadowRegisters) {
+      int trendInterval = DEFAULT_TREND_INTERVAL_MS;
+      getIntOption("trendinterval", trendInterval);
+      trendCharts->setRegisterReader(boost::bind(&ShadowRegisters::getReg, shadowRegisters, _1), trendInterval*MilliSecond);
+    }
+    int benchSeconds;
+    if (getIntOption("uibench", benchSeconds)) {
+      // benchmark only, no main script
+      runUiBenchmark(benchSeconds*Second);
+      return;
+    }
+    int latencyTaps;
+    if (getIntOption("touchlatency", latencyTaps)) {
+      // latency measurement only, no main script
+      touchLatencyTest = TouchLatencyTestPtr(new TouchLatencyTest);
+      err = touchLatencyTest->start(latencyTaps, boost::bind(&P44mbcd::touchLatencyDone, this, _1));
+      if (Error::notOK(err)) terminateAppWith(err);
+      return;
+    }
+    if (getOption("uistress")) {
+      LOG(LOG_WARNING, "UI stress test running");
+      // sample main loop lag often enough for a meaningful average per report
+      diagnostics->setLagInterval(UISTRESS_LAG_INTERVAL);
+      uiStress();
+    }
     // load and start main script
     string code;
     err = string_fromfile(dataPath(MAINSCRIPT_FILE_NAME), code);
@@ -615,6 +929,8 @@ public:
       }
     }
     if (Error::isOK(err)) {
+      // texts in the script are likely to be shown, avoid expanding their glyphs during first rendering
+      GlyphCache::cache().prewarm(code);
       mainScript.setSource(code);
       ScriptObjPtr res = mainScript.syntaxcheck();
       if (res && res->isErr()) {
@@ -631,6 +947,64 @@ public:
       LOG(LOG_ERR, "Startup error: %s", Error::text(err));
       fatalErrorScreen(string_format("Startup error: %s", Error::text(err)));
     }
+    // input recording (before installing scripted input, so only real devices are recorded)
+    string inputRecording;
+    if (getStringOption("recordinput", inputRecording)) {
+      ErrorPtr rerr = InputRecorder::recorder().start(inputRecording);
+      if (Error::notOK(rerr)) {
+        LOG(LOG_ERR, "Cannot record input: %s", Error::text(rerr));
+      }
+    }
+    // scripted input
+    string inputScript;
+    if (getStringOption("inputscript", inputScript)) {
+      scriptedInput = ScriptedInputPtr(new ScriptedInput);
+      scriptedInput->install();
+      ErrorPtr ierr = scriptedInput->loadScript(inputScript);
+      if (Error::notOK(ierr)) {
+        LOG(LOG_ERR, "Cannot load input script: %s", Error::text(ierr));
+      }
+      else {
+        string speed;
+        if (getStringOption("inputspeed", speed)) {
+          scriptedInput->setSpeed(strtod(speed.c_str(), NULL));
+        }
+        if (getOption("inputbench")) {
+          // measure this interaction only
+          diagnostics->reset();
+          scriptedInput->start(false, boost::bind(&P44mbcd::inputBenchDone, this));
+        }
+        else {
+          scriptedInput->start(getOption("inputloop"));
+        }
+      }
+    }
+    LOG(LOG_NOTICE,
+      "UI started %lld mS after launch, images: %s",
+      (MainLoop::now()-startTime)/MilliSecond,
+      NativeImages::images().statistics()->json_c_str()
+    );
+  }
+
+
+  void inputBenchDone()
+  {
+    printf("%s\n", diagnostics->statistics()->json_c_str());
+    terminateApp(EXIT_SUCCESS);
+  }
+
+
+  virtual void cleanup(int aExitCode)
+  {
+    InputRecorder::recorder().stop();
+    // make sure latest register state is on disk
+    if (registerPersistence) registerPersistence->close();
+    string pngDump;
+    if (getStringOption("pngdump", pngDump)) {
+      ErrorPtr err = FrameBuffer::frameBuffer().writePng(pngDump);
+      if (Error::notOK(err)) LOG(LOG_ERR, "Cannot write screen dump: %s", Error::text(err));
+    }
+    inherited::cleanup(aExitCode);
   }
 
 
@@ -679,13 +1053,29 @@ public:
       double res = (-5867520000.0+930000.0*adc)/(-4883456.0-31.0*adc);
       // convert to temperature
       temp = pt1000_Ohms_to_degreeC(res);
-      LOG(LOG_INFO, "tempsens raw value = %.2f -> resistance = %.2f -> temperature = %.2f", adc, res, temp);
+      LOG(LOG_DEBUG, "tempsens raw value = %.2f -> resistance = %.2f -> temperature = %.2f", adc, res, temp);
     }
     return temp;
   }
 
 
   void taskCallBack()
+  {
+    LvglScheduler::scheduler().cycle();
+    QualityGovernor::governor().cycle();
+    updateActivity();
+  }
+
+
+  /// check activity timeouts now, e.g. after they have been changed
+  void checkActivity()
+  {
+    updateActivity();
+    LvglScheduler::scheduler().wakeup(); // input polling period might have changed
+  }
+
+
+  void updateActivity()
   {
     MLMicroSeconds inactivetime = (MLMicroSeconds)lv_disp_get_inactive_time(NULL)*MilliSecond;
     // backlight standby
@@ -694,6 +1084,7 @@ public:
         backlightTimeout>=0 && // not forced into standby...
         (backlightTimeout==Never || inactivetime<backlightTimeout) // ...and no timeout at all or timeout not yet reached
       );
+      LvglScheduler::scheduler().setStandby(!backlight->isActive());
     }
     // inactivity script
     if (activityTimeout && inactivetime>activityTimeout) {
@@ -708,6 +1099,15 @@ public:
         ui.uiActivation(true);
       }
     }
+    // littlevGL tasks only run when needed, so make sure we get called again when the next timeout is reached
+    MLMicroSeconds next = Never;
+    if (backlight && backlightTimeout>0 && inactivetime<backlightTimeout) next = backlightTimeout-inactivetime;
+    if (activityTimeout>0 && inactivetime<=activityTimeout) {
+      MLMicroSeconds a = activityTimeout-inactivetime+MilliSecond; // must be exceeded
+      if (next==Never || a<next) next = a;
+    }
+    if (next!=Never) activityTicket.executeOnce(boost::bind(&P44mbcd::checkActivity, this), next);
+    else activityTicket.cancel();
   }
 
 
@@ -751,6 +1151,20 @@ public:
       exitTicket.executeOnce(boost::bind(&P44mbcd::delayedTerminate, this, EXIT_SUCCESS), 2*Second);
       return;
     }
+    else if (aFileNo>=FILENO_IMAGES_BASE && aFileNo<FILENO_IMAGES_BASE+MAX_IMAGES && !getOption("nonativeimages")) {
+      // convert now, so loading it later does not need to decode the PNG
+      ErrorPtr err = NativeImages::images().prepare(aFinalPath);
+      if (Error::notOK(err)) {
+        LOG(LOG_WARNING, "Cannot convert received image to native format: %s", Error::text(err));
+      }
+    }
+    else if (aFileNo>=FILENO_JSON_BASE && aFileNo<FILENO_JSON_BASE+MAX_JSON && !getOption("nouicompile")) {
+      // compile now, so loading it later does not need to parse JSON
+      ErrorPtr err = UiCompiler::compiler().compile(aFinalPath);
+      if (Error::notOK(err)) {
+        LOG(LOG_WARNING, "Cannot compile received JSON file: %s", Error::text(err));
+      }
+    }
   }
 
 
@@ -777,21 +1191,63 @@ public:
   }
 
 
-  /*
   ErrorPtr modbusValueAccessHandler(int aAddress, bool aBit, bool aInput, bool aWrite)
   {
-    uint16_t val = modBusSlave->getValue(aAddress, aBit, aInput);
-    LOG(LOG_NOTICE,
-      "%s%s %d accessed for %s, value = %d (0x%04X)",
-      aInput ? "Readonly " : "",
-      aBit ? "Bit" : "Register",
-      aAddress,
-      aWrite ? "write" : "read",
-      val, val
-    );
-    return ErrorPtr();
+    MLMicroSeconds start = MainLoop::now();
+    if (LOGENABLED(LOG_DEBUG)) {
+      uint16_t val = modBusSlave->getValue(aAddress, aBit, aInput);
+      LOG(LOG_DEBUG,
+        "%s%s %d accessed for %s, value = %d (0x%04X)",
+        aInput ? "Readonly " : "",
+        aBit ? "Bit" : "Register",
+        aAddress,
+        aWrite ? "write" : "read",
+        val, val
+      );
+    }
+    bool handled;
+    ErrorPtr err = registerHooks->access(aAddress, aBit, aInput, aWrite, handled);
+    if (!handled && !aBit && !aInput && shadowRegisters) {
+      shadowRegisters->registerAccessed(aAddress, aWrite);
+    }
+    if (aWrite && registerPersistence) registerPersistence->changed();
+    diagnostics->modbusAccess(err, MainLoop::now()-start);
+    return err;
+  }
+
+
+  /// set a register from the local side (scripts, ubus)
+  void setLocalReg(int aAddress, uint16_t aValue)
+  {
+    if (shadowRegisters) shadowRegisters->setReg(aAddress, aValue);
+    else modBusSlave->setReg(aAddress, false, aValue);
+    // computed values depending on this register must be re-evaluated
+    if (registerHooks) registerHooks->invalidate(aAddress, false, false);
+    if (registerPersistence) registerPersistence->changed();
+  }
+
+
+  uint16_t temperatureReg(int aAddress)
+  {
+    double temp = getTemp();
+    if (temp<=-999) return 0x8000; // no sensor
+    return (uint16_t)(int16_t)(temp*10);
+  }
+
+
+  uint16_t backlightReg(int aAddress)
+  {
+    if (!backlight) return 0;
+    if (aAddress==INPUTREG_BACKLIGHT_ACTIVE) return backlight->isActive() ? 1 : 0;
+    return (uint16_t)(backlight->getCurrentBrightness()*10);
+  }
+
+
+  uint16_t uptimeReg(int aAddress)
+  {
+    uint32_t uptime = (uint32_t)((MainLoop::now()-startTime)/Second);
+    return aAddress==INPUTREG_UPTIME ? uptime>>16 : uptime & 0xFFFF;
   }
-  */
 
 
   // MARK: - littlevGL
@@ -800,13 +1256,229 @@ public:
   void initLvgl()
   {
     LOG(LOG_NOTICE, "initializing littlevGL");
-    LvGL::lvgl().init(getOption("mousecursor"));
+    LvglScheduler::scheduler().init(getOption("mousecursor"), boost::bind(&P44mbcd::taskCallBack, this));
+    string fbdev;
+    if (getOption("headless") || getOption("uibench")) {
+      lv_disp_t* disp = lv_disp_get_default();
+      ErrorPtr err = FrameBuffer::frameBuffer().openMemory(lv_disp_get_hor_res(disp), lv_disp_get_ver_res(disp), 1);
+      if (Error::notOK(err)) {
+        LOG(LOG_ERR, "Could not create memory framebuffer: %s", Error::text(err));
+      }
+      else {
+        int flushCost;
+        if (getIntOption("flushcost", flushCost)) FrameBuffer::frameBuffer().setFlushCost(flushCost);
+        FrameBuffer::frameBuffer().install(disp);
+        LOG(LOG_NOTICE, "headless mode, rendering into %dx%d memory framebuffer", lv_disp_get_hor_res(disp), lv_disp_get_ver_res(disp));
+      }
+    }
+    else if (getStringOption("pageflip", fbdev)) {
+      ErrorPtr err = FrameBuffer::frameBuffer().openDevice(fbdev, true);
+      if (Error::notOK(err)) {
+        LOG(LOG_ERR, "Could not open framebuffer: %s", Error::text(err));
+      }
+      else {
+        FrameBuffer::frameBuffer().install(lv_disp_get_default());
+      }
+    }
+    if (!getOption("nonativeimages")) {
+      NativeImages::images().install(dataPath(NATIVE_IMAGES_DIR_NAME));
+    }
+    if (!getOption("nouicompile")) {
+      UiCompiler::compiler().setCacheDir(dataPath(UI_COMPILED_DIR_NAME));
+    }
+    int glyphCacheKB = DEFAULT_GLYPH_CACHE_KB;
+    getIntOption("glyphcachekb", glyphCacheKB);
+    if (glyphCacheKB>0) {
+      GlyphCache::cache().setBudget((size_t)glyphCacheKB*1024);
+      GlyphCache::cache().addFont(&lv_font_roboto_12);
+      GlyphCache::cache().addFont(&lv_font_roboto_16);
+      GlyphCache::cache().addFont(&lv_font_roboto_22);
+      GlyphCache::cache().addFont(&lv_font_roboto_28);
+      GlyphCache::cache().addFont(&lv_font_unscii_8);
+    }
+    int staticLayerKB = DEFAULT_STATIC_LAYER_KB;
+    getIntOption("staticlayerkb", staticLayerKB);
+    StaticLayers::layers().setBudget((size_t)staticLayerKB*1024);
+    int imgCacheKB = DEFAULT_IMAGE_CACHE_KB;
+    getIntOption("imgcachekb", imgCacheKB);
+    ImageCache::cache().install((size_t)imgCacheKB*1024);
+    if (!getOption("nodrawkernels")) {
+      GpuKernels::install(lv_disp_get_default());
+    }
+    DisplayTap::tap().install(lv_disp_get_default());
+    int frameBudget = DEFAULT_FRAME_BUDGET_MS;
+    getIntOption("framebudget", frameBudget);
+    QualityGovernor::governor().install(lv_disp_get_default(), frameBudget);
+    if (getOption("fullquality")) {
+      QualityGovernor::governor().setMode(QualityGovernor::quality_full);
+    }
+    ScreenMirror::mirror().install(lv_disp_get_default());
+    if (!getOption("nosnapshot")) {
+      int snapshotInterval = DEFAULT_SNAPSHOT_INTERVAL_MS;
+      getIntOption("snapshotinterval", snapshotInterval);
+      ScreenSnapshot::snapshot().install(
+        tempPath(SNAPSHOT_KEYFRAME_FILE_NAME), tempPath(SNAPSHOT_DELTA_FILE_NAME),
+        snapshotInterval*MilliSecond
+      );
+    }
+    string remotePort;
+    if (getStringOption("remoteport", remotePort)) {
+      int remoteFps = DEFAULT_REMOTE_FPS;
+      getIntOption("remotefps", remoteFps);
+      string remoteSecret;
+      getStringOption("remotesecret", remoteSecret);
+      ErrorPtr err = RemoteDisplay::remote().start(remotePort, remoteFps, getOption("remotenonlocal"), remoteSecret);
+      if (Error::notOK(err)) {
+        LOG(LOG_ERR, "Could not start remote display server: %s", Error::text(err));
+      }
+    }
+    if (!getOption("fixedrefresh")) {
+      LvglScheduler::scheduler().install(lv_disp_get_default());
+    }
+    string touchdev;
+    if (getStringOption("touchdev", touchdev)) {
+      ErrorPtr err = TouchInput::touchInput().open(touchdev);
+      if (Error::notOK(err)) {
+        LOG(LOG_ERR, "Could not open touch device: %s", Error::text(err));
+      }
+      else {
+        DisplayTap::tap().setFrameHandler(boost::bind(&TouchInput::frameRendered, &TouchInput::touchInput()));
+      }
+    }
+    if (getOption("flushthread") || FrameBuffer::frameBuffer().isPageFlipping()) {
+      // page flipping needs the second draw buffer the flush thread provides
+      ErrorPtr err = DisplayTap::tap().startFlushThread();
+      if (Error::notOK(err)) {
+        LOG(LOG_ERR, "Could not start flush thread: %s", Error::text(err));
+      }
+    }
     // create app UI
     // - init display
     ui.initForDisplay(lv_disp_get_default());
   }
 
 
+  static lv_obj_t* demoBenchSetup(lv_obj_t* aScreen)
+  {
+    demo_create(); // creates on active screen
+    return aScreen;
+  }
+
+
+  lv_obj_t* jsonBenchSetup(JsonObjectPtr aConfig, lv_obj_t* aScreen)
+  {
+    ErrorPtr err = ui.setConfig(aConfig);
+    if (Error::notOK(err)) {
+      LOG(LOG_ERR, "UI benchmark: cannot apply UI definition: %s", Error::text(err));
+    }
+    return lv_scr_act(); // config might have loaded its own screen
+  }
+
+
+  void runUiBenchmark(MLMicroSeconds aPhaseDuration)
+  {
+    uiBenchmark = UiBenchmarkPtr(new UiBenchmark);
+    uiBenchmark->addStandardPhases();
+    string screensFile;
+    if (getStringOption("uibenchscreens", screensFile)) {
+      ErrorPtr err;
+      JsonObjectPtr cfg = JsonObject::objFromFile(screensFile.c_str(), &err, true);
+      if (Error::notOK(err) || !cfg) {
+        LOG(LOG_ERR, "UI benchmark: cannot load '%s': %s", screensFile.c_str(), Error::text(err));
+      }
+      else {
+        uiBenchmark->addPhase("json", boost::bind(&P44mbcd::jsonBenchSetup, this, cfg, _1), &UiBenchmark::invalidateStep);
+      }
+    }
+    // demo last, as it changes the theme
+    uiBenchmark->addPhase("demo", &P44mbcd::demoBenchSetup, &UiBenchmark::invalidateStep);
+    uiBenchmark->run(aPhaseDuration, boost::bind(&P44mbcd::uiBenchmarkDone, this, _1));
+  }
+
+
+  void uiBenchmarkDone(JsonObjectPtr aResults)
+  {
+    JsonObjectPtr r = JsonObject::newObj();
+    lv_disp_t* disp = lv_disp_get_default();
+    r->add("resolution", JsonObject::newString(string_format("%dx%d", lv_disp_get_hor_res(disp), lv_disp_get_ver_res(disp))));
+    r->add("drawKernels", JsonObject::newString(getOption("nodrawkernels") ? "scalar" : GpuKernels::simdName()));
+    r->add("phases", aResults);
+    printf("%s\n", r->json_c_str());
+    terminateApp(EXIT_SUCCESS);
+  }
+
+
+  void touchLatencyDone(JsonObjectPtr aResults)
+  {
+    if (!aResults) {
+      terminateApp(EXIT_FAILURE);
+      return;
+    }
+    printf("%s\n", aResults->json_c_str());
+    terminateApp(EXIT_SUCCESS);
+  }
+
+
+  void queueScreenHook(const string aScreenName, const string aHookCode, SimpleCB aDoneCB)
+  {
+    // not from within building or tearing down: run from mainloop, one after the other
+    ScreenHook h;
+    h.screenName = aScreenName;
+    h.code = aHookCode;
+    h.doneCB = aDoneCB;
+    pendingScreenHooks.push_back(h);
+    MainLoop::currentMainLoop().executeNow(boost::bind(&P44mbcd::runNextScreenHook, this));
+  }
+
+
+  void runNextScreenHook()
+  {
+    if (screenHookRunning || pendingScreenHooks.empty()) return;
+    ScreenHook& h = pendingScreenHooks.front();
+    LOG(LOG_INFO, "running hook script for screen '%s'", h.screenName.c_str());
+    screenHookRunning = true;
+    screenHookScript.setSource(h.code);
+    screenHookScript.run(inherit, boost::bind(&P44mbcd::screenHookDone, this, _1));
+  }
+
+
+  void screenHookDone(ScriptObjPtr aResult)
+  {
+    ScreenHook h = pendingScreenHooks.front();
+    pendingScreenHooks.pop_front();
+    screenHookRunning = false;
+    if (aResult && aResult->isErr()) {
+      LOG(LOG_ERR, "hook script for screen '%s' failed: %s", h.screenName.c_str(), aResult->errorValue()->text());
+    }
+    if (h.doneCB) h.doneCB();
+    runNextScreenHook();
+  }
+
+
+  void deleteUiScreen(const string aScreenName)
+  {
+    // Note: needs LvGLUi::namedElement() and LvGLUi::removeElement() from p44utils (luz branch)
+    LVGLUiElementPtr scr = ui.namedElement(aScreenName);
+    if (!scr) return;
+    // Do not lv_obj_del() the screen here: that would delete the child widgets as well, but their
+    // LVGLUiElements would still delete them again when released. Removing the screen from LvGLUi
+    // releases the element tree the same way LvGLUi does itself, children before their parent.
+    ui.removeElement(scr);
+  }
+
+
+  void uiStress()
+  {
+    // redraw the whole screen over and over, to compare main loop lag with and without flush thread
+    lv_obj_invalidate(lv_scr_act());
+    if (++stressCount % UISTRESS_REPORT_REDRAWS == 0) {
+      LOG(LOG_NOTICE, "UI stress: %ld redraws, diagnostics: %s", stressCount, diagnostics->statistics()->json_c_str());
+      diagnostics->reset();
+    }
+    stressTicket.executeOnce(boost::bind(&P44mbcd::uiStress, this), UISTRESS_REDRAW_INTERVAL);
+  }
+
+
   void fatalErrorScreen(const string aMessage)
   {
     lv_obj_t* errorScreen = lv_img_create(NULL, NULL);
@@ -840,6 +1512,7 @@ static void activitytimeout_func(BuiltinFunctionContextPtr f)
 {
   P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
   p44mbcd.activityTimeout = f->arg(0)->doubleValue()*Second;
+  p44mbcd.checkActivity();
   f->finish();
 }
 
@@ -865,6 +1538,7 @@ static void backlight_func(BuiltinFunctionContextPtr f)
       if (f->numArgs()>=4) {
         p44mbcd.backlight->setFadeTime(f->arg(3)->doubleValue()*Second);
       }
+      p44mbcd.checkActivity();
     }
   }
   f->finish();
@@ -884,6 +1558,359 @@ static void temperature_func(BuiltinFunctionContextPtr f)
 }
 
 
+// committedreg(address [, value])
+static const BuiltInArgDesc committedreg_args[] = { { numeric }, { numeric|optionalarg } };
+static const size_t committedreg_numargs = sizeof(committedreg_args)/sizeof(BuiltInArgDesc);
+static void committedreg_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  if (!p44mbcd.shadowRegisters) {
+    f->finish(new AnnotatedNullValue("not a modbus slave"));
+    return;
+  }
+  int addr = f->arg(0)->intValue();
+  if (f->numArgs()>=2) {
+    p44mbcd.setLocalReg(addr, f->arg(1)->intValue());
+    f->finish();
+    return;
+  }
+  f->finish(new NumericValue(p44mbcd.shadowRegisters->getReg(addr)));
+}
+
+
+// regtxstats()
+static void regtxstats_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  if (!p44mbcd.shadowRegisters) {
+    f->finish(new AnnotatedNullValue("not a modbus slave"));
+    return;
+  }
+  f->finish(new JsonValue(p44mbcd.shadowRegisters->statistics()));
+}
+
+
+// diagnostics()
+static void diagnostics_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  f->finish(new JsonValue(p44mbcd.diagnostics->statistics()));
+}
+
+
+// screenshot(pngfile)
+static const BuiltInArgDesc screenshot_args[] = { { text } };
+static const size_t screenshot_numargs = sizeof(screenshot_args)/sizeof(BuiltInArgDesc);
+static void screenshot_func(BuiltinFunctionContextPtr f)
+{
+  ErrorPtr err = FrameBuffer::frameBuffer().writePng(f->arg(0)->stringValue());
+  if (Error::notOK(err)) {
+    f->finish(new ErrorValue(err));
+    return;
+  }
+  f->finish(new AnnotatedNullValue("screenshot written"));
+}
+
+
+// imgcache([budgetKB])
+static const BuiltInArgDesc imgcache_args[] = { { numeric|optionalarg } };
+static const size_t imgcache_numargs = sizeof(imgcache_args)/sizeof(BuiltInArgDesc);
+static void imgcache_func(BuiltinFunctionContextPtr f)
+{
+  if (f->numArgs()>0) {
+    ImageCache::cache().setBudget((size_t)f->arg(0)->intValue()*1024);
+  }
+  f->finish(new JsonValue(ImageCache::cache().statistics()));
+}
+
+
+// lazyui(config)
+// lazyui(jsonfile)
+static const BuiltInArgDesc lazyui_args[] = { { json|text } };
+static const size_t lazyui_numargs = sizeof(lazyui_args)/sizeof(BuiltInArgDesc);
+static void lazyui_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  ErrorPtr err;
+  if (f->arg(0)->hasType(text)) {
+    // screen definitions are only needed as text, do not build JsonObjects for them
+    UiCompiler::DeferredMembers screens;
+    JsonObjectPtr cfg = UiCompiler::compiler().loadDeferred(p44mbcd.dataPath(f->arg(0)->stringValue()), "screens", LazyScreens::hookKeys(), screens, err);
+    if (Error::isOK(err)) err = p44mbcd.lazyScreens->setConfig(cfg, screens);
+  }
+  else {
+    err = p44mbcd.lazyScreens->setConfig(f->arg(0)->jsonValue());
+  }
+  if (Error::notOK(err)) {
+    f->finish(new ErrorValue(err));
+    return;
+  }
+  f->finish(new JsonValue(p44mbcd.lazyScreens->statistics()));
+}
+
+
+// uijson(jsonfile)
+static const BuiltInArgDesc uijson_args[] = { { text } };
+static const size_t uijson_numargs = sizeof(uijson_args)/sizeof(BuiltInArgDesc);
+static void uijson_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  ErrorPtr err;
+  JsonObjectPtr json = UiCompiler::compiler().load(p44mbcd.dataPath(f->arg(0)->stringValue()), err);
+  if (Error::notOK(err)) {
+    f->finish(new ErrorValue(err));
+    return;
+  }
+  f->finish(new JsonValue(json));
+}
+
+
+static const lv_font_t* fontForSize(int aSize)
+{
+  switch (aSize) {
+    case 12: return &lv_font_roboto_12;
+    case 16: return &lv_font_roboto_16;
+    case 22: return &lv_font_roboto_22;
+    case 28: return &lv_font_roboto_28;
+    default: return NULL;
+  }
+}
+
+
+// valuelabel(name, x, y, format [, fontsize])
+static const BuiltInArgDesc valuelabel_args[] = { { text }, { numeric }, { numeric }, { text }, { numeric|optionalarg } };
+static const size_t valuelabel_numargs = sizeof(valuelabel_args)/sizeof(BuiltInArgDesc);
+static void valuelabel_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  ErrorPtr err = p44mbcd.valueLabels->create(
+    f->arg(0)->stringValue(), lv_scr_act(),
+    f->arg(1)->intValue(), f->arg(2)->intValue(),
+    f->numArgs()>4 ? fontForSize(f->arg(4)->intValue()) : NULL,
+    f->arg(3)->stringValue()
+  );
+  if (Error::notOK(err)) {
+    f->finish(new ErrorValue(err));
+    return;
+  }
+  f->finish();
+}
+
+
+// setvalue(name, value)
+static const BuiltInArgDesc setvalue_args[] = { { text }, { numeric } };
+static const size_t setvalue_numargs = sizeof(setvalue_args)/sizeof(BuiltInArgDesc);
+static void setvalue_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  if (!p44mbcd.valueLabels->setValue(f->arg(0)->stringValue(), f->arg(1)->doubleValue())) {
+    f->finish(new AnnotatedNullValue("no such value label"));
+    return;
+  }
+  f->finish();
+}
+
+
+// valuelabelreg(name, register [, scale [, offset [, signed]]])
+static const BuiltInArgDesc valuelabelreg_args[] = { { text }, { numeric }, { numeric|optionalarg }, { numeric|optionalarg }, { numeric|optionalarg } };
+static const size_t valuelabelreg_numargs = sizeof(valuelabelreg_args)/sizeof(BuiltInArgDesc);
+static void valuelabelreg_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  if (!p44mbcd.valueLabels->bindRegister(
+    f->arg(0)->stringValue(), f->arg(1)->intValue(),
+    f->numArgs()>4 && f->arg(4)->boolValue(),
+    f->numArgs()>2 ? f->arg(2)->doubleValue() : 1,
+    f->numArgs()>3 ? f->arg(3)->doubleValue() : 0
+  )) {
+    f->finish(new AnnotatedNullValue("no such value label"));
+    return;
+  }
+  f->finish();
+}
+
+
+// valuelabels()
+static void valuelabels_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  f->finish(new JsonValue(p44mbcd.valueLabels->statistics()));
+}
+
+
+// trendchart(name, x, y, dx, dy, min, max [, samplespercolumn [, color [, scroll]]])
+static const BuiltInArgDesc trendchart_args[] = {
+  { text }, { numeric }, { numeric }, { numeric }, { numeric }, { numeric }, { numeric },
+  { numeric|optionalarg }, { numeric|optionalarg }, { numeric|optionalarg }
+};
+static const size_t trendchart_numargs = sizeof(trendchart_args)/sizeof(BuiltInArgDesc);
+static void trendchart_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  lv_area_t a;
+  a.x1 = f->arg(1)->intValue();
+  a.y1 = f->arg(2)->intValue();
+  a.x2 = a.x1+f->arg(3)->intValue()-1;
+  a.y2 = a.y1+f->arg(4)->intValue()-1;
+  p44mbcd.trendCharts->create(
+    f->arg(0)->stringValue(), lv_scr_act(), a,
+    f->arg(5)->doubleValue(), f->arg(6)->doubleValue(),
+    f->numArgs()>7 ? f->arg(7)->intValue() : 1,
+    lv_color_hex(f->numArgs()>8 ? f->arg(8)->intValue() : 0x00FF00),
+    f->numArgs()>9 && f->arg(9)->boolValue()
+  );
+  f->finish();
+}
+
+
+// trendsample(name, value)
+static const BuiltInArgDesc trendsample_args[] = { { text }, { numeric } };
+static const size_t trendsample_numargs = sizeof(trendsample_args)/sizeof(BuiltInArgDesc);
+static void trendsample_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  if (!p44mbcd.trendCharts->addSample(f->arg(0)->stringValue(), f->arg(1)->doubleValue())) {
+    f->finish(new AnnotatedNullValue("no such trend chart"));
+    return;
+  }
+  f->finish();
+}
+
+
+// trendchartreg(name, register [, scale [, offset [, signed]]])
+static const BuiltInArgDesc trendchartreg_args[] = { { text }, { numeric }, { numeric|optionalarg }, { numeric|optionalarg }, { numeric|optionalarg } };
+static const size_t trendchartreg_numargs = sizeof(trendchartreg_args)/sizeof(BuiltInArgDesc);
+static void trendchartreg_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  if (!p44mbcd.trendCharts->bindRegister(
+    f->arg(0)->stringValue(), f->arg(1)->intValue(),
+    f->numArgs()>4 && f->arg(4)->boolValue(),
+    f->numArgs()>2 ? f->arg(2)->doubleValue() : 1,
+    f->numArgs()>3 ? f->arg(3)->doubleValue() : 0
+  )) {
+    f->finish(new AnnotatedNullValue("no such trend chart"));
+    return;
+  }
+  f->finish();
+}
+
+
+// trendcharts()
+static void trendcharts_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  f->finish(new JsonValue(p44mbcd.trendCharts->statistics()));
+}
+
+
+// staticlayer(x, y, dx, dy)
+static const BuiltInArgDesc staticlayer_args[] = { { numeric }, { numeric }, { numeric }, { numeric } };
+static const size_t staticlayer_numargs = sizeof(staticlayer_args)/sizeof(BuiltInArgDesc);
+static void staticlayer_func(BuiltinFunctionContextPtr f)
+{
+  lv_area_t a;
+  a.x1 = f->arg(0)->intValue();
+  a.y1 = f->arg(1)->intValue();
+  a.x2 = a.x1+f->arg(2)->intValue()-1;
+  a.y2 = a.y1+f->arg(3)->intValue()-1;
+  ErrorPtr err = StaticLayers::layers().createAt(a);
+  if (Error::notOK(err)) {
+    f->finish(new ErrorValue(err));
+    return;
+  }
+  f->finish();
+}
+
+
+// staticlayers([refresh])
+static const BuiltInArgDesc staticlayers_args[] = { { numeric|optionalarg } };
+static const size_t staticlayers_numargs = sizeof(staticlayers_args)/sizeof(BuiltInArgDesc);
+static void staticlayers_func(BuiltinFunctionContextPtr f)
+{
+  if (f->numArgs()>0 && f->arg(0)->boolValue()) {
+    StaticLayers::layers().refresh();
+  }
+  f->finish(new JsonValue(StaticLayers::layers().statistics()));
+}
+
+
+// renderquality([mode [, budget]])
+static const BuiltInArgDesc renderquality_args[] = { { text|optionalarg }, { numeric|optionalarg } };
+static const size_t renderquality_numargs = sizeof(renderquality_args)/sizeof(BuiltInArgDesc);
+static void renderquality_func(BuiltinFunctionContextPtr f)
+{
+  if (f->numArgs()>0) {
+    QualityGovernor::QualityMode mode;
+    if (!QualityGovernor::modeFromName(f->arg(0)->stringValue(), mode)) {
+      f->finish(new ErrorValue(TextError::err("mode must be 'auto', 'full' or 'reduced'")));
+      return;
+    }
+    QualityGovernor::governor().setMode(mode);
+  }
+  if (f->numArgs()>1) {
+    QualityGovernor::governor().setBudget(f->arg(1)->intValue());
+  }
+  f->finish(new JsonValue(QualityGovernor::governor().statistics()));
+}
+
+
+// recordinput([file])
+static const BuiltInArgDesc recordinput_args[] = { { text|optionalarg } };
+static const size_t recordinput_numargs = sizeof(recordinput_args)/sizeof(BuiltInArgDesc);
+static void recordinput_func(BuiltinFunctionContextPtr f)
+{
+  if (f->numArgs()==0) {
+    InputRecorder::recorder().stop();
+    f->finish();
+    return;
+  }
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  ErrorPtr err = InputRecorder::recorder().start(p44mbcd.dataPath(f->arg(0)->stringValue()));
+  if (Error::notOK(err)) {
+    f->finish(new ErrorValue(err));
+    return;
+  }
+  f->finish();
+}
+
+
+// replayinput(file [, speed [, loop]])
+static const BuiltInArgDesc replayinput_args[] = { { text }, { numeric|optionalarg }, { numeric|optionalarg } };
+static const size_t replayinput_numargs = sizeof(replayinput_args)/sizeof(BuiltInArgDesc);
+static void replayinput_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  if (!p44mbcd.scriptedInput) {
+    p44mbcd.scriptedInput = ScriptedInputPtr(new ScriptedInput);
+    p44mbcd.scriptedInput->install();
+  }
+  ErrorPtr err = p44mbcd.scriptedInput->loadScript(p44mbcd.dataPath(f->arg(0)->stringValue()));
+  if (Error::notOK(err)) {
+    f->finish(new ErrorValue(err));
+    return;
+  }
+  p44mbcd.scriptedInput->setSpeed(f->numArgs()>1 ? f->arg(1)->doubleValue() : 1);
+  p44mbcd.scriptedInput->start(f->numArgs()>2 && f->arg(2)->boolValue());
+  f->finish();
+}
+
+
+// showscreen(name)
+static const BuiltInArgDesc showscreen_args[] = { { text } };
+static const size_t showscreen_numargs = sizeof(showscreen_args)/sizeof(BuiltInArgDesc);
+static void showscreen_func(BuiltinFunctionContextPtr f)
+{
+  P44mbcd& p44mbcd = static_cast<P44mbcdLookup*>(f->funcObj()->getMemberLookup())->mP44mbcd;
+  ErrorPtr err = p44mbcd.lazyScreens->showScreen(f->arg(0)->stringValue());
+  if (Error::notOK(err)) {
+    f->finish(new ErrorValue(err));
+    return;
+  }
+  f->finish();
+}
+
+
 // exit(exitcode)
 static const BuiltInArgDesc exit_args[] = { { numeric } };
 static const size_t exit_numargs = sizeof(exit_args)/sizeof(BuiltInArgDesc);
@@ -900,6 +1927,27 @@ static const BuiltinMemberDescriptor p44mbcdGlobals[] = {
   { "activitytimeout", executable|null, activitytimeout_numargs, activitytimeout_args, &activitytimeout_func },
   { "backlight", executable|null, backlight_numargs, backlight_args, &backlight_func },
   { "temperature", executable|numeric, 0, NULL, &temperature_func },
+  { "committedreg", executable|numeric|null, committedreg_numargs, committedreg_args, &committedreg_func },
+  { "regtxstats", executable|json|null, 0, NULL, &regtxstats_func },
+  { "diagnostics", executable|json, 0, NULL, &diagnostics_func },
+  { "imgcache", executable|json, imgcache_numargs, imgcache_args, &imgcache_func },
+  { "lazyui", executable|json|error, lazyui_numargs, lazyui_args, &lazyui_func },
+  { "uijson", executable|json|error, uijson_numargs, uijson_args, &uijson_func },
+  { "valuelabel", executable|null|error, valuelabel_numargs, valuelabel_args, &valuelabel_func },
+  { "setvalue", executable|null, setvalue_numargs, setvalue_args, &setvalue_func },
+  { "valuelabelreg", executable|null, valuelabelreg_numargs, valuelabelreg_args, &valuelabelreg_func },
+  { "valuelabels", executable|json, 0, NULL, &valuelabels_func },
+  { "trendchart", executable|null, trendchart_numargs, trendchart_args, &trendchart_func },
+  { "trendsample", executable|null, trendsample_numargs, trendsample_args, &trendsample_func },
+  { "trendchartreg", executable|null, trendchartreg_numargs, trendchartreg_args, &trendchartreg_func },
+  { "trendcharts", executable|json, 0, NULL, &trendcharts_func },
+  { "staticlayer", executable|null|error, staticlayer_numargs, staticlayer_args, &staticlayer_func },
+  { "staticlayers", executable|json, staticlayers_numargs, staticlayers_args, &staticlayers_func },
+  { "renderquality", executable|json|error, renderquality_numargs, renderquality_args, &renderquality_func },
+  { "recordinput", executable|null|error, recordinput_numargs, recordinput_args, &recordinput_func },
+  { "replayinput", executable|null|error, replayinput_numargs, replayinput_args, &replayinput_func },
+  { "showscreen", executable|null|error, showscreen_numargs, showscreen_args, &showscreen_func },
+  { "screenshot", executable|null|error, screenshot_numargs, screenshot_args, &screenshot_func },
   { "exit", executable|null, exit_numargs, exit_args, &exit_func },
   { NULL } // terminator
 };
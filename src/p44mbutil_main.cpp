@@ -11,14 +11,22 @@
 #include "macaddress.hpp"
 #include "modbus.hpp"
 #include "utils.hpp"
+#include "snapshotcodec.hpp"
 
 #include <stdio.h>
+#include <unistd.h>
+#if !P44_BUILD_WIN
+  #include <png.h>
+#endif
 
 #define DEFAULT_MODBUS_RTU_PARAMS "115200,8,N,1" // [baud rate][,[bits][,[parity][,[stopbits][,[H]]]]]
 #define DEFAULT_MODBUS_IP_PORT 1502
 
 #define ENABLE_IRQTEST 1
 
+#define DEFAULT_SCREEN_FILENO 91 // delta snapshot, keyframe is at fileno+1
+#define SNAPSHOT_RETRIES 3
+
 using namespace p44;
 
 
@@ -45,10 +53,12 @@ public:
       "  write <addr> <value>                  : write value to modbus register/bit\n"
       "  monitor <addr> [<interval in ms>]     : monitor (constantly poll) register/bit, default interval = 200mS\n"
       "  readinfo                              : read slave info\n"
+      "  bench <addr> [<count> [<seconds>]]    : measure read request rate and latency (default: 1 register for 10 seconds)\n"
       "  flush                                 : just flush the communication channel and display number of bytes flushed\n"
       "  scan [<from> <to>]                    : scan for slaves on the bus by querying slave info\n"
       "  sendfile <path> <fileno> [<dest>...]  : send file to destination (<dest> can be ALL, idMatch or slave addresses)\n"
-      "  getfile <path> <fileno>               : get file from slave\n";
+      "  getfile <path> <fileno>               : get file from slave\n"
+      "  getscreen <pngfile> [<fileno>]        : get screen snapshot from slave and save it as PNG\n";
     const CmdLineOptionDescriptor options[] = {
       { 'i', "input",           false, "read input-only register / bit" },
       { 'b', "bit",             false, "access bit (not register)" },
@@ -282,6 +292,47 @@ public:
       if (!getIntArgument(2, fileNo) || fileNo<1 || fileNo>0xFFFF) return TextError::err("missing or invalid file number");
       return modBus.receiveFile(path, fileNo, !getOption("stdmodbusfiles"));
     }
+    else if (cmd=="getscreen") {
+      string path;
+      if (!getStringArgument(1, path)) return TextError::err("missing PNG file path");
+      int fileNo = DEFAULT_SCREEN_FILENO;
+      if (getIntArgument(2, fileNo) && (fileNo<1 || fileNo>0xFFFE)) return TextError::err("invalid file number");
+      return getScreen(path, fileNo);
+    }
+    else if (cmd=="bench") {
+      int addr;
+      if (!getIntArgument(1, addr) || addr<0 || addr>0xFFFF) return TextError::err("missing or invalid address");
+      int cnt = 1;
+      if (getIntArgument(2, cnt) && (cnt<1 || cnt>125)) return TextError::err("invalid count (1..125 allowed)");
+      int seconds = 10;
+      if (getIntArgument(3, seconds) && seconds<1) return TextError::err("invalid duration");
+      uint16_t vals[125];
+      uint8_t bits[125];
+      long requests = 0;
+      long errors = 0;
+      MLMicroSeconds maxLatency = 0;
+      MLMicroSeconds start = MainLoop::now();
+      MLMicroSeconds now = start;
+      while (!isTerminated() && now<start+seconds*Second) {
+        ErrorPtr err;
+        if (isBit) err = modBus.readBits(addr, cnt, bits, isInput);
+        else err = modBus.readRegisters(addr, cnt, vals, isInput);
+        MLMicroSeconds done = MainLoop::now();
+        if (done-now>maxLatency) maxLatency = done-now;
+        now = done;
+        requests++;
+        if (Error::notOK(err)) errors++;
+      }
+      double elapsed = (double)(now-start)/Second;
+      printf(
+        "%ld requests (%ld errors) in %.2f seconds: %.1f requests/second, avg latency %.3f mS, max latency %.3f mS\n",
+        requests, errors, elapsed,
+        elapsed>0 ? requests/elapsed : 0,
+        requests>0 ? elapsed*1000/requests : 0,
+        (double)maxLatency/MilliSecond
+      );
+      return ErrorPtr();
+    }
     else if (cmd=="flush") {
       modBus.connect(false); // prevent implicit flush
       int f = modBus.flush(); // now explicitly flush
@@ -292,6 +343,82 @@ public:
     return TextError::err("unknown command '%s'", cmd.c_str());
   }
 
+
+  /// get screen snapshot delta, and keyframe only if the one we have cached is not the one the delta is based on
+  ErrorPtr getScreen(const string aPngPath, int aFileNo)
+  {
+    bool p44files = !getOption("stdmodbusfiles");
+    string keyPath = aPngPath+".key";
+    string deltaPath = aPngPath+".delta";
+    ErrorPtr err;
+    for (int attempt=0; attempt<SNAPSHOT_RETRIES; attempt++) {
+      string delta;
+      SnapshotCodec::Header dh;
+      err = modBus.receiveFile(deltaPath, aFileNo, p44files);
+      if (Error::isOK(err)) err = string_fromfile(deltaPath, delta);
+      if (Error::isOK(err)) err = SnapshotCodec::decodeHeader(delta, dh);
+      unlink(deltaPath.c_str());
+      if (Error::notOK(err)) return err;
+      string key;
+      SnapshotCodec::Header kh;
+      bool keyRead = false;
+      if (
+        Error::notOK(string_fromfile(keyPath, key)) ||
+        Error::notOK(SnapshotCodec::decodeHeader(key, kh)) ||
+        kh.seq!=dh.keySeq || kh.width!=dh.width || kh.height!=dh.height || kh.tileSize!=dh.tileSize
+      ) {
+        // need the keyframe
+        err = modBus.receiveFile(keyPath, aFileNo+1, p44files);
+        if (Error::isOK(err)) err = string_fromfile(keyPath, key);
+        if (Error::isOK(err)) err = SnapshotCodec::decodeHeader(key, kh);
+        if (Error::notOK(err)) return err;
+        if (kh.seq!=dh.keySeq) continue; // keyframe changed since we read the delta, try again
+        keyRead = true;
+      }
+      std::vector<uint16_t> pixels(dh.width*dh.height, 0);
+      err = SnapshotCodec::decodeTiles(key, &pixels[0]);
+      if (Error::isOK(err)) err = SnapshotCodec::decodeTiles(delta, &pixels[0]);
+      if (Error::isOK(err)) err = writePng(aPngPath, dh.width, dh.height, pixels);
+      if (Error::notOK(err)) return err;
+      printf(
+        "Screen %dx%d, snapshot #%u: %zu bytes delta (%d tiles), %s, saved to %s\n",
+        dh.width, dh.height, dh.seq, delta.size(), dh.numTiles,
+        keyRead ? string_format("%zu bytes keyframe", key.size()).c_str() : "cached keyframe",
+        aPngPath.c_str()
+      );
+      return ErrorPtr();
+    }
+    return TextError::err("screen changes too fast, could not get a consistent snapshot");
+  }
+
+
+  ErrorPtr writePng(const string aPngPath, int aWidth, int aHeight, const std::vector<uint16_t> &aPixels)
+  {
+    #if P44_BUILD_WIN
+    return TextError::err("PNG output not supported on this platform");
+    #else
+    std::vector<uint8_t> rgb(aWidth*aHeight*3);
+    uint8_t* d = &rgb[0];
+    for (size_t i=0; i<aPixels.size(); i++) {
+      // RGB565 -> RGB888
+      uint16_t px = aPixels[i];
+      *d++ = ((px>>11) & 0x1F)*255/31;
+      *d++ = ((px>>5) & 0x3F)*255/63;
+      *d++ = (px & 0x1F)*255/31;
+    }
+    png_image image;
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    image.width = aWidth;
+    image.height = aHeight;
+    image.format = PNG_FORMAT_RGB;
+    if (!png_image_write_to_file(&image, aPngPath.c_str(), 0, &rgb[0], 0, NULL)) {
+      return TextError::err("cannot write PNG '%s': %s", aPngPath.c_str(), image.message);
+    }
+    return ErrorPtr();
+    #endif
+  }
+
 };
 
 
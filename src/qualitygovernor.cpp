@@ -0,0 +1,218 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "qualitygovernor.hpp"
+#include "displaytap.hpp"
+
+using namespace p44;
+
+#define RESTORE_DELAY (500*MilliSecond) // restore full quality after being idle that long
+
+static QualityGovernor* qualityGovernorP = NULL;
+
+
+QualityGovernor::QualityGovernor() :
+  display(NULL),
+  fullAntialiasing(false),
+  mode(quality_auto),
+  budget(0),
+  reduced(false),
+  repainting(false),
+  lastFrames(0),
+  lastPressure(Never),
+  reducedSince(Never),
+  reductions(0),
+  overBudgetFrames(0),
+  reducedTime(0)
+{
+}
+
+
+QualityGovernor& QualityGovernor::governor()
+{
+  if (!qualityGovernorP) {
+    qualityGovernorP = new QualityGovernor;
+  }
+  return *qualityGovernorP;
+}
+
+
+void QualityGovernor::install(lv_disp_t* aDisplay, uint32_t aBudget)
+{
+  if (display || !aDisplay) return; // already installed or no display
+  display = aDisplay;
+  fullAntialiasing = display->driver.antialiasing;
+  budget = aBudget;
+  lastFrames = DisplayTap::tap().getFrames();
+}
+
+
+void QualityGovernor::cycle()
+{
+  if (!display || mode!=quality_auto) return;
+  MLMicroSeconds now = MainLoop::now();
+  if (underPressure()) {
+    lastPressure = now;
+    if (!reduced) reduceQuality();
+  }
+  else if (reduced && now>lastPressure+RESTORE_DELAY) {
+    restoreQuality();
+  }
+}
+
+
+bool QualityGovernor::underPressure()
+{
+  // only actual frame times count: running animations or dragging are no pressure as long as
+  // frames are fast enough (e.g. infinite animations would otherwise keep quality reduced forever)
+  long frames = DisplayTap::tap().getFrames();
+  if (frames==lastFrames) return false; // nothing rendered
+  lastFrames = frames;
+  if (repainting) {
+    // this is the full quality repaint after restoring, which is expected to be slow
+    repainting = false;
+    return false;
+  }
+  if (budget>0 && DisplayTap::tap().getLastFrameTime()>budget) {
+    overBudgetFrames++;
+    return true;
+  }
+  return false;
+}
+
+
+void QualityGovernor::setMode(QualityMode aMode)
+{
+  mode = aMode;
+  if (!display) return;
+  if (mode==quality_reduced && !reduced) reduceQuality();
+  else if (mode!=quality_reduced && reduced) restoreQuality();
+}
+
+
+// MARK: - quality switching
+
+void QualityGovernor::reduceQuality()
+{
+  reduced = true;
+  repainting = false;
+  reducedSince = MainLoop::now();
+  reductions++;
+  display->driver.antialiasing = 0;
+  disableShadows(lv_disp_get_scr_act(display));
+  disableShadows(lv_disp_get_layer_top(display));
+  LOG(LOG_DEBUG, "rendering quality reduced, %zu styles with shadows", shadowless.size());
+}
+
+
+void QualityGovernor::disableShadows(lv_obj_t* aObj)
+{
+  if (!aObj) return;
+  // styles might be shared with other objects or owned by someone else: use a shadowless copy
+  const lv_style_t* style = aObj->style_p;
+  if (style && style->body.shadow.width>0 && originals.find(const_cast<lv_style_t*>(style))==originals.end()) {
+    lv_style_t* copy;
+    StyleMap::iterator pos = shadowless.find(style);
+    if (pos!=shadowless.end()) {
+      copy = pos->second;
+    }
+    else {
+      copy = new lv_style_t;
+      lv_style_copy(copy, style);
+      copy->body.shadow.width = 0;
+      shadowless[style] = copy;
+      originals[copy] = const_cast<lv_style_t*>(style);
+    }
+    lv_obj_set_style(aObj, copy);
+  }
+  lv_obj_t* child = NULL;
+  while ((child = lv_obj_get_child(aObj, child))) disableShadows(child);
+}
+
+
+void QualityGovernor::restoreShadows(lv_obj_t* aObj)
+{
+  if (!aObj) return;
+  StyleMap::iterator pos = originals.find(const_cast<lv_style_t*>(aObj->style_p));
+  if (pos!=originals.end()) lv_obj_set_style(aObj, pos->second);
+  lv_obj_t* child = NULL;
+  while ((child = lv_obj_get_child(aObj, child))) restoreShadows(child);
+}
+
+
+void QualityGovernor::restoreQuality()
+{
+  reduced = false;
+  reducedTime += MainLoop::now()-reducedSince;
+  display->driver.antialiasing = fullAntialiasing;
+  // every object still using a shadowless copy gets its original style back (deleted objects don't matter,
+  // as the original styles themselves were never touched)
+  lv_obj_t* scr = (lv_obj_t*)lv_ll_get_head(&display->scr_ll);
+  while (scr) {
+    restoreShadows(scr);
+    scr = (lv_obj_t*)lv_ll_get_next(&display->scr_ll, scr);
+  }
+  restoreShadows(lv_disp_get_layer_top(display));
+  restoreShadows(lv_disp_get_layer_sys(display));
+  for (StyleMap::iterator pos = originals.begin(); pos!=originals.end(); ++pos) delete pos->first;
+  originals.clear();
+  shadowless.clear();
+  // repaint everything in full quality
+  lv_obj_invalidate(lv_disp_get_scr_act(display));
+  lv_obj_invalidate(lv_disp_get_layer_top(display));
+  repainting = true;
+  LOG(LOG_DEBUG, "full rendering quality restored");
+}
+
+
+// MARK: - modes and statistics
+
+const char* QualityGovernor::modeName(QualityMode aMode)
+{
+  switch (aMode) {
+    case quality_full: return "full";
+    case quality_reduced: return "reduced";
+    default: return "auto";
+  }
+}
+
+
+bool QualityGovernor::modeFromName(const string aName, QualityMode &aMode)
+{
+  if (aName=="auto") aMode = quality_auto;
+  else if (aName=="full") aMode = quality_full;
+  else if (aName=="reduced") aMode = quality_reduced;
+  else return false;
+  return true;
+}
+
+
+JsonObjectPtr QualityGovernor::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("mode", JsonObject::newString(modeName(mode)));
+  s->add("budget", JsonObject::newInt32(budget));
+  s->add("reduced", JsonObject::newBool(reduced));
+  s->add("reductions", JsonObject::newInt64(reductions));
+  s->add("overBudgetFrames", JsonObject::newInt64(overBudgetFrames));
+  MLMicroSeconds t = reducedTime;
+  if (reduced) t += MainLoop::now()-reducedSince;
+  s->add("reducedTime", JsonObject::newDouble((double)t/Second));
+  return s;
+}
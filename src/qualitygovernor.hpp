@@ -0,0 +1,116 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__qualitygovernor__
+#define __p44mbcd__qualitygovernor__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+namespace p44 {
+
+  /// Reduces rendering quality at runtime while the display is under pressure (frames exceeding
+  /// the frame time budget), and restores full quality once frames are fast enough again.
+  /// Reduced quality means: no antialiasing of rounded corners, borders, lines and arcs (text
+  /// is not affected, as glyph smoothing is part of the font data), and no shadows. Shadows are
+  /// removed by giving objects a shadowless copy of their style, shared styles are never modified.
+  class QualityGovernor : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+  public:
+
+    typedef enum {
+      quality_auto, ///< reduce under pressure, restore when idle
+      quality_full, ///< always full quality
+      quality_reduced ///< always reduced quality
+    } QualityMode;
+
+  private:
+
+    lv_disp_t* display; ///< the display
+    bool fullAntialiasing; ///< the display's antialiasing setting for full quality
+    QualityMode mode; ///< current mode
+    uint32_t budget; ///< frame time budget in mS, 0 = none
+    bool reduced; ///< set while quality is reduced
+    bool repainting; ///< set while the full quality repaint after restoring is pending
+    long lastFrames; ///< frame count at last check
+    MLMicroSeconds lastPressure; ///< last time the display was under pressure
+    MLMicroSeconds reducedSince; ///< when quality was reduced
+    typedef std::map<const lv_style_t*, lv_style_t*> StyleMap;
+    StyleMap shadowless; ///< original styles with shadows and their shadowless copies
+    StyleMap originals; ///< shadowless copies and the original styles they replace
+
+    // statistics
+    long reductions; ///< number of times quality was reduced
+    long overBudgetFrames; ///< number of frames exceeding the budget
+    MLMicroSeconds reducedTime; ///< total time spent in reduced quality
+
+  public:
+
+    QualityGovernor();
+
+    /// get the shared instance
+    static QualityGovernor& governor();
+
+    /// start governing a display
+    /// @param aDisplay the display, usually lv_disp_get_default()
+    /// @param aBudget frame time budget in mS, 0 to never reduce quality automatically
+    void install(lv_disp_t* aDisplay, uint32_t aBudget);
+
+    /// to be called once per littlevGL cycle, after lv_task_handler()
+    void cycle();
+
+    /// set the mode
+    /// @param aMode new mode
+    void setMode(QualityMode aMode);
+
+    /// set the frame time budget
+    /// @param aBudget frame time budget in mS, 0 for none (no automatic reduction)
+    void setBudget(uint32_t aBudget) { budget = aBudget; };
+
+    /// @return true while quality is reduced
+    bool isReduced() { return reduced; };
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+    /// @return name of the mode
+    static const char* modeName(QualityMode aMode);
+
+    /// @param aName name of a mode
+    /// @param aMode will be set to the mode
+    /// @return false if name is not a valid mode name
+    static bool modeFromName(const string aName, QualityMode &aMode);
+
+  private:
+
+    bool underPressure();
+    void reduceQuality();
+    void restoreQuality();
+    void disableShadows(lv_obj_t* aObj);
+    void restoreShadows(lv_obj_t* aObj);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__qualitygovernor__) */
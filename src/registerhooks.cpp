@@ -0,0 +1,121 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "registerhooks.hpp"
+
+using namespace p44;
+
+
+RegisterHooks::RegisterHooks(ModbusSlavePtr aModbusSlave) :
+  modbusSlave(aModbusSlave),
+  cacheHits(0),
+  cacheMisses(0)
+{
+  for (int i=0; i<numSpaces; i++) spaces[i].base = 0;
+}
+
+
+void RegisterHooks::addHandler(int aAddress, int aCount, bool aBit, bool aInput, ReadHandler aReadHandler, WriteHandler aWriteHandler, MLMicroSeconds aMaxAge)
+{
+  if (aCount<1) return;
+  Space &s = spaces[aBit ? (aInput ? space_inputbits : space_coils) : (aInput ? space_inputregisters : space_registers)];
+  // extend the index table to cover the new range
+  if (s.index.empty()) {
+    s.base = aAddress;
+  }
+  else if (aAddress<s.base) {
+    s.index.insert(s.index.begin(), s.base-aAddress, 0);
+    s.base = aAddress;
+  }
+  size_t needed = aAddress+aCount-s.base;
+  if (s.index.size()<needed) s.index.resize(needed, 0);
+  // add the hook
+  Hook h;
+  h.readHandler = aReadHandler;
+  h.writeHandler = aWriteHandler;
+  h.first = aAddress;
+  h.maxAge = aMaxAge;
+  h.evaluated = Never;
+  h.version = 1;
+  h.cachedVersion = 0;
+  if (aMaxAge>0) h.cache.resize(aCount, 0);
+  hooks.push_back(h);
+  uint16_t hookIdx = hooks.size(); // index+1
+  for (int i=0; i<aCount; i++) s.index[aAddress-s.base+i] = hookIdx;
+}
+
+
+RegisterHooks::Hook* RegisterHooks::hookFor(int aAddress, bool aBit, bool aInput)
+{
+  const Space &s = spaces[aBit ? (aInput ? space_inputbits : space_coils) : (aInput ? space_inputregisters : space_registers)];
+  size_t i = aAddress-s.base;
+  if (aAddress<s.base || i>=s.index.size() || s.index[i]==0) return NULL;
+  return &hooks[s.index[i]-1];
+}
+
+
+ErrorPtr RegisterHooks::access(int aAddress, bool aBit, bool aInput, bool aWrite, bool &aHandled)
+{
+  aHandled = false;
+  Hook* h = hookFor(aAddress, aBit, aInput);
+  if (!h) return ErrorPtr();
+  if (aWrite) {
+    h->version++; // written value might affect what the read handler returns
+    if (!h->writeHandler) return ErrorPtr();
+    aHandled = true;
+    return h->writeHandler(aAddress, modbusSlave->getValue(aAddress, aBit, aInput));
+  }
+  if (!h->readHandler) return ErrorPtr();
+  aHandled = true;
+  if (h->maxAge<=0) {
+    modbusSlave->setValue(aAddress, aBit, aInput, h->readHandler(aAddress));
+    return ErrorPtr();
+  }
+  MLMicroSeconds now = MainLoop::now();
+  if (h->cachedVersion!=h->version || now>h->evaluated+h->maxAge) {
+    // evaluate the entire range
+    cacheMisses++;
+    for (size_t i=0; i<h->cache.size(); i++) h->cache[i] = h->readHandler(h->first+(int)i);
+    h->evaluated = now;
+    h->cachedVersion = h->version;
+  }
+  else {
+    cacheHits++;
+  }
+  modbusSlave->setValue(aAddress, aBit, aInput, h->cache[aAddress-h->first]);
+  return ErrorPtr();
+}
+
+
+void RegisterHooks::invalidate(int aAddress, bool aBit, bool aInput)
+{
+  Hook* h = hookFor(aAddress, aBit, aInput);
+  if (h) h->version++;
+}
+
+
+JsonObjectPtr RegisterHooks::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("cacheHits", JsonObject::newInt64(cacheHits));
+  s->add("cacheMisses", JsonObject::newInt64(cacheMisses));
+  long total = cacheHits+cacheMisses;
+  s->add("cacheHitRate", JsonObject::newDouble(total>0 ? (double)cacheHits/total : 0));
+  return s;
+}
@@ -0,0 +1,126 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__registerhooks__
+#define __p44mbcd__registerhooks__
+
+#include "p44utils_common.hpp"
+#include "modbus.hpp"
+#include "jsonobject.hpp"
+
+namespace p44 {
+
+  /// Per-address dispatch table for native register/bit access handlers.
+  /// All lookup structures are built at registration time, dispatching an access is a
+  /// range check plus one indexed table lookup and does not allocate.
+  class RegisterHooks : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+  public:
+
+    /// called before a register or bit is read by the master
+    /// @param aAddress the address being read
+    /// @return the value to be placed into the register/bit for the master to read
+    typedef boost::function<uint16_t (int aAddress)> ReadHandler;
+
+    /// called after a register or bit has been written by the master
+    /// @param aAddress the address written
+    /// @param aValue the value written
+    /// @return error to be reported as modbus exception, if any
+    typedef boost::function<ErrorPtr (int aAddress, uint16_t aValue)> WriteHandler;
+
+  private:
+
+    enum {
+      space_coils,
+      space_inputbits,
+      space_registers,
+      space_inputregisters,
+      numSpaces
+    };
+
+    struct Hook {
+      ReadHandler readHandler;
+      WriteHandler writeHandler;
+      int first; ///< first address of the range served by this hook
+      MLMicroSeconds maxAge; ///< how long evaluated values may be served from cache, 0 = no caching
+      MLMicroSeconds evaluated; ///< when the cached values were evaluated
+      uint32_t version; ///< bumped to invalidate the cached values
+      uint32_t cachedVersion; ///< version the cached values were evaluated for
+      std::vector<uint16_t> cache; ///< cached values for the entire range
+    };
+    typedef std::vector<Hook> HookVector;
+
+    struct Space {
+      int base; ///< address corresponding to index[0]
+      std::vector<uint16_t> index; ///< per address index+1 into hooks, 0 = no hook
+    };
+
+    ModbusSlavePtr modbusSlave;
+    HookVector hooks;
+    Space spaces[numSpaces];
+
+    long cacheHits; ///< number of reads served from cache
+    long cacheMisses; ///< number of reads that needed evaluation
+
+    Hook* hookFor(int aAddress, bool aBit, bool aInput);
+
+  public:
+
+    RegisterHooks(ModbusSlavePtr aModbusSlave);
+
+    /// install native handlers for a single register/bit or a range
+    /// @param aAddress first address
+    /// @param aCount number of addresses
+    /// @param aBit true for coils/input bits, false for registers
+    /// @param aInput true for read-only input bits/registers
+    /// @param aReadHandler handler providing the value on read, can be NULL
+    /// @param aWriteHandler handler called after write, can be NULL
+    /// @param aMaxAge if >0, the read handler evaluates the entire range at once, and the values are
+    ///   served from cache for reads within aMaxAge unless invalidated. This also makes multi-register
+    ///   values consistent across the registers of the range.
+    /// @note registering again for the same address replaces the previous handler
+    void addHandler(int aAddress, int aCount, bool aBit, bool aInput, ReadHandler aReadHandler, WriteHandler aWriteHandler = WriteHandler(), MLMicroSeconds aMaxAge = 0);
+
+    /// invalidate cached values of the range containing the given address
+    /// @note master writes invalidate automatically, this must be called when a register is changed locally
+    /// @param aAddress address within the range
+    /// @param aBit true for bits
+    /// @param aInput true for input bits/registers
+    void invalidate(int aAddress, bool aBit, bool aInput);
+
+    /// @return cache statistics as JSON object
+    JsonObjectPtr statistics();
+
+    /// dispatch an access, to be called from the slave's value access handler
+    /// @param aAddress the address accessed
+    /// @param aBit true for bits
+    /// @param aInput true for input bits/registers
+    /// @param aWrite true for write accesses
+    /// @param aHandled is set to true if a handler was found for this address
+    /// @return error from write handler, if any
+    ErrorPtr access(int aAddress, bool aBit, bool aInput, bool aWrite, bool &aHandled);
+
+  };
+  typedef boost::intrusive_ptr<RegisterHooks> RegisterHooksPtr;
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__registerhooks__) */
@@ -0,0 +1,243 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "registerpersistence.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace p44;
+
+#define SNAPSHOT_MAGIC 0x52343450 // "P44R"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t numRanges;
+} SnapshotHeader;
+
+typedef struct {
+  uint16_t first;
+  uint16_t count;
+  uint8_t input;
+  uint8_t reserved[3];
+} SnapshotRange;
+
+
+RegisterPersistence::RegisterPersistence(ModbusSlavePtr aModbusSlave) :
+  modbusSlave(aModbusSlave),
+  numValues(0),
+  snapshotFd(-1),
+  mapP(NULL),
+  mapSize(0),
+  valuesP(NULL),
+  flushInterval(Never),
+  flushPending(false)
+{
+}
+
+
+RegisterPersistence::~RegisterPersistence()
+{
+  close();
+}
+
+
+ErrorPtr RegisterPersistence::addRanges(const string aRangeSpec)
+{
+  if (mapP) return TextError::err("cannot add ranges after snapshot is open");
+  const char *p = aRangeSpec.c_str();
+  string part;
+  while (nextPart(p, part, ',')) {
+    Range r;
+    r.input = false;
+    const char *rp = part.c_str();
+    if (*rp=='i' || *rp=='I') {
+      r.input = true;
+      rp++;
+    }
+    int first, last;
+    int n = sscanf(rp, "%d-%d", &first, &last);
+    if (n==1) last = first;
+    else if (n!=2) return TextError::err("invalid register range '%s'", part.c_str());
+    if (first<0 || last>0xFFFF || last<first) return TextError::err("invalid register range '%s'", part.c_str());
+    r.first = first;
+    r.count = last-first+1;
+    r.valueIdx = numValues;
+    numValues += r.count;
+    ranges.push_back(r);
+  }
+  return ErrorPtr();
+}
+
+
+ErrorPtr RegisterPersistence::open(const string aFilePath, MLMicroSeconds aFlushInterval)
+{
+  if (mapP) close();
+  filePath = aFilePath;
+  flushInterval = aFlushInterval;
+  snapshotFd = ::open(filePath.c_str(), O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if (snapshotFd<0) return SysError::errNo("cannot open register snapshot: ");
+  // read the previous snapshot, if any
+  string oldImage;
+  struct stat st;
+  if (fstat(snapshotFd, &st)==0 && st.st_size>0) {
+    oldImage.resize(st.st_size);
+    ssize_t n = pread(snapshotFd, &oldImage[0], st.st_size, 0);
+    oldImage.resize(n>0 ? n : 0);
+  }
+  // resize for the current layout. Not truncating to 0 first: if we crash before the new layout is
+  // written, the old snapshot is still there (or at least the part fitting the new size)
+  mapSize = sizeof(SnapshotHeader) + ranges.size()*sizeof(SnapshotRange) + numValues*sizeof(uint16_t);
+  if (ftruncate(snapshotFd, mapSize)<0) {
+    ErrorPtr err = SysError::errNo("cannot size register snapshot: ");
+    ::close(snapshotFd);
+    snapshotFd = -1;
+    return err;
+  }
+  void *m = mmap(NULL, mapSize, PROT_READ|PROT_WRITE, MAP_SHARED, snapshotFd, 0);
+  if (m==MAP_FAILED) {
+    ErrorPtr err = SysError::errNo("cannot map register snapshot: ");
+    ::close(snapshotFd);
+    snapshotFd = -1;
+    return err;
+  }
+  mapP = (uint8_t *)m;
+  SnapshotHeader* hdrP = (SnapshotHeader*)mapP;
+  hdrP->magic = SNAPSHOT_MAGIC;
+  hdrP->version = SNAPSHOT_VERSION;
+  hdrP->numRanges = ranges.size();
+  SnapshotRange* srP = (SnapshotRange*)(mapP+sizeof(SnapshotHeader));
+  for (RangeVector::iterator pos = ranges.begin(); pos!=ranges.end(); ++pos, ++srP) {
+    memset(srP, 0, sizeof(SnapshotRange));
+    srP->first = pos->first;
+    srP->count = pos->count;
+    srP->input = pos->input;
+  }
+  valuesP = (uint16_t*)srP;
+  // capture current register state (this also overwrites all old values), then restore what the previous snapshot had
+  updateSnapshot();
+  restoreFrom((const uint8_t*)oldImage.c_str(), oldImage.size());
+  msync(mapP, mapSize, MS_SYNC);
+  return ErrorPtr();
+}
+
+
+void RegisterPersistence::restoreFrom(const uint8_t* aOldImageP, size_t aOldSize)
+{
+  if (aOldSize<sizeof(SnapshotHeader)) return; // no previous snapshot
+  const SnapshotHeader* oldHdrP = (const SnapshotHeader*)aOldImageP;
+  if (oldHdrP->magic!=SNAPSHOT_MAGIC || oldHdrP->version!=SNAPSHOT_VERSION) {
+    LOG(LOG_WARNING, "register snapshot '%s' has unknown format -> not restored", filePath.c_str());
+    return;
+  }
+  size_t oldValuesOffset = sizeof(SnapshotHeader) + oldHdrP->numRanges*sizeof(SnapshotRange);
+  if (aOldSize<oldValuesOffset) return; // truncated
+  const SnapshotRange* oldRangesP = (const SnapshotRange*)(aOldImageP+sizeof(SnapshotHeader));
+  const uint16_t* oldValuesP = (const uint16_t*)(aOldImageP+oldValuesOffset);
+  size_t oldNumValues = (aOldSize-oldValuesOffset)/sizeof(uint16_t);
+  int restored = 0;
+  for (RangeVector::iterator pos = ranges.begin(); pos!=ranges.end(); ++pos) {
+    // only restore ranges that were persisted with identical extent
+    size_t oldIdx = 0;
+    for (int i=0; i<oldHdrP->numRanges; i++) {
+      const SnapshotRange& oldRange = oldRangesP[i];
+      if (oldRange.first==pos->first && oldRange.count==pos->count && (bool)oldRange.input==pos->input) {
+        if (oldIdx+oldRange.count<=oldNumValues) {
+          for (int r=0; r<pos->count; r++) {
+            uint16_t v = oldValuesP[oldIdx+r];
+            valuesP[pos->valueIdx+r] = v;
+            modbusSlave->setReg(pos->first+r, pos->input, v);
+          }
+          restored += pos->count;
+        }
+        break;
+      }
+      oldIdx += oldRange.count;
+    }
+  }
+  LOG(LOG_NOTICE, "restored %d of %zu persistent registers from '%s'", restored, numValues, filePath.c_str());
+}
+
+
+bool RegisterPersistence::updateSnapshot()
+{
+  bool changed = false;
+  if (!valuesP) return false;
+  for (RangeVector::iterator pos = ranges.begin(); pos!=ranges.end(); ++pos) {
+    uint16_t* vP = valuesP+pos->valueIdx;
+    for (int r=0; r<pos->count; r++, vP++) {
+      uint16_t v = modbusSlave->getReg(pos->first+r, pos->input);
+      if (v!=*vP) {
+        *vP = v;
+        changed = true;
+      }
+    }
+  }
+  return changed;
+}
+
+
+void RegisterPersistence::changed()
+{
+  if (flushPending || !mapP || flushInterval<=0 || flushInterval==Never) return;
+  flushPending = true;
+  flushTicket.executeOnce(boost::bind(&RegisterPersistence::flushTimer, this), flushInterval);
+}
+
+
+void RegisterPersistence::flushTimer()
+{
+  flushPending = false;
+  if (updateSnapshot()) {
+    // let the kernel write back the dirty page(s) without blocking the mainloop
+    msync(mapP, mapSize, MS_ASYNC);
+    LOG(LOG_DEBUG, "register snapshot updated");
+  }
+  // not re-armed, next write will do that
+}
+
+
+void RegisterPersistence::flush()
+{
+  if (!mapP) return;
+  updateSnapshot();
+  msync(mapP, mapSize, MS_SYNC);
+}
+
+
+void RegisterPersistence::close()
+{
+  flushTicket.cancel();
+  flushPending = false;
+  if (mapP) {
+    flush();
+    munmap(mapP, mapSize);
+    mapP = NULL;
+    valuesP = NULL;
+    mapSize = 0;
+  }
+  if (snapshotFd>=0) {
+    ::close(snapshotFd);
+    snapshotFd = -1;
+  }
+}
@@ -0,0 +1,99 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__registerpersistence__
+#define __p44mbcd__registerpersistence__
+
+#include "p44utils_common.hpp"
+#include "modbus.hpp"
+
+namespace p44 {
+
+  /// Keeps a snapshot of selected register ranges of a ModbusSlave in a memory mapped file,
+  /// so the last known values can be restored at startup before the slave starts answering requests.
+  /// @note register writes only arm a timer (see changed()), which then compares the live registers with
+  ///   the snapshot. Any number of writes within one flush interval result in a single update of the file,
+  ///   and nothing wakes up while no registers are written.
+  class RegisterPersistence : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    struct Range {
+      uint16_t first; ///< first register address
+      uint16_t count; ///< number of registers
+      bool input; ///< set for input registers
+      size_t valueIdx; ///< index of the first value in the snapshot's value area
+    };
+    typedef std::vector<Range> RangeVector;
+
+    ModbusSlavePtr modbusSlave; ///< the slave whose registers are persisted
+    RangeVector ranges; ///< the ranges to persist
+    size_t numValues; ///< total number of persisted registers
+
+    string filePath; ///< path of the snapshot file
+    int snapshotFd; ///< fd of the snapshot file
+    uint8_t* mapP; ///< the mapped snapshot file
+    size_t mapSize; ///< size of the mapping
+    uint16_t* valuesP; ///< the value area within the mapped file
+
+    MLMicroSeconds flushInterval; ///< interval for checking for changes and flushing the snapshot
+    MLTicket flushTicket; ///< timer for the next flush, armed by changed()
+    bool flushPending; ///< set while flushTicket is armed
+
+  public:
+
+    RegisterPersistence(ModbusSlavePtr aModbusSlave);
+    virtual ~RegisterPersistence();
+
+    /// add register ranges to be persisted
+    /// @param aRangeSpec comma separated list of ranges in the form `first[-last]`, prefix `i` for input registers
+    /// @return error when range specification is invalid
+    /// @note must be called before open()
+    ErrorPtr addRanges(const string aRangeSpec);
+
+    /// open (or create) the snapshot file, restore the values it contains for the configured ranges
+    /// and start monitoring the registers for changes
+    /// @param aFilePath path of the snapshot file
+    /// @param aFlushInterval registers are compared with the snapshot at most this often
+    /// @return error if the snapshot file cannot be created or mapped
+    ErrorPtr open(const string aFilePath, MLMicroSeconds aFlushInterval);
+
+    /// to be called when registers might have changed, to update the snapshot within the flush interval
+    /// @note writes not reported here (such as modbus.setreg() from scripts) are picked up with the next
+    ///   flush caused by another write, or at close()
+    void changed();
+
+    /// update the snapshot from the current register values now, and make sure it is on disk
+    void flush();
+
+    /// flush and close the snapshot file
+    void close();
+
+  private:
+
+    void restoreFrom(const uint8_t* aOldImageP, size_t aOldSize);
+    bool updateSnapshot();
+    void flushTimer();
+
+  };
+  typedef boost::intrusive_ptr<RegisterPersistence> RegisterPersistencePtr;
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__registerpersistence__) */
@@ -0,0 +1,346 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "remotedisplay.hpp"
+#include "screenmirror.hpp"
+
+using namespace p44;
+
+#define POINTER_MSG_SIZE 6
+#define AUTH_TIMEOUT (5*Second)
+
+static RemoteDisplay* remoteDisplayP = NULL;
+
+
+RemoteDisplay::RemoteDisplay() :
+  observer(-1),
+  pointerX(0),
+  pointerY(0),
+  authenticated(false),
+  minFrameInterval(100*MilliSecond),
+  framePending(false),
+  lastFrame(Never),
+  seq(0),
+  connections(0),
+  connectedSince(Never),
+  frames(0),
+  deferredFrames(0),
+  bytesSent(0),
+  sessionBytes(0),
+  rawBytes(0),
+  inputEvents(0),
+  rejectedClients(0),
+  encodeTime(0)
+{
+}
+
+
+RemoteDisplay& RemoteDisplay::remote()
+{
+  if (!remoteDisplayP) {
+    remoteDisplayP = new RemoteDisplay;
+  }
+  return *remoteDisplayP;
+}
+
+
+ErrorPtr RemoteDisplay::start(const string aPort, int aMaxFps, bool aNonLocal, const string aSecret)
+{
+  if (server) return ErrorPtr(); // already running
+  if (!ScreenMirror::mirror().isInstalled()) return TextError::err("no screen mirror");
+  if (aNonLocal && aSecret.empty()) return TextError::err("non-local connections require a secret");
+  if (aSecret.size()>255) return TextError::err("secret must not be longer than 255 characters");
+  secret = aSecret;
+  if (aMaxFps<1) aMaxFps = 1;
+  minFrameInterval = Second/aMaxFps;
+  observer = ScreenMirror::mirror().addObserver(boost::bind(&RemoteDisplay::mirrorChanged, this));
+  pointer = ScriptedInputPtr(new ScriptedInput);
+  pointer->install();
+  server = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+  server->setConnectionParams(NULL, aPort.c_str(), SOCK_STREAM, AF_INET);
+  server->setAllowNonlocalConnections(aNonLocal);
+  ErrorPtr err = server->startServer(boost::bind(&RemoteDisplay::clientConnected, this, _1), 1);
+  if (Error::notOK(err)) {
+    server.reset();
+    return err;
+  }
+  LOG(LOG_NOTICE,
+    "remote display server listening on port %s for %s connections%s, max %d frames/second",
+    aPort.c_str(), aNonLocal ? "all" : "local", secret.empty() ? "" : " with secret", aMaxFps
+  );
+  return ErrorPtr();
+}
+
+
+// MARK: - connection
+
+SocketCommPtr RemoteDisplay::clientConnected(SocketCommPtr aServerSocketComm)
+{
+  if (client) {
+    LOG(LOG_WARNING, "remote display: already have a client, rejecting new connection");
+    return SocketCommPtr();
+  }
+  client = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+  client->setConnectionStatusHandler(boost::bind(&RemoteDisplay::connectionStatus, this, _1, _2));
+  client->setReceiveHandler(boost::bind(&RemoteDisplay::dataReceived, this, _1));
+  connections++;
+  connectedSince = MainLoop::now();
+  sessionBytes = 0;
+  txBuffer.clear();
+  rxBuffer.clear();
+  authenticated = false;
+  if (secret.empty()) {
+    startStreaming();
+  }
+  else {
+    // nothing is sent and no input is accepted before the client has sent the secret
+    authTicket.executeOnce(boost::bind(&RemoteDisplay::authTimeout, this), AUTH_TIMEOUT);
+  }
+  LOG(LOG_NOTICE, "remote display: client connected");
+  return client;
+}
+
+
+void RemoteDisplay::startStreaming()
+{
+  authenticated = true;
+  seq = 0; // start with keyframe
+  tiles.assign(ScreenMirror::mirror().getGeometry().numTiles, true);
+  ScreenMirror::mirror().setActive(observer, true); // re-renders everything
+  scheduleFrame();
+}
+
+
+void RemoteDisplay::authTimeout()
+{
+  LOG(LOG_WARNING, "remote display: client did not authenticate in time");
+  rejectedClients++;
+  disconnect();
+}
+
+
+bool RemoteDisplay::authenticate(const uint8_t* aMsg, size_t aSize, size_t &aConsumed)
+{
+  aConsumed = 0;
+  if (aSize<2) return true; // need more data
+  if (aMsg[0]!='A') return false;
+  size_t len = aMsg[1];
+  if (aSize<2+len) return true; // need more data
+  aConsumed = 2+len;
+  if (len!=secret.size()) return false;
+  // compare in constant time
+  uint8_t diff = 0;
+  for (size_t i=0; i<len; i++) diff |= aMsg[2+i] ^ (uint8_t)secret[i];
+  return diff==0;
+}
+
+
+void RemoteDisplay::connectionStatus(SocketCommPtr aSocketComm, ErrorPtr aError)
+{
+  if (Error::notOK(aError) || !aSocketComm->connected()) {
+    LOG(LOG_NOTICE, "remote display: client disconnected: %s", Error::text(aError));
+    disconnect();
+  }
+}
+
+
+void RemoteDisplay::disconnect()
+{
+  if (!client) return;
+  SocketCommPtr c = client;
+  client.reset();
+  c->setConnectionStatusHandler(NULL);
+  c->setReceiveHandler(NULL);
+  c->setTransmitHandler(NULL);
+  c->closeConnection();
+  authTicket.cancel();
+  frameTicket.cancel();
+  framePending = false;
+  txBuffer.clear();
+  if (authenticated) {
+    authenticated = false;
+    ScreenMirror::mirror().setActive(observer, false);
+    pointer->inject(pointerX, pointerY, false); // make sure no press remains
+  }
+}
+
+
+void RemoteDisplay::dataReceived(ErrorPtr aError)
+{
+  if (!client) return;
+  if (Error::isOK(aError)) {
+    size_t n = client->numBytesReady();
+    if (n>0) {
+      uint8_t buf[256];
+      if (n>sizeof(buf)) n = sizeof(buf);
+      n = client->receiveBytes(n, buf, aError);
+      rxBuffer.append((const char*)buf, n);
+    }
+  }
+  if (Error::notOK(aError)) {
+    LOG(LOG_WARNING, "remote display: receive error: %s", Error::text(aError));
+    disconnect();
+    return;
+  }
+  size_t pos = 0;
+  if (!authenticated) {
+    if (!authenticate((const uint8_t*)rxBuffer.data(), rxBuffer.size(), pos)) {
+      LOG(LOG_WARNING, "remote display: client sent wrong secret");
+      rejectedClients++;
+      disconnect();
+      return;
+    }
+    if (pos==0) return; // secret not complete yet
+    authTicket.cancel();
+    LOG(LOG_NOTICE, "remote display: client authenticated");
+    startStreaming();
+  }
+  // process complete pointer messages
+  const SnapshotCodec::Header &g = ScreenMirror::mirror().getGeometry();
+  while (rxBuffer.size()-pos>=POINTER_MSG_SIZE) {
+    const uint8_t* m = (const uint8_t*)rxBuffer.data()+pos;
+    if (m[0]!='P') {
+      LOG(LOG_WARNING, "remote display: invalid message from client");
+      disconnect();
+      return;
+    }
+    // clamp to the screen, the client might not know or respect its size
+    int x = m[2] | (m[3]<<8);
+    int y = m[4] | (m[5]<<8);
+    pointerX = x<g.width ? x : g.width-1;
+    pointerY = y<g.height ? y : g.height-1;
+    pointer->inject(pointerX, pointerY, m[1]!=0);
+    inputEvents++;
+    pos += POINTER_MSG_SIZE;
+  }
+  rxBuffer.erase(0, pos);
+}
+
+
+// MARK: - frames
+
+void RemoteDisplay::mirrorChanged()
+{
+  // called from flush, just schedule
+  scheduleFrame();
+}
+
+
+void RemoteDisplay::scheduleFrame()
+{
+  if (framePending || !client || !authenticated) return;
+  framePending = true;
+  MLMicroSeconds delay = lastFrame+minFrameInterval-MainLoop::now();
+  frameTicket.executeOnce(boost::bind(&RemoteDisplay::sendFrame, this), delay>0 ? delay : 0);
+}
+
+
+void RemoteDisplay::sendFrame()
+{
+  framePending = false;
+  if (!client) return;
+  if (!txBuffer.empty()) {
+    // previous frame still being transmitted, tiles accumulate until it is done
+    deferredFrames++;
+    return;
+  }
+  MLMicroSeconds start = MainLoop::now();
+  int n = ScreenMirror::mirror().takeDirty(observer, tiles);
+  if (n==0) return;
+  SnapshotCodec::Header h = ScreenMirror::mirror().getGeometry();
+  h.keyFrame = seq==0;
+  h.keySeq = seq; // previous frame
+  h.seq = ++seq;
+  h.numTiles = n;
+  txBuffer.assign(4, 0); // length, filled in below
+  SnapshotCodec::encodeHeader(txBuffer, h);
+  const uint16_t* pixels = ScreenMirror::mirror().getPixels();
+  for (int i=0; i<(int)tiles.size(); i++) {
+    if (tiles[i]) {
+      SnapshotCodec::encodeTile(txBuffer, h, pixels, i);
+      int x, y, dx, dy;
+      SnapshotCodec::tileRect(h, i, x, y, dx, dy);
+      rawBytes += dx*dy*2;
+      tiles[i] = false;
+    }
+  }
+  uint32_t len = (uint32_t)txBuffer.size()-4;
+  for (int i=0; i<4; i++) txBuffer[i] = (char)((len>>(8*i)) & 0xFF);
+  lastFrame = MainLoop::now();
+  encodeTime += lastFrame-start;
+  frames++;
+  transmit();
+}
+
+
+void RemoteDisplay::transmit()
+{
+  ErrorPtr err;
+  size_t n = client->transmitBytes(txBuffer.size(), (const uint8_t*)txBuffer.data(), err);
+  if (Error::notOK(err)) {
+    LOG(LOG_WARNING, "remote display: transmit error: %s", Error::text(err));
+    disconnect();
+    return;
+  }
+  bytesSent += n;
+  sessionBytes += n;
+  txBuffer.erase(0, n);
+  if (!txBuffer.empty()) {
+    // continue when socket is ready again
+    client->setTransmitHandler(boost::bind(&RemoteDisplay::readyForTransmit, this, _1));
+  }
+  else {
+    client->setTransmitHandler(NULL);
+    scheduleFrame(); // tiles might have accumulated meanwhile
+  }
+}
+
+
+void RemoteDisplay::readyForTransmit(ErrorPtr aError)
+{
+  if (!client) return;
+  if (Error::notOK(aError)) {
+    LOG(LOG_WARNING, "remote display: socket error: %s", Error::text(aError));
+    disconnect();
+    return;
+  }
+  transmit();
+}
+
+
+// MARK: - statistics
+
+JsonObjectPtr RemoteDisplay::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("connected", JsonObject::newBool(client!=NULL));
+  s->add("connections", JsonObject::newInt64(connections));
+  s->add("frames", JsonObject::newInt64(frames));
+  s->add("deferredFrames", JsonObject::newInt64(deferredFrames));
+  s->add("bytesSent", JsonObject::newInt64(bytesSent));
+  s->add("compression", JsonObject::newDouble(rawBytes>0 ? (double)bytesSent/rawBytes : 0));
+  s->add("inputEvents", JsonObject::newInt64(inputEvents));
+  s->add("rejectedClients", JsonObject::newInt64(rejectedClients));
+  s->add("avgEncodeTime", JsonObject::newDouble(frames>0 ? (double)encodeTime/frames/MilliSecond : 0));
+  if (client) {
+    double secs = (double)(MainLoop::now()-connectedSince)/Second;
+    if (secs>0) s->add("kBytesPerSecond", JsonObject::newDouble(sessionBytes/1024.0/secs));
+  }
+  return s;
+}
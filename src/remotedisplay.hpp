@@ -0,0 +1,123 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__remotedisplay__
+#define __p44mbcd__remotedisplay__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+#include "socketcomm.hpp"
+#include "scriptedinput.hpp"
+
+#include <vector>
+
+namespace p44 {
+
+  /// TCP server streaming the display contents to a remote viewer, and feeding pointer events
+  /// from the viewer back into littlevGL. One client at a time.
+  ///
+  /// Server to client: messages consisting of a 32-bit little endian length followed by a
+  /// SnapshotCodec snapshot. The first one is a keyframe, the following ones contain the tiles
+  /// rendered since the previous message.
+  /// Client to server: 6-byte pointer messages: 'P', pressed (0/1), x, y (16-bit little endian).
+  /// When a secret is configured, the client must first send 'A', secret length (1 byte) and the
+  /// secret, before anything is sent to it or any pointer message is accepted.
+  ///
+  /// Only connections from the local host are accepted unless explicitly allowed, and allowing
+  /// non-local connections requires a secret.
+  ///
+  /// Frames are encoded from the ScreenMirror at most at the configured frame rate, and only when
+  /// the previous frame has been completely handed to the socket - tiles rendered in between just
+  /// accumulate, so a slow link gets fewer frames instead of a growing queue.
+  class RemoteDisplay : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    SocketCommPtr server; ///< listening socket
+    SocketCommPtr client; ///< connected client
+    int observer; ///< our ScreenMirror observer id
+    ScriptedInputPtr pointer; ///< pointer input device for remote input
+    lv_coord_t pointerX, pointerY; ///< last remote pointer position
+    string secret; ///< shared secret the client must send first, empty if none
+    bool authenticated; ///< set when the current client has sent the secret (or none is needed)
+    MLTicket authTicket; ///< timeout for the client to authenticate
+
+    MLMicroSeconds minFrameInterval; ///< frame rate limit
+    MLTicket frameTicket; ///< for rate limited frame sending
+    bool framePending; ///< set when frame sending is scheduled
+    MLMicroSeconds lastFrame; ///< when the last frame was encoded
+    std::vector<bool> tiles; ///< tiles to send
+    uint32_t seq; ///< frame sequence number, 0 = next frame is the keyframe
+    string txBuffer; ///< not yet transmitted part of the current frame
+    string rxBuffer; ///< incomplete received messages
+
+    // statistics
+    long connections; ///< number of client connections
+    MLMicroSeconds connectedSince; ///< when the current client connected
+    long frames; ///< frames sent
+    long deferredFrames; ///< frames deferred because the previous one was still being transmitted
+    long long bytesSent; ///< encoded bytes sent
+    long long sessionBytes; ///< bytes sent to the current client
+    long long rawBytes; ///< uncompressed size of the tiles sent
+    long inputEvents; ///< pointer events received
+    long rejectedClients; ///< clients disconnected for not authenticating
+    MLMicroSeconds encodeTime; ///< total time spent encoding frames
+
+  public:
+
+    RemoteDisplay();
+
+    /// get the shared instance
+    static RemoteDisplay& remote();
+
+    /// start the server
+    /// @param aPort TCP port to listen on
+    /// @param aMaxFps max number of frames per second to send
+    /// @param aNonLocal if set, connections from other hosts are accepted
+    /// @param aSecret if not empty, clients must send this secret before they get anything
+    /// @return error if server could not be started
+    /// @note must be called after ScreenMirror is installed
+    ErrorPtr start(const string aPort, int aMaxFps, bool aNonLocal, const string aSecret);
+
+    /// @return true if started
+    bool isStarted() { return server!=NULL; };
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    SocketCommPtr clientConnected(SocketCommPtr aServerSocketComm);
+    void connectionStatus(SocketCommPtr aSocketComm, ErrorPtr aError);
+    void disconnect();
+    void authTimeout();
+    bool authenticate(const uint8_t* aMsg, size_t aSize, size_t &aConsumed);
+    void startStreaming();
+    void dataReceived(ErrorPtr aError);
+    void mirrorChanged();
+    void scheduleFrame();
+    void sendFrame();
+    void transmit();
+    void readyForTransmit(ErrorPtr aError);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__remotedisplay__) */
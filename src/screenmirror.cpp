@@ -0,0 +1,131 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "screenmirror.hpp"
+#include "displaytap.hpp"
+
+#if LV_COLOR_DEPTH!=16 || LV_COLOR_16_SWAP
+  #error "screen mirror requires LV_COLOR_DEPTH 16 without LV_COLOR_16_SWAP"
+#endif
+
+using namespace p44;
+
+#define MIRROR_TILE_SIZE 16
+
+static ScreenMirror* screenMirrorP = NULL;
+
+
+ScreenMirror::ScreenMirror() :
+  display(NULL),
+  activeObservers(0)
+{
+  memset(&geometry, 0, sizeof(geometry));
+}
+
+
+ScreenMirror& ScreenMirror::mirror()
+{
+  if (!screenMirrorP) {
+    screenMirrorP = new ScreenMirror;
+  }
+  return *screenMirrorP;
+}
+
+
+void ScreenMirror::install(lv_disp_t* aDisplay)
+{
+  if (display || !aDisplay) return; // already installed or no display
+  display = aDisplay;
+  geometry.width = lv_disp_get_hor_res(display);
+  geometry.height = lv_disp_get_ver_res(display);
+  geometry.tileSize = MIRROR_TILE_SIZE;
+  geometry.numTiles = SnapshotCodec::tiles(geometry);
+  pixels.resize(geometry.width*geometry.height, 0);
+  DisplayTap::tap().addFlushObserver(boost::bind(&ScreenMirror::flushed, this, _1, _2));
+}
+
+
+int ScreenMirror::addObserver(SimpleCB aChangedCB)
+{
+  Observer o;
+  o.active = false;
+  o.dirty.resize(geometry.numTiles, false);
+  o.changedCB = aChangedCB;
+  observers.push_back(o);
+  return (int)observers.size()-1;
+}
+
+
+void ScreenMirror::setActive(int aObserver, bool aActive)
+{
+  Observer &o = observers[aObserver];
+  if (o.active==aActive) return;
+  o.active = aActive;
+  if (aActive) {
+    activeObservers++;
+    // mirror is not up to date when there were no active observers, and the new observer
+    // needs all tiles anyway: just render everything again
+    lv_obj_invalidate(lv_disp_get_scr_act(display));
+    lv_obj_invalidate(lv_disp_get_layer_top(display));
+  }
+  else {
+    activeObservers--;
+  }
+}
+
+
+int ScreenMirror::takeDirty(int aObserver, std::vector<bool> &aTiles)
+{
+  Observer &o = observers[aObserver];
+  aTiles.resize(geometry.numTiles, false);
+  int n = 0;
+  for (int i=0; i<geometry.numTiles; i++) {
+    if (o.dirty[i]) { aTiles[i] = true; o.dirty[i] = false; }
+    if (aTiles[i]) n++;
+  }
+  return n;
+}
+
+
+void ScreenMirror::flushed(const lv_area_t* aArea, const lv_color_t* aPixels)
+{
+  if (activeObservers==0) return;
+  // clip to screen (source lines still have the full area's width)
+  int x1 = aArea->x1<0 ? 0 : aArea->x1;
+  int y1 = aArea->y1<0 ? 0 : aArea->y1;
+  int x2 = aArea->x2>=geometry.width ? geometry.width-1 : aArea->x2;
+  int y2 = aArea->y2>=geometry.height ? geometry.height-1 : aArea->y2;
+  if (x2<x1 || y2<y1) return;
+  int srcW = lv_area_get_width(aArea);
+  const lv_color_t* src = aPixels+(y1-aArea->y1)*srcW+(x1-aArea->x1);
+  size_t bytes = (x2-x1+1)*sizeof(lv_color_t);
+  for (int y=y1; y<=y2; y++) {
+    memcpy(&pixels[y*geometry.width+x1], src, bytes);
+    src += srcW;
+  }
+  // mark tiles
+  int tx = SnapshotCodec::tilesX(geometry);
+  for (ObserverVector::iterator pos = observers.begin(); pos!=observers.end(); ++pos) {
+    if (!pos->active) continue;
+    for (int ty=y1/geometry.tileSize; ty<=y2/geometry.tileSize; ty++) {
+      for (int t=x1/geometry.tileSize; t<=x2/geometry.tileSize; t++) pos->dirty[ty*tx+t] = true;
+    }
+    if (pos->changedCB) pos->changedCB();
+  }
+}
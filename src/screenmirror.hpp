@@ -0,0 +1,99 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__screenmirror__
+#define __p44mbcd__screenmirror__
+
+#include "p44utils_common.hpp"
+#include "snapshotcodec.hpp"
+
+#include "lvgl/lvgl.h"
+
+#include <vector>
+
+namespace p44 {
+
+  /// Copy of the display contents in memory, updated from the rendered areas on flush (a memcpy
+  /// per area line), with per-observer dirty tiles, for consumers that encode and send the screen
+  /// contents asynchronously (modbus snapshots, remote display).
+  /// Copying only takes place while at least one observer is active.
+  class ScreenMirror : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    lv_disp_t* display; ///< the display
+    SnapshotCodec::Header geometry; ///< screen and tile geometry
+    std::vector<uint16_t> pixels; ///< copy of the screen contents
+
+    typedef struct {
+      bool active; ///< set when observer wants updates
+      std::vector<bool> dirty; ///< tiles rendered since last takeDirty()
+      SimpleCB changedCB; ///< called (from flush!) when tiles have been marked dirty
+    } Observer;
+    typedef std::vector<Observer> ObserverVector;
+    ObserverVector observers;
+    int activeObservers; ///< number of active observers
+
+  public:
+
+    ScreenMirror();
+
+    /// get the shared instance
+    static ScreenMirror& mirror();
+
+    /// start mirroring a display
+    /// @param aDisplay the display, usually lv_disp_get_default()
+    /// @note must be called after DisplayTap is installed
+    void install(lv_disp_t* aDisplay);
+
+    /// @return true if installed
+    bool isInstalled() { return display!=NULL; };
+
+    /// add an observer
+    /// @param aChangedCB called from the flush path when tiles get dirty, must be fast (e.g. just schedule work)
+    /// @return observer id
+    /// @note observers start inactive
+    int addObserver(SimpleCB aChangedCB);
+
+    /// activate or deactivate an observer
+    /// @param aObserver observer id
+    /// @param aActive when activated, the entire screen is re-rendered, so all tiles will become dirty
+    void setActive(int aObserver, bool aActive);
+
+    /// get and clear the dirty tiles of an observer
+    /// @param aObserver observer id
+    /// @param aTiles dirty tiles are set in this vector (existing set tiles are kept)
+    /// @return number of tiles set in aTiles
+    int takeDirty(int aObserver, std::vector<bool> &aTiles);
+
+    /// @return screen and tile geometry (numTiles is the total number of tiles)
+    const SnapshotCodec::Header &getGeometry() { return geometry; };
+
+    /// @return screen contents, RGB565
+    const uint16_t* getPixels() { return &pixels[0]; };
+
+  private:
+
+    void flushed(const lv_area_t* aArea, const lv_color_t* aPixels);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__screenmirror__) */
@@ -0,0 +1,145 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "screensnapshot.hpp"
+#include "screenmirror.hpp"
+
+using namespace p44;
+
+static ScreenSnapshot* screenSnapshotP = NULL;
+
+
+ScreenSnapshot::ScreenSnapshot() :
+  installed(false),
+  observer(-1),
+  minInterval(Second),
+  keySeq(0),
+  hasKeyFrame(false),
+  seq(0),
+  updatePending(false),
+  updates(0),
+  keyFrames(0),
+  keyFrameBytes(0),
+  deltaBytes(0),
+  encodeTime(0)
+{
+}
+
+
+ScreenSnapshot& ScreenSnapshot::snapshot()
+{
+  if (!screenSnapshotP) {
+    screenSnapshotP = new ScreenSnapshot;
+  }
+  return *screenSnapshotP;
+}
+
+
+void ScreenSnapshot::install(const string aKeyFramePath, const string aDeltaPath, MLMicroSeconds aMinInterval)
+{
+  if (installed || !ScreenMirror::mirror().isInstalled()) return;
+  installed = true;
+  keyFramePath = aKeyFramePath;
+  deltaPath = aDeltaPath;
+  minInterval = aMinInterval;
+  changed.resize(ScreenMirror::mirror().getGeometry().numTiles, false);
+  observer = ScreenMirror::mirror().addObserver(boost::bind(&ScreenSnapshot::mirrorChanged, this));
+  ScreenMirror::mirror().setActive(observer, true);
+}
+
+
+void ScreenSnapshot::mirrorChanged()
+{
+  if (!updatePending) {
+    updatePending = true;
+    updateTicket.executeOnce(boost::bind(&ScreenSnapshot::update, this), minInterval);
+  }
+}
+
+
+void ScreenSnapshot::update()
+{
+  updatePending = false;
+  MLMicroSeconds start = MainLoop::now();
+  int n = (int)changed.size();
+  int numChanged = ScreenMirror::mirror().takeDirty(observer, changed);
+  seq++;
+  ErrorPtr err;
+  if (!hasKeyFrame || numChanged*2>n) {
+    // new keyframe, delta based on it is empty
+    err = writeSnapshot(keyFramePath, true);
+    if (Error::isOK(err)) {
+      hasKeyFrame = true;
+      keySeq = seq;
+      keyFrames++;
+      changed.assign(n, false);
+    }
+  }
+  if (Error::isOK(err)) err = writeSnapshot(deltaPath, false);
+  if (Error::notOK(err)) {
+    LOG(LOG_ERR, "cannot write screen snapshot: %s", Error::text(err));
+  }
+  updates++;
+  encodeTime += MainLoop::now()-start;
+}
+
+
+ErrorPtr ScreenSnapshot::writeSnapshot(const string aPath, bool aKeyFrame)
+{
+  SnapshotCodec::Header h = ScreenMirror::mirror().getGeometry();
+  h.keyFrame = aKeyFrame;
+  h.seq = seq;
+  h.keySeq = aKeyFrame ? seq : keySeq;
+  int n = (int)changed.size();
+  h.numTiles = 0;
+  for (int i=0; i<n; i++) if (aKeyFrame || changed[i]) h.numTiles++;
+  string data;
+  SnapshotCodec::encodeHeader(data, h);
+  const uint16_t* pixels = ScreenMirror::mirror().getPixels();
+  for (int i=0; i<n; i++) {
+    if (aKeyFrame || changed[i]) SnapshotCodec::encodeTile(data, h, pixels, i);
+  }
+  if (aKeyFrame) keyFrameBytes = data.size();
+  else deltaBytes = data.size();
+  // write atomically, so a modbus transfer in progress gets a consistent file
+  string tmp = aPath+".tmp";
+  ErrorPtr err = string_tofile(tmp, data);
+  if (Error::isOK(err) && rename(tmp.c_str(), aPath.c_str())<0) {
+    err = SysError::errNo("cannot store snapshot: ");
+  }
+  return err;
+}
+
+
+// MARK: - statistics
+
+JsonObjectPtr ScreenSnapshot::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("seq", JsonObject::newInt64(seq));
+  s->add("keySeq", JsonObject::newInt64(keySeq));
+  s->add("updates", JsonObject::newInt64(updates));
+  s->add("keyFrames", JsonObject::newInt64(keyFrames));
+  s->add("keyFrameBytes", JsonObject::newInt64(keyFrameBytes));
+  s->add("deltaBytes", JsonObject::newInt64(deltaBytes));
+  const SnapshotCodec::Header &g = ScreenMirror::mirror().getGeometry();
+  s->add("rawBytes", JsonObject::newInt64(g.width*g.height*2));
+  s->add("avgEncodeTime", JsonObject::newDouble(updates>0 ? (double)encodeTime/updates/MilliSecond : 0));
+  return s;
+}
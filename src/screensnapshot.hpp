@@ -0,0 +1,89 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__screensnapshot__
+#define __p44mbcd__screensnapshot__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+#include "snapshotcodec.hpp"
+
+#include <vector>
+
+namespace p44 {
+
+  /// Maintains compact snapshots of the display contents in two files, to be served read-only
+  /// via modbus: a keyframe with all tiles, and a delta with the tiles changed since that keyframe
+  /// (see SnapshotCodec). The snapshot files are updated from the dirty tiles of the ScreenMirror
+  /// later (rate limited), so neither modbus reads nor rendering have to wait for encoding.
+  /// A new keyframe is written when more than half of the tiles have changed since the last one.
+  class ScreenSnapshot : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    bool installed; ///< set when installed
+    int observer; ///< our ScreenMirror observer id
+    string keyFramePath; ///< file for keyframes
+    string deltaPath; ///< file for deltas
+    MLMicroSeconds minInterval; ///< min time between snapshot updates
+    uint32_t keySeq; ///< sequence number of the current keyframe
+    std::vector<bool> changed; ///< tiles changed since last keyframe
+    bool hasKeyFrame; ///< set when a keyframe has been written
+    uint32_t seq; ///< current sequence number
+    MLTicket updateTicket; ///< for rate limited updates
+    bool updatePending; ///< set when update is scheduled
+
+    // statistics
+    long updates; ///< number of snapshot updates
+    long keyFrames; ///< number of keyframes written
+    size_t keyFrameBytes; ///< size of current keyframe
+    size_t deltaBytes; ///< size of current delta
+    MLMicroSeconds encodeTime; ///< total time spent encoding
+
+  public:
+
+    ScreenSnapshot();
+
+    /// get the shared instance
+    static ScreenSnapshot& snapshot();
+
+    /// start maintaining snapshots of the display
+    /// @param aKeyFramePath file to write keyframes to
+    /// @param aDeltaPath file to write deltas to
+    /// @param aMinInterval minimal time between snapshot updates
+    /// @note must be called after ScreenMirror is installed
+    void install(const string aKeyFramePath, const string aDeltaPath, MLMicroSeconds aMinInterval);
+
+    /// @return true if installed
+    bool isInstalled() { return installed; };
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    void mirrorChanged();
+    void update();
+    ErrorPtr writeSnapshot(const string aPath, bool aKeyFrame);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__screensnapshot__) */
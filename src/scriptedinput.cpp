@@ -0,0 +1,183 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "scriptedinput.hpp"
+#include "lvglscheduler.hpp"
+
+using namespace p44;
+
+#define TAP_DURATION (100*MilliSecond)
+
+
+ScriptedInput::ScriptedInput() :
+  indev(NULL),
+  x(0),
+  y(0),
+  pressed(false),
+  nextStep(0),
+  loop(false),
+  speed(1)
+{
+}
+
+
+ScriptedInput::~ScriptedInput()
+{
+  stop();
+}
+
+
+void ScriptedInput::install()
+{
+  if (indev) return;
+  lv_indev_drv_t drv;
+  lv_indev_drv_init(&drv);
+  drv.type = LV_INDEV_TYPE_POINTER;
+  drv.read_cb = &ScriptedInput::readCB;
+  drv.user_data = this; // marks input device as event driven (see LvglScheduler::setStandby())
+  indev = lv_indev_drv_register(&drv);
+  lv_task_set_period(indev->driver.read_task, LVGL_IDLE_TASK_PERIOD); // inject() triggers reads
+}
+
+
+bool ScriptedInput::isScriptedInput(const lv_indev_t* aIndev)
+{
+  return aIndev->driver.read_cb==&ScriptedInput::readCB;
+}
+
+
+void ScriptedInput::inject(lv_coord_t aX, lv_coord_t aY, bool aPressed)
+{
+  x = aX;
+  y = aY;
+  pressed = aPressed;
+  if (indev) {
+    lv_task_set_period(indev->driver.read_task, LV_INDEV_DEF_READ_PERIOD);
+    lv_task_ready(indev->driver.read_task);
+    LvglScheduler::scheduler().wakeup();
+  }
+}
+
+
+bool ScriptedInput::readCB(lv_indev_drv_t* aDrv, lv_indev_data_t* aData)
+{
+  ScriptedInput* si = static_cast<ScriptedInput*>(aDrv->user_data);
+  aData->point.x = si->x;
+  aData->point.y = si->y;
+  aData->state = si->pressed ? LV_INDEV_STATE_PR : LV_INDEV_STATE_REL;
+  if (!si->pressed && !si->indev->proc.types.pointer.drag_in_prog) {
+    // nothing more to do until next inject() (while pressed, keep polling for long press detection,
+    // while dragging, for the drag throw after release)
+    lv_task_set_period(si->indev->driver.read_task, LVGL_IDLE_TASK_PERIOD);
+  }
+  return false; // no buffered data
+}
+
+
+// MARK: - scripts
+
+ErrorPtr ScriptedInput::setScript(const string aScriptText)
+{
+  StepVector newSteps;
+  const char* p = aScriptText.c_str();
+  string line;
+  int lineNo = 0;
+  while (nextLine(p, line)) {
+    lineNo++;
+    const char* l = line.c_str();
+    while (*l==' ' || *l=='\t') l++;
+    if (*l==0 || *l=='#') continue;
+    int ms, sx, sy;
+    char action[16];
+    int n = sscanf(l, "%d %15s %d %d", &ms, action, &sx, &sy);
+    if (n<2 || ms<0) return TextError::err("input script line %d: syntax error", lineNo);
+    Step s;
+    s.delay = ms*MilliSecond;
+    s.moves = n>=4;
+    s.x = s.moves ? sx : 0;
+    s.y = s.moves ? sy : 0;
+    if (strcmp(action, "press")==0 || strcmp(action, "tap")==0) s.pressed = true;
+    else if (strcmp(action, "release")==0) s.pressed = false;
+    else if (strcmp(action, "move")==0 && s.moves) s.pressed = true;
+    else return TextError::err("input script line %d: unknown action or missing coordinates", lineNo);
+    newSteps.push_back(s);
+    if (strcmp(action, "tap")==0) {
+      s.delay = TAP_DURATION;
+      s.pressed = false;
+      s.moves = false;
+      newSteps.push_back(s);
+    }
+  }
+  stop();
+  steps.swap(newSteps);
+  return ErrorPtr();
+}
+
+
+ErrorPtr ScriptedInput::loadScript(const string aPath)
+{
+  string script;
+  ErrorPtr err = string_fromfile(aPath, script);
+  if (Error::notOK(err)) return err;
+  return setScript(script);
+}
+
+
+void ScriptedInput::start(bool aLoop, SimpleCB aDoneCB)
+{
+  stop();
+  loop = aLoop;
+  doneCB = aDoneCB;
+  nextStep = 0;
+  scheduleNextStep();
+}
+
+
+void ScriptedInput::stop()
+{
+  stepTicket.cancel();
+  nextStep = steps.size();
+}
+
+
+void ScriptedInput::scheduleNextStep()
+{
+  if (nextStep>=steps.size()) {
+    if (loop && !steps.empty()) {
+      nextStep = 0;
+    }
+    else {
+      if (doneCB) {
+        SimpleCB cb = doneCB;
+        doneCB = NULL;
+        cb();
+      }
+      return;
+    }
+  }
+  stepTicket.executeOnce(boost::bind(&ScriptedInput::executeStep, this), steps[nextStep].delay/speed);
+}
+
+
+void ScriptedInput::executeStep()
+{
+  const Step &s = steps[nextStep++];
+  inject(s.moves ? s.x : x, s.moves ? s.y : y, s.pressed);
+  scheduleNextStep();
+}
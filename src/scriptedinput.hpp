@@ -0,0 +1,108 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__scriptedinput__
+#define __p44mbcd__scriptedinput__
+
+#include "p44utils_common.hpp"
+
+#include "lvgl/lvgl.h"
+
+namespace p44 {
+
+  /// littlevGL pointer input device driven by software: either by directly injecting pointer
+  /// states, or by playing back an input script.
+  /// Input scripts are text files with one step per line: `<delay_ms> <action> [<x> <y>]`,
+  /// where action is `press`, `move`, `release` or `tap` (press and release 100mS later).
+  /// Delays are relative to the previous step. Empty lines and lines starting with # are ignored,
+  /// as are additional fields after the coordinates.
+  class ScriptedInput : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    lv_indev_t* indev; ///< our input device
+    lv_coord_t x, y; ///< current pointer position
+    bool pressed; ///< current pointer state
+
+    typedef struct {
+      MLMicroSeconds delay; ///< delay after previous step
+      bool pressed; ///< pointer state
+      bool moves; ///< set if step has coordinates
+      lv_coord_t x, y; ///< coordinates
+    } Step;
+    typedef std::vector<Step> StepVector;
+    StepVector steps; ///< the script
+    size_t nextStep; ///< next step to execute
+    bool loop; ///< restart script when done
+    double speed; ///< playback speed factor
+    MLTicket stepTicket; ///< timer for next step
+    SimpleCB doneCB; ///< called when script is done
+
+  public:
+
+    ScriptedInput();
+    virtual ~ScriptedInput();
+
+    /// register as littlevGL pointer input device
+    void install();
+
+    /// @param aIndev a littlevGL input device
+    /// @return true if aIndev is a ScriptedInput device (and not a physical one)
+    static bool isScriptedInput(const lv_indev_t* aIndev);
+
+    /// set pointer state immediately
+    /// @param aX x coordinate
+    /// @param aY y coordinate
+    /// @param aPressed true if pointer is pressed/touched
+    void inject(lv_coord_t aX, lv_coord_t aY, bool aPressed);
+
+    /// load an input script
+    /// @param aScriptText the script
+    /// @return error if script has syntax errors
+    ErrorPtr setScript(const string aScriptText);
+
+    /// load an input script from a file
+    /// @param aPath file path
+    /// @return error if file cannot be read or script has syntax errors
+    ErrorPtr loadScript(const string aPath);
+
+    /// start playing the script
+    /// @param aLoop if set, script is restarted when done
+    /// @param aDoneCB called when script is done (not in loop mode)
+    void start(bool aLoop, SimpleCB aDoneCB = NULL);
+
+    /// stop playing the script
+    void stop();
+
+    /// set the playback speed
+    /// @param aSpeed speed factor, 1 = original speed, 2 = twice as fast, etc.
+    void setSpeed(double aSpeed) { speed = aSpeed>0 ? aSpeed : 1; };
+
+  private:
+
+    void scheduleNextStep();
+    void executeStep();
+    static bool readCB(lv_indev_drv_t* aDrv, lv_indev_data_t* aData);
+
+  };
+  typedef boost::intrusive_ptr<ScriptedInput> ScriptedInputPtr;
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__scriptedinput__) */
@@ -0,0 +1,189 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "shadowregisters.hpp"
+
+using namespace p44;
+
+
+ShadowRegisters::ShadowRegisters(ModbusSlavePtr aModbusSlave) :
+  modbusSlave(aModbusSlave),
+  commitScheduled(false),
+  commits(0),
+  tornReadsPrevented(0),
+  diverting(false)
+{
+}
+
+
+ErrorPtr ShadowRegisters::addRegions(const string aRegionSpec)
+{
+  const char *p = aRegionSpec.c_str();
+  string part;
+  while (nextPart(p, part, ',')) {
+    int first, last;
+    int commitReg = -1;
+    int n = sscanf(part.c_str(), "%d-%d:%d", &first, &last, &commitReg);
+    if (n<2 || first<0 || last>0xFFFF || last<first) {
+      return TextError::err("invalid shadow register region '%s'", part.c_str());
+    }
+    if (commitReg>=first && commitReg<=last) {
+      return TextError::err("commit register %d must not be part of region '%s'", commitReg, part.c_str());
+    }
+    Region r;
+    r.first = first;
+    r.count = last-first+1;
+    r.commitReg = n>2 ? commitReg : -1;
+    r.uncommitted = false;
+    r.commitRequested = false;
+    // start with current (possibly restored) register contents
+    r.committed.resize(r.count);
+    for (int i=0; i<r.count; i++) r.committed[i] = modbusSlave->getReg(r.first+i, false);
+    r.shadow = r.committed;
+    r.masterWritten.assign(r.count, false);
+    r.inRequest.assign(r.count, false);
+    regions.push_back(r);
+    LOG(LOG_INFO,
+      "Registers %d..%d double buffered, committed %s",
+      first, last, r.commitReg<0 ? "at end of write request" : string_format("by writing register %d", r.commitReg).c_str()
+    );
+  }
+  return ErrorPtr();
+}
+
+
+ShadowRegisters::Region* ShadowRegisters::regionFor(int aAddress)
+{
+  for (RegionVector::iterator pos = regions.begin(); pos!=regions.end(); ++pos) {
+    if (aAddress>=pos->first && aAddress<pos->first+pos->count) return &(*pos);
+  }
+  return NULL;
+}
+
+
+void ShadowRegisters::registerAccessed(int aAddress, bool aWrite)
+{
+  if (!aWrite || diverting) return;
+  for (RegionVector::iterator pos = regions.begin(); pos!=regions.end(); ++pos) {
+    if (aAddress==pos->commitReg) {
+      // do not commit now, rest of the data might be written later in the same request
+      pos->commitRequested = true;
+    }
+    else if (aAddress>=pos->first && aAddress<pos->first+pos->count) {
+      // divert the written value into the shadow bank, keep the committed value in the register table
+      int i = aAddress-pos->first;
+      pos->shadow[i] = modbusSlave->getReg(aAddress, false);
+      pos->masterWritten[i] = true;
+      pos->inRequest[i] = true;
+      diverting = true;
+      modbusSlave->setReg(aAddress, false, pos->committed[i]);
+      diverting = false;
+      pos->uncommitted = true;
+    }
+    else {
+      continue;
+    }
+    if (!commitScheduled) {
+      // commit once the entire request has been processed
+      commitScheduled = true;
+      MainLoop::currentMainLoop().executeNow(boost::bind(&ShadowRegisters::commitPending, this));
+    }
+  }
+}
+
+
+void ShadowRegisters::commitPending()
+{
+  commitScheduled = false;
+  for (RegionVector::iterator pos = regions.begin(); pos!=regions.end(); ++pos) {
+    syncLocalWrites(*pos);
+    if (pos->uncommitted && (pos->commitReg<0 || pos->commitRequested)) commit(*pos);
+    pos->commitRequested = false;
+    pos->inRequest.assign(pos->count, false);
+  }
+}
+
+
+void ShadowRegisters::syncLocalWrites(Region &aRegion)
+{
+  // registers not written by the master in this request hold the committed value in the register table,
+  // unless it was changed locally without going through setReg()
+  for (int i=0; i<aRegion.count; i++) {
+    if (aRegion.inRequest[i]) continue; // table has the (possibly outdated) committed value we restored
+    uint16_t v = modbusSlave->getReg(aRegion.first+i, false);
+    if (v!=aRegion.committed[i]) {
+      // local write, more recent than anything the master wrote before
+      aRegion.committed[i] = v;
+      aRegion.shadow[i] = v;
+      aRegion.masterWritten[i] = false;
+    }
+    else if (!aRegion.masterWritten[i]) {
+      aRegion.shadow[i] = v;
+    }
+  }
+}
+
+
+void ShadowRegisters::commit(Region &aRegion)
+{
+  diverting = true;
+  aRegion.committed = aRegion.shadow;
+  for (int i=0; i<aRegion.count; i++) modbusSlave->setReg(aRegion.first+i, false, aRegion.committed[i]);
+  diverting = false;
+  aRegion.uncommitted = false;
+  aRegion.masterWritten.assign(aRegion.count, false);
+  commits++;
+  LOG(LOG_DEBUG, "Registers %d..%d committed", aRegion.first, aRegion.first+aRegion.count-1);
+}
+
+
+uint16_t ShadowRegisters::getReg(int aAddress)
+{
+  Region* r = regionFor(aAddress);
+  uint16_t v = modbusSlave->getReg(aAddress, false);
+  if (r && r->uncommitted && v!=r->shadow[aAddress-r->first]) tornReadsPrevented++;
+  return v;
+}
+
+
+void ShadowRegisters::setReg(int aAddress, uint16_t aValue)
+{
+  Region* r = regionFor(aAddress);
+  if (r) {
+    int i = aAddress-r->first;
+    r->committed[i] = aValue;
+    r->shadow[i] = aValue;
+    r->masterWritten[i] = false;
+  }
+  modbusSlave->setReg(aAddress, false, aValue);
+}
+
+
+JsonObjectPtr ShadowRegisters::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("commits", JsonObject::newInt64(commits));
+  s->add("tornReadsPrevented", JsonObject::newInt64(tornReadsPrevented));
+  int uncommitted = 0;
+  for (RegionVector::iterator pos = regions.begin(); pos!=regions.end(); ++pos) {
+    if (pos->uncommitted) uncommitted++;
+  }
+  s->add("uncommittedRegions", JsonObject::newInt32(uncommitted));
+  return s;
+}
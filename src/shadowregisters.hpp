@@ -0,0 +1,105 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__shadowregisters__
+#define __p44mbcd__shadowregisters__
+
+#include "p44utils_common.hpp"
+#include "modbus.hpp"
+#include "jsonobject.hpp"
+
+namespace p44 {
+
+  /// Double buffered register regions.
+  /// The slave's register table always holds the committed values, so everything reading it (modbus.reg
+  /// in scripts, UI, ubus, the master itself) sees a consistent snapshot. Values written by the master are
+  /// diverted into a shadow bank and copied into the register table as a whole once the master's write
+  /// request has completed - either for every request, or only for requests writing the region's
+  /// commit register (regardless of whether the commit register is written before or after the data).
+  /// Local writes that bypass setReg() (modbus.setreg() in scripts) go directly to the register table.
+  /// They are picked up from there once the master's request has completed, before committing.
+  /// The last writer wins: a local write replaces a not yet committed master value, and vice versa.
+  class ShadowRegisters : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    struct Region {
+      uint16_t first; ///< first register of the region
+      uint16_t count; ///< number of registers
+      int commitReg; ///< register that commits the region when written, -1 = commit at end of every write request
+      bool uncommitted; ///< set when the master has written to the shadow bank since the last commit
+      bool commitRequested; ///< set when the commit register was written in the current request
+      std::vector<uint16_t> committed; ///< the committed values, to restore registers overwritten by the master
+      std::vector<uint16_t> shadow; ///< the values written by the master, not yet committed
+      std::vector<bool> masterWritten; ///< set for registers the master has written since the last commit
+      std::vector<bool> inRequest; ///< set for registers the master has written in the current request
+    };
+    typedef std::vector<Region> RegionVector;
+
+    ModbusSlavePtr modbusSlave;
+    RegionVector regions;
+    bool commitScheduled; ///< set while a commit at end of the current request is pending
+
+    long commits; ///< number of commits
+    long tornReadsPrevented; ///< number of reads that got the committed instead of a half written value
+    bool diverting; ///< set while restoring a diverted register, to ignore the resulting access
+
+  public:
+
+    ShadowRegisters(ModbusSlavePtr aModbusSlave);
+
+    /// add double buffered regions
+    /// @param aRegionSpec comma separated list of regions in the form `first-last[:commitreg]`.
+    ///   Without commitreg, the region is committed at the end of every master write request touching it.
+    /// @return error when region specification is invalid
+    ErrorPtr addRegions(const string aRegionSpec);
+
+    /// to be called from the slave's value access handler for every (non-bit, non-input) register access
+    /// @param aAddress the register accessed
+    /// @param aWrite true for write accesses
+    /// @note master writes to a double buffered region are moved into the shadow bank and the register is
+    ///   reset to its committed value, so the master also reads back committed values
+    void registerAccessed(int aAddress, bool aWrite);
+
+    /// get a register value as seen by scripts and UI
+    /// @param aAddress register address
+    /// @return the register value, which is always the committed one
+    uint16_t getReg(int aAddress);
+
+    /// set a register value from scripts or UI
+    /// @param aAddress register address
+    /// @param aValue new value, written to both the register table and the shadow bank
+    void setReg(int aAddress, uint16_t aValue);
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    Region* regionFor(int aAddress);
+    void commit(Region &aRegion);
+    void commitPending();
+    void syncLocalWrites(Region &aRegion);
+
+  };
+  typedef boost::intrusive_ptr<ShadowRegisters> ShadowRegistersPtr;
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__shadowregisters__) */
@@ -0,0 +1,159 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "snapshotcodec.hpp"
+
+using namespace p44;
+
+#define SNAPSHOT_VERSION 1
+#define HEADER_SIZE 22
+#define MAX_LITERAL 128
+#define MAX_REPEAT 129
+
+
+static void append16(string &aData, uint16_t aVal)
+{
+  aData += (char)(aVal & 0xFF);
+  aData += (char)(aVal>>8);
+}
+
+
+static void append32(string &aData, uint32_t aVal)
+{
+  append16(aData, aVal & 0xFFFF);
+  append16(aData, aVal>>16);
+}
+
+
+static uint16_t get16(const string &aData, size_t aPos)
+{
+  return (uint8_t)aData[aPos] | ((uint8_t)aData[aPos+1]<<8);
+}
+
+
+static uint32_t get32(const string &aData, size_t aPos)
+{
+  return get16(aData, aPos) | ((uint32_t)get16(aData, aPos+2)<<16);
+}
+
+
+void SnapshotCodec::tileRect(const Header &aHeader, int aTileIndex, int &aX, int &aY, int &aDx, int &aDy)
+{
+  int tx = tilesX(aHeader);
+  aX = (aTileIndex%tx)*aHeader.tileSize;
+  aY = (aTileIndex/tx)*aHeader.tileSize;
+  aDx = aHeader.width-aX; if (aDx>aHeader.tileSize) aDx = aHeader.tileSize;
+  aDy = aHeader.height-aY; if (aDy>aHeader.tileSize) aDy = aHeader.tileSize;
+}
+
+
+void SnapshotCodec::encodeHeader(string &aData, const Header &aHeader)
+{
+  aData.append("P44S");
+  aData += (char)SNAPSHOT_VERSION;
+  aData += (char)(aHeader.keyFrame ? 0 : 1);
+  append16(aData, aHeader.width);
+  append16(aData, aHeader.height);
+  append16(aData, aHeader.tileSize);
+  append32(aData, aHeader.seq);
+  append32(aData, aHeader.keySeq);
+  append16(aData, aHeader.numTiles);
+}
+
+
+void SnapshotCodec::encodeTile(string &aData, const Header &aHeader, const uint16_t* aPixels, int aTileIndex)
+{
+  int x, y, dx, dy;
+  tileRect(aHeader, aTileIndex, x, y, dx, dy);
+  // collect the tile's pixels
+  uint16_t px[256];
+  uint16_t* tp = aHeader.tileSize<=16 ? px : new uint16_t[dx*dy];
+  int n = 0;
+  for (int ty=y; ty<y+dy; ty++) {
+    const uint16_t* l = aPixels+ty*aHeader.width+x;
+    for (int tx=0; tx<dx; tx++) tp[n++] = l[tx];
+  }
+  append16(aData, aTileIndex);
+  int i = 0;
+  while (i<n) {
+    // measure run
+    int r = 1;
+    while (i+r<n && r<MAX_REPEAT && tp[i+r]==tp[i]) r++;
+    if (r>=2) {
+      aData += (char)(0x80 | (r-2));
+      append16(aData, tp[i]);
+      i += r;
+      continue;
+    }
+    // literal up to the next run of at least 2
+    int j = i+1;
+    while (j<n && j-i<MAX_LITERAL && !(j+1<n && tp[j]==tp[j+1])) j++;
+    aData += (char)(j-i-1);
+    while (i<j) append16(aData, tp[i++]);
+  }
+  if (tp!=px) delete[] tp;
+}
+
+
+ErrorPtr SnapshotCodec::decodeHeader(const string &aData, Header &aHeader)
+{
+  if (aData.size()<HEADER_SIZE || aData.compare(0, 4, "P44S")!=0) return TextError::err("not a screen snapshot");
+  if (aData[4]!=SNAPSHOT_VERSION) return TextError::err("unsupported snapshot version %d", aData[4]);
+  aHeader.keyFrame = aData[5]==0;
+  aHeader.width = get16(aData, 6);
+  aHeader.height = get16(aData, 8);
+  aHeader.tileSize = get16(aData, 10);
+  aHeader.seq = get32(aData, 12);
+  aHeader.keySeq = get32(aData, 16);
+  aHeader.numTiles = get16(aData, 20);
+  if (aHeader.tileSize==0) return TextError::err("invalid tile size");
+  return ErrorPtr();
+}
+
+
+ErrorPtr SnapshotCodec::decodeTiles(const string &aData, uint16_t* aPixels)
+{
+  Header h;
+  ErrorPtr err = decodeHeader(aData, h);
+  if (Error::notOK(err)) return err;
+  size_t pos = HEADER_SIZE;
+  int numTiles = tiles(h);
+  for (int t=0; t<h.numTiles; t++) {
+    if (pos+2>aData.size()) return TextError::err("truncated snapshot");
+    int tileIndex = get16(aData, pos); pos += 2;
+    if (tileIndex>=numTiles) return TextError::err("invalid tile index %d", tileIndex);
+    int x, y, dx, dy;
+    tileRect(h, tileIndex, x, y, dx, dy);
+    int n = dx*dy;
+    int i = 0;
+    while (i<n) {
+      if (pos>=aData.size()) return TextError::err("truncated snapshot");
+      uint8_t c = (uint8_t)aData[pos++];
+      int cnt = c & 0x80 ? (c & 0x7F)+2 : c+1;
+      if (i+cnt>n) return TextError::err("run exceeds tile %d", tileIndex);
+      if (pos+(c & 0x80 ? 2 : 2*cnt)>aData.size()) return TextError::err("truncated snapshot");
+      for (int k=0; k<cnt; k++, i++) {
+        aPixels[(y+i/dx)*h.width+x+i%dx] = get16(aData, pos);
+        if (!(c & 0x80)) pos += 2;
+      }
+      if (c & 0x80) pos += 2;
+    }
+  }
+  return ErrorPtr();
+}
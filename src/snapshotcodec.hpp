@@ -0,0 +1,90 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__snapshotcodec__
+#define __p44mbcd__snapshotcodec__
+
+#include "p44utils_common.hpp"
+
+namespace p44 {
+
+  /// Encoding/decoding of compact RGB565 screen snapshots (shared by p44mbcd and p44mbutil).
+  /// A snapshot consists of a header followed by a number of square tiles, each run length
+  /// encoded (PackBits style, 16-bit pixels, little endian). A keyframe contains all tiles,
+  /// a delta contains only the tiles that changed since the keyframe it is based on.
+  ///
+  /// Header (little endian):
+  /// - 'P','4','4','S', version (1), type (0=keyframe, 1=delta)
+  /// - width, height, tile size (16 bit each)
+  /// - sequence number, keyframe sequence number (32 bit each)
+  /// - number of tiles (16 bit)
+  ///
+  /// Each tile: tile index (16 bit), then runs until all of the tile's pixels are covered:
+  /// - 0x00..0x7F: literal, followed by (n+1) pixels
+  /// - 0x80..0xFF: repeat, followed by one pixel to be repeated ((n&0x7F)+2) times
+  class SnapshotCodec
+  {
+  public:
+
+    typedef struct {
+      bool keyFrame; ///< set for keyframe, cleared for delta
+      uint16_t width; ///< screen width
+      uint16_t height; ///< screen height
+      uint16_t tileSize; ///< tile width and height
+      uint32_t seq; ///< sequence number of the snapshot
+      uint32_t keySeq; ///< sequence number of the keyframe (same as seq for keyframes)
+      uint16_t numTiles; ///< number of tiles in the snapshot
+    } Header;
+
+    /// @return number of tiles per row
+    static int tilesX(const Header &aHeader) { return (aHeader.width+aHeader.tileSize-1)/aHeader.tileSize; };
+
+    /// @return total number of tiles of the screen
+    static int tiles(const Header &aHeader) { return tilesX(aHeader)*((aHeader.height+aHeader.tileSize-1)/aHeader.tileSize); };
+
+    /// get the area covered by a tile (tiles at the right and bottom border might be smaller)
+    static void tileRect(const Header &aHeader, int aTileIndex, int &aX, int &aY, int &aDx, int &aDy);
+
+    /// append header
+    /// @param aData the snapshot data to append to
+    static void encodeHeader(string &aData, const Header &aHeader);
+
+    /// append a tile
+    /// @param aData the snapshot data to append to
+    /// @param aPixels the full screen, aHeader.width*aHeader.height RGB565 pixels
+    /// @param aTileIndex the tile to encode
+    static void encodeTile(string &aData, const Header &aHeader, const uint16_t* aPixels, int aTileIndex);
+
+    /// decode the header
+    /// @param aData the snapshot data
+    /// @param aHeader will receive the header
+    /// @return error if not a valid snapshot
+    static ErrorPtr decodeHeader(const string &aData, Header &aHeader);
+
+    /// decode all tiles of a snapshot into a screen buffer
+    /// @param aData the snapshot data
+    /// @param aPixels the full screen to draw the tiles into, must have the size from the header
+    /// @return error if the data is corrupt
+    static ErrorPtr decodeTiles(const string &aData, uint16_t* aPixels);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__snapshotcodec__) */
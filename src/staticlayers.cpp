@@ -0,0 +1,325 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "staticlayers.hpp"
+#include "qualitygovernor.hpp"
+
+using namespace p44;
+
+static StaticLayers* staticLayersP = NULL;
+
+
+StaticLayers::StaticLayers() :
+  budget(0),
+  used(0),
+  hidingChildren(false),
+  renders(0),
+  totalRenderTime(0),
+  blits(0),
+  blitTime(0),
+  savedTime(0)
+{
+}
+
+
+StaticLayers& StaticLayers::layers()
+{
+  if (!staticLayersP) {
+    staticLayersP = new StaticLayers;
+  }
+  return *staticLayersP;
+}
+
+
+ErrorPtr StaticLayers::create(lv_obj_t* aObj)
+{
+  if (!aObj) return TextError::err("no object");
+  if (layerMap.find(aObj)!=layerMap.end()) return ErrorPtr(); // already is a layer
+  lv_area_t coords;
+  lv_obj_get_coords(aObj, &coords);
+  lv_design_cb_t design = lv_obj_get_design_cb(aObj);
+  if (!design(aObj, &coords, LV_DESIGN_COVER_CHK)) {
+    return TextError::err("static layer must have an opaque background");
+  }
+  extArea(aObj, coords);
+  size_t bytes = lv_area_get_size(&coords)*sizeof(lv_color_t);
+  if (budget>0 && used+bytes>budget) {
+    return TextError::err("static layer needs %zu bytes, exceeds budget (%zu of %zu bytes used)", bytes, used, budget);
+  }
+  Layer* l = new Layer();
+  l->obj = aObj;
+  l->orgDesignCB = design;
+  l->orgSignalCB = lv_obj_get_signal_cb(aObj);
+  l->dirty = true;
+  layerMap[aObj] = l;
+  lv_obj_set_design_cb(aObj, &StaticLayers::designCB);
+  lv_obj_set_signal_cb(aObj, &StaticLayers::signalCB);
+  hideChildren(l);
+  lv_obj_invalidate(aObj);
+  return ErrorPtr();
+}
+
+
+lv_obj_t* StaticLayers::findObj(lv_obj_t* aParent, const lv_area_t &aArea)
+{
+  lv_obj_t* child = NULL;
+  while ((child = lv_obj_get_child(aParent, child))) {
+    lv_area_t a;
+    lv_obj_get_coords(child, &a);
+    if (a.x1==aArea.x1 && a.y1==aArea.y1 && a.x2==aArea.x2 && a.y2==aArea.y2) return child;
+    lv_obj_t* o = findObj(child, aArea);
+    if (o) return o;
+  }
+  return NULL;
+}
+
+
+ErrorPtr StaticLayers::createAt(const lv_area_t &aArea)
+{
+  lv_obj_t* obj = findObj(lv_scr_act(), aArea);
+  if (!obj) return TextError::err("no object at %d,%d with size %dx%d", aArea.x1, aArea.y1, lv_area_get_width(&aArea), lv_area_get_height(&aArea));
+  return create(obj);
+}
+
+
+void StaticLayers::refresh()
+{
+  for (LayerMap::iterator pos = layerMap.begin(); pos!=layerMap.end(); ++pos) {
+    pos->second->dirty = true;
+    lv_obj_invalidate(pos->first);
+  }
+}
+
+
+void StaticLayers::hideChildren(Layer* aLayer)
+{
+  hidingChildren = true;
+  lv_obj_t* child = NULL;
+  while ((child = lv_obj_get_child(aLayer->obj, child))) {
+    if (aLayer->children.find(child)==aLayer->children.end()) {
+      aLayer->children[child] = lv_obj_get_hidden(child);
+      lv_obj_set_hidden(child, true);
+    }
+  }
+  hidingChildren = false;
+}
+
+
+void StaticLayers::childrenChanged(Layer* aLayer, lv_obj_t* aNewChild)
+{
+  // rebuild from the actual children: entries of deleted children go away without touching them
+  HiddenMap children;
+  lv_obj_t* child = NULL;
+  while ((child = lv_obj_get_child(aLayer->obj, child))) {
+    HiddenMap::iterator pos = aLayer->children.find(child);
+    if (pos!=aLayer->children.end() && child!=aNewChild) children[child] = pos->second;
+  }
+  aLayer->children.swap(children);
+  // a new child (even one at the address of a deleted one) gets its own state recorded and is hidden
+  hideChildren(aLayer);
+}
+
+
+void StaticLayers::releaseLayer(Layer* aLayer)
+{
+  if (aLayer->buffer) {
+    lv_img_cache_invalidate_src(&aLayer->img);
+    delete[] aLayer->buffer;
+    used -= aLayer->bytes;
+  }
+  layerMap.erase(aLayer->obj);
+  delete aLayer;
+}
+
+
+// MARK: - rendering
+
+void StaticLayers::extArea(lv_obj_t* aObj, lv_area_t &aArea)
+{
+  lv_obj_get_coords(aObj, &aArea);
+  aArea.x1 -= aObj->ext_draw_pad;
+  aArea.y1 -= aObj->ext_draw_pad;
+  aArea.x2 += aObj->ext_draw_pad;
+  aArea.y2 += aObj->ext_draw_pad;
+}
+
+
+void StaticLayers::drawTree(lv_obj_t* aObj, const lv_area_t* aMask, bool aIgnoreHidden)
+{
+  if (!aIgnoreHidden && lv_obj_get_hidden(aObj)) return;
+  // same as littlevGL's own refresh: object itself with its extra draw area, children clipped to the object
+  lv_area_t coords;
+  lv_obj_get_coords(aObj, &coords);
+  lv_area_t ext;
+  extArea(aObj, ext);
+  lv_area_t m;
+  if (!lv_area_intersect(&m, aMask, &ext)) return;
+  lv_design_cb_t design = lv_obj_get_design_cb(aObj);
+  design(aObj, &m, LV_DESIGN_DRAW_MAIN);
+  lv_area_t cm;
+  if (lv_area_intersect(&cm, aMask, &coords)) {
+    lv_obj_t* child = NULL;
+    while ((child = lv_obj_get_child_back(aObj, child))) drawTree(child, &cm, false);
+  }
+  design(aObj, &m, LV_DESIGN_DRAW_POST);
+}
+
+
+bool StaticLayers::render(Layer* aLayer)
+{
+  MLMicroSeconds start = MainLoop::now();
+  // the buffer must also hold what the container draws outside its coordinates (e.g. shadow)
+  lv_area_t coords;
+  lv_obj_get_coords(aLayer->obj, &coords);
+  lv_area_t ext;
+  extArea(aLayer->obj, ext);
+  size_t npx = lv_area_get_size(&ext);
+  if (!aLayer->buffer || aLayer->bytes!=npx*sizeof(lv_color_t)) {
+    // (re)allocate
+    if (aLayer->buffer) {
+      lv_img_cache_invalidate_src(&aLayer->img);
+      delete[] aLayer->buffer;
+      used -= aLayer->bytes;
+      aLayer->buffer = NULL;
+    }
+    size_t bytes = npx*sizeof(lv_color_t);
+    if (budget>0 && used+bytes>budget) {
+      LOG(LOG_WARNING, "static layer resized beyond budget, rendering it normally");
+      return false;
+    }
+    aLayer->buffer = new lv_color_t[npx];
+    aLayer->bytes = bytes;
+    used += bytes;
+  }
+  hideChildren(aLayer); // new children
+  // make littlevGL's draw functions render into our buffer (same as lv_canvas does)
+  lv_disp_t disp;
+  memset(&disp, 0, sizeof(disp));
+  lv_disp_buf_t dispBuf;
+  lv_disp_buf_init(&dispBuf, aLayer->buffer, NULL, (uint32_t)npx);
+  dispBuf.area = ext;
+  lv_disp_drv_init(&disp.driver);
+  disp.driver.buffer = &dispBuf;
+  disp.driver.hor_res = lv_disp_get_hor_res(NULL);
+  disp.driver.ver_res = lv_disp_get_ver_res(NULL);
+  disp.driver.antialiasing = lv_disp_get_default()->driver.antialiasing; // as set by the quality governor
+  lv_disp_t* orgDisp = lv_refr_get_disp_refreshing();
+  lv_refr_set_disp_refreshing(&disp);
+  aLayer->orgDesignCB(aLayer->obj, &ext, LV_DESIGN_DRAW_MAIN);
+  lv_obj_t* child = NULL;
+  while ((child = lv_obj_get_child_back(aLayer->obj, child))) {
+    HiddenMap::iterator pos = aLayer->children.find(child);
+    if (pos!=aLayer->children.end() && pos->second) continue; // hidden by itself
+    drawTree(child, &coords, true);
+  }
+  aLayer->orgDesignCB(aLayer->obj, &ext, LV_DESIGN_DRAW_POST);
+  lv_refr_set_disp_refreshing(orgDisp);
+  // image descriptor
+  lv_img_cache_invalidate_src(&aLayer->img);
+  memset(&aLayer->img, 0, sizeof(aLayer->img));
+  aLayer->img.header.cf = LV_IMG_CF_TRUE_COLOR;
+  aLayer->img.header.w = lv_area_get_width(&ext);
+  aLayer->img.header.h = lv_area_get_height(&ext);
+  aLayer->img.data_size = (uint32_t)aLayer->bytes;
+  aLayer->img.data = (const uint8_t*)aLayer->buffer;
+  aLayer->renderedArea = coords;
+  aLayer->bufferArea = ext;
+  aLayer->dirty = false;
+  aLayer->reducedQuality = QualityGovernor::governor().isReduced();
+  aLayer->renderTime = (double)(MainLoop::now()-start)/MilliSecond;
+  renders++;
+  totalRenderTime += aLayer->renderTime;
+  return true;
+}
+
+
+bool StaticLayers::designCB(lv_obj_t* aObj, const lv_area_t* aMask, lv_design_mode_t aMode)
+{
+  StaticLayers& sl = layers();
+  LayerMap::iterator pos = sl.layerMap.find(aObj);
+  if (pos==sl.layerMap.end()) return false; // should not happen
+  Layer* l = pos->second;
+  if (aMode==LV_DESIGN_COVER_CHK) return l->orgDesignCB(aObj, aMask, aMode);
+  if (aMode==LV_DESIGN_DRAW_POST) return true; // already in the buffer
+  lv_area_t coords;
+  lv_obj_get_coords(aObj, &coords);
+  if (
+    l->dirty ||
+    memcmp(&coords, &l->renderedArea, sizeof(coords))!=0 ||
+    (l->reducedQuality && !QualityGovernor::governor().isReduced())
+  ) {
+    if (!sl.render(l)) {
+      // cannot use buffer, draw normally
+      return l->orgDesignCB(aObj, aMask, aMode);
+    }
+  }
+  MLMicroSeconds start = MainLoop::now();
+  lv_draw_img(&l->bufferArea, aMask, &l->img, &lv_style_plain, lv_obj_get_opa_scale(aObj));
+  double t = (double)(MainLoop::now()-start)/MilliSecond;
+  sl.blits++;
+  sl.blitTime += t;
+  // estimate: rendering the masked part normally takes the proportional part of a full rendering
+  lv_area_t m;
+  if (lv_area_intersect(&m, aMask, &l->bufferArea)) {
+    sl.savedTime += l->renderTime*lv_area_get_size(&m)/lv_area_get_size(&l->bufferArea)-t;
+  }
+  return true;
+}
+
+
+lv_res_t StaticLayers::signalCB(lv_obj_t* aObj, lv_signal_t aSign, void* aParam)
+{
+  StaticLayers& sl = layers();
+  LayerMap::iterator pos = sl.layerMap.find(aObj);
+  if (pos==sl.layerMap.end()) return LV_RES_INV; // should not happen
+  Layer* l = pos->second;
+  lv_res_t res = l->orgSignalCB(aObj, aSign, aParam);
+  if (aSign==LV_SIGNAL_CLEANUP) {
+    sl.releaseLayer(l);
+    return res;
+  }
+  if (res!=LV_RES_OK) return res;
+  if (aSign==LV_SIGNAL_CHILD_CHG && !sl.hidingChildren) {
+    // child added (aParam is the new child) or deleted (aParam is NULL)
+    lv_obj_t* newChild = static_cast<lv_obj_t*>(aParam);
+    sl.childrenChanged(l, newChild && lv_obj_get_parent(newChild)==aObj ? newChild : NULL);
+    l->dirty = true;
+  }
+  else if (aSign==LV_SIGNAL_STYLE_CHG || aSign==LV_SIGNAL_CORD_CHG) {
+    l->dirty = true;
+  }
+  return res;
+}
+
+
+// MARK: - statistics
+
+JsonObjectPtr StaticLayers::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("layers", JsonObject::newInt32((int)layerMap.size()));
+  s->add("budget", JsonObject::newInt64(budget));
+  s->add("used", JsonObject::newInt64(used));
+  s->add("renders", JsonObject::newInt64(renders));
+  s->add("renderTime", JsonObject::newDouble(totalRenderTime));
+  s->add("blits", JsonObject::newInt64(blits));
+  s->add("blitTime", JsonObject::newDouble(blitTime));
+  s->add("savedTime", JsonObject::newDouble(savedTime));
+  return s;
+}
@@ -0,0 +1,117 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__staticlayers__
+#define __p44mbcd__staticlayers__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+namespace p44 {
+
+  /// Static layers: containers whose subtree (the container itself and all its children) is
+  /// rendered once into an image buffer, and then drawn by copying that buffer instead of
+  /// rendering gradients, shadows, rounded corners etc. again for every invalidated area.
+  /// The container's children are hidden while it is a static layer. The layer is re-rendered
+  /// when children are added/removed, when the container's style or coordinates change, or when
+  /// refresh() is called (e.g. after changing a child's content or the theme).
+  /// @note static layers must have an opaque background.
+  /// @note the children of a static layer do not get any input: littlevGL skips hidden objects
+  ///   when searching the object under a pointer, so clicks go to the container or the objects behind it.
+  ///   Interactive widgets should be siblings placed on top of the layer, not its children.
+  class StaticLayers : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    typedef std::map<lv_obj_t*, bool> HiddenMap;
+
+    typedef struct {
+      lv_obj_t* obj; ///< the container
+      lv_design_cb_t orgDesignCB; ///< the container's original design callback
+      lv_signal_cb_t orgSignalCB; ///< the container's original signal callback
+      HiddenMap children; ///< direct children and their own hidden state
+      lv_color_t* buffer; ///< the rendered layer
+      size_t bytes; ///< size of buffer
+      lv_img_dsc_t img; ///< image descriptor for the buffer
+      lv_area_t renderedArea; ///< container coordinates the buffer was rendered for
+      lv_area_t bufferArea; ///< area covered by the buffer: container coordinates plus its extra draw area
+      bool dirty; ///< needs re-rendering
+      double renderTime; ///< time the last rendering took in mS
+      bool reducedQuality; ///< rendered while the quality governor had reduced quality
+    } Layer;
+    typedef std::map<lv_obj_t*, Layer*> LayerMap;
+    LayerMap layerMap; ///< all layers by container
+
+    size_t budget; ///< max bytes for layer buffers
+    size_t used; ///< bytes used by layer buffers
+    bool hidingChildren; ///< set while we hide children, to ignore the resulting signals
+
+    // statistics
+    long renders; ///< number of (re)renderings
+    double totalRenderTime; ///< total time spent rendering layers in mS
+    long blits; ///< number of times a layer was drawn from its buffer
+    double blitTime; ///< total time spent drawing from buffers in mS
+    double savedTime; ///< estimated rendering time saved in mS
+
+  public:
+
+    StaticLayers();
+
+    /// get the shared instance
+    static StaticLayers& layers();
+
+    /// set the memory budget
+    /// @param aBudget max number of bytes for all layer buffers
+    void setBudget(size_t aBudget) { budget = aBudget; };
+
+    /// make a container a static layer
+    /// @param aObj the container
+    /// @return error if container is not opaque or budget would be exceeded
+    ErrorPtr create(lv_obj_t* aObj);
+
+    /// make a container a static layer
+    /// @param aArea exact screen coordinates of the container on the active screen
+    /// @return error if no such container exists, or it cannot be made a static layer
+    ErrorPtr createAt(const lv_area_t &aArea);
+
+    /// re-render all layers at next redraw
+    void refresh();
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    void hideChildren(Layer* aLayer);
+    void childrenChanged(Layer* aLayer, lv_obj_t* aNewChild);
+    static void extArea(lv_obj_t* aObj, lv_area_t &aArea);
+    bool render(Layer* aLayer);
+    void drawTree(lv_obj_t* aObj, const lv_area_t* aMask, bool aIgnoreHidden);
+    void releaseLayer(Layer* aLayer);
+    static lv_obj_t* findObj(lv_obj_t* aParent, const lv_area_t &aArea);
+    static bool designCB(lv_obj_t* aObj, const lv_area_t* aMask, lv_design_mode_t aMode);
+    static lv_res_t signalCB(lv_obj_t* aObj, lv_signal_t aSign, void* aParam);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__staticlayers__) */
@@ -0,0 +1,309 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "touchinput.hpp"
+#include "lvglscheduler.hpp"
+#include "scriptedinput.hpp"
+
+#include "lv_drv_conf.h"
+
+#if !defined(__APPLE__)
+  #include <linux/input.h>
+#endif
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+using namespace p44;
+
+#define TOUCH_IDLE_READ_PERIOD LVGL_IDLE_TASK_PERIOD // not touched: events trigger reads
+#define LATENCY_AVG_WEIGHT 16 // moving average over approx this many touches
+
+static TouchInput* touchInputP = NULL;
+
+
+TouchInput::TouchInput() :
+  fd(-1),
+  indev(NULL),
+  kernelTimestamps(false),
+  x(0),
+  y(0),
+  pressed(false),
+  queueIn(0),
+  queueOut(0)
+{
+  memset(&last, 0, sizeof(last));
+  resetStatistics();
+}
+
+
+TouchInput::~TouchInput()
+{
+  close();
+}
+
+
+TouchInput& TouchInput::touchInput()
+{
+  if (!touchInputP) {
+    touchInputP = new TouchInput;
+  }
+  return *touchInputP;
+}
+
+
+ErrorPtr TouchInput::open(const string aDevicePath)
+{
+  #if defined(__APPLE__)
+  return TextError::err("evdev touch input not supported on this platform");
+  #else
+  if (fd>=0) return TextError::err("touch input already open");
+  fd = ::open(aDevicePath.c_str(), O_RDONLY|O_NONBLOCK);
+  if (fd<0) return SysError::errNo("cannot open touch device: ");
+  // have the kernel timestamp events with the monotonic clock the mainloop uses
+  int clk = CLOCK_MONOTONIC;
+  kernelTimestamps = ioctl(fd, EVIOCSCLOCKID, &clk)==0;
+  // replace polled pointer input devices (but not scripted ones, remote display and replay must still work)
+  lv_indev_t* i = lv_indev_get_next(NULL);
+  while (i) {
+    if (i->driver.type==LV_INDEV_TYPE_POINTER && i!=indev && !ScriptedInput::isScriptedInput(i) && i->driver.read_task->prio!=LV_TASK_PRIO_OFF) {
+      ReplacedIndev r;
+      r.indev = i;
+      r.prio = i->driver.read_task->prio;
+      replaced.push_back(r);
+      lv_indev_enable(i, false);
+      lv_task_set_prio(i->driver.read_task, LV_TASK_PRIO_OFF);
+    }
+    i = lv_indev_get_next(i);
+  }
+  if (!indev) {
+    lv_indev_drv_t drv;
+    lv_indev_drv_init(&drv);
+    drv.type = LV_INDEV_TYPE_POINTER;
+    drv.read_cb = &TouchInput::readCB;
+    drv.user_data = this; // marks input device as event driven (see LvglScheduler::setStandby())
+    indev = lv_indev_drv_register(&drv);
+  }
+  else {
+    // re-opened: littlevGL cannot unregister input devices, so close() has only disabled it
+    lv_indev_enable(indev, true);
+    lv_task_set_prio(indev->driver.read_task, LV_TASK_PRIO_MID);
+  }
+  lv_task_set_period(indev->driver.read_task, TOUCH_IDLE_READ_PERIOD);
+  MainLoop::currentMainLoop().registerPollHandler(fd, POLLIN, boost::bind(&TouchInput::readEvents, this, _1, _2));
+  LOG(LOG_NOTICE, "event driven touch input from %s", aDevicePath.c_str());
+  return ErrorPtr();
+  #endif
+}
+
+
+void TouchInput::close()
+{
+  if (fd<0) return;
+  MainLoop::currentMainLoop().unregisterPollHandler(fd);
+  ::close(fd);
+  fd = -1;
+  queueIn = queueOut;
+  if (indev) {
+    // littlevGL has no way to unregister an input device, so just disable it
+    lv_indev_enable(indev, false);
+    lv_task_set_prio(indev->driver.read_task, LV_TASK_PRIO_OFF);
+  }
+  // restore the input devices we have replaced
+  for (ReplacedIndevVector::iterator pos = replaced.begin(); pos!=replaced.end(); ++pos) {
+    lv_indev_enable(pos->indev, true);
+    lv_task_set_prio(pos->indev->driver.read_task, pos->prio);
+  }
+  replaced.clear();
+  LvglScheduler::scheduler().wakeup(); // polled devices need their read task run again
+}
+
+
+bool TouchInput::readEvents(int aFD, int aPollFlags)
+{
+  #if !defined(__APPLE__)
+  if (aPollFlags & POLLIN) {
+    // drain everything that is pending
+    struct input_event ev[16];
+    ssize_t n;
+    while ((n = ::read(aFD, ev, sizeof(ev)))>0) {
+      for (size_t k=0; k<n/sizeof(struct input_event); k++) {
+        const struct input_event &e = ev[k];
+        if (e.type==EV_ABS) {
+          if (e.code==ABS_X || e.code==ABS_MT_POSITION_X) {
+            #if EVDEV_SWAP_AXES
+            y = e.value;
+            #else
+            x = e.value;
+            #endif
+          }
+          else if (e.code==ABS_Y || e.code==ABS_MT_POSITION_Y) {
+            #if EVDEV_SWAP_AXES
+            x = e.value;
+            #else
+            y = e.value;
+            #endif
+          }
+          else if (e.code==ABS_MT_TRACKING_ID) {
+            pressed = e.value>=0;
+          }
+        }
+        else if (e.type==EV_KEY) {
+          if (e.code==BTN_TOUCH || e.code==BTN_MOUSE) {
+            pressed = e.value!=0;
+          }
+        }
+        else if (e.type==EV_SYN && e.code==SYN_REPORT) {
+          pushState(kernelTimestamps ? (MLMicroSeconds)e.time.tv_sec*Second+e.time.tv_usec : MainLoop::now());
+        }
+      }
+    }
+    // process immediately
+    if (indev) {
+      lv_task_set_period(indev->driver.read_task, LV_INDEV_DEF_READ_PERIOD);
+      lv_task_ready(indev->driver.read_task);
+      lv_task_handler();
+      // input might have invalidated something, render it right now
+      if (LvglScheduler::scheduler().cycle()) lv_task_handler();
+      // read period has changed
+      LvglScheduler::scheduler().wakeup();
+    }
+  }
+  else if (aPollFlags & (POLLHUP|POLLERR)) {
+    LOG(LOG_ERR, "touch input device error, closing");
+    close();
+  }
+  #endif
+  return true;
+}
+
+
+void TouchInput::pushState(MLMicroSeconds aWhen)
+{
+  events++;
+  if (latencyStart==Never) latencyStart = aWhen;
+  TouchState* s;
+  if (queueIn-queueOut>=TOUCH_QUEUE_SIZE) {
+    // full: merge into newest entry. Press/release transitions are still seen, only intermediate moves are lost
+    coalesced++;
+    s = &queue[(queueIn-1) & (TOUCH_QUEUE_SIZE-1)];
+  }
+  else {
+    s = &queue[queueIn & (TOUCH_QUEUE_SIZE-1)];
+    queueIn++;
+  }
+  lv_coord_t px = x;
+  lv_coord_t py = y;
+  #if EVDEV_CALIBRATE
+  px = (lv_coord_t)(((int32_t)px-EVDEV_HOR_MIN)*lv_disp_get_hor_res(NULL)/(EVDEV_HOR_MAX-EVDEV_HOR_MIN));
+  py = (lv_coord_t)(((int32_t)py-EVDEV_VER_MIN)*lv_disp_get_ver_res(NULL)/(EVDEV_VER_MAX-EVDEV_VER_MIN));
+  #elif EVDEV_SCALE
+  px = (lv_coord_t)((int32_t)px*lv_disp_get_hor_res(NULL)/EVDEV_SCALE_HOR_RES);
+  py = (lv_coord_t)((int32_t)py*lv_disp_get_ver_res(NULL)/EVDEV_SCALE_VER_RES);
+  #endif
+  if (px<0) px = 0;
+  if (py<0) py = 0;
+  if (px>=lv_disp_get_hor_res(NULL)) px = lv_disp_get_hor_res(NULL)-1;
+  if (py>=lv_disp_get_ver_res(NULL)) py = lv_disp_get_ver_res(NULL)-1;
+  s->x = px;
+  s->y = py;
+  s->pressed = pressed;
+  s->when = aWhen;
+}
+
+
+void TouchInput::rawForPixel(lv_coord_t aX, lv_coord_t aY, int &aRawX, int &aRawY)
+{
+  int32_t rx = aX;
+  int32_t ry = aY;
+  #if EVDEV_CALIBRATE
+  rx = EVDEV_HOR_MIN+(int32_t)aX*(EVDEV_HOR_MAX-EVDEV_HOR_MIN)/lv_disp_get_hor_res(NULL);
+  ry = EVDEV_VER_MIN+(int32_t)aY*(EVDEV_VER_MAX-EVDEV_VER_MIN)/lv_disp_get_ver_res(NULL);
+  #elif EVDEV_SCALE
+  rx = (int32_t)aX*EVDEV_SCALE_HOR_RES/lv_disp_get_hor_res(NULL);
+  ry = (int32_t)aY*EVDEV_SCALE_VER_RES/lv_disp_get_ver_res(NULL);
+  #endif
+  #if EVDEV_SWAP_AXES
+  aRawX = ry;
+  aRawY = rx;
+  #else
+  aRawX = rx;
+  aRawY = ry;
+  #endif
+}
+
+
+bool TouchInput::readCB(lv_indev_drv_t* aDrv, lv_indev_data_t* aData)
+{
+  return static_cast<TouchInput*>(aDrv->user_data)->read(aData);
+}
+
+
+bool TouchInput::read(lv_indev_data_t* aData)
+{
+  if (queueIn!=queueOut) {
+    last = queue[queueOut & (TOUCH_QUEUE_SIZE-1)];
+    queueOut++;
+  }
+  aData->point.x = last.x;
+  aData->point.y = last.y;
+  aData->state = last.pressed ? LV_INDEV_STATE_PR : LV_INDEV_STATE_REL;
+  if (queueIn==queueOut && !last.pressed && !indev->proc.types.pointer.drag_in_prog) {
+    // nothing more to do until next event (while pressed, keep polling for long press detection,
+    // while dragging, for the drag throw after release)
+    lv_task_set_period(indev->driver.read_task, TOUCH_IDLE_READ_PERIOD);
+  }
+  return queueIn!=queueOut; // more to read
+}
+
+
+// MARK: - statistics
+
+void TouchInput::frameRendered()
+{
+  if (latencyStart==Never) return;
+  MLMicroSeconds l = MainLoop::now()-latencyStart;
+  latencyStart = Never;
+  latencySamples++;
+  if (latencySamples==1) avgLatency = l;
+  else avgLatency += ((double)l-avgLatency)/LATENCY_AVG_WEIGHT;
+  if (l>maxLatency) maxLatency = l;
+}
+
+
+void TouchInput::resetStatistics()
+{
+  events = 0;
+  coalesced = 0;
+  latencyStart = Never;
+  latencySamples = 0;
+  avgLatency = 0;
+  maxLatency = 0;
+}
+
+
+JsonObjectPtr TouchInput::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("events", JsonObject::newInt64(events));
+  s->add("coalesced", JsonObject::newInt64(coalesced));
+  s->add("latencySamples", JsonObject::newInt64(latencySamples));
+  s->add("avgTouchToPixel", JsonObject::newDouble(avgLatency/MilliSecond));
+  s->add("maxTouchToPixel", JsonObject::newDouble((double)maxLatency/MilliSecond));
+  return s;
+}
@@ -0,0 +1,120 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__touchinput__
+#define __p44mbcd__touchinput__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+namespace p44 {
+
+  #define TOUCH_QUEUE_SIZE 32 // must be power of 2
+
+  /// Event driven littlevGL pointer input from a linux evdev touch screen.
+  /// The device's fd is monitored by the mainloop, all pending events are drained into a queue
+  /// on every wakeup, and the littlevGL input device read task is run immediately.
+  /// Between touches, the read task is not polled at all.
+  class TouchInput : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    int fd; ///< the evdev device
+    lv_indev_t* indev; ///< the littlevGL input device
+    bool kernelTimestamps; ///< set if event timestamps are on the mainloop's (monotonic) clock
+
+    // polled pointer input devices disabled while open
+    struct ReplacedIndev {
+      lv_indev_t* indev;
+      uint8_t prio; ///< original read task priority
+    };
+    typedef std::vector<ReplacedIndev> ReplacedIndevVector;
+    ReplacedIndevVector replaced;
+
+    // state being assembled from events until SYN_REPORT
+    lv_coord_t x, y;
+    bool pressed;
+
+    // queue of complete states
+    struct TouchState {
+      lv_coord_t x, y;
+      bool pressed;
+      MLMicroSeconds when;
+    };
+    TouchState queue[TOUCH_QUEUE_SIZE];
+    uint32_t queueIn; ///< write index (free running)
+    uint32_t queueOut; ///< read index (free running)
+    TouchState last; ///< last state reported to littlevGL
+
+    // statistics
+    long events; ///< number of complete touch states received
+    long coalesced; ///< number of states merged due to full queue
+    MLMicroSeconds latencyStart; ///< time of oldest event not yet visible on screen, Never if none
+    long latencySamples; ///< number of latency measurements
+    double avgLatency; ///< moving average of touch to pixel latency
+    MLMicroSeconds maxLatency; ///< max touch to pixel latency
+
+  public:
+
+    TouchInput();
+    virtual ~TouchInput();
+
+    /// get the shared instance
+    static TouchInput& touchInput();
+
+    /// open the touch device and register it as littlevGL pointer input, replacing
+    /// the polled pointer input device(s) set up by LvglScheduler::init().
+    /// Scripted pointer input devices (remote display, replay) remain active.
+    /// @param aDevicePath evdev device path such as /dev/input/event0
+    /// @return error if device could not be opened
+    ErrorPtr open(const string aDevicePath);
+
+    /// close the device, disable its littlevGL input device and re-enable the pointer input devices it has replaced
+    void close();
+
+    /// to be called when a frame has been rendered, for touch to pixel latency measurement
+    void frameRendered();
+
+    /// get the raw event values that map to a given display pixel (inverse of the scaling/calibration applied to events)
+    /// @param aX horizontal pixel position
+    /// @param aY vertical pixel position
+    /// @param aRawX value for an ABS_X event
+    /// @param aRawY value for an ABS_Y event
+    static void rawForPixel(lv_coord_t aX, lv_coord_t aY, int &aRawX, int &aRawY);
+
+    /// reset statistics
+    void resetStatistics();
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    bool readEvents(int aFD, int aPollFlags);
+    void pushState(MLMicroSeconds aWhen);
+    static bool readCB(lv_indev_drv_t* aDrv, lv_indev_data_t* aData);
+    bool read(lv_indev_data_t* aData);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__touchinput__) */
@@ -0,0 +1,227 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "touchlatency.hpp"
+#include "touchinput.hpp"
+#include "displaytap.hpp"
+
+#if !defined(__APPLE__)
+  #include <linux/input.h>
+  #include <linux/uinput.h>
+#endif
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+
+using namespace p44;
+
+#define TAP_DURATION (150*MilliSecond) // time between press and release
+#define TAP_INTERVAL (350*MilliSecond) // time between release and next press
+#define DEVICE_WAIT_INTERVAL (100*MilliSecond) // retry interval while waiting for the event device node
+#define DEVICE_WAIT_RETRIES 30
+#define PROBE_SIZE 40
+#define RAW_MAX 4095 // range of the synthetic touch screen's axes
+
+
+TouchLatencyTest::TouchLatencyTest() :
+  uinputFd(-1),
+  probe(NULL),
+  taps(0),
+  tapCount(0),
+  down(false),
+  waitCount(0)
+{
+}
+
+
+TouchLatencyTest::~TouchLatencyTest()
+{
+  stepTicket.cancel();
+  if (probe) lv_obj_del(probe);
+  destroyDevice();
+}
+
+
+ErrorPtr TouchLatencyTest::start(int aTaps, DoneCB aDoneCB)
+{
+  #if defined(__APPLE__)
+  return TextError::err("uinput not supported on this platform");
+  #else
+  if (uinputFd>=0) return TextError::err("touch latency test already running");
+  taps = aTaps;
+  doneCB = aDoneCB;
+  uinputFd = ::open("/dev/uinput", O_WRONLY|O_NONBLOCK);
+  if (uinputFd<0) return SysError::errNo("cannot open /dev/uinput: ");
+  ioctl(uinputFd, UI_SET_EVBIT, EV_SYN);
+  ioctl(uinputFd, UI_SET_EVBIT, EV_KEY);
+  ioctl(uinputFd, UI_SET_KEYBIT, BTN_TOUCH);
+  ioctl(uinputFd, UI_SET_EVBIT, EV_ABS);
+  ioctl(uinputFd, UI_SET_ABSBIT, ABS_X);
+  ioctl(uinputFd, UI_SET_ABSBIT, ABS_Y);
+  struct uinput_user_dev dev;
+  memset(&dev, 0, sizeof(dev));
+  snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "p44mbcd latency test touch");
+  dev.id.bustype = BUS_VIRTUAL;
+  dev.absmax[ABS_X] = RAW_MAX;
+  dev.absmax[ABS_Y] = RAW_MAX;
+  if (write(uinputFd, &dev, sizeof(dev))!=sizeof(dev) || ioctl(uinputFd, UI_DEV_CREATE)<0) {
+    ErrorPtr err = SysError::errNo("cannot create uinput touch screen: ");
+    destroyDevice();
+    return err;
+  }
+  // find the event device the kernel created for it
+  char sysname[64];
+  if (ioctl(uinputFd, UI_GET_SYSNAME(sizeof(sysname)), sysname)<0) {
+    ErrorPtr err = SysError::errNo("cannot get uinput device name: ");
+    destroyDevice();
+    return err;
+  }
+  string sysdir = string_format("/sys/devices/virtual/input/%s", sysname);
+  DIR* d = opendir(sysdir.c_str());
+  if (d) {
+    struct dirent* e;
+    while ((e = readdir(d))!=NULL) {
+      if (strncmp(e->d_name, "event", 5)==0) {
+        eventDevice = string_format("/dev/input/%s", e->d_name);
+        break;
+      }
+    }
+    closedir(d);
+  }
+  if (eventDevice.empty()) {
+    destroyDevice();
+    return TextError::err("no event device found in %s", sysdir.c_str());
+  }
+  // the probe
+  probe = lv_btn_create(lv_layer_top(), NULL);
+  lv_obj_set_size(probe, PROBE_SIZE, PROBE_SIZE);
+  lv_obj_align(probe, NULL, LV_ALIGN_CENTER, 0, 0);
+  // device node is created asynchronously by udev/mdev
+  waitCount = 0;
+  waitForDevice();
+  return ErrorPtr();
+  #endif
+}
+
+
+void TouchLatencyTest::waitForDevice()
+{
+  if (access(eventDevice.c_str(), R_OK)!=0) {
+    if (++waitCount>DEVICE_WAIT_RETRIES) {
+      done(TextError::err("event device %s did not appear", eventDevice.c_str()));
+      return;
+    }
+    stepTicket.executeOnce(boost::bind(&TouchLatencyTest::waitForDevice, this), DEVICE_WAIT_INTERVAL);
+    return;
+  }
+  ErrorPtr err = TouchInput::touchInput().open(eventDevice);
+  if (Error::notOK(err)) {
+    done(err);
+    return;
+  }
+  DisplayTap::tap().setFrameHandler(boost::bind(&TouchInput::frameRendered, &TouchInput::touchInput()));
+  LOG(LOG_NOTICE, "touch latency test: tapping %d times via %s", taps, eventDevice.c_str());
+  TouchInput::touchInput().resetStatistics();
+  tapCount = 0;
+  down = false;
+  stepTicket.executeOnce(boost::bind(&TouchLatencyTest::step, this), TAP_INTERVAL);
+}
+
+
+void TouchLatencyTest::emit(uint16_t aType, uint16_t aCode, int32_t aValue)
+{
+  #if !defined(__APPLE__)
+  struct input_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.type = aType;
+  ev.code = aCode;
+  ev.value = aValue;
+  if (write(uinputFd, &ev, sizeof(ev))<0) {
+    LOG(LOG_WARNING, "touch latency test: cannot write event: %s", Error::text(SysError::errNo()));
+  }
+  #endif
+}
+
+
+void TouchLatencyTest::step()
+{
+  #if !defined(__APPLE__)
+  if (!down) {
+    if (tapCount>=taps) {
+      done(ErrorPtr());
+      return;
+    }
+    // touch the center of the probe
+    int rx, ry;
+    TouchInput::rawForPixel(
+      (probe->coords.x1+probe->coords.x2)/2, (probe->coords.y1+probe->coords.y2)/2,
+      rx, ry
+    );
+    emit(EV_ABS, ABS_X, rx);
+    emit(EV_ABS, ABS_Y, ry);
+    emit(EV_KEY, BTN_TOUCH, 1);
+    emit(EV_SYN, SYN_REPORT, 0);
+    down = true;
+    stepTicket.executeOnce(boost::bind(&TouchLatencyTest::step, this), TAP_DURATION);
+  }
+  else {
+    emit(EV_KEY, BTN_TOUCH, 0);
+    emit(EV_SYN, SYN_REPORT, 0);
+    down = false;
+    tapCount++;
+    stepTicket.executeOnce(boost::bind(&TouchLatencyTest::step, this), TAP_INTERVAL);
+  }
+  #endif
+}
+
+
+void TouchLatencyTest::done(ErrorPtr aError)
+{
+  JsonObjectPtr results;
+  if (Error::notOK(aError)) {
+    LOG(LOG_ERR, "touch latency test failed: %s", Error::text(aError));
+  }
+  else {
+    results = TouchInput::touchInput().statistics();
+    results->add("taps", JsonObject::newInt32(tapCount));
+  }
+  DisplayTap::tap().setFrameHandler(NULL);
+  TouchInput::touchInput().close();
+  if (probe) {
+    lv_obj_del(probe);
+    probe = NULL;
+  }
+  destroyDevice();
+  if (doneCB) {
+    DoneCB cb = doneCB;
+    doneCB = NULL;
+    cb(results);
+  }
+}
+
+
+void TouchLatencyTest::destroyDevice()
+{
+  if (uinputFd<0) return;
+  #if !defined(__APPLE__)
+  ioctl(uinputFd, UI_DEV_DESTROY);
+  #endif
+  ::close(uinputFd);
+  uinputFd = -1;
+}
@@ -0,0 +1,79 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__touchlatency__
+#define __p44mbcd__touchlatency__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+namespace p44 {
+
+  /// Measures touch to pixel latency with a synthetic touch screen created via uinput.
+  /// The synthetic device is opened by TouchInput like a real one, so the measurement covers the entire
+  /// path from the kernel event timestamp through the mainloop, littlevGL and flushing the frame to the display.
+  /// Taps go to a probe button on the top layer, which changes its appearance on press and on release.
+  class TouchLatencyTest : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+  public:
+
+    /// called when the test is complete
+    typedef boost::function<void (JsonObjectPtr aResults)> DoneCB;
+
+  private:
+
+    int uinputFd; ///< the uinput device
+    string eventDevice; ///< path of the event device created for it
+    lv_obj_t* probe; ///< the probe button
+    int taps; ///< number of taps to do
+    int tapCount; ///< taps done so far
+    bool down; ///< set while touching
+    int waitCount; ///< retries waiting for the event device node
+    MLTicket stepTicket;
+    DoneCB doneCB;
+
+  public:
+
+    TouchLatencyTest();
+    virtual ~TouchLatencyTest();
+
+    /// create the synthetic touch screen, open it via TouchInput and start tapping
+    /// @param aTaps number of taps (each measures press and release)
+    /// @param aDoneCB called with the TouchInput statistics when done
+    /// @return error if uinput is not available
+    ErrorPtr start(int aTaps, DoneCB aDoneCB);
+
+  private:
+
+    void waitForDevice();
+    void step();
+    void emit(uint16_t aType, uint16_t aCode, int32_t aValue);
+    void done(ErrorPtr aError);
+    void destroyDevice();
+
+  };
+  typedef boost::intrusive_ptr<TouchLatencyTest> TouchLatencyTestPtr;
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__touchlatency__) */
@@ -0,0 +1,288 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "trendcharts.hpp"
+
+using namespace p44;
+
+
+TrendCharts::TrendCharts() :
+  sampling(false),
+  sampleInterval(Never),
+  samples(0),
+  newColumns(0),
+  invalidatedPixels(0),
+  chartPixels(0)
+{
+}
+
+
+TrendCharts::~TrendCharts()
+{
+  sampleTicket.cancel();
+  while (!charts.empty()) lv_obj_del(charts.begin()->second->obj);
+}
+
+
+void TrendCharts::create(const string aName, lv_obj_t* aParent, const lv_area_t &aArea, double aMinValue, double aMaxValue, int aSamplesPerColumn, lv_color_t aColor, bool aScroll)
+{
+  remove(aName);
+  Chart* c = new Chart();
+  c->owner = this;
+  c->obj = lv_obj_create(aParent, NULL);
+  lv_obj_set_pos(c->obj, aArea.x1, aArea.y1);
+  lv_obj_set_size(c->obj, lv_area_get_width(&aArea), lv_area_get_height(&aArea));
+  c->columns.resize(lv_area_get_width(&aArea));
+  c->head = 0;
+  c->samplesPerColumn = aSamplesPerColumn>0 ? aSamplesPerColumn : 1;
+  c->samplesInColumn = 0;
+  c->minValue = aMinValue;
+  c->maxValue = aMaxValue!=aMinValue ? aMaxValue : aMinValue+1;
+  c->scroll = aScroll;
+  c->reg = -1;
+  c->scale = 1;
+  lv_style_copy(&c->lineStyle, &lv_style_plain);
+  c->lineStyle.body.main_color = aColor;
+  c->lineStyle.body.grad_color = aColor;
+  c->orgDesignCB = lv_obj_get_design_cb(c->obj);
+  lv_obj_set_design_cb(c->obj, &TrendCharts::designCB);
+  lv_obj_set_user_data(c->obj, c);
+  lv_obj_set_event_cb(c->obj, &TrendCharts::eventCB);
+  charts[aName] = c;
+}
+
+
+void TrendCharts::remove(const string aName)
+{
+  ChartMap::iterator pos = charts.find(aName);
+  if (pos==charts.end()) return;
+  lv_obj_del(pos->second->obj); // eventCB does the rest
+}
+
+
+void TrendCharts::eventCB(lv_obj_t* aObj, lv_event_t aEvent)
+{
+  if (aEvent!=LV_EVENT_DELETE) return;
+  Chart* c = static_cast<Chart*>(lv_obj_get_user_data(aObj));
+  TrendCharts* owner = c->owner;
+  ChartMap &cm = owner->charts;
+  for (ChartMap::iterator pos = cm.begin(); pos!=cm.end(); ++pos) {
+    if (pos->second==c) {
+      cm.erase(pos);
+      break;
+    }
+  }
+  delete c;
+  owner->updateSampling();
+}
+
+
+// MARK: - samples
+
+bool TrendCharts::addSample(const string aName, double aValue)
+{
+  ChartMap::iterator pos = charts.find(aName);
+  if (pos==charts.end()) return false;
+  add(pos->second, aValue);
+  return true;
+}
+
+
+void TrendCharts::add(Chart* aChart, double aValue)
+{
+  samples++;
+  lv_coord_t h = lv_obj_get_height(aChart->obj);
+  double rel = (aValue-aChart->minValue)/(aChart->maxValue-aChart->minValue);
+  if (rel<0) rel = 0;
+  if (rel>1) rel = 1;
+  lv_coord_t y = (lv_coord_t)((1-rel)*(h-1)+0.5);
+  int n = (int)aChart->columns.size();
+  bool advanced = false;
+  if (aChart->samplesInColumn>=aChart->samplesPerColumn) {
+    // start next column
+    aChart->head = (aChart->head+1)%n;
+    aChart->samplesInColumn = 0;
+    advanced = true;
+    newColumns++;
+    if (aChart->scroll) {
+      // all columns move
+      aChart->columns[aChart->head].valid = false;
+      invalidateColumns(aChart, 0, n);
+    }
+  }
+  Column &col = aChart->columns[aChart->head];
+  if (aChart->samplesInColumn==0) {
+    col.min = y;
+    col.max = y;
+    col.valid = true;
+  }
+  else {
+    if (y<col.min) col.min = y;
+    if (y>col.max) col.max = y;
+  }
+  col.last = y;
+  aChart->samplesInColumn++;
+  if (!aChart->scroll) {
+    // new head column, and when advancing, the new gap column and the now oldest column which is no longer connected
+    invalidateColumns(aChart, aChart->head, advanced ? 3 : 1);
+  }
+  else if (aChart->samplesInColumn>1) {
+    invalidateColumns(aChart, aChart->head, 1);
+  }
+}
+
+
+lv_coord_t TrendCharts::columnX(Chart* aChart, int aColumn)
+{
+  int n = (int)aChart->columns.size();
+  if (aChart->scroll) {
+    // head is the rightmost column
+    return (aColumn-aChart->head-1+2*n)%n;
+  }
+  return aColumn;
+}
+
+
+void TrendCharts::invalidateColumns(Chart* aChart, int aFirst, int aCount)
+{
+  lv_area_t coords;
+  lv_obj_get_coords(aChart->obj, &coords);
+  chartPixels += lv_area_get_size(&coords);
+  int n = (int)aChart->columns.size();
+  if (aCount>=n) {
+    lv_obj_invalidate(aChart->obj);
+    invalidatedPixels += lv_area_get_size(&coords);
+    return;
+  }
+  for (int i=0; i<aCount; i++) {
+    lv_area_t a = coords;
+    a.x1 = coords.x1+columnX(aChart, (aFirst+i)%n);
+    a.x2 = a.x1;
+    lv_inv_area(lv_obj_get_disp(aChart->obj), &a);
+    invalidatedPixels += lv_area_get_size(&a);
+  }
+}
+
+
+// MARK: - drawing
+
+bool TrendCharts::designCB(lv_obj_t* aObj, const lv_area_t* aMask, lv_design_mode_t aMode)
+{
+  Chart* c = static_cast<Chart*>(lv_obj_get_user_data(aObj));
+  bool res = c->orgDesignCB(aObj, aMask, aMode); // background
+  if (aMode!=LV_DESIGN_DRAW_MAIN) return res;
+  lv_area_t coords;
+  lv_obj_get_coords(aObj, &coords);
+  int n = (int)c->columns.size();
+  lv_opa_t opaScale = lv_obj_get_opa_scale(aObj);
+  // only the columns within the mask
+  lv_coord_t fromX = LV_MATH_MAX(aMask->x1, coords.x1)-coords.x1;
+  lv_coord_t toX = LV_MATH_MIN(aMask->x2, coords.x2)-coords.x1;
+  for (lv_coord_t x=fromX; x<=toX; x++) {
+    int i = c->scroll ? (x+c->head+1)%n : x;
+    if (!c->scroll && i==(c->head+1)%n) continue; // gap after the cursor
+    const Column &col = c->columns[i];
+    if (!col.valid) continue;
+    lv_coord_t y1 = col.min;
+    lv_coord_t y2 = col.max;
+    // connect to the previous column
+    int p = (i-1+n)%n;
+    if (p!=c->head && c->columns[p].valid && (c->scroll || p!=(c->head+1)%n)) {
+      if (c->columns[p].last<y1) y1 = c->columns[p].last;
+      if (c->columns[p].last>y2) y2 = c->columns[p].last;
+    }
+    lv_area_t a;
+    a.x1 = coords.x1+x;
+    a.x2 = a.x1;
+    a.y1 = coords.y1+y1;
+    a.y2 = coords.y1+y2;
+    lv_draw_rect(&a, aMask, &c->lineStyle, opaScale);
+  }
+  return res;
+}
+
+
+// MARK: - register binding
+
+bool TrendCharts::bindRegister(const string aName, int aRegister, bool aSigned, double aScale, double aOffset)
+{
+  ChartMap::iterator pos = charts.find(aName);
+  if (pos==charts.end()) return false;
+  Chart* c = pos->second;
+  c->reg = aRegister;
+  c->sign = aSigned;
+  c->scale = aScale;
+  c->offset = aOffset;
+  updateSampling();
+  return true;
+}
+
+
+void TrendCharts::setRegisterReader(RegisterReader aReader, MLMicroSeconds aInterval)
+{
+  registerReader = aReader;
+  sampleInterval = aInterval;
+  updateSampling();
+}
+
+
+void TrendCharts::updateSampling()
+{
+  // only wake up while there is a register bound chart to sample
+  bool bound = false;
+  for (ChartMap::iterator pos = charts.begin(); pos!=charts.end(); ++pos) {
+    if (pos->second->reg>=0) {
+      bound = true;
+      break;
+    }
+  }
+  if (!registerReader || !bound) {
+    sampleTicket.cancel();
+    sampling = false;
+  }
+  else if (!sampling) {
+    sampling = true;
+    sampleTicket.executeOnce(boost::bind(&TrendCharts::sampleRegisters, this), sampleInterval);
+  }
+}
+
+
+void TrendCharts::sampleRegisters()
+{
+  sampling = false;
+  for (ChartMap::iterator pos = charts.begin(); pos!=charts.end(); ++pos) {
+    Chart* c = pos->second;
+    if (c->reg<0) continue;
+    uint16_t v = registerReader(c->reg);
+    add(c, (c->sign ? (int16_t)v : v)*c->scale+c->offset);
+  }
+  updateSampling();
+}
+
+
+JsonObjectPtr TrendCharts::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("charts", JsonObject::newInt32((int)charts.size()));
+  s->add("samples", JsonObject::newInt64(samples));
+  s->add("newColumns", JsonObject::newInt64(newColumns));
+  s->add("invalidatedPixels", JsonObject::newInt64(invalidatedPixels));
+  s->add("chartPixels", JsonObject::newInt64(chartPixels));
+  return s;
+}
@@ -0,0 +1,138 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__trendcharts__
+#define __p44mbcd__trendcharts__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+namespace p44 {
+
+  /// Streaming trend charts for register or script values.
+  /// Each chart keeps a ring buffer with one entry per pixel column, holding min/max/last of the
+  /// samples decimated into that column, so adding a sample is O(1) regardless of history length.
+  /// In sweep mode (default), new columns are drawn at a moving cursor overwriting the oldest ones,
+  /// so only the cursor columns need to be redrawn. In scroll mode, the newest column is always at
+  /// the right edge, which requires redrawing the entire plot for every new column.
+  class TrendCharts : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+  public:
+
+    /// reads a register
+    typedef boost::function<uint16_t (int aAddress)> RegisterReader;
+
+  private:
+
+    typedef struct {
+      lv_coord_t min; ///< topmost y (relative to chart) of the column's samples
+      lv_coord_t max; ///< bottommost y of the column's samples
+      lv_coord_t last; ///< y of the column's last sample
+      bool valid; ///< set when the column has samples
+    } Column;
+
+    typedef struct {
+      TrendCharts* owner;
+      lv_obj_t* obj; ///< the chart object
+      lv_design_cb_t orgDesignCB; ///< original design callback (draws the background)
+      lv_style_t lineStyle; ///< style for drawing the trend line
+      std::vector<Column> columns; ///< ring buffer, one entry per pixel column
+      int head; ///< column currently being filled
+      int samplesPerColumn; ///< decimation
+      int samplesInColumn; ///< samples in the head column so far
+      double minValue; ///< value at bottom
+      double maxValue; ///< value at top
+      bool scroll; ///< scroll mode instead of sweep mode
+      int reg; ///< register to sample, -1 if none
+      bool sign; ///< register is signed
+      double scale; ///< register value scaling
+      double offset; ///< register value offset
+    } Chart;
+    typedef std::map<string, Chart*> ChartMap;
+    ChartMap charts;
+
+    RegisterReader registerReader; ///< reads registers
+    MLTicket sampleTicket; ///< register sampling, only armed while charts are bound to registers
+    bool sampling; ///< set while sampleTicket is armed
+    MLMicroSeconds sampleInterval; ///< register sampling interval
+
+    // statistics
+    long samples; ///< number of samples added
+    long newColumns; ///< number of columns completed
+    uint64_t invalidatedPixels; ///< pixels invalidated
+    uint64_t chartPixels; ///< pixels a full chart redraw would have invalidated
+
+  public:
+
+    TrendCharts();
+    virtual ~TrendCharts();
+
+    /// create a trend chart
+    /// @param aName name of the chart, replaces existing chart with same name
+    /// @param aParent parent object
+    /// @param aArea position and size within parent
+    /// @param aMinValue value shown at the bottom
+    /// @param aMaxValue value shown at the top
+    /// @param aSamplesPerColumn number of samples decimated into one pixel column
+    /// @param aColor line color
+    /// @param aScroll if set, use scroll mode instead of sweep mode
+    void create(const string aName, lv_obj_t* aParent, const lv_area_t &aArea, double aMinValue, double aMaxValue, int aSamplesPerColumn, lv_color_t aColor, bool aScroll);
+
+    /// remove a chart
+    /// @param aName name of the chart
+    void remove(const string aName);
+
+    /// add a sample
+    /// @param aName name of the chart
+    /// @param aValue the sample value
+    /// @return false if no chart with that name exists
+    bool addSample(const string aName, double aValue);
+
+    /// let chart sample a register, scaled as aValue = reg*aScale+aOffset
+    /// @return false if no chart with that name exists
+    bool bindRegister(const string aName, int aRegister, bool aSigned, double aScale, double aOffset);
+
+    /// set the register reader and start sampling registers bound to charts
+    /// @param aReader function to read registers
+    /// @param aInterval sampling interval
+    void setRegisterReader(RegisterReader aReader, MLMicroSeconds aInterval);
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    void add(Chart* aChart, double aValue);
+    void invalidateColumns(Chart* aChart, int aFirst, int aCount);
+    lv_coord_t columnX(Chart* aChart, int aColumn);
+    void updateSampling();
+    void sampleRegisters();
+    static bool designCB(lv_obj_t* aObj, const lv_area_t* aMask, lv_design_mode_t aMode);
+    static void eventCB(lv_obj_t* aObj, lv_event_t aEvent);
+
+  };
+  typedef boost::intrusive_ptr<TrendCharts> TrendChartsPtr;
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__trendcharts__) */
@@ -0,0 +1,320 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "uibenchmark.hpp"
+#include "displaytap.hpp"
+#include "valuelabels.hpp"
+#include "trendcharts.hpp"
+
+#include <algorithm>
+#include <math.h>
+
+using namespace p44;
+
+#define BENCH_STEP_INTERVAL (20*MilliSecond)
+#define BENCH_LABELS 30 // number of labels updated in the "labels" and "valuelabels" phases
+#define BENCH_LABEL_COLS 3
+#define BENCH_SCROLL_ITEMS 60 // number of items in the "scroll" phase's list
+
+
+UiBenchmark::UiBenchmark() :
+  phaseDuration(0),
+  currentPhase(0),
+  phaseObj(NULL),
+  phaseScreen(NULL),
+  prevScreen(NULL),
+  stepCount(0),
+  phaseEnd(Never)
+{
+}
+
+
+UiBenchmark::~UiBenchmark()
+{
+  stepTicket.cancel();
+  DisplayTap::tap().setFrameHandler(NULL);
+}
+
+
+void UiBenchmark::addPhase(const string aName, SetupFunc aSetup, StepFunc aStep)
+{
+  Phase p;
+  p.name = aName;
+  p.setup = aSetup;
+  p.step = aStep;
+  phases.push_back(p);
+}
+
+
+void UiBenchmark::invalidateStep(lv_obj_t* aObj, int aStep)
+{
+  lv_obj_invalidate(lv_scr_act());
+}
+
+
+// MARK: - standard phases
+
+static lv_obj_t* animationSetup(lv_obj_t* aScreen)
+{
+  lv_obj_t* obj = lv_btn_create(aScreen, NULL);
+  lv_obj_set_size(obj, lv_obj_get_width(aScreen)/4, lv_obj_get_height(aScreen)/4);
+  lv_obj_t* label = lv_label_create(obj, NULL);
+  lv_label_set_text(label, "Animation");
+  lv_anim_t a;
+  lv_anim_init(&a);
+  lv_anim_set_exec_cb(&a, obj, (lv_anim_exec_xcb_t)lv_obj_set_x);
+  lv_anim_set_values(&a, 0, lv_obj_get_width(aScreen)-lv_obj_get_width(obj));
+  lv_anim_set_time(&a, 1000, 0);
+  lv_anim_set_playback(&a, 0);
+  lv_anim_set_repeat(&a, 0);
+  lv_anim_create(&a);
+  return obj;
+}
+
+static void animationStep(lv_obj_t* aObj, int aStep)
+{
+  // nothing to do, animation runs by itself
+}
+
+
+static lv_obj_t* scrollSetup(lv_obj_t* aScreen)
+{
+  lv_obj_t* list = lv_list_create(aScreen, NULL);
+  lv_obj_set_size(list, lv_obj_get_width(aScreen), lv_obj_get_height(aScreen));
+  for (int i=0; i<BENCH_SCROLL_ITEMS; i++) {
+    lv_list_add_btn(list, LV_SYMBOL_FILE, string_format("List item #%d", i).c_str());
+  }
+  return list;
+}
+
+static void scrollStep(lv_obj_t* aObj, int aStep)
+{
+  // scroll down 3/4 of the way, then back up
+  lv_list_set_anim_time(aObj, 0);
+  int dir = (aStep/(BENCH_SCROLL_ITEMS*3/4)) & 1 ? 1 : -1;
+  lv_page_scroll_ver(aObj, dir*lv_obj_get_height(aObj)/20);
+}
+
+
+static lv_obj_t* labelsSetup(lv_obj_t* aScreen)
+{
+  lv_coord_t w = lv_obj_get_width(aScreen)/BENCH_LABEL_COLS;
+  lv_coord_t h = lv_obj_get_height(aScreen)/(BENCH_LABELS/BENCH_LABEL_COLS);
+  for (int i=0; i<BENCH_LABELS; i++) {
+    lv_obj_t* label = lv_label_create(aScreen, NULL);
+    lv_obj_set_pos(label, (i%BENCH_LABEL_COLS)*w, (i/BENCH_LABEL_COLS)*h);
+    lv_label_set_text(label, "0");
+  }
+  return aScreen;
+}
+
+static void labelsStep(lv_obj_t* aObj, int aStep)
+{
+  int i = 0;
+  lv_obj_t* label = NULL;
+  while ((label = lv_obj_get_child_back(aObj, label))) {
+    lv_label_set_text(label, string_format("%d.%02d", aStep, (aStep*7+i*13)%100).c_str());
+    i++;
+  }
+}
+
+
+static lv_obj_t* valueLabelsSetup(ValueLabelsPtr aValueLabels, lv_obj_t* aScreen)
+{
+  lv_coord_t w = lv_obj_get_width(aScreen)/BENCH_LABEL_COLS;
+  lv_coord_t h = lv_obj_get_height(aScreen)/(BENCH_LABELS/BENCH_LABEL_COLS);
+  for (int i=0; i<BENCH_LABELS; i++) {
+    aValueLabels->create(string_format("v%d", i), aScreen, (i%BENCH_LABEL_COLS)*w, (i/BENCH_LABEL_COLS)*h, NULL, "%.2f");
+  }
+  return aScreen;
+}
+
+static void valueLabelsStep(ValueLabelsPtr aValueLabels, lv_obj_t* aObj, int aStep)
+{
+  // same texts as labelsStep()
+  for (int i=0; i<BENCH_LABELS; i++) {
+    aValueLabels->setValue(string_format("v%d", i), aStep+(double)((aStep*7+i*13)%100)/100);
+  }
+}
+
+
+static lv_obj_t* trendSetup(TrendChartsPtr aTrendCharts, bool aScroll, lv_obj_t* aScreen)
+{
+  lv_area_t a;
+  a.x1 = 0;
+  a.y1 = 0;
+  a.x2 = lv_obj_get_width(aScreen)-1;
+  a.y2 = lv_obj_get_height(aScreen)/2-1;
+  aTrendCharts->create("bench", aScreen, a, -1, 1, 1, LV_COLOR_GREEN, aScroll);
+  return aScreen;
+}
+
+static void trendStep(TrendChartsPtr aTrendCharts, lv_obj_t* aObj, int aStep)
+{
+  aTrendCharts->addSample("bench", sin(aStep*0.1)*0.8+((aStep*37)%11-5)*0.02);
+}
+
+
+void UiBenchmark::addStandardPhases()
+{
+  addPhase("animation", &animationSetup, &animationStep);
+  addPhase("scroll", &scrollSetup, &scrollStep);
+  addPhase("labels", &labelsSetup, &labelsStep);
+  ValueLabelsPtr vl = ValueLabelsPtr(new ValueLabels);
+  addPhase("valuelabels", boost::bind(&valueLabelsSetup, vl, _1), boost::bind(&valueLabelsStep, vl, _1, _2));
+  TrendChartsPtr tc = TrendChartsPtr(new TrendCharts);
+  addPhase("trendsweep", boost::bind(&trendSetup, tc, false, _1), boost::bind(&trendStep, tc, _1, _2));
+  addPhase("trendscroll", boost::bind(&trendSetup, tc, true, _1), boost::bind(&trendStep, tc, _1, _2));
+}
+
+
+// MARK: - running
+
+void UiBenchmark::run(MLMicroSeconds aPhaseDuration, DoneCB aDoneCB)
+{
+  phaseDuration = aPhaseDuration;
+  doneCB = aDoneCB;
+  results = JsonObject::newObj();
+  currentPhase = 0;
+  prevScreen = lv_scr_act();
+  DisplayTap::tap().setFrameHandler(boost::bind(&UiBenchmark::frameRendered, this));
+  startPhase();
+}
+
+
+void UiBenchmark::startPhase()
+{
+  if (currentPhase>=phases.size()) {
+    // all done
+    DisplayTap::tap().setFrameHandler(NULL);
+    if (doneCB) {
+      DoneCB cb = doneCB;
+      doneCB = NULL;
+      cb(results);
+    }
+    return;
+  }
+  Phase& p = phases[currentPhase];
+  LOG(LOG_NOTICE, "UI benchmark: starting phase '%s'", p.name.c_str());
+  phaseScreen = lv_obj_create(NULL, NULL);
+  lv_scr_load(phaseScreen);
+  phaseObj = p.setup(phaseScreen);
+  lv_obj_invalidate(lv_scr_act());
+  samples.clear();
+  stepCount = 0;
+  phaseEnd = MainLoop::now()+phaseDuration;
+  stepTicket.executeOnce(boost::bind(&UiBenchmark::step, this), BENCH_STEP_INTERVAL);
+}
+
+
+void UiBenchmark::step()
+{
+  if (MainLoop::now()>=phaseEnd) {
+    finishPhase();
+    return;
+  }
+  Phase& p = phases[currentPhase];
+  p.step(phaseObj, stepCount++);
+  stepTicket.executeOnce(boost::bind(&UiBenchmark::step, this), BENCH_STEP_INTERVAL);
+}
+
+
+void UiBenchmark::frameRendered()
+{
+  if (phaseEnd==Never) return; // not in a phase
+  FrameSample s;
+  s.renderTime = DisplayTap::tap().getLastFrameTime();
+  s.flushTime = DisplayTap::tap().getLastFrameFlushTime();
+  s.pixels = DisplayTap::tap().getLastFramePixels();
+  samples.push_back(s);
+}
+
+
+static double percentile(std::vector<double>& aSorted, int aPercent)
+{
+  if (aSorted.empty()) return 0;
+  size_t i = (aSorted.size()-1)*aPercent/100;
+  return aSorted[i];
+}
+
+
+static JsonObjectPtr distribution(std::vector<double>& aValues)
+{
+  JsonObjectPtr d = JsonObject::newObj();
+  std::sort(aValues.begin(), aValues.end());
+  double sum = 0;
+  for (size_t i=0; i<aValues.size(); i++) sum += aValues[i];
+  d->add("avg", JsonObject::newDouble(aValues.empty() ? 0 : sum/aValues.size()));
+  d->add("p50", JsonObject::newDouble(percentile(aValues, 50)));
+  d->add("p99", JsonObject::newDouble(percentile(aValues, 99)));
+  d->add("max", JsonObject::newDouble(aValues.empty() ? 0 : aValues.back()));
+  return d;
+}
+
+
+bool UiBenchmark::isScreen(lv_obj_t* aObj)
+{
+  // the screen active before the benchmark might have been replaced by a JSON phase meanwhile
+  lv_disp_t* disp = lv_disp_get_default();
+  lv_obj_t* scr;
+  LV_LL_READ(disp->scr_ll, scr) {
+    if (scr==aObj) return true;
+  }
+  return false;
+}
+
+
+void UiBenchmark::finishPhase()
+{
+  Phase& p = phases[currentPhase];
+  phaseEnd = Never;
+  std::vector<double> render, flush;
+  uint64_t pixels = 0;
+  for (SampleVector::iterator pos = samples.begin(); pos!=samples.end(); ++pos) {
+    render.push_back(pos->renderTime);
+    flush.push_back(pos->flushTime);
+    pixels += pos->pixels;
+  }
+  JsonObjectPtr r = JsonObject::newObj();
+  r->add("frames", JsonObject::newInt64(samples.size()));
+  r->add("steps", JsonObject::newInt32(stepCount));
+  r->add("renderTime", distribution(render));
+  r->add("flushTime", distribution(flush));
+  r->add("pixelsTotal", JsonObject::newInt64(pixels));
+  r->add("pixelsPerFrame", JsonObject::newDouble(samples.empty() ? 0 : (double)pixels/samples.size()));
+  results->add(p.name.c_str(), r);
+  LOG(LOG_NOTICE, "UI benchmark: phase '%s' done: %s", p.name.c_str(), r->json_c_str());
+  // get rid of the phase's objects, but only those the benchmark created itself:
+  // screens loaded by the setup (e.g. JSON defined ones) belong to their creator
+  lv_anim_del(phaseObj, NULL);
+  if (prevScreen && isScreen(prevScreen)) {
+    lv_scr_load(prevScreen);
+    lv_obj_del(phaseScreen);
+  }
+  else {
+    // screen to return to is gone, keep ours (emptied) as the one to return to
+    lv_obj_clean(phaseScreen);
+    lv_scr_load(phaseScreen);
+    prevScreen = phaseScreen;
+  }
+  phaseScreen = NULL;
+  phaseObj = NULL;
+  currentPhase++;
+  startPhase();
+}
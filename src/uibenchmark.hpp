@@ -0,0 +1,110 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__uibenchmark__
+#define __p44mbcd__uibenchmark__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+namespace p44 {
+
+  /// Runs a series of rendering workloads (animation, scrolling, label updates, full redraws of
+  /// the demo screen and of JSON defined screens) and collects per frame render time, flush time
+  /// and rendered pixels from DisplayTap. Meant to run in headless mode.
+  class UiBenchmark : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+  public:
+
+    /// sets up a phase's screen, returns the object the step function works on
+    typedef boost::function<lv_obj_t* (lv_obj_t* aScreen)> SetupFunc;
+    /// advances a phase's workload by one step
+    typedef boost::function<void (lv_obj_t* aObj, int aStep)> StepFunc;
+    /// called when benchmark is complete
+    typedef boost::function<void (JsonObjectPtr aResults)> DoneCB;
+
+  private:
+
+    typedef struct {
+      string name;
+      SetupFunc setup;
+      StepFunc step;
+    } Phase;
+    typedef std::vector<Phase> PhaseVector;
+    PhaseVector phases;
+
+    typedef struct {
+      uint32_t renderTime;
+      double flushTime;
+      uint32_t pixels;
+    } FrameSample;
+    typedef std::vector<FrameSample> SampleVector;
+    SampleVector samples; ///< samples of the current phase
+
+    MLMicroSeconds phaseDuration; ///< duration of each phase
+    size_t currentPhase; ///< index of current phase
+    lv_obj_t* phaseObj; ///< object the current phase works on
+    lv_obj_t* phaseScreen; ///< screen the benchmark created for the current phase (setup might load another one)
+    lv_obj_t* prevScreen; ///< screen active before the benchmark
+    int stepCount; ///< steps in current phase
+    MLMicroSeconds phaseEnd; ///< end of current phase
+    MLTicket stepTicket; ///< step timer
+    JsonObjectPtr results; ///< results so far
+    DoneCB doneCB; ///< completion callback
+
+  public:
+
+    UiBenchmark();
+    virtual ~UiBenchmark();
+
+    /// add a phase
+    /// @param aName name of the phase (key in results)
+    /// @param aSetup creates the phase's objects on the (empty, fresh) screen passed
+    /// @param aStep changes something, called every 20mS
+    void addPhase(const string aName, SetupFunc aSetup, StepFunc aStep);
+
+    /// add the built-in phases (animation, scrolling, labels)
+    void addStandardPhases();
+
+    /// run all phases
+    /// @param aPhaseDuration duration of each phase
+    /// @param aDoneCB called with the results
+    void run(MLMicroSeconds aPhaseDuration, DoneCB aDoneCB);
+
+    /// full redraw step, for static screens
+    static void invalidateStep(lv_obj_t* aObj, int aStep);
+
+  private:
+
+    void startPhase();
+    void step();
+    void frameRendered();
+    void finishPhase();
+    static bool isScreen(lv_obj_t* aObj);
+
+  };
+  typedef boost::intrusive_ptr<UiBenchmark> UiBenchmarkPtr;
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__uibenchmark__) */
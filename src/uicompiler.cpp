@@ -0,0 +1,763 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "uicompiler.hpp"
+#include "nativeimages.hpp"
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+using namespace p44;
+
+#define UIBIN_MAGIC 0x55343450 // "P44U"
+#define UIBIN_VERSION 3
+#define UIBIN_SUFFIX ".uibin"
+#define UIBIN_MAX_DEPTH 64 // max nesting of arrays/objects accepted when loading
+#define UIBIN_MAX_SOURCE (16*1024*1024) // max size of JSON source to compile
+
+/// header of a compiled UI definition file, followed by the NUL padded JSON source path,
+/// the string offset table, the strings (each uint32 length, bytes, NUL) and the value tree
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t srcPathLen; ///< space used by the source path following the header (multiple of 4)
+  uint64_t srcSize; ///< size of the JSON source when compiled
+  int64_t srcMtime; ///< modification time of the JSON source when compiled, in nS
+  uint32_t numStrings; ///< number of entries in the string table
+  uint32_t rootOffset; ///< file offset of the root value
+  uint32_t size; ///< total file size
+} UiBinHeader;
+
+/// @return modification time with sub-second resolution, in nS
+static int64_t mtimeNs(const struct stat &aStat)
+{
+  #if defined(__APPLE__)
+  return (int64_t)aStat.st_mtimespec.tv_sec*1000000000LL + aStat.st_mtimespec.tv_nsec;
+  #else
+  return (int64_t)aStat.st_mtim.tv_sec*1000000000LL + aStat.st_mtim.tv_nsec;
+  #endif
+}
+
+/// value tags in the value tree
+enum {
+  uibin_null,
+  uibin_false,
+  uibin_true,
+  uibin_int32, ///< followed by int32
+  uibin_int64, ///< followed by int64
+  uibin_double, ///< followed by double
+  uibin_string, ///< followed by uint32 string index
+  uibin_array, ///< followed by uint32 count and count values
+  uibin_object ///< followed by uint32 count and count (uint32 key string index, value) pairs
+};
+
+
+static UiCompiler* uiCompilerP = NULL;
+
+
+UiCompiler::UiCompiler() :
+  compilations(0),
+  compileTime(0),
+  binaryLoads(0),
+  binaryLoadTime(0),
+  jsonLoads(0),
+  pruned(0)
+{
+}
+
+
+UiCompiler& UiCompiler::compiler()
+{
+  if (!uiCompilerP) {
+    uiCompilerP = new UiCompiler;
+  }
+  return *uiCompilerP;
+}
+
+
+void UiCompiler::setCacheDir(const string aCacheDir)
+{
+  cacheDir = aCacheDir;
+  mkdir(cacheDir.c_str(), 0755);
+  pruneCache();
+}
+
+
+string UiCompiler::compiledPathFor(const string aJsonPath)
+{
+  // FNV-1a, 64bit of the path
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i=0; i<aJsonPath.size(); i++) {
+    h ^= (uint8_t)aJsonPath[i];
+    h *= 0x100000001b3ULL;
+  }
+  return cacheDir + string_format("/%016llx" UIBIN_SUFFIX, (unsigned long long)h);
+}
+
+
+void UiCompiler::pruneCache()
+{
+  // compiled files are keyed by their source's path, so remove those whose source is gone
+  DIR* d = opendir(cacheDir.c_str());
+  if (!d) return;
+  struct dirent* e;
+  while ((e = readdir(d))!=NULL) {
+    string name = e->d_name;
+    if (name=="." || name=="..") continue;
+    string path = cacheDir + "/" + name;
+    bool stale = true;
+    size_t sl = strlen(UIBIN_SUFFIX);
+    if (name.size()>sl && name.compare(name.size()-sl, sl, UIBIN_SUFFIX)==0) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd>=0) {
+        UiBinHeader hdr;
+        if (read(fd, &hdr, sizeof(hdr))==sizeof(hdr) && hdr.magic==UIBIN_MAGIC && hdr.version==UIBIN_VERSION) {
+          string src(hdr.srcPathLen, 0);
+          if (
+            read(fd, &src[0], hdr.srcPathLen)==hdr.srcPathLen &&
+            access(src.c_str(), R_OK)==0 && // NUL padded
+            compiledPathFor(src.c_str())==path
+          ) {
+            stale = false;
+          }
+        }
+        close(fd);
+      }
+    }
+    if (stale) {
+      LOG(LOG_INFO, "removing stale compiled UI definition %s", path.c_str());
+      unlink(path.c_str());
+      pruned++;
+    }
+  }
+  closedir(d);
+}
+
+
+// MARK: - compiling
+
+namespace {
+
+  class UiBinWriter
+  {
+    typedef std::map<string, uint32_t> StringIndex;
+    StringIndex index;
+    std::vector<string> strings;
+
+  public:
+
+    string tree;
+    long stringRefs; ///< number of string references (before interning)
+
+    UiBinWriter() : stringRefs(0) {};
+
+    void appendRaw(const void* aData, size_t aSize) { tree.append((const char*)aData, aSize); };
+    void appendTag(uint8_t aTag) { tree.append(1, (char)aTag); };
+    void appendU32(uint32_t aVal) { appendRaw(&aVal, sizeof(aVal)); };
+
+    uint32_t intern(const string aString)
+    {
+      stringRefs++;
+      StringIndex::iterator pos = index.find(aString);
+      if (pos!=index.end()) return pos->second;
+      uint32_t i = (uint32_t)strings.size();
+      strings.push_back(aString);
+      index[aString] = i;
+      return i;
+    }
+
+    void encode(JsonObjectPtr aObj)
+    {
+      if (!aObj) {
+        appendTag(uibin_null);
+        return;
+      }
+      switch (aObj->type()) {
+        case json_type_boolean:
+          appendTag(aObj->boolValue() ? uibin_true : uibin_false);
+          break;
+        case json_type_int: {
+          int64_t v = aObj->int64Value();
+          if (v>=INT32_MIN && v<=INT32_MAX) {
+            int32_t v32 = (int32_t)v;
+            appendTag(uibin_int32);
+            appendRaw(&v32, sizeof(v32));
+          }
+          else {
+            appendTag(uibin_int64);
+            appendRaw(&v, sizeof(v));
+          }
+          break;
+        }
+        case json_type_double: {
+          double d = aObj->doubleValue();
+          appendTag(uibin_double);
+          appendRaw(&d, sizeof(d));
+          break;
+        }
+        case json_type_string:
+          appendTag(uibin_string);
+          appendU32(intern(aObj->stringValue()));
+          break;
+        case json_type_array: {
+          int n = aObj->arrayLength();
+          appendTag(uibin_array);
+          appendU32(n);
+          for (int i=0; i<n; i++) encode(aObj->arrayGet(i));
+          break;
+        }
+        case json_type_object: {
+          std::vector<std::pair<string, JsonObjectPtr> > members;
+          string key;
+          JsonObjectPtr o;
+          aObj->resetKeyIteration();
+          while (aObj->nextKeyValue(key, o)) members.push_back(std::make_pair(key, o));
+          appendTag(uibin_object);
+          appendU32((uint32_t)members.size());
+          for (size_t i=0; i<members.size(); i++) {
+            appendU32(intern(members[i].first));
+            encode(members[i].second);
+          }
+          break;
+        }
+        default:
+          appendTag(uibin_null);
+          break;
+      }
+    }
+
+    string fileData(const string aSrcPath, const struct stat &aSrcStat)
+    {
+      UiBinHeader hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.magic = UIBIN_MAGIC;
+      hdr.version = UIBIN_VERSION;
+      hdr.srcPathLen = (aSrcPath.size()+4) & ~3;
+      hdr.srcSize = aSrcStat.st_size;
+      hdr.srcMtime = mtimeNs(aSrcStat);
+      hdr.numStrings = (uint32_t)strings.size();
+      string srcPath = aSrcPath;
+      srcPath.resize(hdr.srcPathLen, 0);
+      string offsets;
+      string data;
+      uint32_t base = (uint32_t)(sizeof(hdr)+hdr.srcPathLen+strings.size()*sizeof(uint32_t));
+      for (size_t i=0; i<strings.size(); i++) {
+        uint32_t o = base+(uint32_t)data.size();
+        offsets.append((const char*)&o, sizeof(o));
+        uint32_t len = (uint32_t)strings[i].size();
+        data.append((const char*)&len, sizeof(len));
+        data.append(strings[i]);
+        data.append(1, 0);
+      }
+      hdr.rootOffset = base+(uint32_t)data.size();
+      hdr.size = hdr.rootOffset+(uint32_t)tree.size();
+      return string((const char*)&hdr, sizeof(hdr)) + srcPath + offsets + data + tree;
+    }
+
+  };
+
+} // namespace
+
+
+ErrorPtr UiCompiler::compile(const string aJsonPath)
+{
+  MLMicroSeconds start = MainLoop::now();
+  struct stat st;
+  if (stat(aJsonPath.c_str(), &st)<0) return SysError::errNo("cannot access UI definition: ");
+  if (st.st_size>UIBIN_MAX_SOURCE || aJsonPath.size()>=0xFFFC) return TextError::err("UI definition too large to compile: %s", aJsonPath.c_str());
+  ErrorPtr err;
+  JsonObjectPtr json = JsonObject::objFromFile(aJsonPath.c_str(), &err, true);
+  if (Error::notOK(err)) return err;
+  UiBinWriter w;
+  w.encode(json);
+  // images referenced by the definition are converted to native format now, not when the screen is built
+  size_t sl = aJsonPath.rfind('/');
+  prepareImages(json, sl==string::npos ? "." : aJsonPath.substr(0, sl));
+  string cf = compiledPathFor(aJsonPath);
+  string tmp = cf+".tmp";
+  err = string_tofile(tmp, w.fileData(aJsonPath, st));
+  if (Error::isOK(err) && rename(tmp.c_str(), cf.c_str())<0) {
+    err = SysError::errNo("cannot store compiled UI definition: ");
+  }
+  compilations++;
+  compileTime += MainLoop::now()-start;
+  LOG(LOG_INFO,
+    "compiled %s to %s (%lld bytes JSON, %zu bytes compiled, %ld string refs interned) in %lld mS",
+    aJsonPath.c_str(), cf.c_str(), (long long)st.st_size, w.tree.size(), w.stringRefs, (MainLoop::now()-start)/MilliSecond
+  );
+  return err;
+}
+
+
+void UiCompiler::prepareImages(JsonObjectPtr aObj, const string aBaseDir)
+{
+  if (!aObj || !NativeImages::images().isInstalled()) return;
+  if (aObj->isType(json_type_string)) {
+    string s = aObj->stringValue();
+    if (s.size()>4 && strcasecmp(s.c_str()+s.size()-4, ".png")==0) {
+      string p = s[0]=='/' ? s : aBaseDir + "/" + s;
+      if (access(p.c_str(), R_OK)==0) NativeImages::images().prepare(p);
+    }
+  }
+  else if (aObj->isType(json_type_array)) {
+    for (int i=0; i<aObj->arrayLength(); i++) prepareImages(aObj->arrayGet(i), aBaseDir);
+  }
+  else if (aObj->isType(json_type_object)) {
+    string key;
+    JsonObjectPtr o;
+    aObj->resetKeyIteration();
+    while (aObj->nextKeyValue(key, o)) prepareImages(o, aBaseDir);
+  }
+}
+
+
+// MARK: - loading
+
+namespace {
+
+  void appendJsonString(string &aText, const char* aStr, size_t aLen)
+  {
+    aText += '"';
+    for (size_t i=0; i<aLen; i++) {
+      char c = aStr[i];
+      switch (c) {
+        case '"': aText += "\\\""; break;
+        case '\\': aText += "\\\\"; break;
+        case '\n': aText += "\\n"; break;
+        case '\r': aText += "\\r"; break;
+        case '\t': aText += "\\t"; break;
+        default:
+          if ((uint8_t)c<0x20) string_format_append(aText, "\\u%04x", c);
+          else aText += c;
+          break;
+      }
+    }
+    aText += '"';
+  }
+
+
+  class UiBinReader
+  {
+    const uint8_t* base;
+    const uint8_t* end;
+    const UiBinHeader* hdr;
+
+  public:
+
+    const uint8_t* p;
+    bool ok;
+    long objCount; ///< number of JsonObjects created
+
+    UiBinReader(const void* aData, size_t aSize) :
+      base((const uint8_t*)aData), end((const uint8_t*)aData+aSize), hdr((const UiBinHeader*)aData), p(NULL), ok(true), objCount(0)
+    {
+      p = base+hdr->rootOffset;
+    }
+
+    bool get(void* aDest, size_t aSize)
+    {
+      if (p+aSize>end) { ok = false; return false; }
+      memcpy(aDest, p, aSize);
+      p += aSize;
+      return true;
+    }
+
+    uint32_t getU32()
+    {
+      uint32_t v = 0;
+      get(&v, sizeof(v));
+      return v;
+    }
+
+    /// get element count, which cannot be more than the remaining data allows
+    uint32_t getCount(size_t aMinElementSize)
+    {
+      uint32_t n = getU32();
+      if ((uint64_t)n*aMinElementSize>(uint64_t)(end-p)) { ok = false; return 0; }
+      return n;
+    }
+
+    bool peekTag(uint8_t aTag)
+    {
+      return p<end && *p==aTag;
+    }
+
+    bool str(uint32_t aIndex, const char*& aStr, uint32_t& aLen)
+    {
+      if (aIndex>=hdr->numStrings) { ok = false; return false; }
+      uint32_t o;
+      memcpy(&o, base+sizeof(UiBinHeader)+hdr->srcPathLen+aIndex*sizeof(uint32_t), sizeof(o));
+      if (o>(size_t)(end-base) || base+o+sizeof(uint32_t)>end) { ok = false; return false; }
+      memcpy(&aLen, base+o, sizeof(aLen));
+      aStr = (const char*)base+o+sizeof(uint32_t);
+      if (aLen>(size_t)(end-(const uint8_t*)aStr) || (const uint8_t*)aStr+aLen+1>end) { ok = false; return false; }
+      if (aStr[aLen]!=0) { ok = false; return false; } // keys are used as C strings
+      return true;
+    }
+
+    JsonObjectPtr decode(int aDepth)
+    {
+      uint8_t tag;
+      if (aDepth>UIBIN_MAX_DEPTH) { ok = false; return JsonObjectPtr(); }
+      if (!get(&tag, 1)) return JsonObjectPtr();
+      if (tag!=uibin_null) objCount++;
+      switch (tag) {
+        case uibin_false: return JsonObject::newBool(false);
+        case uibin_true: return JsonObject::newBool(true);
+        case uibin_int32: { int32_t v = 0; get(&v, sizeof(v)); return JsonObject::newInt32(v); }
+        case uibin_int64: { int64_t v = 0; get(&v, sizeof(v)); return JsonObject::newInt64(v); }
+        case uibin_double: { double d = 0; get(&d, sizeof(d)); return JsonObject::newDouble(d); }
+        case uibin_string: {
+          const char* s; uint32_t len;
+          if (!str(getU32(), s, len)) return JsonObjectPtr();
+          return JsonObject::newString(string(s, len));
+        }
+        case uibin_array: {
+          uint32_t n = getCount(1);
+          JsonObjectPtr a = JsonObject::newArray();
+          for (uint32_t i=0; i<n && ok; i++) a->arrayAppend(decode(aDepth+1));
+          return a;
+        }
+        case uibin_object: {
+          uint32_t n = getCount(5);
+          JsonObjectPtr o = JsonObject::newObj();
+          for (uint32_t i=0; i<n && ok; i++) {
+            const char* k; uint32_t len;
+            if (!str(getU32(), k, len)) break;
+            o->add(k, decode(aDepth+1)); // strings are NUL terminated in the file
+          }
+          return o;
+        }
+        case uibin_null:
+          return JsonObjectPtr();
+        default:
+          ok = false;
+          return JsonObjectPtr();
+      }
+    }
+
+    /// append a value as JSON text, without creating JsonObjects
+    /// @param aExtractKeys if set and value is an object, these fields are decoded into aExtracted instead
+    void text(string &aText, int aDepth, const UiCompiler::KeySet* aExtractKeys = NULL, JsonObjectPtr* aExtracted = NULL)
+    {
+      uint8_t tag;
+      if (aDepth>UIBIN_MAX_DEPTH) { ok = false; return; }
+      if (!get(&tag, 1)) return;
+      switch (tag) {
+        case uibin_null: aText += "null"; break;
+        case uibin_false: aText += "false"; break;
+        case uibin_true: aText += "true"; break;
+        case uibin_int32: { int32_t v = 0; get(&v, sizeof(v)); string_format_append(aText, "%d", v); break; }
+        case uibin_int64: { int64_t v = 0; get(&v, sizeof(v)); string_format_append(aText, "%lld", (long long)v); break; }
+        case uibin_double: {
+          double d = 0;
+          get(&d, sizeof(d));
+          string n = string_format("%.17g", d);
+          if (n.find_first_of(".eEn")==string::npos) n += ".0"; // must remain a double when parsed again
+          aText += n;
+          break;
+        }
+        case uibin_string: {
+          const char* s; uint32_t len;
+          if (str(getU32(), s, len)) appendJsonString(aText, s, len);
+          break;
+        }
+        case uibin_array: {
+          uint32_t n = getCount(1);
+          aText += '[';
+          for (uint32_t i=0; i<n && ok; i++) {
+            if (i>0) aText += ',';
+            text(aText, aDepth+1);
+          }
+          aText += ']';
+          break;
+        }
+        case uibin_object: {
+          uint32_t n = getCount(5);
+          bool first = true;
+          aText += '{';
+          for (uint32_t i=0; i<n && ok; i++) {
+            const char* k; uint32_t len;
+            if (!str(getU32(), k, len)) break;
+            if (aExtractKeys && aExtractKeys->find(string(k, len))!=aExtractKeys->end()) {
+              if (!*aExtracted) *aExtracted = JsonObject::newObj();
+              (*aExtracted)->add(k, decode(aDepth+1));
+              continue;
+            }
+            if (!first) aText += ',';
+            first = false;
+            appendJsonString(aText, k, len);
+            aText += ':';
+            text(aText, aDepth+1);
+          }
+          aText += '}';
+          break;
+        }
+        default:
+          ok = false;
+          break;
+      }
+    }
+
+    /// decode the root object, but only as text for the members of aDeferKey
+    JsonObjectPtr decodeDeferred(const string &aDeferKey, const UiCompiler::KeySet &aExtractKeys, UiCompiler::DeferredMembers &aDeferred)
+    {
+      if (!peekTag(uibin_object)) return decode(0);
+      p++;
+      uint32_t n = getCount(5);
+      JsonObjectPtr o = JsonObject::newObj();
+      objCount++;
+      for (uint32_t i=0; i<n && ok; i++) {
+        const char* k; uint32_t len;
+        if (!str(getU32(), k, len)) break;
+        if (aDeferKey!=k || !peekTag(uibin_object)) {
+          o->add(k, decode(1));
+          continue;
+        }
+        p++;
+        uint32_t m = getCount(5);
+        for (uint32_t j=0; j<m && ok; j++) {
+          const char* mk; uint32_t mlen;
+          if (!str(getU32(), mk, mlen)) break;
+          UiCompiler::DeferredMember d;
+          d.name.assign(mk, mlen);
+          text(d.text, 2, &aExtractKeys, &d.extracted);
+          aDeferred.push_back(d);
+        }
+      }
+      return o;
+    }
+
+  };
+
+} // namespace
+
+
+JsonObjectPtr UiCompiler::loadCompiled(const string aCompiledPath, const string aJsonPath, ErrorPtr &aErr, const string* aDeferKey, const KeySet* aExtractKeys, DeferredMembers* aDeferred, long* aObjCount)
+{
+  struct stat src;
+  if (stat(aJsonPath.c_str(), &src)<0) {
+    aErr = SysError::errNo("cannot access UI definition: ");
+    return JsonObjectPtr();
+  }
+  int fd = open(aCompiledPath.c_str(), O_RDONLY);
+  if (fd<0) return JsonObjectPtr(); // not compiled yet, no error
+  struct stat st;
+  void* m = MAP_FAILED;
+  if (fstat(fd, &st)==0 && (size_t)st.st_size>=sizeof(UiBinHeader)) {
+    m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (m==MAP_FAILED) return JsonObjectPtr();
+  JsonObjectPtr json;
+  const UiBinHeader* hdr = (const UiBinHeader*)m;
+  if (
+    hdr->magic==UIBIN_MAGIC && hdr->version==UIBIN_VERSION &&
+    hdr->size==(uint32_t)st.st_size && hdr->rootOffset<hdr->size &&
+    sizeof(UiBinHeader)+hdr->srcPathLen+(uint64_t)hdr->numStrings*sizeof(uint32_t)<=hdr->size &&
+    hdr->srcSize==(uint64_t)src.st_size && hdr->srcMtime==mtimeNs(src)
+  ) {
+    UiBinReader r(m, st.st_size);
+    size_t nd = aDeferred ? aDeferred->size() : 0;
+    if (aDeferred) json = r.decodeDeferred(*aDeferKey, *aExtractKeys, *aDeferred);
+    else json = r.decode(0);
+    if (aObjCount) *aObjCount = r.objCount;
+    if (!r.ok) {
+      LOG(LOG_WARNING, "compiled UI definition %s is corrupt or nested too deeply", aCompiledPath.c_str());
+      json.reset();
+      if (aDeferred) aDeferred->resize(nd);
+    }
+  }
+  munmap(m, st.st_size);
+  return json;
+}
+
+
+JsonObjectPtr UiCompiler::load(const string aJsonPath, ErrorPtr &aErr)
+{
+  if (!cacheDir.empty()) {
+    MLMicroSeconds start = MainLoop::now();
+    string cf = compiledPathFor(aJsonPath);
+    JsonObjectPtr json = loadCompiled(cf, aJsonPath, aErr);
+    if (!json && Error::isOK(aErr) && Error::isOK(compile(aJsonPath))) {
+      json = loadCompiled(cf, aJsonPath, aErr);
+    }
+    if (json) {
+      binaryLoads++;
+      binaryLoadTime += MainLoop::now()-start;
+      return json;
+    }
+    if (Error::notOK(aErr)) return JsonObjectPtr();
+  }
+  // fall back to parsing JSON
+  jsonLoads++;
+  return JsonObject::objFromFile(aJsonPath.c_str(), &aErr, true);
+}
+
+
+JsonObjectPtr UiCompiler::loadDeferred(const string aJsonPath, const string aDeferKey, const KeySet &aExtractKeys, DeferredMembers &aDeferred, ErrorPtr &aErr)
+{
+  if (!cacheDir.empty()) {
+    MLMicroSeconds start = MainLoop::now();
+    string cf = compiledPathFor(aJsonPath);
+    JsonObjectPtr json = loadCompiled(cf, aJsonPath, aErr, &aDeferKey, &aExtractKeys, &aDeferred);
+    if (!json && Error::isOK(aErr) && Error::isOK(compile(aJsonPath))) {
+      json = loadCompiled(cf, aJsonPath, aErr, &aDeferKey, &aExtractKeys, &aDeferred);
+    }
+    if (json) {
+      binaryLoads++;
+      binaryLoadTime += MainLoop::now()-start;
+      return json;
+    }
+    if (Error::notOK(aErr)) return JsonObjectPtr();
+  }
+  // fall back to parsing JSON, then split
+  jsonLoads++;
+  JsonObjectPtr json = JsonObject::objFromFile(aJsonPath.c_str(), &aErr, true);
+  JsonObjectPtr d;
+  if (json && json->isType(json_type_object) && json->get(aDeferKey.c_str(), d) && d->isType(json_type_object)) {
+    deferMembers(d, aExtractKeys, aDeferred);
+    json->del(aDeferKey.c_str()); // our own freshly parsed object
+  }
+  return json;
+}
+
+
+void UiCompiler::deferMembers(JsonObjectPtr aObj, const KeySet &aExtractKeys, DeferredMembers &aDeferred)
+{
+  string key;
+  JsonObjectPtr o;
+  aObj->resetKeyIteration();
+  while (aObj->nextKeyValue(key, o)) {
+    DeferredMember d;
+    d.name = key;
+    if (o && o->isType(json_type_object)) {
+      // copy, leaving the original object untouched
+      JsonObjectPtr def = JsonObject::newObj();
+      string f;
+      JsonObjectPtr v;
+      o->resetKeyIteration();
+      while (o->nextKeyValue(f, v)) {
+        if (aExtractKeys.find(f)!=aExtractKeys.end()) {
+          if (!d.extracted) d.extracted = JsonObject::newObj();
+          d.extracted->add(f.c_str(), v);
+        }
+        else {
+          def->add(f.c_str(), v);
+        }
+      }
+      d.text = def->json_c_str();
+    }
+    else {
+      d.text = o ? o->json_c_str() : "null";
+    }
+    aDeferred.push_back(d);
+  }
+}
+
+
+// MARK: - statistics and benchmark
+
+JsonObjectPtr UiCompiler::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("compilations", JsonObject::newInt64(compilations));
+  s->add("compileTime", JsonObject::newDouble((double)compileTime/MilliSecond));
+  s->add("binaryLoads", JsonObject::newInt64(binaryLoads));
+  s->add("avgBinaryLoadTime", JsonObject::newDouble(binaryLoads>0 ? (double)binaryLoadTime/binaryLoads/MilliSecond : 0));
+  s->add("jsonLoads", JsonObject::newInt64(jsonLoads));
+  s->add("pruned", JsonObject::newInt64(pruned));
+  return s;
+}
+
+
+static long countObjects(JsonObjectPtr aObj)
+{
+  // each JsonObject in a tree is at least one heap allocation
+  if (!aObj) return 0;
+  long n = 1;
+  if (aObj->isType(json_type_array)) {
+    for (int i=0; i<aObj->arrayLength(); i++) n += countObjects(aObj->arrayGet(i));
+  }
+  else if (aObj->isType(json_type_object)) {
+    string key;
+    JsonObjectPtr o;
+    aObj->resetKeyIteration();
+    while (aObj->nextKeyValue(key, o)) n += countObjects(o);
+  }
+  return n;
+}
+
+
+JsonObjectPtr UiCompiler::benchmark(const string aJsonPath, int aIterations)
+{
+  JsonObjectPtr res = JsonObject::newObj();
+  ErrorPtr err = compile(aJsonPath);
+  if (Error::notOK(err)) {
+    res->add("error", JsonObject::newString(Error::text(err)));
+    return res;
+  }
+  string cf = compiledPathFor(aJsonPath);
+  struct stat st;
+  if (stat(aJsonPath.c_str(), &st)==0) res->add("jsonBytes", JsonObject::newInt64(st.st_size));
+  if (stat(cf.c_str(), &st)==0) res->add("compiledBytes", JsonObject::newInt64(st.st_size));
+  // plain JSON
+  MLMicroSeconds start = MainLoop::now();
+  for (int i=0; i<aIterations; i++) {
+    JsonObjectPtr j = JsonObject::objFromFile(aJsonPath.c_str(), &err, true);
+  }
+  double jsonTime = (double)(MainLoop::now()-start)/aIterations/MilliSecond;
+  // compiled
+  start = MainLoop::now();
+  for (int i=0; i<aIterations; i++) {
+    JsonObjectPtr j = loadCompiled(cf, aJsonPath, err);
+  }
+  double compiledTime = (double)(MainLoop::now()-start)/aIterations/MilliSecond;
+  // compiled, screens deferred as text (as for lazy screens)
+  string deferKey = "screens";
+  KeySet extractKeys;
+  DeferredMembers deferred;
+  start = MainLoop::now();
+  for (int i=0; i<aIterations; i++) {
+    deferred.clear();
+    JsonObjectPtr j = loadCompiled(cf, aJsonPath, err, &deferKey, &extractKeys, &deferred);
+  }
+  double deferredTime = (double)(MainLoop::now()-start)/aIterations/MilliSecond;
+  // result must be the same
+  JsonObjectPtr j1 = JsonObject::objFromFile(aJsonPath.c_str(), &err, true);
+  long compiledObjects = 0;
+  JsonObjectPtr j2 = loadCompiled(cf, aJsonPath, err, NULL, NULL, NULL, &compiledObjects);
+  long deferredObjects = 0;
+  deferred.clear();
+  loadCompiled(cf, aJsonPath, err, &deferKey, &extractKeys, &deferred, &deferredObjects);
+  res->add("identical", JsonObject::newBool(j1 && j2 && strcmp(j1->json_c_str(), j2->json_c_str())==0));
+  res->add("iterations", JsonObject::newInt32(aIterations));
+  res->add("jsonLoadTime", JsonObject::newDouble(jsonTime));
+  res->add("compiledLoadTime", JsonObject::newDouble(compiledTime));
+  res->add("deferredLoadTime", JsonObject::newDouble(deferredTime));
+  res->add("speedup", JsonObject::newDouble(compiledTime>0 ? jsonTime/compiledTime : 0));
+  // allocations: JsonObjects per load (json-c's parser allocates at least as many)
+  res->add("jsonObjects", JsonObject::newInt64(countObjects(j1)));
+  res->add("compiledObjects", JsonObject::newInt64(compiledObjects));
+  res->add("deferredObjects", JsonObject::newInt64(deferredObjects));
+  res->add("deferredTexts", JsonObject::newInt64(deferred.size())); // one string allocation each
+  return res;
+}
@@ -0,0 +1,119 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__uicompiler__
+#define __p44mbcd__uicompiler__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include <set>
+
+namespace p44 {
+
+  /// Compiles JSON UI definitions into a compact binary form (all keys and string values interned
+  /// into a string table, numbers stored binary, PNG images referenced from the definition
+  /// pre-converted to native format) kept in a cache directory, and loads them from the mmap-ed
+  /// binary without running the json-c text parser.
+  class UiCompiler : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+  public:
+
+    /// a member of a deferred object, kept as JSON text instead of a JsonObject tree
+    typedef struct {
+      string name; ///< member name
+      string text; ///< member value as JSON text, without the extracted fields
+      JsonObjectPtr extracted; ///< object with the extracted fields of the member's value
+    } DeferredMember;
+    typedef std::vector<DeferredMember> DeferredMembers;
+    typedef std::set<string> KeySet;
+
+  private:
+
+    string cacheDir; ///< directory for the compiled files
+
+    // statistics
+    long compilations; ///< number of JSON files compiled
+    MLMicroSeconds compileTime; ///< total time spent compiling
+    long binaryLoads; ///< number of loads from compiled files
+    MLMicroSeconds binaryLoadTime; ///< total time spent loading compiled files
+    long jsonLoads; ///< number of fallbacks to plain JSON parsing
+    long pruned; ///< number of stale compiled files removed
+
+  public:
+
+    UiCompiler();
+
+    /// get the shared instance
+    static UiCompiler& compiler();
+
+    /// set the cache directory, and remove compiled files whose JSON source no longer exists
+    /// @param aCacheDir directory to store compiled files in (created if needed)
+    void setCacheDir(const string aCacheDir);
+
+    /// make sure a JSON file has an up-to-date compiled version
+    /// @param aJsonPath path of the JSON file
+    /// @return error if JSON could not be compiled
+    ErrorPtr compile(const string aJsonPath);
+
+    /// load a JSON UI definition, from its compiled version (compiling it first if needed)
+    /// @param aJsonPath path of the JSON file
+    /// @param aErr set if loading fails
+    /// @return the JSON object, or NULL if loading failed
+    JsonObjectPtr load(const string aJsonPath, ErrorPtr &aErr);
+
+    /// load a JSON UI definition like load(), but keep the members of one top level object as JSON text
+    /// (no JsonObject tree is built for them when loading from the compiled version)
+    /// @param aJsonPath path of the JSON file
+    /// @param aDeferKey top level key of the object whose members are deferred (e.g. "screens")
+    /// @param aExtractKeys fields of deferred values that are returned as JsonObjects in `extracted` instead
+    /// @param aDeferred will receive the deferred members
+    /// @param aErr set if loading fails
+    /// @return the JSON object without aDeferKey, or NULL if loading failed
+    JsonObjectPtr loadDeferred(const string aJsonPath, const string aDeferKey, const KeySet &aExtractKeys, DeferredMembers &aDeferred, ErrorPtr &aErr);
+
+    /// split an already loaded object into deferred members the same way loadDeferred() does
+    /// @param aObj object whose members are to be deferred
+    /// @param aExtractKeys fields of the member values to return in `extracted`
+    /// @param aDeferred deferred members are appended here
+    static void deferMembers(JsonObjectPtr aObj, const KeySet &aExtractKeys, DeferredMembers &aDeferred);
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+    /// benchmark loading a JSON file as JSON text vs. compiled
+    /// @param aJsonPath path of the JSON file
+    /// @param aIterations number of loads for each method
+    /// @return results as JSON object
+    JsonObjectPtr benchmark(const string aJsonPath, int aIterations);
+
+  private:
+
+    string compiledPathFor(const string aJsonPath);
+    void pruneCache();
+    JsonObjectPtr loadCompiled(const string aCompiledPath, const string aJsonPath, ErrorPtr &aErr, const string* aDeferKey = NULL, const KeySet* aExtractKeys = NULL, DeferredMembers* aDeferred = NULL, long* aObjCount = NULL);
+    void prepareImages(JsonObjectPtr aObj, const string aBaseDir);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__uicompiler__) */
@@ -0,0 +1,297 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "valuelabels.hpp"
+
+using namespace p44;
+
+
+ValueLabels::ValueLabels() :
+  polling(false),
+  pollInterval(Never),
+  updates(0),
+  unchanged(0),
+  partial(0),
+  full(0),
+  invalidatedPixels(0),
+  labelPixels(0)
+{
+}
+
+
+ValueLabels::~ValueLabels()
+{
+  pollTicket.cancel();
+  clear();
+}
+
+
+bool ValueLabels::validFormat(const string aFormat)
+{
+  // exactly one conversion, which must be a floating point one
+  int conversions = 0;
+  for (size_t i=0; i<aFormat.size(); i++) {
+    if (aFormat[i]!='%') continue;
+    i++;
+    if (i<aFormat.size() && aFormat[i]=='%') continue; // literal %
+    while (i<aFormat.size() && strchr("-+ #0123456789.", aFormat[i])) i++;
+    if (i>=aFormat.size() || !strchr("fFeEgG", aFormat[i])) return false;
+    conversions++;
+  }
+  return conversions==1;
+}
+
+
+ErrorPtr ValueLabels::create(const string aName, lv_obj_t* aParent, lv_coord_t aX, lv_coord_t aY, const lv_font_t* aFont, const string aFormat)
+{
+  if (aFormat.size()>=VALUELABEL_MAXLEN || !validFormat(aFormat)) {
+    return TextError::err("invalid value label format '%s'", aFormat.c_str());
+  }
+  remove(aName);
+  Label* l = new Label;
+  memset(l, 0, sizeof(Label));
+  strcpy(l->format, aFormat.c_str());
+  l->reg = -1;
+  l->scale = 1;
+  l->label = lv_label_create(aParent, NULL);
+  lv_label_set_long_mode(l->label, LV_LABEL_LONG_EXPAND);
+  if (aFont) {
+    l->style = new lv_style_t;
+    lv_style_copy(l->style, lv_obj_get_style(l->label));
+    l->style->text.font = aFont;
+    lv_obj_set_style(l->label, l->style);
+  }
+  lv_obj_set_pos(l->label, aX, aY);
+  lv_label_set_static_text(l->label, l->text);
+  // get notified when the label is deleted along with its screen
+  lv_obj_set_user_data(l->label, this);
+  lv_obj_set_event_cb(l->label, &ValueLabels::labelEventCB);
+  labels[aName] = l;
+  return ErrorPtr();
+}
+
+
+void ValueLabels::remove(const string aName)
+{
+  LabelMap::iterator pos = labels.find(aName);
+  if (pos==labels.end()) return;
+  lv_obj_del(pos->second->label); // labelDeleted() does the rest
+}
+
+
+void ValueLabels::clear()
+{
+  while (!labels.empty()) lv_obj_del(labels.begin()->second->label);
+}
+
+
+void ValueLabels::labelEventCB(lv_obj_t* aObj, lv_event_t aEvent)
+{
+  if (aEvent!=LV_EVENT_DELETE) return;
+  static_cast<ValueLabels*>(lv_obj_get_user_data(aObj))->labelDeleted(aObj);
+}
+
+
+void ValueLabels::labelDeleted(lv_obj_t* aLabel)
+{
+  for (LabelMap::iterator pos = labels.begin(); pos!=labels.end(); ++pos) {
+    Label* l = pos->second;
+    if (l->label==aLabel) {
+      delete l->style;
+      delete l;
+      labels.erase(pos);
+      updatePolling();
+      return;
+    }
+  }
+}
+
+
+// MARK: - updating
+
+bool ValueLabels::setValue(const string aName, double aValue)
+{
+  LabelMap::iterator pos = labels.find(aName);
+  if (pos==labels.end()) return false;
+  update(pos->second, aValue);
+  return true;
+}
+
+
+bool ValueLabels::sameLayout(Label* aLabel, const char* aNewText)
+{
+  size_t n = strlen(aLabel->text);
+  if (n==0 || strlen(aNewText)!=n) return false;
+  const lv_style_t* style = lv_obj_get_style(aLabel->label);
+  const lv_font_t* font = style->text.font;
+  for (size_t i=0; i<n; i++) {
+    if (aLabel->text[i]==aNewText[i]) continue;
+    // single byte characters only, and same advance (digits are usually tabular)
+    if ((aLabel->text[i] & 0x80) || (aNewText[i] & 0x80) || aNewText[i]=='\n') return false;
+    if (lv_font_get_glyph_width(font, aLabel->text[i], aLabel->text[i+1])!=lv_font_get_glyph_width(font, aNewText[i], aNewText[i+1])) return false;
+    // the previous character's advance might depend on this one (kerning)
+    if (i>0 && lv_font_get_glyph_width(font, aLabel->text[i-1], aLabel->text[i])!=lv_font_get_glyph_width(font, aNewText[i-1], aNewText[i])) return false;
+  }
+  return true;
+}
+
+
+/// extend area to cover the glyph of aLetter at aPos (relative to the label)
+static void addGlyphArea(lv_area_t &aArea, bool &aValid, const lv_font_t* aFont, uint32_t aLetter, uint32_t aNext, const lv_point_t &aPos, const lv_area_t &aCoords)
+{
+  lv_font_glyph_dsc_t g;
+  if (!lv_font_get_glyph_dsc(aFont, &g, aLetter, aNext)) return;
+  lv_coord_t x1 = aCoords.x1+aPos.x+LV_MATH_MIN(0, g.ofs_x);
+  lv_coord_t x2 = aCoords.x1+aPos.x+LV_MATH_MAX(g.adv_w, g.ofs_x+g.box_w)-1;
+  lv_coord_t y1 = aCoords.y1+aPos.y;
+  lv_coord_t y2 = y1+lv_font_get_line_height(aFont)-1;
+  if (!aValid) {
+    aArea.x1 = x1; aArea.x2 = x2; aArea.y1 = y1; aArea.y2 = y2;
+    aValid = true;
+    return;
+  }
+  aArea.x1 = LV_MATH_MIN(aArea.x1, x1);
+  aArea.x2 = LV_MATH_MAX(aArea.x2, x2);
+  aArea.y1 = LV_MATH_MIN(aArea.y1, y1);
+  aArea.y2 = LV_MATH_MAX(aArea.y2, y2);
+}
+
+
+void ValueLabels::update(Label* aLabel, double aValue)
+{
+  updates++;
+  char newText[VALUELABEL_MAXLEN];
+  snprintf(newText, VALUELABEL_MAXLEN, aLabel->format, aValue);
+  if (strcmp(newText, aLabel->text)==0) {
+    unchanged++;
+    return;
+  }
+  lv_area_t coords;
+  lv_obj_get_coords(aLabel->label, &coords);
+  labelPixels += lv_area_get_size(&coords);
+  if (!sameLayout(aLabel, newText)) {
+    strcpy(aLabel->text, newText);
+    lv_label_set_static_text(aLabel->label, aLabel->text); // relayout, refresh entire label
+    full++;
+    lv_obj_get_coords(aLabel->label, &coords);
+    invalidatedPixels += lv_area_get_size(&coords);
+    return;
+  }
+  // same layout: replace changed characters in place, invalidate each run of changed glyphs
+  const lv_font_t* font = lv_obj_get_style(aLabel->label)->text.font;
+  lv_disp_t* disp = lv_obj_get_disp(aLabel->label);
+  size_t n = strlen(newText);
+  size_t i = 0;
+  while (i<n) {
+    if (aLabel->text[i]==newText[i]) { i++; continue; }
+    lv_area_t a;
+    bool valid = false;
+    while (i<n && aLabel->text[i]!=newText[i]) {
+      lv_point_t p;
+      lv_label_get_letter_pos(aLabel->label, (uint16_t)i, &p);
+      addGlyphArea(a, valid, font, (uint8_t)aLabel->text[i], (uint8_t)aLabel->text[i+1], p, coords);
+      addGlyphArea(a, valid, font, (uint8_t)newText[i], (uint8_t)newText[i+1], p, coords);
+      aLabel->text[i] = newText[i];
+      i++;
+    }
+    if (valid && lv_area_intersect(&a, &a, &coords)) {
+      lv_inv_area(disp, &a);
+      invalidatedPixels += lv_area_get_size(&a);
+    }
+  }
+  partial++;
+}
+
+
+// MARK: - register binding
+
+bool ValueLabels::bindRegister(const string aName, int aRegister, bool aSigned, double aScale, double aOffset)
+{
+  LabelMap::iterator pos = labels.find(aName);
+  if (pos==labels.end()) return false;
+  Label* l = pos->second;
+  l->reg = aRegister;
+  l->sign = aSigned;
+  l->scale = aScale;
+  l->offset = aOffset;
+  if (registerReader) {
+    l->lastRegValue = registerReader(aRegister);
+    update(l, (l->sign ? (int16_t)l->lastRegValue : l->lastRegValue)*l->scale+l->offset);
+  }
+  updatePolling();
+  return true;
+}
+
+
+void ValueLabels::setRegisterReader(RegisterReader aReader, MLMicroSeconds aInterval)
+{
+  registerReader = aReader;
+  pollInterval = aInterval;
+  updatePolling();
+}
+
+
+void ValueLabels::updatePolling()
+{
+  // only wake up while there is a register bound label to poll
+  bool bound = false;
+  for (LabelMap::iterator pos = labels.begin(); pos!=labels.end(); ++pos) {
+    if (pos->second->reg>=0) {
+      bound = true;
+      break;
+    }
+  }
+  if (!registerReader || !bound) {
+    pollTicket.cancel();
+    polling = false;
+  }
+  else if (!polling) {
+    polling = true;
+    pollTicket.executeOnce(boost::bind(&ValueLabels::pollRegisters, this), pollInterval);
+  }
+}
+
+
+void ValueLabels::pollRegisters()
+{
+  polling = false;
+  for (LabelMap::iterator pos = labels.begin(); pos!=labels.end(); ++pos) {
+    Label* l = pos->second;
+    if (l->reg<0) continue;
+    uint16_t v = registerReader(l->reg);
+    if (v==l->lastRegValue && l->text[0]) continue; // no need to even format
+    l->lastRegValue = v;
+    update(l, (l->sign ? (int16_t)v : v)*l->scale+l->offset);
+  }
+  updatePolling();
+}
+
+
+JsonObjectPtr ValueLabels::statistics()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("labels", JsonObject::newInt32((int)labels.size()));
+  s->add("updates", JsonObject::newInt64(updates));
+  s->add("unchanged", JsonObject::newInt64(unchanged));
+  s->add("partial", JsonObject::newInt64(partial));
+  s->add("full", JsonObject::newInt64(full));
+  s->add("invalidatedPixels", JsonObject::newInt64(invalidatedPixels));
+  s->add("labelPixels", JsonObject::newInt64(labelPixels));
+  return s;
+}
@@ -0,0 +1,135 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  This file is part of p44mbcd.
+//
+//  p44mbcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44mbcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44mbcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44mbcd__valuelabels__
+#define __p44mbcd__valuelabels__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include "lvgl/lvgl.h"
+
+namespace p44 {
+
+  #define VALUELABEL_MAXLEN 32 // max length of formatted value text
+
+  /// Labels for frequently changing numeric values.
+  /// Values are formatted into a fixed buffer (no heap allocation), which the littlevGL label uses
+  /// as static text. When the new text has the same layout (same length, same glyph advances) as
+  /// the previous one, only the changed characters are replaced in place and only their bounding
+  /// boxes are invalidated, instead of relayouting and redrawing the entire label.
+  class ValueLabels : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+  public:
+
+    /// reads a register
+    typedef boost::function<uint16_t (int aAddress)> RegisterReader;
+
+  private:
+
+    typedef struct {
+      lv_obj_t* label; ///< the littlevGL label
+      lv_style_t* style; ///< own style for custom font, NULL if none
+      char format[VALUELABEL_MAXLEN]; ///< printf format for a single double
+      char text[VALUELABEL_MAXLEN]; ///< the current text, used as static text by the label
+      int reg; ///< register to show, -1 if none
+      bool sign; ///< register is signed
+      double scale; ///< register value scaling
+      double offset; ///< register value offset
+      uint16_t lastRegValue; ///< last value read from register
+    } Label;
+    typedef std::map<string, Label*> LabelMap;
+    LabelMap labels;
+
+    RegisterReader registerReader; ///< reads registers
+    MLTicket pollTicket; ///< register polling, only armed while labels are bound to registers
+    bool polling; ///< set while pollTicket is armed
+    MLMicroSeconds pollInterval; ///< register polling interval
+
+    // statistics
+    long updates; ///< setValue() calls
+    long unchanged; ///< updates that did not change the text
+    long partial; ///< updates done by invalidating changed glyphs only
+    long full; ///< updates that needed a full label refresh
+    uint64_t invalidatedPixels; ///< pixels actually invalidated
+    uint64_t labelPixels; ///< pixels a full label refresh would have invalidated
+
+  public:
+
+    ValueLabels();
+    virtual ~ValueLabels();
+
+    /// create a value label
+    /// @param aName name of the label, replaces existing label with same name
+    /// @param aParent parent object
+    /// @param aX x position within parent
+    /// @param aY y position within parent
+    /// @param aFont font to use, NULL for the theme's default
+    /// @param aFormat printf format containing exactly one floating point conversion, like "%5.1f °C"
+    /// @return error if format is invalid
+    ErrorPtr create(const string aName, lv_obj_t* aParent, lv_coord_t aX, lv_coord_t aY, const lv_font_t* aFont, const string aFormat);
+
+    /// remove a value label
+    /// @param aName name of the label
+    void remove(const string aName);
+
+    /// remove all value labels (e.g. when their screen is deleted)
+    void clear();
+
+    /// set value
+    /// @param aName name of the label
+    /// @param aValue new value
+    /// @return false if no label with that name exists
+    bool setValue(const string aName, double aValue);
+
+    /// let label show a register value, scaled as aValue = reg*aScale+aOffset
+    /// @param aName name of the label
+    /// @param aRegister register address
+    /// @param aSigned if set, register is interpreted as int16_t
+    /// @param aScale scaling factor
+    /// @param aOffset offset
+    /// @return false if no label with that name exists
+    bool bindRegister(const string aName, int aRegister, bool aSigned, double aScale, double aOffset);
+
+    /// set the register reader and start polling registers bound to labels
+    /// @param aReader function to read registers
+    /// @param aInterval polling interval
+    void setRegisterReader(RegisterReader aReader, MLMicroSeconds aInterval);
+
+    /// @return statistics as JSON object
+    JsonObjectPtr statistics();
+
+  private:
+
+    void update(Label* aLabel, double aValue);
+    bool sameLayout(Label* aLabel, const char* aNewText);
+    void updatePolling();
+    void pollRegisters();
+    static bool validFormat(const string aFormat);
+    static void labelEventCB(lv_obj_t* aObj, lv_event_t aEvent);
+    void labelDeleted(lv_obj_t* aLabel);
+
+  };
+  typedef boost::intrusive_ptr<ValueLabels> ValueLabelsPtr;
+
+} // namespace p44
+
+#endif /* defined(__p44mbcd__valuelabels__) */